@@ -0,0 +1,558 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <vector>
+#include <string>
+
+#include "zset.h"
+#include "heap.h"
+#include "timerwheel.h"
+#include "common.h"
+
+// Microbenchmarks for the core data structures.
+// Every result is printed as one JSON object per line so runs can be diffed between commits.
+
+enum {
+    PAT_SEQ  = 0,
+    PAT_RAND = 1,
+};
+
+static const char *k_pattern_names[] = {"seq", "rand"};
+
+static struct {
+    size_t min_n = 1000;
+    size_t max_n = 100 * 1000 * 1000;
+    const char *filter = NULL;
+    const char *tag = NULL;
+} g_opts;
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000 * 1000 * 1000 + tv.tv_nsec;
+}
+
+// splitmix64
+static uint64_t rand_next(uint64_t &state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// 0..n-1 either in order or shuffled
+static std::vector<uint64_t> make_keys(size_t n, int pattern, uint64_t seed) {
+    std::vector<uint64_t> keys(n);
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+
+    if (pattern == PAT_RAND) {
+        uint64_t state = seed;
+        for (size_t i = n; i > 1; i--) {
+            size_t j = rand_next(state) % i;
+            uint64_t tmp = keys[i - 1];
+            keys[i - 1] = keys[j];
+            keys[j] = tmp;
+        }
+    }
+
+    return keys;
+}
+
+// hardware cache miss counter, -1 if perf events are unavailable
+struct Counter {
+    int fd = -1;
+};
+
+static void counter_open(Counter *c) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    c->fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void counter_start(Counter *c) {
+    if (c->fd >= 0) {
+        ioctl(c->fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(c->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static int64_t counter_stop(Counter *c) {
+    if (c->fd < 0) {
+        return -1;
+    }
+
+    ioctl(c->fd, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t val = 0;
+    if (read(c->fd, &val, sizeof(val)) != sizeof(val)) {
+        return -1;
+    }
+    return (int64_t)val;
+}
+
+// bytes in use by malloc, including blocks served by mmap()
+static size_t heap_bytes() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+struct Result {
+    const char *bench = NULL;
+    int pattern = PAT_SEQ;
+    size_t n = 0;
+    size_t ops = 0;
+    uint64_t nsec = 0;
+    int64_t misses = -1;
+    size_t bytes = 0;           // memory held by the structure, 0 if not applicable
+};
+
+static Counter g_counter;
+
+// time the section between two calls
+struct Timer {
+    uint64_t start = 0;
+};
+
+static void timer_start(Timer *t) {
+    counter_start(&g_counter);
+    t->start = get_monotonic_nsec();
+}
+
+static void timer_stop(Timer *t, Result &res) {
+    res.nsec = get_monotonic_nsec() - t->start;
+    res.misses = counter_stop(&g_counter);
+}
+
+static void report(const Result &res) {
+    double ops = res.ops ? (double)res.ops : 1;
+    printf("{\"bench\":\"%s\",\"pattern\":\"%s\",\"n\":%zu,\"ops\":%zu,\"ns_per_op\":%.2f",
+        res.bench, k_pattern_names[res.pattern], res.n, res.ops, (double)res.nsec / ops);
+
+    if (res.misses >= 0) {
+        printf(",\"cache_misses_per_op\":%.3f", (double)res.misses / ops);
+    } else {
+        printf(",\"cache_misses_per_op\":null");
+    }
+
+    if (res.bytes) {
+        printf(",\"bytes_per_elem\":%.2f", (double)res.bytes / (double)res.n);
+    } else {
+        printf(",\"bytes_per_elem\":null");
+    }
+
+    if (g_opts.tag) {
+        printf(",\"tag\":\"%s\"", g_opts.tag);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+static bool selected(const char *name) {
+    return !g_opts.filter || strstr(name, g_opts.filter);
+}
+
+// hashtable
+struct HEntry {
+    HNode node;
+    uint64_t key = 0;
+};
+
+static uint64_t key_hash(uint64_t key) {
+    return str_hash((const uint8_t *)&key, sizeof(key));
+}
+
+static bool hentry_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, HEntry, node)->key == container_of(rhs, HEntry, node)->key;
+}
+
+static void bench_hashtable(size_t n, int pattern) {
+    std::vector<uint64_t> keys = make_keys(n, pattern, n);
+
+    size_t before = heap_bytes();
+    HEntry *entries = (HEntry *)malloc(n * sizeof(HEntry));
+    for (size_t i = 0; i < n; i++) {
+        entries[i].node.next = NULL;
+        entries[i].key = keys[i];
+        entries[i].node.hcode = key_hash(keys[i]);
+    }
+
+    HMap hmap = {};
+    Result ins;
+    ins.bench = "hm_insert";
+    ins.pattern = pattern;
+    ins.n = ins.ops = n;
+
+    Timer t;
+    timer_start(&t);
+    for (size_t i = 0; i < n; i++) {
+        hm_insert(&hmap, &entries[i].node);
+    }
+    timer_stop(&t, ins);
+    ins.bytes = heap_bytes() - before;
+    if (selected(ins.bench)) {
+        report(ins);
+    }
+
+    Result look;
+    look.bench = "hm_lookup";
+    look.pattern = pattern;
+    look.n = look.ops = n;
+
+    size_t found = 0;
+    timer_start(&t);
+    for (size_t i = 0; i < n; i++) {
+        HEntry key;
+        key.key = keys[i];
+        key.node.hcode = key_hash(keys[i]);
+        found += hm_lookup(&hmap, &key.node, &hentry_eq) != NULL;
+    }
+    timer_stop(&t, look);
+    look.bytes = ins.bytes;
+    if (found != n) {
+        fprintf(stderr, "hm_lookup: missing keys\n");
+        exit(1);
+    }
+    if (selected(look.bench)) {
+        report(look);
+    }
+
+    hm_clear(&hmap);
+    free(entries);
+}
+
+// AVL tree
+struct TNode {
+    AVLNode tree;
+    uint64_t key = 0;
+};
+
+static void tree_add(AVLNode *&root, TNode *node) {
+    avl_init(&node->tree);
+
+    AVLNode *parent = NULL;
+    AVLNode **from = &root;
+    while (*from) {
+        parent = *from;
+        from = node->key < container_of(parent, TNode, tree)->key ? &parent->left : &parent->right;
+    }
+
+    *from = &node->tree;
+    node->tree.parent = parent;
+    root = avl_fix(&node->tree);
+}
+
+static void bench_avl(size_t n, int pattern) {
+    std::vector<uint64_t> keys = make_keys(n, pattern, n + 1);
+
+    size_t before = heap_bytes();
+    TNode *nodes = (TNode *)malloc(n * sizeof(TNode));
+    for (size_t i = 0; i < n; i++) {
+        nodes[i].key = keys[i];
+    }
+
+    AVLNode *root = NULL;
+    Result ins;
+    ins.bench = "avl_fix";
+    ins.pattern = pattern;
+    ins.n = ins.ops = n;
+
+    Timer t;
+    timer_start(&t);
+    for (size_t i = 0; i < n; i++) {
+        tree_add(root, &nodes[i]);
+    }
+    timer_stop(&t, ins);
+    ins.bytes = heap_bytes() - before;
+    if (selected(ins.bench)) {
+        report(ins);
+    }
+
+    // rank queries relative to the smallest node
+    AVLNode *first = root;
+    while (first->left) {
+        first = first->left;
+    }
+
+    std::vector<uint64_t> offsets = make_keys(n, pattern, n + 2);
+    Result off;
+    off.bench = "avl_offset";
+    off.pattern = pattern;
+    off.n = off.ops = n;
+
+    uint64_t sum = 0;
+    timer_start(&t);
+    for (size_t i = 0; i < n; i++) {
+        sum += container_of(avl_offset(first, (int64_t)offsets[i]), TNode, tree)->key;
+    }
+    timer_stop(&t, off);
+    off.bytes = ins.bytes;
+    if (sum != (uint64_t)n * (n - 1) / 2) {
+        fprintf(stderr, "avl_offset: bad result\n");
+        exit(1);
+    }
+    if (selected(off.bench)) {
+        report(off);
+    }
+
+    Result del;
+    del.bench = "avl_del";
+    del.pattern = pattern;
+    del.n = del.ops = n;
+
+    timer_start(&t);
+    for (size_t i = 0; i < n; i++) {
+        root = avl_del(&nodes[i].tree);
+    }
+    timer_stop(&t, del);
+    del.bytes = ins.bytes;
+    if (root) {
+        fprintf(stderr, "avl_del: tree not empty\n");
+        exit(1);
+    }
+    if (selected(del.bench)) {
+        report(del);
+    }
+
+    free(nodes);
+}
+
+// binary heap
+static void bench_heap(size_t n, int pattern) {
+    std::vector<uint64_t> vals = make_keys(n, pattern, n + 3);
+
+    size_t before = heap_bytes();
+    std::vector<size_t> refs(n);
+    std::vector<HeapItem> heap;
+    heap.reserve(n);
+
+    Result push;
+    push.bench = "heap_push";
+    push.pattern = pattern;
+    push.n = push.ops = n;
+
+    Timer t;
+    timer_start(&t);
+    for (size_t i = 0; i < n; i++) {
+        heap.push_back(HeapItem{vals[i], &refs[i]});
+        heap_update(heap.data(), heap.size() - 1, heap.size());
+    }
+    timer_stop(&t, push);
+    push.bytes = heap_bytes() - before;
+    if (selected(push.bench)) {
+        report(push);
+    }
+
+    // move items to new values, like TTL updates
+    uint64_t state = n;
+    Result upd;
+    upd.bench = "heap_update";
+    upd.pattern = pattern;
+    upd.n = upd.ops = n;
+
+    timer_start(&t);
+    for (size_t i = 0; i < n; i++) {
+        size_t pos = pattern == PAT_SEQ ? refs[i] : rand_next(state) % n;
+        heap[pos].val += n / 2;
+        heap_update(heap.data(), pos, heap.size());
+    }
+    timer_stop(&t, upd);
+    upd.bytes = push.bytes;
+    if (selected(upd.bench)) {
+        report(upd);
+    }
+}
+
+// timer wheel, with timers spread over n ms
+static void bench_timerwheel(size_t n, int pattern) {
+    std::vector<uint64_t> vals = make_keys(n, pattern, n + 4);
+
+    size_t before = heap_bytes();
+    TimerWheel *tw = new TimerWheel();
+    tw_init(tw, 0);
+    std::vector<TimerNode> timers(n);
+
+    Result add;
+    add.bench = "tw_add";
+    add.pattern = pattern;
+    add.n = add.ops = n;
+
+    Timer t;
+    timer_start(&t);
+    for (size_t i = 0; i < n; i++) {
+        tw_add(tw, &timers[i], vals[i]);
+    }
+    timer_stop(&t, add);
+    add.bytes = heap_bytes() - before;
+    if (selected(add.bench)) {
+        report(add);
+    }
+
+    // push timers back, like idle timeouts after activity
+    uint64_t state = n;
+    Result upd;
+    upd.bench = "tw_update";
+    upd.pattern = pattern;
+    upd.n = upd.ops = n;
+
+    timer_start(&t);
+    for (size_t i = 0; i < n; i++) {
+        TimerNode *timer = &timers[pattern == PAT_SEQ ? i : rand_next(state) % n];
+        tw_add(tw, timer, timer->expire_ms + n / 2);
+    }
+    timer_stop(&t, upd);
+    upd.bytes = add.bytes;
+    if (selected(upd.bench)) {
+        report(upd);
+    }
+
+    Result pop;
+    pop.bench = "tw_pop";
+    pop.pattern = pattern;
+    pop.n = pop.ops = n;
+
+    timer_start(&t);
+    size_t popped = 0;
+    while (tw_pop(tw, (uint64_t)-2)) {
+        popped++;
+    }
+    timer_stop(&t, pop);
+    pop.bytes = add.bytes;
+    if (selected(pop.bench) && popped == n) {
+        report(pop);
+    }
+
+    delete tw;
+}
+
+// sorted set
+static void bench_zset(size_t n, int pattern) {
+    std::vector<uint64_t> keys = make_keys(n, pattern, n + 4);
+    std::vector<std::string> names(n);
+    for (size_t i = 0; i < n; i++) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "member:%012llu", (unsigned long long)keys[i]);
+        names[i].assign(buf, len);
+    }
+
+    size_t before = heap_bytes();
+    ZSet zset = {};
+    Result ins;
+    ins.bench = "zset_insert";
+    ins.pattern = pattern;
+    ins.n = ins.ops = n;
+
+    Timer t;
+    timer_start(&t);
+    for (size_t i = 0; i < n; i++) {
+        zset_insert(&zset, names[i].data(), names[i].size(), (double)keys[i]);
+    }
+    timer_stop(&t, ins);
+    ins.bytes = heap_bytes() - before;
+    if (selected(ins.bench)) {
+        report(ins);
+    }
+
+    Result seek;
+    seek.bench = "zset_seekge";
+    seek.pattern = pattern;
+    seek.n = seek.ops = n;
+
+    size_t found = 0;
+    timer_start(&t);
+    for (size_t i = 0; i < n; i++) {
+        found += zset_seekge(&zset, (double)keys[i], "", 0) != NULL;
+    }
+    timer_stop(&t, seek);
+    seek.bytes = ins.bytes;
+    if (found != n) {
+        fprintf(stderr, "zset_seekge: missing members\n");
+        exit(1);
+    }
+    if (selected(seek.bench)) {
+        report(seek);
+    }
+
+    zset_clear(&zset);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [--min N] [--max N] [--filter NAME] [--tag LABEL]\n"
+        "  runs every benchmark at N = min, 10*min, ... up to max (default 1000..100000000)\n"
+        "  --filter only reports benchmarks whose name contains NAME\n"
+        "  --tag    adds a \"tag\" field to each result, e.g. a commit id\n", prog);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        if (strcmp(arg, "--min") == 0) {
+            g_opts.min_n = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--max") == 0) {
+            g_opts.max_n = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--filter") == 0) {
+            g_opts.filter = argv[++i];
+        } else if (strcmp(arg, "--tag") == 0) {
+            g_opts.tag = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (g_opts.min_n == 0 || g_opts.min_n > g_opts.max_n) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    counter_open(&g_counter);
+    if (g_counter.fd < 0) {
+        fprintf(stderr, "perf counters unavailable, cache misses will be null\n");
+    }
+
+    for (size_t n = g_opts.min_n; n <= g_opts.max_n; n *= 10) {
+        for (int pattern = PAT_SEQ; pattern <= PAT_RAND; pattern++) {
+            if (selected("hm_insert") || selected("hm_lookup")) {
+                bench_hashtable(n, pattern);
+            }
+            if (selected("avl_fix") || selected("avl_offset") || selected("avl_del")) {
+                bench_avl(n, pattern);
+            }
+            if (selected("heap_push") || selected("heap_update")) {
+                bench_heap(n, pattern);
+            }
+            if (selected("tw_add") || selected("tw_update") || selected("tw_pop")) {
+                bench_timerwheel(n, pattern);
+            }
+            if (selected("zset_insert") || selected("zset_seekge")) {
+                bench_zset(n, pattern);
+            }
+        }
+
+        if (n > g_opts.max_n / 10) {
+            break;          // avoid overflow
+        }
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,184 @@
+#include <string.h>
+
+#include "bitops.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITOPS_X86 1
+#endif
+
+enum {
+    IMPL_GENERIC = 0,
+    IMPL_POPCNT  = 1,
+    IMPL_AVX2    = 2,
+};
+
+static int g_impl = IMPL_GENERIC;
+
+void bitops_init() {
+#ifdef BITOPS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_impl = IMPL_AVX2;
+    } else if (__builtin_cpu_supports("popcnt")) {
+        g_impl = IMPL_POPCNT;
+    }
+#endif
+}
+
+const char *bitops_impl() {
+    static const char *names[] = {"generic", "popcnt", "avx2"};
+    return names[g_impl];
+}
+
+static uint64_t count_words(const uint8_t *p, size_t len) {
+    uint64_t n = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w = 0;
+        memcpy(&w, p + i, 8);
+        n += __builtin_popcountll(w);
+    }
+    for (; i < len; i++) {
+        n += __builtin_popcount(p[i]);
+    }
+    return n;
+}
+
+#ifdef BITOPS_X86
+// same code, but __builtin_popcountll becomes one instruction instead of a libgcc call
+__attribute__((target("popcnt")))
+static uint64_t count_popcnt(const uint8_t *p, size_t len) {
+    uint64_t n = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w = 0;
+        memcpy(&w, p + i, 8);
+        n += __builtin_popcountll(w);
+    }
+    for (; i < len; i++) {
+        n += __builtin_popcount(p[i]);
+    }
+    return n;
+}
+
+// per-nibble lookup with vpshufb (Mula), byte counts summed with vpsadbw
+__attribute__((target("avx2")))
+static uint64_t count_avx2(const uint8_t *p, size_t len) {
+    const __m256i lut = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low4 = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+
+    size_t i = 0;
+    while (len - i >= 32) {
+        // a byte lane gains at most 8 per block, so it holds 31 blocks before overflowing
+        size_t blocks = (len - i) / 32;
+        size_t end = i + (blocks < 31 ? blocks : 31) * 32;
+
+        __m256i acc = _mm256_setzero_si256();
+        for (; i < end; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low4));
+            __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low4));
+            acc = _mm256_add_epi8(acc, _mm256_add_epi8(lo, hi));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(acc, _mm256_setzero_si256()));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, total);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + count_popcnt(p + i, len - i);
+}
+
+// [0, len) where every source has data, returns the bytes done
+__attribute__((target("avx2")))
+static size_t op_avx2(uint32_t op, uint8_t *dst, size_t len, const uint8_t *const *srcs, size_t nsrc) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i acc = _mm256_loadu_si256((const __m256i *)(srcs[0] + i));
+        for (size_t k = 1; k < nsrc; k++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(srcs[k] + i));
+            if (op == BITOP_AND) {
+                acc = _mm256_and_si256(acc, v);
+            } else if (op == BITOP_OR) {
+                acc = _mm256_or_si256(acc, v);
+            } else {
+                acc = _mm256_xor_si256(acc, v);
+            }
+        }
+        if (op == BITOP_NOT) {
+            acc = _mm256_xor_si256(acc, ones);
+        }
+        _mm256_storeu_si256((__m256i *)(dst + i), acc);
+    }
+    return i;
+}
+#endif
+
+uint64_t bit_count(const uint8_t *data, size_t len) {
+#ifdef BITOPS_X86
+    if (g_impl == IMPL_AVX2) {
+        return count_avx2(data, len);
+    }
+    if (g_impl == IMPL_POPCNT) {
+        return count_popcnt(data, len);
+    }
+#endif
+    return count_words(data, len);
+}
+
+int64_t bit_pos(const uint8_t *data, size_t len, bool bit) {
+    uint8_t skip = bit ? 0 : 0xff;
+    uint64_t skip_word = bit ? 0 : ~(uint64_t)0;
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w = 0;
+        memcpy(&w, data + i, 8);
+        if (w != skip_word) {
+            break;
+        }
+    }
+    for (; i < len; i++) {
+        if (data[i] != skip) {
+            uint32_t b = bit ? data[i] : (uint8_t)~data[i];
+            return (int64_t)(i * 8) + __builtin_clz(b) - 24;
+        }
+    }
+    return -1;
+}
+
+static uint8_t op_byte(uint32_t op, uint8_t acc, uint8_t b) {
+    if (op == BITOP_AND) {
+        return acc & b;
+    } else if (op == BITOP_OR) {
+        return acc | b;
+    }
+    return acc ^ b;
+}
+
+void bit_op(uint32_t op, uint8_t *dst, size_t len, const uint8_t *const *srcs, const size_t *lens, size_t nsrc) {
+    size_t minlen = len;
+    for (size_t k = 0; k < nsrc; k++) {
+        minlen = lens[k] < minlen ? lens[k] : minlen;
+    }
+
+    size_t i = 0;
+#ifdef BITOPS_X86
+    if (g_impl == IMPL_AVX2) {
+        i = op_avx2(op, dst, minlen, srcs, nsrc);
+    }
+#endif
+
+    // the rest, with missing bytes of shorter sources read as 0
+    for (; i < len; i++) {
+        uint8_t acc = i < lens[0] ? srcs[0][i] : 0;
+        for (size_t k = 1; k < nsrc; k++) {
+            acc = op_byte(op, acc, i < lens[k] ? srcs[k][i] : 0);
+        }
+        dst[i] = op == BITOP_NOT ? (uint8_t)~acc : acc;
+    }
+}
\ No newline at end of file
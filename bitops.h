@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    BITOP_AND = 0,
+    BITOP_OR  = 1,
+    BITOP_XOR = 2,
+    BITOP_NOT = 3,
+};
+
+// picks the implementation for this CPU, call once before any other function
+void bitops_init();
+const char *bitops_impl();
+
+// number of set bits
+uint64_t bit_count(const uint8_t *data, size_t len);
+// index of the first bit equal to `bit`, most significant bit first, or -1
+int64_t bit_pos(const uint8_t *data, size_t len, bool bit);
+// dst[0, len) = the sources combined with `op`, shorter sources are zero padded, NOT takes one
+void bit_op(uint32_t op, uint8_t *dst, size_t len, const uint8_t *const *srcs, const size_t *lens, size_t nsrc);
\ No newline at end of file
@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+
+#include "bloom.h"
+#include "common.h"
+
+const uint64_t k_bloom_seed1 = 0x5bd1e995ULL;
+const uint64_t k_bloom_seed2 = 0x1b873593ULL;
+const size_t k_prefetch_ahead = 8;              // items
+
+// the k bit positions are h1 + i * h2 (Kirsch-Mitzenmacher)
+struct BloomHash {
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+};
+
+static BloomHash bloom_hash(const char *s, size_t len) {
+    BloomHash h;
+    h.h1 = str_hash64((const uint8_t *)s, len, k_bloom_seed1);
+    h.h2 = str_hash64((const uint8_t *)s, len, k_bloom_seed2) | 1;
+    return h;
+}
+
+static bool layer_test(const BloomLayer *l, BloomHash h) {
+    for (uint32_t i = 0; i < l->k; i++) {
+        uint64_t bit = (h.h1 + i * h.h2) % l->nbits;
+        if (!(l->bits[bit / 64] & (1ULL << (bit % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void layer_set(BloomLayer *l, BloomHash h) {
+    for (uint32_t i = 0; i < l->k; i++) {
+        uint64_t bit = (h.h1 + i * h.h2) % l->nbits;
+        l->bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+static void layer_prefetch(const BloomLayer *l, BloomHash h) {
+    for (uint32_t i = 0; i < l->k; i++) {
+        uint64_t bit = (h.h1 + i * h.h2) % l->nbits;
+        __builtin_prefetch(&l->bits[bit / 64], 1);
+    }
+}
+
+bool bloom_init(Bloom *bf, double error, uint64_t capacity) {
+    bf->layers = NULL;
+    bf->nlayers = 0;
+    bf->error = error;
+    bf->capacity = capacity;
+    return bloom_add_layer(bf);
+}
+
+bool bloom_add_layer(Bloom *bf) {
+    uint32_t n = bf->nlayers;
+    if (n >= 64 || bf->capacity > UINT64_MAX >> n) {
+        return false;
+    }
+    double error = bf->error * pow(0.5, n);
+    uint64_t capacity = bf->capacity << n;
+
+    // m = -n ln(p) / ln(2)^2, k = log2(1 / p)
+    double ln2 = log(2.0);
+    double bits = ceil(-(double)capacity * log(error) / (ln2 * ln2));
+    if (!(bits <= (double)k_bloom_max_layer_bits)) {
+        return false;
+    }
+    uint64_t nbits = ((uint64_t)bits + 63) / 64 * 64;
+    nbits = nbits < 64 ? 64 : nbits;
+
+    uint64_t *data = (uint64_t *)calloc(nbits / 64, sizeof(uint64_t));
+    BloomLayer *layers = data ? (BloomLayer *)realloc(bf->layers, (n + 1) * sizeof(BloomLayer)) : NULL;
+    if (!layers) {
+        free(data);
+        return false;
+    }
+    bf->layers = layers;
+    BloomLayer *l = &bf->layers[n];
+    l->nbits = nbits;
+    l->bits = data;
+    l->k = (uint32_t)ceil(-log(error) / ln2);
+    l->capacity = capacity;
+    l->count = 0;
+    bf->nlayers++;
+    return true;
+}
+
+static bool bloom_test(Bloom *bf, BloomHash h) {
+    for (uint32_t i = bf->nlayers; i > 0; i--) {    // the newest layers hold the most items
+        if (layer_test(&bf->layers[i - 1], h)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool bloom_insert(Bloom *bf, BloomHash h) {
+    if (bloom_test(bf, h)) {
+        return false;
+    }
+
+    BloomLayer *last = &bf->layers[bf->nlayers - 1];
+    if (last->count >= last->capacity && bloom_add_layer(bf)) {
+        last = &bf->layers[bf->nlayers - 1];
+    }
+    layer_set(last, h);
+    last->count++;
+    return true;
+}
+
+bool bloom_add(Bloom *bf, const char *s, size_t len) {
+    return bloom_insert(bf, bloom_hash(s, len));
+}
+
+bool bloom_exists(Bloom *bf, const char *s, size_t len) {
+    return bloom_test(bf, bloom_hash(s, len));
+}
+
+void bloom_add_many(Bloom *bf, const char *const *items, const size_t *lens, size_t n, bool *added) {
+    std::vector<BloomHash> hashes(n);
+    for (size_t i = 0; i < n; i++) {
+        hashes[i] = bloom_hash(items[i], lens[i]);
+    }
+
+    // the bits of an item are scattered over the array, start loading them a few items early
+    for (size_t i = 0; i < n && i < k_prefetch_ahead; i++) {
+        layer_prefetch(&bf->layers[bf->nlayers - 1], hashes[i]);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (i + k_prefetch_ahead < n) {
+            layer_prefetch(&bf->layers[bf->nlayers - 1], hashes[i + k_prefetch_ahead]);
+        }
+        added[i] = bloom_insert(bf, hashes[i]);
+    }
+}
+
+size_t bloom_bytes(Bloom *bf) {
+    size_t bytes = 0;
+    for (uint32_t i = 0; i < bf->nlayers; i++) {
+        bytes += bf->layers[i].nbits / 8;
+    }
+    return bytes;
+}
+
+void bloom_clear(Bloom *bf) {
+    for (uint32_t i = 0; i < bf->nlayers; i++) {
+        free(bf->layers[i].bits);
+    }
+    free(bf->layers);
+    bf->layers = NULL;
+    bf->nlayers = 0;
+}
\ No newline at end of file
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Scalable Bloom filter: a chain of bit arrays ("layers"), each sized for its capacity and error
+// rate. When the last layer is full a new one with twice the capacity and half the error rate is
+// added, which keeps the overall false positive rate below the requested one.
+struct BloomLayer {
+    uint64_t *bits = NULL;
+    uint64_t nbits = 0;
+    uint32_t k = 0;                             // hash functions
+    uint64_t capacity = 0;
+    uint64_t count = 0;                         // items added
+};
+
+struct Bloom {
+    BloomLayer *layers = NULL;
+    uint32_t nlayers = 0;
+    double error = 0;                           // of the first layer
+    uint64_t capacity = 0;
+};
+
+const double k_bloom_default_error = 0.01;
+const uint64_t k_bloom_default_capacity = 100;
+const double k_bloom_min_error = 1e-9;
+const uint64_t k_bloom_max_capacity = (uint64_t)1 << 32;
+const uint64_t k_bloom_max_layer_bits = (uint64_t)1 << 32;     // 512 MB, like the largest string
+
+// false if the first layer is too large or can't be allocated
+bool bloom_init(Bloom *bf, double error, uint64_t capacity);
+// false if the layer is too large or can't be allocated, the last layer then takes the new items
+bool bloom_add_layer(Bloom *bf);
+// false if the item may already be present
+bool bloom_add(Bloom *bf, const char *s, size_t len);
+bool bloom_exists(Bloom *bf, const char *s, size_t len);
+// bloom_add() for a batch, hashes everything first and prefetches the bits ahead
+void bloom_add_many(Bloom *bf, const char *const *items, const size_t *lens, size_t n, bool *added);
+size_t bloom_bytes(Bloom *bf);
+void bloom_clear(Bloom *bf);
\ No newline at end of file
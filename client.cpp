@@ -0,0 +1,527 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+// C++
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+// proj
+#include "common.h"
+
+// A command line client and load generator. With --cluster it is a smart client: it caches the
+// slot map from CLUSTER SLOTS, sends each command straight to the node serving its key, refreshes
+// the map on MOVED and follows ASK with ASKING, the way the server expects cluster clients to.
+
+const size_t k_max_msg = 32 << 20;
+const uint32_t k_cluster_slots = 16384;
+const int k_max_redirects = 16;
+
+enum {
+    ERR_MOVED    = 8,
+    ERR_ASK      = 9,
+    ERR_TRYAGAIN = 10,
+};
+
+enum {
+    TAG_NIL = 0,
+    TAG_ERR = 1,
+    TAG_STR = 2,
+    TAG_INT = 3,
+    TAG_DBL = 4,
+    TAG_ARR = 5,
+};
+
+struct Reply {
+    uint8_t tag = TAG_NIL;
+    uint32_t code = 0;              // TAG_ERR
+    int64_t i = 0;
+    double d = 0;
+    std::string s;                  // TAG_STR, and the message of TAG_ERR
+    std::vector<Reply> arr;
+};
+
+static void die(const char *msg) {
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+static uint64_t now_us() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+// same as the server
+static uint32_t key_slot(const std::string &key) {
+    const char *s = key.data();
+    size_t len = key.size();
+    const char *open = (const char *)memchr(s, '{', len);
+    if (open) {
+        const char *close = (const char *)memchr(open + 1, '}', (size_t)(s + len - open - 1));
+        if (close && close > open + 1) {
+            s = open + 1;
+            len = (size_t)(close - s);
+        }
+    }
+    return str_hash((const uint8_t *)s, len) & (k_cluster_slots - 1);
+}
+
+static bool read_full(int fd, uint8_t *buf, size_t n) {
+    while (n > 0) {
+        ssize_t rv = read(fd, buf, n);
+        if (rv <= 0) {
+            return false;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const uint8_t *buf, size_t n) {
+    while (n > 0) {
+        ssize_t rv = write(fd, buf, n);
+        if (rv <= 0) {
+            return false;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return true;
+}
+
+static int connect_unix(const std::string &path) {
+    struct sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path is too long\n");
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "connect to %s: %s\n", path.c_str(), strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// host is a name, an IPv4 or IPv6 address, or "unix:<path>"
+static int connect_to(const std::string &host, uint16_t port) {
+    if (host.compare(0, 5, "unix:") == 0) {
+        return connect_unix(host.substr(5));
+    }
+
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0 || !res) {
+        fprintf(stderr, "cannot resolve %s\n", host.c_str());
+        return -1;
+    }
+
+    int fd = socket(res->ai_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    int rv = connect(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rv < 0) {
+        fprintf(stderr, "connect to %s:%u: %s\n", host.c_str(), (unsigned)port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool send_req(int fd, const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for (const std::string &s : cmd) {
+        len += 4 + (uint32_t)s.size();
+    }
+    if (len > k_max_msg) {
+        fprintf(stderr, "request is too big\n");
+        return false;
+    }
+
+    std::vector<uint8_t> wbuf(4 + len);
+    uint32_t n = (uint32_t)cmd.size();
+    memcpy(&wbuf[0], &len, 4);
+    memcpy(&wbuf[4], &n, 4);
+    size_t cur = 8;
+    for (const std::string &s : cmd) {
+        uint32_t p = (uint32_t)s.size();
+        memcpy(&wbuf[cur], &p, 4);
+        memcpy(&wbuf[cur + 4], s.data(), s.size());
+        cur += 4 + s.size();
+    }
+    return write_all(fd, wbuf.data(), wbuf.size());
+}
+
+// returns the number of bytes parsed, 0 if the reply is malformed
+static size_t parse_reply(const uint8_t *data, size_t size, Reply &out) {
+    if (size < 1) {
+        return 0;
+    }
+    out.tag = data[0];
+    switch (data[0]) {
+    case TAG_NIL:
+        return 1;
+    case TAG_ERR: {
+        uint32_t len = 0;
+        if (size < 1 + 8) {
+            return 0;
+        }
+        memcpy(&out.code, &data[1], 4);
+        memcpy(&len, &data[5], 4);
+        if (size < 1 + 8 + (size_t)len) {
+            return 0;
+        }
+        out.s.assign((const char *)&data[9], len);
+        return 1 + 8 + len;
+    }
+    case TAG_STR: {
+        uint32_t len = 0;
+        if (size < 1 + 4) {
+            return 0;
+        }
+        memcpy(&len, &data[1], 4);
+        if (size < 1 + 4 + (size_t)len) {
+            return 0;
+        }
+        out.s.assign((const char *)&data[5], len);
+        return 1 + 4 + len;
+    }
+    case TAG_INT:
+        if (size < 1 + 8) {
+            return 0;
+        }
+        memcpy(&out.i, &data[1], 8);
+        return 1 + 8;
+    case TAG_DBL:
+        if (size < 1 + 8) {
+            return 0;
+        }
+        memcpy(&out.d, &data[1], 8);
+        return 1 + 8;
+    case TAG_ARR: {
+        uint32_t len = 0;
+        if (size < 1 + 4) {
+            return 0;
+        }
+        memcpy(&len, &data[1], 4);
+        size_t bytes = 1 + 4;
+        out.arr.resize(len);
+        for (uint32_t i = 0; i < len; i++) {
+            size_t rv = parse_reply(&data[bytes], size - bytes, out.arr[i]);
+            if (!rv) {
+                return 0;
+            }
+            bytes += rv;
+        }
+        return bytes;
+    }
+    default:
+        return 0;
+    }
+}
+
+static bool read_reply(int fd, Reply &out) {
+    uint8_t header[4];
+    if (!read_full(fd, header, 4)) {
+        return false;
+    }
+    uint32_t len = 0;
+    memcpy(&len, header, 4);
+    if (len > k_max_msg) {
+        return false;
+    }
+    std::vector<uint8_t> rbuf(len);
+    if (!read_full(fd, rbuf.data(), len)) {
+        return false;
+    }
+    out = Reply();
+    return parse_reply(rbuf.data(), len, out) == len;
+}
+
+static void print_reply(const Reply &r, int depth) {
+    printf("%*s", depth * 2, "");
+    switch (r.tag) {
+    case TAG_NIL:
+        printf("(nil)\n");
+        break;
+    case TAG_ERR:
+        printf("(err) %u %s\n", r.code, r.s.c_str());
+        break;
+    case TAG_STR:
+        printf("(str) %s\n", r.s.c_str());
+        break;
+    case TAG_INT:
+        printf("(int) %lld\n", (long long)r.i);
+        break;
+    case TAG_DBL:
+        printf("(dbl) %g\n", r.d);
+        break;
+    case TAG_ARR:
+        printf("(arr) len=%zu\n", r.arr.size());
+        for (const Reply &sub : r.arr) {
+            print_reply(sub, depth + 1);
+        }
+        break;
+    }
+}
+
+// Routing
+
+struct Client {
+    std::string host;
+    uint16_t port = 0;
+    bool cluster = false;
+    std::map<std::string, int> fds;             // "host:port" -> connection
+    std::vector<std::string> slot_addr;         // "host:port" serving each slot, empty if unknown
+    uint64_t moved = 0, asked = 0;
+};
+
+static std::string addr_str(const std::string &host, uint16_t port) {
+    return host + ":" + std::to_string(port);
+}
+
+static int client_fd(Client &c, const std::string &addr) {
+    auto it = c.fds.find(addr);
+    if (it != c.fds.end()) {
+        return it->second;
+    }
+    size_t colon = addr.rfind(':');
+    if (colon == std::string::npos) {
+        return -1;
+    }
+    int fd = connect_to(addr.substr(0, colon), (uint16_t)atoi(addr.c_str() + colon + 1));
+    if (fd >= 0) {
+        c.fds[addr] = fd;
+    }
+    return fd;
+}
+
+static void client_drop(Client &c, const std::string &addr) {
+    auto it = c.fds.find(addr);
+    if (it != c.fds.end()) {
+        close(it->second);
+        c.fds.erase(it);
+    }
+}
+
+static bool roundtrip(Client &c, const std::string &addr, const std::vector<std::string> &cmd, Reply &out) {
+    int fd = client_fd(c, addr);
+    if (fd < 0) {
+        return false;
+    }
+    if (!send_req(fd, cmd) || !read_reply(fd, out)) {
+        client_drop(c, addr);
+        return false;
+    }
+    return true;
+}
+
+// reloads the slot map from the node at `addr`
+static bool refresh_slots(Client &c, const std::string &addr) {
+    Reply r;
+    if (!roundtrip(c, addr, {"cluster", "slots"}, r) || r.tag != TAG_ARR) {
+        return false;
+    }
+    c.slot_addr.assign(k_cluster_slots, std::string());
+    for (const Reply &range : r.arr) {
+        if (range.arr.size() != 4) {
+            continue;
+        }
+        std::string node = addr_str(range.arr[2].s, (uint16_t)range.arr[3].i);
+        for (int64_t s = range.arr[0].i; s <= range.arr[1].i && s < (int64_t)k_cluster_slots; s++) {
+            c.slot_addr[s] = node;
+        }
+    }
+    return true;
+}
+
+// the key a command is routed by, the same for every key of a command in cluster mode
+static const std::string *route_key(const std::vector<std::string> &cmd) {
+    std::string name = cmd[0];
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if (name == "eval" || name == "evalsha") {
+        return cmd.size() > 3 && cmd[2] != "0" ? &cmd[3] : NULL;
+    }
+    if (name == "bitop") {
+        return cmd.size() > 2 ? &cmd[2] : NULL;
+    }
+    static const char *no_key[] = {
+        "keys", "info", "config", "slowlog", "stalllog", "replicaof", "psync", "subscribe",
+        "psubscribe", "unsubscribe", "punsubscribe", "publish", "client", "multi", "exec",
+        "discard", "unwatch", "script", "cluster", "asking",
+    };
+    for (const char *s : no_key) {
+        if (name == s) {
+            return NULL;
+        }
+    }
+    return cmd.size() > 1 ? &cmd[1] : NULL;
+}
+
+// the address in a "MOVED <slot> <host>:<port>" or "ASK ..." message
+static std::string redirect_addr(const std::string &msg) {
+    size_t sp = msg.rfind(' ');
+    return sp == std::string::npos ? std::string() : msg.substr(sp + 1);
+}
+
+static bool client_call(Client &c, const std::vector<std::string> &cmd, Reply &out) {
+    std::string addr = addr_str(c.host, c.port);
+    const std::string *key = c.cluster ? route_key(cmd) : NULL;
+    if (key && !c.slot_addr.empty() && !c.slot_addr[key_slot(*key)].empty()) {
+        addr = c.slot_addr[key_slot(*key)];
+    }
+
+    bool asking = false;
+    for (int i = 0; i < k_max_redirects; i++) {
+        if (asking) {
+            Reply ack;
+            if (!roundtrip(c, addr, {"asking"}, ack)) {
+                return false;
+            }
+        }
+        if (!roundtrip(c, addr, cmd, out)) {
+            return false;
+        }
+        asking = false;
+        if (!c.cluster || out.tag != TAG_ERR) {
+            return true;
+        }
+
+        if (out.code == ERR_MOVED) {
+            c.moved++;
+            addr = redirect_addr(out.s);
+            refresh_slots(c, addr);
+        } else if (out.code == ERR_ASK) {
+            c.asked++;
+            addr = redirect_addr(out.s);
+            asking = true;
+        } else if (out.code == ERR_TRYAGAIN) {
+            usleep(1000);
+        } else {
+            return true;
+        }
+    }
+    return true;                                // the last redirection
+}
+
+// Benchmark
+
+static void bench(Client &c, uint64_t nreq, uint64_t keyspace, uint32_t read_pct) {
+    std::vector<uint32_t> lat;
+    lat.reserve(nreq);
+    uint64_t errors = 0;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    uint64_t start = now_us();
+    for (uint64_t i = 0; i < nreq; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        std::string key = "key:" + std::to_string((seed >> 33) % keyspace);
+        bool read = (seed >> 17) % 100 < read_pct;
+        std::vector<std::string> cmd;
+        if (read) {
+            cmd = {"get", key};
+        } else {
+            cmd = {"set", key, std::to_string(i)};
+        }
+
+        uint64_t t0 = now_us();
+        Reply r;
+        if (!client_call(c, cmd, r)) {
+            fprintf(stderr, "connection lost\n");
+            exit(1);
+        }
+        lat.push_back((uint32_t)std::min<uint64_t>(now_us() - t0, UINT32_MAX));
+        errors += r.tag == TAG_ERR;
+    }
+    uint64_t elapsed = std::max<uint64_t>(now_us() - start, 1);
+
+    std::sort(lat.begin(), lat.end());
+    auto pct = [&](double p) { return lat.empty() ? 0 : lat[std::min(lat.size() - 1, (size_t)(p * lat.size()))]; };
+    printf("requests: %llu\nops_per_sec: %.0f\np50_us: %u\np99_us: %u\nmax_us: %u\n",
+        (unsigned long long)nreq, (double)nreq * 1e6 / (double)elapsed, pct(0.50), pct(0.99), pct(1.0));
+    printf("errors: %llu\nmoved: %llu\nask: %llu\nnodes: %zu\n", (unsigned long long)errors,
+        (unsigned long long)c.moved, (unsigned long long)c.asked, c.fds.size());
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--host <host>] [--port <port>] [--socket <path>] [--cluster] <cmd> [arg ...]\n"
+        "       %s [--host <host>] [--port <port>] [--socket <path>] [--cluster] --bench <requests> "
+        "[--keyspace <n>] [--reads <percent>]\n",
+        prog, prog);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    Client c;
+    c.host = "127.0.0.1";
+    c.port = 1234;
+    uint64_t nbench = 0, keyspace = 100000;
+    uint32_t read_pct = 50;
+
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (strcmp(argv[i], "--cluster") == 0) {
+            c.cluster = true;
+        } else if (i + 1 >= argc) {
+            usage(argv[0]);
+        } else if (strcmp(argv[i], "--host") == 0) {
+            c.host = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0) {
+            c.port = (uint16_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--socket") == 0) {
+            c.host = std::string("unix:") + argv[++i];
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            nbench = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--keyspace") == 0) {
+            keyspace = std::max<uint64_t>(strtoull(argv[++i], NULL, 10), 1);
+        } else if (strcmp(argv[i], "--reads") == 0) {
+            read_pct = (uint32_t)atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (c.cluster && !refresh_slots(c, addr_str(c.host, c.port))) {
+        fprintf(stderr, "cannot load the slot map\n");
+        return 1;
+    }
+    if (nbench) {
+        bench(c, nbench, keyspace, read_pct);
+        return 0;
+    }
+    if (i >= argc) {
+        usage(argv[0]);
+    }
+
+    std::vector<std::string> cmd(argv + i, argv + argc);
+    Reply r;
+    if (!client_call(c, cmd, r)) {
+        fprintf(stderr, "connection lost\n");
+        return 1;
+    }
+    print_reply(r, 0);
+    return r.tag == TAG_ERR;
+}
\ No newline at end of file
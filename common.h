@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 #define container_of(ptr, T, member) \
     ((T *)( (char *)ptr - offsetof(T, member) ))
@@ -11,4 +12,37 @@ inline uint64_t str_hash(const uint8_t *data, size_t len) {
         h = (h + data[i]) * 0x01000193;
     }
     return h;
+}
+
+// MurmurHash64A, for sketches that need 64 well mixed bits
+inline uint64_t str_hash64(const uint8_t *data, size_t len, uint64_t seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+
+    size_t nblocks = len / 8;
+    for (size_t i = 0; i < nblocks; i++) {
+        uint64_t k = 0;
+        memcpy(&k, data + i * 8, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    size_t rest = len & 7;
+    if (rest) {
+        uint64_t k = 0;
+        for (size_t i = rest; i > 0; i--) {
+            k = (k << 8) | data[nblocks * 8 + i - 1];
+        }
+        h ^= k;
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
 }
\ No newline at end of file
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <stddef.h>
 
 struct DList {              // head <-> node1 <-> node2 <-> head
@@ -0,0 +1,262 @@
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "hash.h"
+#include "common.h"
+
+static uint32_t read_len(const uint8_t *p) {
+    uint32_t len = 0;
+    memcpy(&len, p, 4);
+    return len;
+}
+
+static size_t compact_pair_size(Hash *hash, size_t pos) {
+    uint32_t flen = read_len(&hash->compact[pos]);
+    uint32_t vlen = read_len(&hash->compact[pos + 4 + flen]);
+    return 8 + flen + vlen;
+}
+
+// offset of the pair, or compact_len if not found
+static size_t compact_find(Hash *hash, const char *field, size_t flen) {
+    size_t pos = 0;
+    while (pos < hash->compact_len) {
+        uint32_t len = read_len(&hash->compact[pos]);
+        if (len == flen && memcmp(&hash->compact[pos + 4], field, flen) == 0) {
+            return pos;
+        }
+        pos += compact_pair_size(hash, pos);
+    }
+    return pos;
+}
+
+static void compact_append(Hash *hash, const char *field, size_t flen, const char *val, size_t vlen) {
+    size_t need = hash->compact_len + 8 + flen + vlen;
+    if (need > hash->compact_cap) {
+        size_t cap = hash->compact_cap ? hash->compact_cap : 64;
+        while (cap < need) {
+            cap *= 2;
+        }
+        hash->compact = (uint8_t *)realloc(hash->compact, cap);
+        hash->compact_cap = cap;
+    }
+
+    uint8_t *p = &hash->compact[hash->compact_len];
+    uint32_t len = (uint32_t)flen;
+    memcpy(p, &len, 4);
+    memcpy(p + 4, field, flen);
+    len = (uint32_t)vlen;
+    memcpy(p + 4 + flen, &len, 4);
+    memcpy(p + 8 + flen, val, vlen);
+
+    hash->compact_len = need;
+    hash->count++;
+}
+
+static void compact_remove(Hash *hash, size_t pos) {
+    size_t size = compact_pair_size(hash, pos);
+    memmove(&hash->compact[pos], &hash->compact[pos + size], hash->compact_len - pos - size);
+    hash->compact_len -= size;
+    hash->count--;
+}
+
+static HField *hfield_new(const char *field, size_t flen, const char *val, size_t vlen, uint64_t hcode) {
+    HField *node = (HField *)malloc(sizeof(HField) + flen + vlen);
+    node->node.next = NULL;
+    node->node.hcode = hcode;
+
+    node->flen = (uint32_t)flen;
+    node->vlen = (uint32_t)vlen;
+    memcpy(&node->data[0], field, flen);
+    memcpy(&node->data[flen], val, vlen);
+
+    return node;
+}
+
+// helper structure for hashtable lookup
+struct HKey {
+    HNode node;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+static bool hcmp(HNode *node, HNode *key) {
+    HField *hf = container_of(node, HField, node);
+    HKey *hkey = container_of(key, HKey, node);
+
+    if (hf->flen != hkey->len) {
+        return false;
+    }
+
+    return memcmp(hf->data, hkey->name, hf->flen) == 0;
+}
+
+static void map_insert(Hash *hash, const char *field, size_t flen, const char *val, size_t vlen) {
+    HField *hf = hfield_new(field, flen, val, vlen, str_hash((uint8_t *)field, flen));
+    hm_insert(&hash->hmap, &hf->node);
+}
+
+static void convert_to_map(Hash *hash) {
+    hm_reserve(&hash->hmap, hash->count + 1);
+    size_t pos = 0;
+    while (pos < hash->compact_len) {
+        const uint8_t *p = &hash->compact[pos];
+        uint32_t flen = read_len(p);
+        uint32_t vlen = read_len(p + 4 + flen);
+        map_insert(hash, (const char *)p + 4, flen, (const char *)p + 8 + flen, vlen);
+        pos += 8 + flen + vlen;
+    }
+
+    free(hash->compact);
+    hash->compact = NULL;
+    hash->compact_len = hash->compact_cap = 0;
+    hash->count = 0;
+    hash->is_map = true;
+}
+
+static HField *map_lookup(Hash *hash, const char *field, size_t flen) {
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)field, flen);
+    key.name = field;
+    key.len = flen;
+
+    HNode *found = hm_lookup(&hash->hmap, &key.node, &hcmp);
+    return found ? container_of(found, HField, node) : NULL;
+}
+
+static bool map_delete(Hash *hash, const char *field, size_t flen) {
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)field, flen);
+    key.name = field;
+    key.len = flen;
+
+    HNode *found = hm_delete(&hash->hmap, &key.node, &hcmp);
+    if (found) {
+        free(container_of(found, HField, node));
+    }
+    return found != NULL;
+}
+
+bool hash_set(Hash *hash, const char *field, size_t flen, const char *val, size_t vlen) {
+    if (!hash->is_map) {
+        size_t pos = compact_find(hash, field, flen);
+        bool existed = pos < hash->compact_len;
+        if (existed && read_len(&hash->compact[pos + 4 + flen]) == vlen) {
+            memcpy(&hash->compact[pos + 8 + flen], val, vlen);     // same size, update in place
+            return false;
+        }
+        if (existed) {
+            compact_remove(hash, pos);
+        }
+
+        if (flen <= k_hash_compact_max_len && vlen <= k_hash_compact_max_len
+            && hash->count < k_hash_compact_max_fields)
+        {
+            compact_append(hash, field, flen, val, vlen);
+            return !existed;
+        }
+
+        convert_to_map(hash);
+        map_insert(hash, field, flen, val, vlen);
+        return !existed;
+    }
+
+    HField *hf = map_lookup(hash, field, flen);
+    if (hf && hf->vlen == vlen) {
+        memcpy(&hf->data[flen], val, vlen);
+        return false;
+    }
+
+    bool existed = hf && map_delete(hash, field, flen);
+    map_insert(hash, field, flen, val, vlen);
+    return !existed;
+}
+
+bool hash_get(Hash *hash, const char *field, size_t flen, const char **val, size_t *vlen) {
+    if (!hash->is_map) {
+        size_t pos = compact_find(hash, field, flen);
+        if (pos == hash->compact_len) {
+            return false;
+        }
+        *vlen = read_len(&hash->compact[pos + 4 + flen]);
+        *val = (const char *)&hash->compact[pos + 8 + flen];
+        return true;
+    }
+
+    HField *hf = map_lookup(hash, field, flen);
+    if (!hf) {
+        return false;
+    }
+    *vlen = hf->vlen;
+    *val = &hf->data[hf->flen];
+    return true;
+}
+
+bool hash_del(Hash *hash, const char *field, size_t flen) {
+    if (!hash->is_map) {
+        size_t pos = compact_find(hash, field, flen);
+        if (pos == hash->compact_len) {
+            return false;
+        }
+        compact_remove(hash, pos);
+        return true;
+    }
+
+    return map_delete(hash, field, flen);
+}
+
+size_t hash_size(Hash *hash) {
+    return hash->is_map ? hm_size(&hash->hmap) : hash->count;
+}
+
+struct ForeachArg {
+    hash_cb f;
+    void *arg;
+};
+
+static bool cb_foreach_field(HNode *node, void *arg) {
+    HField *hf = container_of(node, HField, node);
+    ForeachArg *fa = (ForeachArg *)arg;
+    return fa->f(hf->data, hf->flen, &hf->data[hf->flen], hf->vlen, fa->arg);
+}
+
+void hash_foreach(Hash *hash, hash_cb f, void *arg) {
+    if (hash->is_map) {
+        ForeachArg fa = {f, arg};
+        hm_foreach(&hash->hmap, &cb_foreach_field, &fa);
+        return;
+    }
+
+    size_t pos = 0;
+    while (pos < hash->compact_len) {
+        const uint8_t *p = &hash->compact[pos];
+        uint32_t flen = read_len(p);
+        uint32_t vlen = read_len(p + 4 + flen);
+        if (!f((const char *)p + 4, flen, (const char *)p + 8 + flen, vlen, arg)) {
+            return;
+        }
+        pos += 8 + flen + vlen;
+    }
+}
+
+static bool cb_collect_field(HNode *node, void *arg) {
+    ((std::vector<HField *> *)arg)->push_back(container_of(node, HField, node));
+    return true;
+}
+
+void hash_clear(Hash *hash) {
+    if (hash->is_map) {
+        std::vector<HField *> fields;
+        hm_foreach(&hash->hmap, &cb_collect_field, &fields);
+        hm_clear(&hash->hmap);
+        for (HField *hf : fields) {
+            free(hf);
+        }
+    }
+
+    free(hash->compact);
+    hash->compact = NULL;
+    hash->compact_len = hash->compact_cap = 0;
+    hash->count = 0;
+    hash->is_map = false;
+}
\ No newline at end of file
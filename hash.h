@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hashtable.h"
+
+// Field-value map. Small hashes are kept as one contiguous buffer of (u32 len, bytes) field and
+// value pairs that is scanned linearly, and converted to an HMap of HField nodes once they have
+// more than k_hash_compact_max_fields fields or a field or value longer than k_hash_compact_max_len.
+struct Hash {
+    uint8_t *compact = NULL;
+    size_t compact_len = 0;
+    size_t compact_cap = 0;
+    uint32_t count = 0;             // pairs in the compact buffer
+    bool is_map = false;
+    HMap hmap;
+};
+
+struct HField {
+    HNode node;
+    uint32_t flen = 0;
+    uint32_t vlen = 0;
+    char data[0];                   // field, then value
+};
+
+const uint32_t k_hash_compact_max_fields = 128;
+const uint32_t k_hash_compact_max_len = 64;
+
+// returns true if the field was added, false if an existing value was replaced
+bool hash_set(Hash *hash, const char *field, size_t flen, const char *val, size_t vlen);
+// the value points into the hash and is valid until the next modification
+bool hash_get(Hash *hash, const char *field, size_t flen, const char **val, size_t *vlen);
+bool hash_del(Hash *hash, const char *field, size_t flen);
+size_t hash_size(Hash *hash);
+void hash_clear(Hash *hash);
+
+typedef bool (*hash_cb)(const char *field, size_t flen, const char *val, size_t vlen, void *arg);
+void hash_foreach(Hash *hash, hash_cb f, void *arg);
\ No newline at end of file
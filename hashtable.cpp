@@ -1,10 +1,14 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "hashtable.h"
 
 const size_t k_max_load_factor = 8;
+const size_t k_min_buckets = 4;
 const size_t k_max_rehashing_work = 128;
+const size_t k_lookup_rehashing_work = 16;                      // lookups are more frequent
+const size_t k_rehashing_scan_ratio = 8;                        // empty buckets skipped per unit of work
 
 static void h_init(HTable *htable, size_t n) {
     assert(n > 0 && ((n - 1) & n) == 0);                        // n must be a power of 2
@@ -48,18 +52,30 @@ static HNode *h_detach(HTable *htable, HNode **from) {
     return target;
 }
 
-static void hm_trigger_rehashing(HMap *hmap) {
+// buckets for n nodes at half the max load factor, the load right after the table grows
+static size_t h_buckets_for(size_t n) {
+    size_t nbuckets = k_min_buckets;
+    while (nbuckets * (k_max_load_factor / 2) < n) {
+        nbuckets *= 2;
+    }
+    return nbuckets;
+}
+
+static void hm_trigger_rehashing(HMap *hmap, size_t nbuckets) {
     hmap->old_table = hmap->new_table;
-    h_init(&hmap->new_table, (hmap->new_table.mask + 1) * 2);           // set new hash table to be double the size
+    h_init(&hmap->new_table, nbuckets);
     hmap->migrate_pos = 0;
 }
 
-static void hm_help_rehashing(HMap *hmap) {                             // migrate up to n nodes each call
-    size_t nwork = 0;
-    while (nwork < k_max_rehashing_work && hmap->old_table.size > 0) {
+static void hm_help_rehashing(HMap *hmap, size_t max_work) {           // migrate up to n nodes each call
+    size_t nwork = 0, nscan = 0;
+    while (nwork < max_work && hmap->old_table.size > 0) {
         HNode **from = &hmap->old_table.table[hmap->migrate_pos];
         if (!*from) {
             hmap->migrate_pos++;
+            if (++nscan >= max_work * k_rehashing_scan_ratio) {
+                break;                                                  // a mostly empty table being shrunk
+            }
             continue;
         }
 
@@ -74,6 +90,10 @@ static void hm_help_rehashing(HMap *hmap) {                             // migra
 }
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode*, HNode*)) {
+    if (hmap->old_table.table) {
+        hm_help_rehashing(hmap, k_lookup_rehashing_work);
+    }
+
     HNode **from = h_lookup(&hmap->new_table, key, eq);
     if (!from) {
         from = h_lookup(&hmap->old_table, key, eq);
@@ -82,16 +102,32 @@ HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode*, HNode*)) {
     return from ? *from : NULL;
 }
 
-HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode*, HNode*)) {
-    if (HNode **from = h_lookup(&hmap->new_table, key, eq)) {
-        return h_detach(&hmap->new_table, from);
+// shrinks the table incrementally once it has more than 2 buckets per node
+static void hm_maybe_shrink(HMap *hmap) {
+    size_t nbuckets = hmap->new_table.mask + 1;
+    if (hmap->old_table.table || !hmap->new_table.table || nbuckets <= k_min_buckets) {
+        return;
+    }
+    if (hmap->new_table.size * 2 < nbuckets) {
+        hm_trigger_rehashing(hmap, h_buckets_for(hmap->new_table.size));
     }
+}
 
-    if (HNode **from = h_lookup(&hmap->old_table, key, eq)) {
-        return h_detach(&hmap->old_table, from);
+HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode*, HNode*)) {
+    HNode **from = h_lookup(&hmap->new_table, key, eq);
+    HTable *htable = &hmap->new_table;
+    if (!from) {
+        from = h_lookup(&hmap->old_table, key, eq);
+        htable = &hmap->old_table;
+    }
+    if (!from) {
+        return NULL;
     }
 
-    return NULL;
+    HNode *node = h_detach(htable, from);
+    hm_maybe_shrink(hmap);
+    hm_help_rehashing(hmap, k_max_rehashing_work);
+    return node;
 }
 
 void hm_insert(HMap *hmap, HNode *node) {
@@ -104,11 +140,33 @@ void hm_insert(HMap *hmap, HNode *node) {
     if (!hmap->old_table.table) {                           // check if we need to rehash (resize)
         size_t threshold = (hmap->new_table.mask + 1) * k_max_load_factor;
         if (hmap->new_table.size > threshold) {
-            hm_trigger_rehashing(hmap);
+            hm_trigger_rehashing(hmap, (hmap->new_table.mask + 1) * 2);     // set new hash table to be double the size
         }
     }
 
-    hm_help_rehashing(hmap);
+    hm_help_rehashing(hmap, k_max_rehashing_work);
+}
+
+void hm_reserve(HMap *hmap, size_t n) {
+    size_t nbuckets = h_buckets_for(n);
+    if (hmap->old_table.table || (hmap->new_table.table && nbuckets <= hmap->new_table.mask + 1)) {
+        return;
+    }
+
+    if (hm_size(hmap) == 0) {
+        free(hmap->new_table.table);
+        h_init(&hmap->new_table, nbuckets);
+    } else {
+        hm_trigger_rehashing(hmap, nbuckets);                           // existing nodes move over incrementally
+        hm_help_rehashing(hmap, k_max_rehashing_work);
+    }
+}
+
+bool hm_rehash_step(HMap *hmap) {
+    if (hmap->old_table.table) {
+        hm_help_rehashing(hmap, k_max_rehashing_work);
+    }
+    return hmap->old_table.table != NULL;
 }
 
 void hm_clear(HMap *hmap) {
@@ -121,6 +179,10 @@ size_t hm_size(HMap *hmap) {
     return hmap->new_table.size + hmap->old_table.size;
 }
 
+size_t hm_buckets(HMap *hmap) {
+    return hmap->new_table.table ? hmap->new_table.mask + 1 : 0;
+}
+
 static bool h_foreach(HTable *htab, bool (*f)(HNode *, void *), void *arg) {
     for (size_t i = 0; htab->mask != 0 && i <= htab->mask; i++) {                   // walk through hashtable buckets
         for (HNode *node = htab->table[i]; node != NULL; node = node->next) {
@@ -134,4 +196,54 @@ static bool h_foreach(HTable *htab, bool (*f)(HNode *, void *), void *arg) {
 
 void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg) {
     h_foreach(&hmap->new_table, f, arg) && h_foreach(&hmap->old_table, f, arg);
+}
+
+bool hm_scan(HMap *hmap, size_t *cursor, void (*f)(HNode *, void *), void *arg) {
+    HTable *htab = &hmap->new_table;
+    if (!htab->table || *cursor > htab->mask) {
+        return false;
+    }
+    for (HNode *node = htab->table[*cursor]; node != NULL;) {
+        HNode *next = node->next;                               // `node` may be moved
+        f(node, arg);
+        node = next;
+    }
+    (*cursor)++;
+    return true;
+}
+
+static bool h_replace(HTable *htab, HNode *node, HNode *fresh) {
+    if (!htab->table) {
+        return false;
+    }
+    for (HNode **from = &htab->table[node->hcode & htab->mask]; *from != NULL; from = &(*from)->next) {
+        if (*from == node) {
+            fresh->next = node->next;
+            *from = fresh;
+            return true;
+        }
+    }
+    return false;
+}
+
+void hm_replace(HMap *hmap, HNode *node, HNode *fresh) {
+    bool found = h_replace(&hmap->new_table, node, fresh) || h_replace(&hmap->old_table, node, fresh);
+    assert(found);
+    (void)found;
+}
+
+static void h_move(HTable *htab) {
+    if (!htab->table) {
+        return;
+    }
+    size_t bytes = (htab->mask + 1) * sizeof(HNode *);
+    HNode **table = (HNode **)malloc(bytes);
+    memcpy(table, htab->table, bytes);
+    free(htab->table);
+    htab->table = table;
+}
+
+void hm_defrag(HMap *hmap) {
+    h_move(&hmap->new_table);
+    h_move(&hmap->old_table);
 }
\ No newline at end of file
@@ -23,7 +23,19 @@ struct HMap {
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode*, HNode*));
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode*, HNode*));
 void hm_insert(HMap *hmap, HNode *node);
+// presizes the table for n nodes, a no-op while it is being resized
+void hm_reserve(HMap *hmap, size_t n);
+// moves a batch of nodes of a pending resize, false once none is pending
+bool hm_rehash_step(HMap *hmap);
 void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
+// visits the nodes of bucket `*cursor` of the table being filled and advances the cursor, false
+// past the last bucket; `f` may hm_replace() the node it is given
+bool hm_scan(HMap *hmap, size_t *cursor, void (*f)(HNode *, void *), void *arg);
+// puts `fresh`, a copy of `node` at another address, in its place
+void hm_replace(HMap *hmap, HNode *node, HNode *fresh);
+// moves the bucket arrays into fresh allocations, to defragment memory
+void hm_defrag(HMap *hmap);
 void hm_clear(HMap *hmap);
 
-size_t hm_size(HMap *hmap);
\ No newline at end of file
+size_t hm_size(HMap *hmap);
+size_t hm_buckets(HMap *hmap);              // of the table being filled
\ No newline at end of file
@@ -0,0 +1,64 @@
+#include "histogram.h"
+
+const uint64_t k_hist_sub = 1 << k_hist_sub_bits;
+
+static size_t hist_index(uint64_t val) {
+    if (val < 2 * k_hist_sub) {
+        return val;                                             // exact region
+    }
+
+    uint32_t msb = 63 - __builtin_clzll(val);
+    uint32_t shift = msb - k_hist_sub_bits;                         // keep the top (sub_bits + 1) bits
+    return shift * k_hist_sub + (val >> shift);
+}
+
+// largest value that maps to the bucket
+static uint64_t hist_bucket_max(size_t idx) {
+    if (idx < 2 * k_hist_sub) {
+        return idx;
+    }
+
+    uint64_t shift = idx / k_hist_sub - 1;
+    uint64_t mantissa = idx - shift * k_hist_sub;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void hist_record(Histogram *hist, uint64_t val) {
+    size_t idx = hist_index(val);
+    if (idx >= k_hist_buckets) {
+        idx = k_hist_buckets - 1;
+    }
+
+    hist->counts[idx]++;
+    hist->total++;
+    hist->sum += val;
+    if (val > hist->max) {
+        hist->max = val;
+    }
+}
+
+void hist_reset(Histogram *hist) {
+    *hist = Histogram{};
+}
+
+uint64_t hist_percentile(const Histogram *hist, double p) {
+    if (hist->total == 0) {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t)(p * (double)hist->total + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < k_hist_buckets; i++) {
+        seen += hist->counts[i];
+        if (seen >= target) {
+            uint64_t val = hist_bucket_max(i);
+            return val < hist->max ? val : hist->max;
+        }
+    }
+
+    return hist->max;
+}
\ No newline at end of file
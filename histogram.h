@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// HDR-style log-linear histogram: exact below 32, then 16 sub-buckets per power of 2 (~6% error)
+const size_t k_hist_sub_bits = 4;
+const size_t k_hist_buckets = (64 - k_hist_sub_bits + 1) << k_hist_sub_bits;
+
+struct Histogram {
+    uint64_t counts[k_hist_buckets] = {};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+};
+
+void hist_record(Histogram *hist, uint64_t val);
+void hist_reset(Histogram *hist);
+
+// value at or below which the given fraction (0..1) of the samples fall
+uint64_t hist_percentile(const Histogram *hist, double p);
\ No newline at end of file
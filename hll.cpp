@@ -0,0 +1,203 @@
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hll.h"
+#include "common.h"
+
+const uint32_t k_hll_q = 64 - k_hll_p;          // hash bits left for the run of zeros
+const uint64_t k_hll_seed = 0xadc83b19ULL;
+
+static void to_dense(HLL *hll) {
+    hll->dense = (uint8_t *)calloc(k_hll_registers, 1);
+    for (uint32_t i = 0; i < hll->nsparse; i++) {
+        hll->dense[hll->sparse[i] >> 8] = (uint8_t)hll->sparse[i];
+    }
+
+    free(hll->sparse);
+    hll->sparse = NULL;
+    hll->nsparse = hll->sparse_cap = 0;
+}
+
+// first entry with an index >= idx
+static uint32_t sparse_find(HLL *hll, uint32_t idx) {
+    uint32_t lo = 0, hi = hll->nsparse;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if ((hll->sparse[mid] >> 8) < idx) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool hll_set_register(HLL *hll, uint32_t idx, uint8_t val) {
+    if (hll->dense) {
+        if (hll->dense[idx] >= val) {
+            return false;
+        }
+        hll->dense[idx] = val;
+        hll->card_valid = false;
+        return true;
+    }
+
+    uint32_t pos = sparse_find(hll, idx);
+    if (pos < hll->nsparse && (hll->sparse[pos] >> 8) == idx) {
+        if ((uint8_t)hll->sparse[pos] >= val) {
+            return false;
+        }
+        hll->sparse[pos] = idx << 8 | val;
+        hll->card_valid = false;
+        return true;
+    }
+
+    if (hll->nsparse >= k_hll_sparse_max) {
+        to_dense(hll);
+        return hll_set_register(hll, idx, val);
+    }
+    if (hll->nsparse == hll->sparse_cap) {
+        hll->sparse_cap = hll->sparse_cap ? hll->sparse_cap * 2 : 16;
+        hll->sparse = (uint32_t *)realloc(hll->sparse, hll->sparse_cap * sizeof(uint32_t));
+    }
+    memmove(&hll->sparse[pos + 1], &hll->sparse[pos], (hll->nsparse - pos) * sizeof(uint32_t));
+    hll->sparse[pos] = idx << 8 | val;
+    hll->nsparse++;
+    hll->card_valid = false;
+    return true;
+}
+
+bool hll_add(HLL *hll, const char *s, size_t len) {
+    uint64_t h = str_hash64((const uint8_t *)s, len, k_hll_seed);
+    uint32_t idx = (uint32_t)(h & (k_hll_registers - 1));
+    uint64_t bits = (h >> k_hll_p) | (1ULL << k_hll_q);     // the sentinel bounds the run at q
+    uint8_t val = (uint8_t)(__builtin_ctzll(bits) + 1);
+    return hll_set_register(hll, idx, val);
+}
+
+// dst[i] = max(dst[i], src[i]), 16 registers at a time
+static void registers_max(uint8_t *dst, const uint8_t *src, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_max_epu8(a, b));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = dst[i] > src[i] ? dst[i] : src[i];
+    }
+}
+
+void hll_merge(HLL *dst, HLL *src) {
+    if (!src->dense) {
+        for (uint32_t i = 0; i < src->nsparse; i++) {
+            hll_set_register(dst, src->sparse[i] >> 8, (uint8_t)src->sparse[i]);
+        }
+        return;
+    }
+
+    if (!dst->dense) {
+        to_dense(dst);
+    }
+    registers_max(dst->dense, src->dense, k_hll_registers);
+    dst->card_valid = false;
+}
+
+// Ertl, "New cardinality estimation algorithms for HyperLogLog sketches"
+static double hll_sigma(double x) {
+    if (x == 1.0) {
+        return INFINITY;
+    }
+
+    double y = 1, z = x, prev = 0;
+    do {
+        x *= x;
+        prev = z;
+        z += x * y;
+        y += y;
+    } while (prev != z);
+    return z;
+}
+
+static double hll_tau(double x) {
+    if (x == 0.0 || x == 1.0) {
+        return 0.0;
+    }
+
+    double y = 1, z = 1 - x, prev = 0;
+    do {
+        x = sqrt(x);
+        prev = z;
+        y *= 0.5;
+        z -= pow(1 - x, 2) * y;
+    } while (prev != z);
+    return z / 3;
+}
+
+uint64_t hll_count(HLL *hll) {
+    if (hll->card_valid) {
+        return hll->card;
+    }
+
+    // histogram of register values
+    uint32_t hist[k_hll_q + 2] = {};
+    if (hll->dense) {
+        for (uint32_t i = 0; i < k_hll_registers; i++) {
+            hist[hll->dense[i]]++;
+        }
+    } else {
+        hist[0] = k_hll_registers - hll->nsparse;
+        for (uint32_t i = 0; i < hll->nsparse; i++) {
+            hist[(uint8_t)hll->sparse[i]]++;
+        }
+    }
+
+    double m = k_hll_registers;
+    double z = m * hll_tau((m - hist[k_hll_q + 1]) / m);
+    for (uint32_t k = k_hll_q; k >= 1; k--) {
+        z += hist[k];
+        z *= 0.5;
+    }
+    z += m * hll_sigma(hist[0] / m);
+
+    const double alpha_inf = 0.5 / log(2.0);
+    hll->card = (uint64_t)llround(alpha_inf * m * m / z);
+    hll->card_valid = true;
+    return hll->card;
+}
+
+size_t hll_bytes(HLL *hll) {
+    return hll->dense ? k_hll_registers : hll->sparse_cap * sizeof(uint32_t);
+}
+
+void hll_clear(HLL *hll) {
+    free(hll->dense);
+    free(hll->sparse);
+    hll->dense = NULL;
+    hll->sparse = NULL;
+    hll->nsparse = hll->sparse_cap = 0;
+    hll->card_valid = false;
+}
+
+void hll_foreach(HLL *hll, hll_cb f, void *arg) {
+    if (!hll->dense) {
+        for (uint32_t i = 0; i < hll->nsparse; i++) {
+            if (!f(hll->sparse[i] >> 8, (uint8_t)hll->sparse[i], arg)) {
+                return;
+            }
+        }
+        return;
+    }
+
+    for (uint32_t i = 0; i < k_hll_registers; i++) {
+        if (hll->dense[i] && !f(i, hll->dense[i], arg)) {
+            return;
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// HyperLogLog with 2^14 registers, about 0.81% standard error. A sketch starts sparse, holding
+// only its non-zero registers as a sorted array of (index << 8 | value) words, and switches to
+// one byte per register once that array would approach the size of the dense form.
+const uint32_t k_hll_p = 14;
+const uint32_t k_hll_registers = 1 << k_hll_p;
+const uint32_t k_hll_sparse_max = 3000;         // entries, 12 KB against 16 KB dense
+
+struct HLL {
+    uint8_t *dense = NULL;                      // k_hll_registers bytes, NULL while sparse
+    uint32_t *sparse = NULL;
+    uint32_t nsparse = 0;
+    uint32_t sparse_cap = 0;
+    uint64_t card = 0;                          // cached estimate
+    bool card_valid = false;
+};
+
+// true if a register changed
+bool hll_add(HLL *hll, const char *s, size_t len);
+bool hll_set_register(HLL *hll, uint32_t idx, uint8_t val);
+void hll_merge(HLL *dst, HLL *src);
+uint64_t hll_count(HLL *hll);
+size_t hll_bytes(HLL *hll);
+void hll_clear(HLL *hll);
+
+// non-zero registers
+typedef bool (*hll_cb)(uint32_t idx, uint8_t val, void *arg);
+void hll_foreach(HLL *hll, hll_cb f, void *arg);
\ No newline at end of file
@@ -0,0 +1,153 @@
+#include <string.h>
+
+#include "lz4.h"
+
+const uint32_t k_lz4_hash_log = 14;                     // 64 KB table on the stack
+const size_t k_lz4_min_match = 4;
+const size_t k_lz4_last_literals = 5;                   // the block ends with literals
+const size_t k_lz4_mf_limit = 12;                       // no match starts in the last 12 bytes
+const size_t k_lz4_max_offset = 65535;
+const uint32_t k_lz4_skip_trigger = 6;                  // search faster in incompressible data
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v = 0;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t hash4(uint32_t seq) {
+    return (seq * 2654435761U) >> (32 - k_lz4_hash_log);
+}
+
+// the 255-byte continuation of a length that did not fit in its 4 bits
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *put_literals(uint8_t *op, uint8_t *token, const uint8_t *lit, size_t n) {
+    *token = (uint8_t)((n >= 15 ? 15 : n) << 4);
+    if (n >= 15) {
+        op = put_length(op, n - 15);
+    }
+    memcpy(op, lit, n);
+    return op + n;
+}
+
+size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst) {
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    uint8_t *op = dst;
+
+    if (n > k_lz4_mf_limit) {
+        uint32_t table[1 << k_lz4_hash_log] = {};       // positions of 4-byte sequences
+        const uint8_t *match_limit = end - k_lz4_mf_limit;
+        const uint8_t *extend_limit = end - k_lz4_last_literals;
+        uint32_t misses = 0;
+
+        while (ip < match_limit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || (size_t)(ip - ref) > k_lz4_max_offset || read32(ref) != seq) {
+                ip += 1 + (misses++ >> k_lz4_skip_trigger);
+                continue;
+            }
+            misses = 0;
+
+            // extend the match forwards, then backwards over pending literals
+            const uint8_t *mp = ip + k_lz4_min_match, *rp = ref + k_lz4_min_match;
+            while (mp < extend_limit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            uint8_t *token = op++;
+            op = put_literals(op, token, anchor, (size_t)(ip - anchor));
+            size_t offset = (size_t)(ip - ref);
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+            size_t mlen = (size_t)(mp - ip) - k_lz4_min_match;
+            *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+            if (mlen >= 15) {
+                op = put_length(op, mlen - 15);
+            }
+
+            ip = anchor = mp;
+            if (ip < match_limit) {
+                table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+            }
+        }
+    }
+
+    uint8_t *token = op++;
+    op = put_literals(op, token, anchor, (size_t)(end - anchor));
+    return (size_t)(op - dst);
+}
+
+// a length continued in 255-byte steps, false if the input ends first
+static bool get_length(const uint8_t *&ip, const uint8_t *end, size_t &len) {
+    uint8_t b = 255;
+    while (b == 255) {
+        if (ip >= end) {
+            return false;
+        }
+        b = *ip++;
+        len += b;
+    }
+    return true;
+}
+
+bool lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t len) {
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + len;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && !get_length(ip, iend, lit)) {
+            return false;
+        }
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit) {
+            return false;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) {
+            break;                                      // the last sequence has no match
+        }
+
+        if (iend - ip < 2) {
+            return false;
+        }
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && !get_length(ip, iend, mlen)) {
+            return false;
+        }
+        mlen += k_lz4_min_match;
+        if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(oend - op) < mlen) {
+            return false;
+        }
+
+        // an overlapping copy repeats the last `offset` bytes, copy whole periods at a time
+        const uint8_t *ref = op - offset;
+        while (mlen > 0) {
+            size_t chunk = (size_t)(op - ref) < mlen ? (size_t)(op - ref) : mlen;
+            memcpy(op, ref, chunk);
+            op += chunk;
+            mlen -= chunk;
+        }
+    }
+    return op == oend;
+}
\ No newline at end of file
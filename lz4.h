@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A compressor and decompressor for the LZ4 block format: greedy matching of 4-byte sequences
+// through a hash table, and copies of earlier output up to 64 KB back. Blocks are compatible
+// with other LZ4 implementations, but carry no frame, size or checksum.
+
+// worst case size of the compressed form of n bytes
+inline size_t lz4_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+// writes at most lz4_bound(n) bytes to dst and returns their count
+size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst);
+// false if the block is corrupt or does not decompress to exactly `len` bytes
+bool lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t len);
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "qlist.h"
+#include "common.h"
+
+const uint32_t k_rec_overhead = 8;
+
+static uint32_t read_len(const uint8_t *p) {
+    uint32_t len = 0;
+    memcpy(&len, p, 4);
+    return len;
+}
+
+static QChunk *qchunk_new(uint32_t cap, bool front) {
+    QChunk *c = (QChunk *)malloc(sizeof(QChunk) + cap);
+    dlist_init(&c->node);
+    c->count = 0;
+    c->cap = cap;
+    c->start = c->end = front ? cap : 0;        // leave the room on the side that grows
+    return c;
+}
+
+static void qchunk_del(QList *ql, QChunk *c) {
+    dlist_detach(&c->node);
+    free(c);
+    ql->nchunks--;
+}
+
+// make `need` bytes available at one end, moving the records if the free space is at the other
+static bool qchunk_make_room(QChunk *c, uint32_t need, bool front) {
+    if ((front ? c->start : c->cap - c->end) >= need) {
+        return true;
+    }
+
+    uint32_t used = c->end - c->start;
+    if (c->cap - used < need) {
+        return false;
+    }
+
+    uint32_t start = (c->cap - used) / 2;
+    if (front && start < need) {
+        start = c->cap - used;
+    } else if (!front && c->cap - (start + used) < need) {
+        start = 0;
+    }
+    memmove(&c->data[start], &c->data[c->start], used);
+    c->start = start;
+    c->end = start + used;
+    return true;
+}
+
+void qlist_init(QList *ql) {
+    dlist_init(&ql->chunks);
+    ql->size = 0;
+    ql->nchunks = 0;
+}
+
+void qlist_push(QList *ql, bool front, const char *s, size_t len) {
+    uint32_t need = (uint32_t)len + k_rec_overhead;
+
+    QChunk *c = NULL;
+    if (!dlist_empty(&ql->chunks)) {
+        c = container_of(front ? ql->chunks.next : ql->chunks.prev, QChunk, node);
+        if (!qchunk_make_room(c, need, front)) {
+            c = NULL;
+        }
+    }
+    if (!c) {
+        c = qchunk_new(need > k_qchunk_size ? need : k_qchunk_size, front);
+        dlist_insert_before(front ? ql->chunks.next : &ql->chunks, &c->node);
+        ql->nchunks++;
+    }
+
+    uint32_t pos = front ? c->start - need : c->end;
+    uint32_t len32 = (uint32_t)len;
+    memcpy(&c->data[pos], &len32, 4);
+    memcpy(&c->data[pos + 4], s, len);
+    memcpy(&c->data[pos + 4 + len], &len32, 4);
+
+    if (front) {
+        c->start = pos;
+    } else {
+        c->end = pos + need;
+    }
+    c->count++;
+    ql->size++;
+}
+
+bool qlist_peek(QList *ql, bool front, const char **s, size_t *len) {
+    if (dlist_empty(&ql->chunks)) {
+        return false;
+    }
+
+    QChunk *c = container_of(front ? ql->chunks.next : ql->chunks.prev, QChunk, node);
+    if (front) {
+        *len = read_len(&c->data[c->start]);
+        *s = (const char *)&c->data[c->start + 4];
+    } else {
+        *len = read_len(&c->data[c->end - 4]);
+        *s = (const char *)&c->data[c->end - 4 - *len];
+    }
+    return true;
+}
+
+void qlist_pop(QList *ql, bool front) {
+    if (dlist_empty(&ql->chunks)) {
+        return;
+    }
+
+    QChunk *c = container_of(front ? ql->chunks.next : ql->chunks.prev, QChunk, node);
+    if (front) {
+        c->start += read_len(&c->data[c->start]) + k_rec_overhead;
+    } else {
+        c->end -= read_len(&c->data[c->end - 4]) + k_rec_overhead;
+    }
+    c->count--;
+    ql->size--;
+
+    if (c->count == 0) {
+        qchunk_del(ql, c);
+    }
+}
+
+void qlist_clear(QList *ql) {
+    while (!dlist_empty(&ql->chunks)) {
+        qchunk_del(ql, container_of(ql->chunks.next, QChunk, node));
+    }
+    ql->size = 0;
+}
+
+void qlist_range(QList *ql, size_t start, size_t stop, qlist_cb f, void *arg) {
+    size_t idx = 0;                             // index of the first element of the chunk
+    for (DList *node = ql->chunks.next; node != &ql->chunks && idx <= stop; node = node->next) {
+        QChunk *c = container_of(node, QChunk, node);
+        if (idx + c->count <= start) {
+            idx += c->count;                    // skip whole chunks
+            continue;
+        }
+
+        uint32_t pos = c->start;
+        for (uint32_t i = 0; i < c->count && idx <= stop; i++, idx++) {
+            uint32_t len = read_len(&c->data[pos]);
+            if (idx >= start && !f((const char *)&c->data[pos + 4], len, arg)) {
+                return;
+            }
+            pos += len + k_rec_overhead;
+        }
+    }
+}
\ No newline at end of file
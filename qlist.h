@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dlist.h"
+
+// Deque of strings stored as a linked list of chunks ("quicklist"). A chunk packs its elements
+// contiguously as (u32 len, bytes, u32 len) records, the trailing length lets it be walked from
+// either end. Chunks keep free space at both ends so most pushes only copy the element.
+struct QChunk {
+    DList node;
+    uint32_t count = 0;
+    uint32_t start = 0;             // first record
+    uint32_t end = 0;               // past the last record
+    uint32_t cap = 0;
+    uint8_t data[0];
+};
+
+struct QList {
+    DList chunks;                   // head, see qlist_init()
+    size_t size = 0;                // elements
+    size_t nchunks = 0;
+};
+
+const uint32_t k_qchunk_size = 4096;    // data bytes per chunk, larger elements get a chunk of their own
+
+void qlist_init(QList *ql);
+void qlist_push(QList *ql, bool front, const char *s, size_t len);
+// the element points into the list and is valid until the next modification
+bool qlist_peek(QList *ql, bool front, const char **s, size_t *len);
+void qlist_pop(QList *ql, bool front);
+void qlist_clear(QList *ql);
+
+// elements [start, stop] counted from the front, stop < size
+typedef bool (*qlist_cb)(const char *s, size_t len, void *arg);
+void qlist_range(QList *ql, size_t start, size_t stop, qlist_cb f, void *arg);
\ No newline at end of file
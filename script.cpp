@@ -0,0 +1,1462 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+
+#include "script.h"
+
+// Lexer
+
+enum {
+    TK_EOF = 256,               // below are single characters
+    TK_NAME,
+    TK_INT,
+    TK_DBL,
+    TK_STR,
+    TK_EQ,
+    TK_NE,
+    TK_LE,
+    TK_GE,
+    TK_CONCAT,
+    TK_ERROR,                   // message in Token::text
+    // keywords, in the order of k_keywords
+    TK_AND,
+    TK_BREAK,
+    TK_DO,
+    TK_ELSE,
+    TK_ELSEIF,
+    TK_END,
+    TK_FALSE,
+    TK_FOR,
+    TK_IF,
+    TK_LOCAL,
+    TK_NIL,
+    TK_NOT,
+    TK_OR,
+    TK_RETURN,
+    TK_THEN,
+    TK_TRUE,
+    TK_WHILE,
+};
+
+static const char *k_keywords[] = {
+    "and", "break", "do", "else", "elseif", "end", "false", "for", "if", "local", "nil", "not", "or",
+    "return", "then", "true", "while",
+};
+
+struct Token {
+    int type = TK_EOF;
+    std::string text;           // TK_NAME, TK_STR, TK_ERROR
+    int64_t i = 0;
+    double d = 0;
+    uint32_t line = 1;
+};
+
+struct Lexer {
+    const char *p = NULL;
+    const char *end = NULL;
+    uint32_t line = 1;
+};
+
+static void lex_error(Token &t, const char *msg) {
+    t.type = TK_ERROR;
+    t.text = msg;
+}
+
+static void lex_number(Lexer *lx, Token &t) {
+    const char *start = lx->p;
+    bool is_dbl = false;
+    while (lx->p < lx->end) {
+        char c = *lx->p;
+        if (isdigit((unsigned char)c) || c == '.') {
+            is_dbl = is_dbl || c == '.';
+            lx->p++;
+        } else if (c == 'e' || c == 'E') {
+            is_dbl = true;
+            lx->p++;
+            if (lx->p < lx->end && (*lx->p == '+' || *lx->p == '-')) {
+                lx->p++;
+            }
+        } else if (isalpha((unsigned char)c) || c == '_') {
+            return lex_error(t, "malformed number");
+        } else {
+            break;
+        }
+    }
+
+    std::string num(start, lx->p);
+    char *endp = NULL;
+    if (!is_dbl) {
+        errno = 0;
+        t.i = strtoll(num.c_str(), &endp, 10);
+        if (errno == 0 && endp == num.c_str() + num.size()) {
+            t.type = TK_INT;
+            return;
+        }
+    }
+
+    t.d = strtod(num.c_str(), &endp);
+    if (endp != num.c_str() + num.size()) {
+        return lex_error(t, "malformed number");
+    }
+    t.type = TK_DBL;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = (char)tolower((unsigned char)c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+static void lex_string(Lexer *lx, Token &t) {
+    char quote = *lx->p++;
+    while (lx->p < lx->end && *lx->p != quote) {
+        char c = *lx->p++;
+        if (c == '\n') {
+            return lex_error(t, "unfinished string");
+        }
+        if (c != '\\') {
+            t.text.push_back(c);
+            continue;
+        }
+
+        if (lx->p >= lx->end) {
+            break;
+        }
+        char e = *lx->p++;
+        switch (e) {
+        case 'n': t.text.push_back('\n'); break;
+        case 't': t.text.push_back('\t'); break;
+        case 'r': t.text.push_back('\r'); break;
+        case '0': t.text.push_back('\0'); break;
+        case '\\': case '"': case '\'': t.text.push_back(e); break;
+        case 'x': {
+            int hi = lx->p + 1 < lx->end ? hex_digit(lx->p[0]) : -1;
+            int lo = hi >= 0 ? hex_digit(lx->p[1]) : -1;
+            if (lo < 0) {
+                return lex_error(t, "invalid escape sequence");
+            }
+            t.text.push_back((char)(hi * 16 + lo));
+            lx->p += 2;
+            break;
+        }
+        default:
+            return lex_error(t, "invalid escape sequence");
+        }
+    }
+
+    if (lx->p >= lx->end) {
+        return lex_error(t, "unfinished string");
+    }
+    lx->p++;                    // closing quote
+    t.type = TK_STR;
+}
+
+static void lex_next(Lexer *lx, Token &t) {
+    t = Token();
+
+    // spaces and -- comments
+    while (lx->p < lx->end) {
+        char c = *lx->p;
+        if (c == '\n') {
+            lx->line++;
+            lx->p++;
+        } else if (isspace((unsigned char)c)) {
+            lx->p++;
+        } else if (c == '-' && lx->p + 1 < lx->end && lx->p[1] == '-') {
+            while (lx->p < lx->end && *lx->p != '\n') {
+                lx->p++;
+            }
+        } else {
+            break;
+        }
+    }
+
+    t.line = lx->line;
+    if (lx->p >= lx->end) {
+        t.type = TK_EOF;
+        return;
+    }
+
+    char c = *lx->p;
+    char next = lx->p + 1 < lx->end ? lx->p[1] : 0;
+    if (isalpha((unsigned char)c) || c == '_') {
+        const char *start = lx->p;
+        while (lx->p < lx->end && (isalnum((unsigned char)*lx->p) || *lx->p == '_')) {
+            lx->p++;
+        }
+        t.text.assign(start, lx->p);
+        t.type = TK_NAME;
+        for (size_t k = 0; k < sizeof(k_keywords) / sizeof(k_keywords[0]); k++) {
+            if (t.text == k_keywords[k]) {
+                t.type = TK_AND + (int)k;
+            }
+        }
+        return;
+    }
+    if (isdigit((unsigned char)c) || (c == '.' && isdigit((unsigned char)next))) {
+        return lex_number(lx, t);
+    }
+    if (c == '"' || c == '\'') {
+        return lex_string(lx, t);
+    }
+
+    // two character operators
+    int two = 0;
+    if (c == '=' && next == '=') {
+        two = TK_EQ;
+    } else if (c == '~' && next == '=') {
+        two = TK_NE;
+    } else if (c == '<' && next == '=') {
+        two = TK_LE;
+    } else if (c == '>' && next == '=') {
+        two = TK_GE;
+    } else if (c == '.' && next == '.') {
+        two = TK_CONCAT;
+    }
+    if (two) {
+        t.type = two;
+        lx->p += 2;
+        return;
+    }
+
+    if (strchr("+-*/%#<>=(){}[],;", c)) {
+        t.type = c;
+        lx->p++;
+        return;
+    }
+    lex_error(t, "unexpected character");
+}
+
+// Bytecode
+
+enum {
+    OP_CONST,                   // push consts[a]
+    OP_NIL,
+    OP_TRUE,
+    OP_FALSE,
+    OP_KEYS,                    // push KEYS as an array
+    OP_ARGV,
+    OP_LOAD,                    // push locals[a]
+    OP_STORE,                   // pop into locals[a]
+    OP_INDEX,                   // pop index and array, push the element
+    OP_SETINDEX,                // pop value and index, locals[a][index] = value
+    OP_ARRAY,                   // pop a values into a new array
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_NEG,
+    OP_CONCAT,
+    OP_LEN,
+    OP_NOT,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_JMP,                     // to a
+    OP_JMPF,                    // pop, to a if false
+    OP_AND,                     // to a keeping the top if it is false, else pop
+    OP_OR,                      // to a keeping the top if it is true, else pop
+    OP_FORCHK,                  // to b if the loop over locals[a], limit locals[a + 1], step locals[a + 2] is done
+    OP_FORINC,                  // locals[a] += step
+    OP_CALL,                    // builtin a with b arguments
+    OP_POP,
+    OP_RET,
+};
+
+struct Instr {
+    uint8_t op = 0;
+    int32_t a = 0;
+    int32_t b = 0;
+};
+
+struct Script {
+    std::vector<Instr> code;
+    std::vector<uint32_t> lines;        // source line of each instruction
+    std::vector<SValue> consts;
+    uint32_t nlocals = 0;
+};
+
+enum {
+    BI_CALL     = 0,            // run a command, errors abort the script
+    BI_PCALL    = 1,            // run a command, errors are returned
+    BI_TONUMBER = 2,
+    BI_TOSTRING = 3,
+    BI_TYPE     = 4,
+    BI_ERROR    = 5,
+    BI_MAX      = 6,
+};
+
+static const char *k_builtins[BI_MAX] = {"call", "pcall", "tonumber", "tostring", "type", "error"};
+
+const uint32_t k_max_locals = 200;
+const uint32_t k_max_depth = 200;       // nesting of blocks and expressions
+const uint32_t k_max_nesting = 64;      // of arrays in arrays
+const size_t k_max_elems = 16 << 20;    // in an array and the arrays nested in it
+const size_t k_max_str = 512 << 20;
+
+// Compiler, a recursive descent parser that emits bytecode as it goes
+
+struct Compiler {
+    Lexer lx;
+    Token tok;                          // current token
+    Token ahead;                        // the one after, if has_ahead
+    bool has_ahead = false;
+    Script *s = NULL;
+    std::vector<std::pair<std::string, int32_t>> scope;    // visible locals, innermost last
+    std::vector<std::vector<size_t>> breaks;                // jumps out of each enclosing loop
+    uint32_t depth = 0;
+    std::string err;
+};
+
+static bool fail(Compiler *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static bool fail(Compiler *c, const char *fmt, ...) {
+    if (!c->err.empty()) {
+        return false;                   // keep the first error
+    }
+
+    char msg[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    char buf[300];
+    snprintf(buf, sizeof(buf), "line %u: %s", c->tok.line, msg);
+    c->err = buf;
+    return false;
+}
+
+static void advance(Compiler *c) {
+    if (c->has_ahead) {
+        c->tok = c->ahead;
+        c->has_ahead = false;
+    } else {
+        lex_next(&c->lx, c->tok);
+    }
+    if (c->tok.type == TK_ERROR) {
+        fail(c, "%s", c->tok.text.c_str());
+    }
+}
+
+static const Token &peek(Compiler *c) {
+    if (!c->has_ahead) {
+        lex_next(&c->lx, c->ahead);
+        c->has_ahead = true;
+    }
+    return c->ahead;
+}
+
+static bool expect(Compiler *c, int type, const char *what) {
+    if (c->tok.type != type) {
+        return fail(c, "expected %s", what);
+    }
+    advance(c);
+    return true;
+}
+
+static size_t emit(Compiler *c, uint8_t op, int32_t a = 0, int32_t b = 0) {
+    Instr in;
+    in.op = op;
+    in.a = a;
+    in.b = b;
+    c->s->code.push_back(in);
+    c->s->lines.push_back(c->tok.line);
+    return c->s->code.size() - 1;
+}
+
+// point the jump at `at` to the next instruction
+static void patch(Compiler *c, size_t at) {
+    c->s->code[at].a = (int32_t)c->s->code.size();
+}
+
+static void emit_const(Compiler *c, const SValue &v) {
+    c->s->consts.push_back(v);
+    emit(c, OP_CONST, (int32_t)c->s->consts.size() - 1);
+}
+
+static int32_t find_local(Compiler *c, const std::string &name) {
+    for (size_t i = c->scope.size(); i-- > 0;) {
+        if (c->scope[i].first == name) {
+            return c->scope[i].second;
+        }
+    }
+    return -1;
+}
+
+static bool alloc_locals(Compiler *c, uint32_t n, int32_t &slot) {
+    if (c->s->nlocals + n > k_max_locals) {
+        return fail(c, "too many local variables");
+    }
+    slot = (int32_t)c->s->nlocals;
+    c->s->nlocals += n;
+    return true;
+}
+
+static bool is_block_end(int type) {
+    return type == TK_EOF || type == TK_END || type == TK_ELSE || type == TK_ELSEIF;
+}
+
+static bool parse_expr(Compiler *c);
+static bool parse_block(Compiler *c);
+
+// name(args), for builtins only
+static bool parse_call(Compiler *c) {
+    int32_t id = -1;
+    for (int32_t i = 0; i < BI_MAX; i++) {
+        if (c->tok.text == k_builtins[i]) {
+            id = i;
+        }
+    }
+    if (id < 0) {
+        return fail(c, "unknown function '%s'", c->tok.text.c_str());
+    }
+    advance(c);
+    advance(c);                         // (
+
+    int32_t nargs = 0;
+    if (c->tok.type != ')') {
+        do {
+            if (nargs > 0) {
+                advance(c);             // ,
+            }
+            if (!parse_expr(c)) {
+                return false;
+            }
+            nargs++;
+        } while (c->tok.type == ',');
+    }
+    if (!expect(c, ')', "')'")) {
+        return false;
+    }
+
+    bool one = id == BI_TONUMBER || id == BI_TOSTRING || id == BI_TYPE || id == BI_ERROR;
+    if ((one && nargs != 1) || (!one && nargs < 1)) {
+        return fail(c, "wrong number of arguments to '%s'", k_builtins[id]);
+    }
+    emit(c, OP_CALL, id, nargs);
+    return true;
+}
+
+static bool parse_primary(Compiler *c) {
+    Token &t = c->tok;
+    SValue v;
+    switch (t.type) {
+    case TK_INT:
+        v.type = SV_INT;
+        v.i = t.i;
+        emit_const(c, v);
+        advance(c);
+        return true;
+    case TK_DBL:
+        v.type = SV_DBL;
+        v.d = t.d;
+        emit_const(c, v);
+        advance(c);
+        return true;
+    case TK_STR:
+        v.type = SV_STR;
+        v.s = t.text;
+        emit_const(c, v);
+        advance(c);
+        return true;
+    case TK_NIL:
+        emit(c, OP_NIL);
+        advance(c);
+        return true;
+    case TK_TRUE:
+        emit(c, OP_TRUE);
+        advance(c);
+        return true;
+    case TK_FALSE:
+        emit(c, OP_FALSE);
+        advance(c);
+        return true;
+    case '(':
+        advance(c);
+        return parse_expr(c) && expect(c, ')', "')'");
+    case '{': {
+        advance(c);
+        int32_t n = 0;
+        while (c->tok.type != '}') {
+            if (!parse_expr(c)) {
+                return false;
+            }
+            n++;
+            if (c->tok.type != ',') {
+                break;
+            }
+            advance(c);
+        }
+        emit(c, OP_ARRAY, n);
+        return expect(c, '}', "'}'");
+    }
+    case TK_NAME: {
+        if (peek(c).type == '(') {
+            return parse_call(c);
+        }
+
+        int32_t slot = find_local(c, t.text);
+        if (slot >= 0) {
+            emit(c, OP_LOAD, slot);
+        } else if (t.text == "KEYS") {
+            emit(c, OP_KEYS);
+        } else if (t.text == "ARGV") {
+            emit(c, OP_ARGV);
+        } else {
+            return fail(c, "undefined variable '%s'", t.text.c_str());
+        }
+        advance(c);
+        return true;
+    }
+    default:
+        return fail(c, "unexpected symbol");
+    }
+}
+
+static bool parse_postfix(Compiler *c) {
+    if (!parse_primary(c)) {
+        return false;
+    }
+    while (c->tok.type == '[') {
+        advance(c);
+        if (!parse_expr(c) || !expect(c, ']', "']'")) {
+            return false;
+        }
+        emit(c, OP_INDEX);
+    }
+    return true;
+}
+
+static bool parse_unary(Compiler *c) {
+    uint8_t op = 0;
+    if (c->tok.type == TK_NOT) {
+        op = OP_NOT;
+    } else if (c->tok.type == '-') {
+        op = OP_NEG;
+    } else if (c->tok.type == '#') {
+        op = OP_LEN;
+    } else {
+        return parse_postfix(c);
+    }
+
+    if (++c->depth > k_max_depth) {
+        return fail(c, "expression is too deeply nested");
+    }
+    advance(c);
+    bool ok = parse_unary(c);
+    c->depth--;
+    emit(c, op);
+    return ok;
+}
+
+static bool parse_mul(Compiler *c) {
+    if (!parse_unary(c)) {
+        return false;
+    }
+    while (c->tok.type == '*' || c->tok.type == '/' || c->tok.type == '%') {
+        uint8_t op = c->tok.type == '*' ? OP_MUL : c->tok.type == '/' ? OP_DIV : OP_MOD;
+        advance(c);
+        if (!parse_unary(c)) {
+            return false;
+        }
+        emit(c, op);
+    }
+    return true;
+}
+
+static bool parse_add(Compiler *c) {
+    if (!parse_mul(c)) {
+        return false;
+    }
+    while (c->tok.type == '+' || c->tok.type == '-') {
+        uint8_t op = c->tok.type == '+' ? OP_ADD : OP_SUB;
+        advance(c);
+        if (!parse_mul(c)) {
+            return false;
+        }
+        emit(c, op);
+    }
+    return true;
+}
+
+// right associative
+static bool parse_concat(Compiler *c) {
+    if (!parse_add(c)) {
+        return false;
+    }
+    if (c->tok.type != TK_CONCAT) {
+        return true;
+    }
+
+    if (++c->depth > k_max_depth) {
+        return fail(c, "expression is too deeply nested");
+    }
+    advance(c);
+    bool ok = parse_concat(c);
+    c->depth--;
+    emit(c, OP_CONCAT);
+    return ok;
+}
+
+static bool parse_cmp(Compiler *c) {
+    if (!parse_concat(c)) {
+        return false;
+    }
+    while (true) {
+        uint8_t op = 0;
+        switch (c->tok.type) {
+        case TK_EQ: op = OP_EQ; break;
+        case TK_NE: op = OP_NE; break;
+        case '<': op = OP_LT; break;
+        case TK_LE: op = OP_LE; break;
+        case '>': op = OP_GT; break;
+        case TK_GE: op = OP_GE; break;
+        default: return true;
+        }
+        advance(c);
+        if (!parse_concat(c)) {
+            return false;
+        }
+        emit(c, op);
+    }
+}
+
+static bool parse_and(Compiler *c) {
+    if (!parse_cmp(c)) {
+        return false;
+    }
+    while (c->tok.type == TK_AND) {
+        size_t j = emit(c, OP_AND);
+        advance(c);
+        if (!parse_cmp(c)) {
+            return false;
+        }
+        patch(c, j);
+    }
+    return true;
+}
+
+static bool parse_expr(Compiler *c) {
+    if (++c->depth > k_max_depth) {
+        return fail(c, "expression is too deeply nested");
+    }
+
+    bool ok = parse_and(c);
+    while (ok && c->tok.type == TK_OR) {
+        size_t j = emit(c, OP_OR);
+        advance(c);
+        ok = parse_and(c);
+        patch(c, j);
+    }
+    c->depth--;
+    return ok;
+}
+
+// a block with its own locals
+static bool parse_scoped(Compiler *c) {
+    size_t nscope = c->scope.size();
+    bool ok = parse_block(c);
+    c->scope.resize(nscope);
+    return ok;
+}
+
+static bool parse_if(Compiler *c) {
+    advance(c);
+    std::vector<size_t> ends;
+    while (true) {
+        if (!parse_expr(c) || !expect(c, TK_THEN, "'then'")) {
+            return false;
+        }
+        size_t jf = emit(c, OP_JMPF);
+        if (!parse_scoped(c)) {
+            return false;
+        }
+
+        if (c->tok.type == TK_ELSEIF || c->tok.type == TK_ELSE) {
+            ends.push_back(emit(c, OP_JMP));
+        }
+        patch(c, jf);
+        if (c->tok.type == TK_ELSEIF) {
+            advance(c);
+            continue;
+        }
+        if (c->tok.type == TK_ELSE) {
+            advance(c);
+            if (!parse_scoped(c)) {
+                return false;
+            }
+        }
+        break;
+    }
+
+    if (!expect(c, TK_END, "'end'")) {
+        return false;
+    }
+    for (size_t j : ends) {
+        patch(c, j);
+    }
+    return true;
+}
+
+static bool parse_loop_body(Compiler *c) {
+    c->breaks.push_back(std::vector<size_t>());
+    return parse_scoped(c) && expect(c, TK_END, "'end'");
+}
+
+static void patch_breaks(Compiler *c) {
+    for (size_t j : c->breaks.back()) {
+        patch(c, j);
+    }
+    c->breaks.pop_back();
+}
+
+static bool parse_while(Compiler *c) {
+    advance(c);
+    int32_t top = (int32_t)c->s->code.size();
+    if (!parse_expr(c) || !expect(c, TK_DO, "'do'")) {
+        return false;
+    }
+
+    size_t jf = emit(c, OP_JMPF);
+    if (!parse_loop_body(c)) {
+        return false;
+    }
+    emit(c, OP_JMP, top);
+    patch(c, jf);
+    patch_breaks(c);
+    return true;
+}
+
+// for name = start, limit [, step] do ... end
+static bool parse_for(Compiler *c) {
+    advance(c);
+    if (c->tok.type != TK_NAME) {
+        return fail(c, "expected a name");
+    }
+    std::string name = c->tok.text;
+    advance(c);
+
+    int32_t slot = 0;
+    if (!alloc_locals(c, 3, slot) || !expect(c, '=', "'='") || !parse_expr(c)) {
+        return false;
+    }
+    emit(c, OP_STORE, slot);
+    if (!expect(c, ',', "','") || !parse_expr(c)) {
+        return false;
+    }
+    emit(c, OP_STORE, slot + 1);
+    if (c->tok.type == ',') {
+        advance(c);
+        if (!parse_expr(c)) {
+            return false;
+        }
+    } else {
+        SValue one;
+        one.type = SV_INT;
+        one.i = 1;
+        emit_const(c, one);
+    }
+    emit(c, OP_STORE, slot + 2);
+    if (!expect(c, TK_DO, "'do'")) {
+        return false;
+    }
+
+    size_t check = emit(c, OP_FORCHK, slot);
+    c->scope.push_back(std::make_pair(name, slot));
+    bool ok = parse_loop_body(c);
+    c->scope.pop_back();
+    if (!ok) {
+        return false;
+    }
+    emit(c, OP_FORINC, slot);
+    emit(c, OP_JMP, (int32_t)check);
+    c->s->code[check].b = (int32_t)c->s->code.size();
+    patch_breaks(c);
+    return true;
+}
+
+static bool parse_local(Compiler *c) {
+    advance(c);
+    if (c->tok.type != TK_NAME) {
+        return fail(c, "expected a name");
+    }
+    std::string name = c->tok.text;
+    advance(c);
+
+    if (c->tok.type == '=') {
+        advance(c);
+        if (!parse_expr(c)) {
+            return false;
+        }
+    } else {
+        emit(c, OP_NIL);
+    }
+
+    int32_t slot = 0;
+    if (!alloc_locals(c, 1, slot)) {
+        return false;
+    }
+    emit(c, OP_STORE, slot);
+    c->scope.push_back(std::make_pair(name, slot));     // after the value, `local x = x` reads the outer one
+    return true;
+}
+
+// assignment, index assignment or a call
+static bool parse_name_stat(Compiler *c) {
+    int next = peek(c).type;
+    if (next == '(') {
+        if (!parse_call(c)) {
+            return false;
+        }
+        emit(c, OP_POP);
+        return true;
+    }
+
+    int32_t slot = find_local(c, c->tok.text);
+    if (next != '=' && next != '[') {
+        return fail(c, "syntax error near '%s'", c->tok.text.c_str());
+    }
+    if (slot < 0) {
+        return fail(c, "assignment to undeclared variable '%s'", c->tok.text.c_str());
+    }
+    advance(c);
+
+    if (next == '=') {
+        advance(c);
+        if (!parse_expr(c)) {
+            return false;
+        }
+        emit(c, OP_STORE, slot);
+        return true;
+    }
+
+    advance(c);                         // [
+    if (!parse_expr(c) || !expect(c, ']', "']'") || !expect(c, '=', "'='") || !parse_expr(c)) {
+        return false;
+    }
+    emit(c, OP_SETINDEX, slot);
+    return true;
+}
+
+static bool parse_stat(Compiler *c) {
+    switch (c->tok.type) {
+    case TK_LOCAL:
+        return parse_local(c);
+    case TK_IF:
+        return parse_if(c);
+    case TK_WHILE:
+        return parse_while(c);
+    case TK_FOR:
+        return parse_for(c);
+    case TK_DO:
+        advance(c);
+        return parse_scoped(c) && expect(c, TK_END, "'end'");
+    case TK_BREAK:
+        if (c->breaks.empty()) {
+            return fail(c, "break outside a loop");
+        }
+        c->breaks.back().push_back(emit(c, OP_JMP));
+        advance(c);
+        return true;
+    case TK_NAME:
+        return parse_name_stat(c);
+    default:
+        return fail(c, "unexpected symbol");
+    }
+}
+
+static bool parse_block(Compiler *c) {
+    if (++c->depth > k_max_depth) {
+        return fail(c, "blocks are too deeply nested");
+    }
+
+    bool ok = true;
+    while (ok && !is_block_end(c->tok.type)) {
+        if (c->tok.type == TK_RETURN) {
+            // the last statement of a block
+            advance(c);
+            if (is_block_end(c->tok.type) || c->tok.type == ';') {
+                emit(c, OP_NIL);
+            } else {
+                ok = parse_expr(c);
+            }
+            emit(c, OP_RET);
+            if (ok && c->tok.type == ';') {
+                advance(c);
+            }
+            if (ok && !is_block_end(c->tok.type)) {
+                ok = fail(c, "'end' expected after return");
+            }
+            break;
+        }
+
+        ok = parse_stat(c);
+        if (ok && c->tok.type == ';') {
+            advance(c);
+        }
+    }
+
+    c->depth--;
+    return ok && c->err.empty();
+}
+
+Script *script_compile(const char *src, size_t len, std::string &err) {
+    Compiler c;
+    c.lx.p = src;
+    c.lx.end = src + len;
+    c.s = new Script();
+    advance(&c);
+
+    if (parse_block(&c) && c.tok.type != TK_EOF) {
+        fail(&c, "unexpected symbol");
+    }
+    if (!c.err.empty()) {
+        err = c.err;
+        delete c.s;
+        return NULL;
+    }
+
+    emit(&c, OP_NIL);
+    emit(&c, OP_RET);
+    return c.s;
+}
+
+void script_free(Script *script) {
+    delete script;
+}
+
+// VM
+
+struct VM {
+    Script *s = NULL;
+    ScriptEnv *env = NULL;
+    SValue *out = NULL;
+    size_t pc = 0;
+    std::vector<SValue> stack;
+    std::vector<SValue> locals;
+};
+
+static bool vm_error(VM *vm, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static bool vm_error(VM *vm, const char *fmt, ...) {
+    char msg[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    char buf[300];
+    snprintf(buf, sizeof(buf), "line %u: %s", vm->s->lines[vm->pc], msg);
+    *vm->out = SValue();
+    vm->out->type = SV_ERR;
+    vm->out->s = buf;
+    return false;
+}
+
+static const char *type_name(const SValue &v) {
+    static const char *names[] = {"nil", "boolean", "number", "number", "string", "array", "error"};
+    return names[v.type];
+}
+
+static bool truthy(const SValue &v) {
+    return !(v.type == SV_NIL || (v.type == SV_BOOL && !v.i));
+}
+
+static bool is_number(const SValue &v) {
+    return v.type == SV_INT || v.type == SV_DBL;
+}
+
+static double as_dbl(const SValue &v) {
+    return v.type == SV_INT ? (double)v.i : v.d;
+}
+
+// numbers, and strings that look like one
+static bool to_number(const SValue &v, SValue &num) {
+    if (is_number(v)) {
+        num = v;
+        return true;
+    }
+    if (v.type != SV_STR || v.s.empty() || isspace((unsigned char)v.s[0])) {
+        return false;
+    }
+
+    const char *s = v.s.c_str();
+    const char *end = s + v.s.size();
+    char *endp = NULL;
+    errno = 0;
+    int64_t i = strtoll(s, &endp, 10);
+    if (errno == 0 && endp == end) {
+        num.type = SV_INT;
+        num.i = i;
+        return true;
+    }
+
+    double d = strtod(s, &endp);
+    if (endp != end) {
+        return false;
+    }
+    num.type = SV_DBL;
+    num.d = d;
+    return true;
+}
+
+static bool to_text(const SValue &v, std::string &out) {
+    char buf[32];
+    if (v.type == SV_STR) {
+        out = v.s;
+    } else if (v.type == SV_INT) {
+        snprintf(buf, sizeof(buf), "%lld", (long long)v.i);
+        out = buf;
+    } else if (v.type == SV_DBL) {
+        snprintf(buf, sizeof(buf), "%.17g", v.d);
+        out = buf;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool values_equal(const SValue &a, const SValue &b) {
+    if (is_number(a) && is_number(b)) {
+        return a.type == SV_INT && b.type == SV_INT ? a.i == b.i : as_dbl(a) == as_dbl(b);
+    }
+    if (a.type != b.type) {
+        return false;
+    }
+
+    switch (a.type) {
+    case SV_NIL:
+        return true;
+    case SV_BOOL:
+        return a.i == b.i;
+    case SV_STR:
+    case SV_ERR:
+        return a.s == b.s;
+    case SV_ARR:
+        if (a.arr.size() != b.arr.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.arr.size(); i++) {
+            if (!values_equal(a.arr[i], b.arr[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+// result in `a`
+static bool vm_arith(VM *vm, uint8_t op, SValue &a, const SValue &b) {
+    SValue x, y;
+    if (!to_number(a, x) || !to_number(b, y)) {
+        return vm_error(vm, "attempt to perform arithmetic on a %s value", type_name(to_number(a, x) ? b : a));
+    }
+
+    a = SValue();
+    if (x.type == SV_INT && y.type == SV_INT && op != OP_DIV) {
+        uint64_t ux = (uint64_t)x.i, uy = (uint64_t)y.i;       // wraps around like Lua
+        a.type = SV_INT;
+        if (op == OP_ADD) {
+            a.i = (int64_t)(ux + uy);
+        } else if (op == OP_SUB) {
+            a.i = (int64_t)(ux - uy);
+        } else if (op == OP_MUL) {
+            a.i = (int64_t)(ux * uy);
+        } else if (y.i == 0) {
+            return vm_error(vm, "attempt to perform 'n%%0'");
+        } else if (y.i == -1) {
+            a.i = 0;
+        } else {
+            a.i = x.i % y.i;                                    // floored, the sign of the divisor
+            if (a.i != 0 && (a.i ^ y.i) < 0) {
+                a.i += y.i;
+            }
+        }
+        return true;
+    }
+
+    double dx = as_dbl(x), dy = as_dbl(y);
+    a.type = SV_DBL;
+    if (op == OP_ADD) {
+        a.d = dx + dy;
+    } else if (op == OP_SUB) {
+        a.d = dx - dy;
+    } else if (op == OP_MUL) {
+        a.d = dx * dy;
+    } else if (op == OP_DIV) {
+        a.d = dx / dy;
+    } else {
+        a.d = fmod(dx, dy);
+        if (a.d != 0 && (a.d < 0) != (dy < 0)) {
+            a.d += dy;
+        }
+    }
+    return true;
+}
+
+static bool vm_compare(VM *vm, uint8_t op, const SValue &a, const SValue &b, bool &res) {
+    int cmp = 0;
+    if (is_number(a) && is_number(b)) {
+        if (a.type == SV_INT && b.type == SV_INT) {
+            cmp = a.i < b.i ? -1 : a.i > b.i;
+        } else {
+            double x = as_dbl(a), y = as_dbl(b);
+            if (isnan(x) || isnan(y)) {
+                res = false;
+                return true;
+            }
+            cmp = x < y ? -1 : x > y;
+        }
+    } else if (a.type == SV_STR && b.type == SV_STR) {
+        cmp = a.s.compare(b.s);
+    } else {
+        return vm_error(vm, "attempt to compare %s with %s", type_name(a), type_name(b));
+    }
+
+    res = op == OP_LT ? cmp < 0 : op == OP_LE ? cmp <= 0 : op == OP_GT ? cmp > 0 : cmp >= 0;
+    return true;
+}
+
+// 1-based index of an array, 0 if it is not an integer
+static int64_t array_index(const SValue &idx) {
+    if (idx.type == SV_INT) {
+        return idx.i;
+    }
+    if (idx.type == SV_DBL && idx.d == floor(idx.d) && fabs(idx.d) < 1e18) {
+        return (int64_t)idx.d;
+    }
+    return 0;
+}
+
+// arrays are copied by value, this keeps `a = {a, a}` in a loop from growing without bound
+static bool value_fits(const SValue &v, uint32_t depth, size_t &budget) {
+    if (v.type != SV_ARR) {
+        return true;
+    }
+    if (depth == 0 || v.arr.size() > budget) {
+        return false;
+    }
+    budget -= v.arr.size();
+    for (const SValue &elem : v.arr) {
+        if (!value_fits(elem, depth - 1, budget)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool vm_call(VM *vm, int32_t id, int32_t nargs) {
+    std::vector<SValue> &st = vm->stack;
+    SValue *args = &st[st.size() - nargs];
+    SValue res;
+
+    switch (id) {
+    case BI_CALL:
+    case BI_PCALL: {
+        std::vector<std::string> cmd((size_t)nargs);
+        for (int32_t i = 0; i < nargs; i++) {
+            if (!to_text(args[i], cmd[i])) {
+                return vm_error(vm, "command arguments must be strings or numbers");
+            }
+        }
+        vm->env->call(vm->env->ctx, cmd, res);
+        if (res.type == SV_ERR && id == BI_CALL) {
+            *vm->out = res;             // aborts the script with the command's error
+            return false;
+        }
+        break;
+    }
+    case BI_TONUMBER:
+        if (!to_number(args[0], res)) {
+            res = SValue();
+        }
+        break;
+    case BI_TOSTRING:
+        res.type = SV_STR;
+        if (!to_text(args[0], res.s)) {
+            res.s = args[0].type == SV_BOOL ? (args[0].i ? "true" : "false")
+                : args[0].type == SV_ERR ? args[0].s : type_name(args[0]);
+        }
+        break;
+    case BI_TYPE:
+        res.type = SV_STR;
+        res.s = type_name(args[0]);
+        break;
+    case BI_ERROR:
+        if (args[0].type == SV_ERR) {
+            *vm->out = args[0];         // rethrow what pcall returned
+        } else {
+            *vm->out = SValue();
+            vm->out->type = SV_ERR;
+            if (!to_text(args[0], vm->out->s)) {
+                vm->out->s = "error";
+            }
+        }
+        return false;
+    }
+
+    st.resize(st.size() - nargs);
+    st.push_back(std::move(res));
+    return true;
+}
+
+static SValue make_array(const std::vector<std::string> &strs) {
+    SValue v;
+    v.type = SV_ARR;
+    v.arr.resize(strs.size());
+    for (size_t i = 0; i < strs.size(); i++) {
+        v.arr[i].type = SV_STR;
+        v.arr[i].s = strs[i];
+    }
+    return v;
+}
+
+static bool vm_step(VM *vm, const Instr &in) {
+    std::vector<SValue> &st = vm->stack;
+    switch (in.op) {
+    case OP_CONST:
+        st.push_back(vm->s->consts[in.a]);
+        break;
+    case OP_NIL:
+        st.push_back(SValue());
+        break;
+    case OP_TRUE:
+    case OP_FALSE:
+        st.push_back(SValue());
+        st.back().type = SV_BOOL;
+        st.back().i = in.op == OP_TRUE;
+        break;
+    case OP_KEYS:
+        st.push_back(make_array(vm->env->keys));
+        break;
+    case OP_ARGV:
+        st.push_back(make_array(vm->env->argv));
+        break;
+    case OP_LOAD:
+        st.push_back(vm->locals[in.a]);
+        break;
+    case OP_STORE:
+        vm->locals[in.a] = std::move(st.back());
+        st.pop_back();
+        break;
+    case OP_INDEX: {
+        SValue idx = std::move(st.back());
+        st.pop_back();
+        SValue &obj = st.back();
+        if (obj.type != SV_ARR) {
+            return vm_error(vm, "attempt to index a %s value", type_name(obj));
+        }
+        int64_t i = array_index(idx);
+        SValue elem = i >= 1 && (uint64_t)i <= obj.arr.size() ? obj.arr[i - 1] : SValue();
+        obj = std::move(elem);
+        break;
+    }
+    case OP_SETINDEX: {
+        SValue &arr = vm->locals[in.a];
+        SValue &idx = st[st.size() - 2];
+        if (arr.type != SV_ARR) {
+            return vm_error(vm, "attempt to index a %s value", type_name(arr));
+        }
+        int64_t i = array_index(idx);
+        size_t budget = k_max_elems;
+        if (st.back().type == SV_ARR && !value_fits(st.back(), k_max_nesting - 1, budget)) {
+            return vm_error(vm, "array is too large or too deeply nested");
+        }
+        if (i >= 1 && (uint64_t)i <= arr.arr.size()) {
+            arr.arr[i - 1] = std::move(st.back());
+        } else if ((uint64_t)i == arr.arr.size() + 1) {
+            arr.arr.push_back(std::move(st.back()));
+        } else {
+            return vm_error(vm, "array index out of range");
+        }
+        st.resize(st.size() - 2);
+        break;
+    }
+    case OP_ARRAY: {
+        SValue arr;
+        arr.type = SV_ARR;
+        arr.arr.assign(std::make_move_iterator(st.end() - in.a), std::make_move_iterator(st.end()));
+        st.resize(st.size() - in.a);
+        size_t budget = k_max_elems;
+        if (!value_fits(arr, k_max_nesting, budget)) {
+            return vm_error(vm, "array is too large or too deeply nested");
+        }
+        st.push_back(std::move(arr));
+        break;
+    }
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD: {
+        if (!vm_arith(vm, in.op, st[st.size() - 2], st.back())) {
+            return false;
+        }
+        st.pop_back();
+        break;
+    }
+    case OP_NEG: {
+        SValue zero;
+        zero.type = SV_INT;
+        std::swap(zero, st.back());
+        if (!vm_arith(vm, OP_SUB, st.back(), zero)) {
+            return false;
+        }
+        break;
+    }
+    case OP_CONCAT: {
+        std::string a, b;
+        SValue &x = st[st.size() - 2];
+        if (!to_text(x, a) || !to_text(st.back(), b)) {
+            return vm_error(vm, "attempt to concatenate a %s value", type_name(to_text(x, a) ? st.back() : x));
+        }
+        if (a.size() + b.size() > k_max_str) {
+            return vm_error(vm, "string length exceeds the limit");
+        }
+        st.pop_back();
+        st.back() = SValue();
+        st.back().type = SV_STR;
+        st.back().s = a + b;
+        break;
+    }
+    case OP_LEN: {
+        SValue &v = st.back();
+        if (v.type != SV_STR && v.type != SV_ARR) {
+            return vm_error(vm, "attempt to get length of a %s value", type_name(v));
+        }
+        int64_t n = (int64_t)(v.type == SV_STR ? v.s.size() : v.arr.size());
+        v = SValue();
+        v.type = SV_INT;
+        v.i = n;
+        break;
+    }
+    case OP_NOT: {
+        bool b = !truthy(st.back());
+        st.back() = SValue();
+        st.back().type = SV_BOOL;
+        st.back().i = b;
+        break;
+    }
+    case OP_EQ:
+    case OP_NE:
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE: {
+        bool res = false;
+        const SValue &a = st[st.size() - 2];
+        if (in.op == OP_EQ || in.op == OP_NE) {
+            res = values_equal(a, st.back()) == (in.op == OP_EQ);
+        } else if (!vm_compare(vm, in.op, a, st.back(), res)) {
+            return false;
+        }
+        st.pop_back();
+        st.back() = SValue();
+        st.back().type = SV_BOOL;
+        st.back().i = res;
+        break;
+    }
+    case OP_JMP:
+        vm->pc = (size_t)in.a;
+        return true;
+    case OP_JMPF: {
+        bool b = truthy(st.back());
+        st.pop_back();
+        if (!b) {
+            vm->pc = (size_t)in.a;
+            return true;
+        }
+        break;
+    }
+    case OP_AND:
+    case OP_OR:
+        if (truthy(st.back()) == (in.op == OP_OR)) {
+            vm->pc = (size_t)in.a;
+            return true;
+        }
+        st.pop_back();
+        break;
+    case OP_FORCHK: {
+        const SValue &v = vm->locals[in.a], &limit = vm->locals[in.a + 1], &step = vm->locals[in.a + 2];
+        if (!is_number(v) || !is_number(limit) || !is_number(step)) {
+            return vm_error(vm, "'for' values must be numbers");
+        }
+        double s = as_dbl(step);
+        if (s == 0) {
+            return vm_error(vm, "'for' step is zero");
+        }
+        bool done = s > 0 ? as_dbl(v) > as_dbl(limit) : as_dbl(v) < as_dbl(limit);
+        if (v.type == SV_INT && limit.type == SV_INT && step.type == SV_INT) {
+            done = s > 0 ? v.i > limit.i : v.i < limit.i;
+        }
+        if (done) {
+            vm->pc = (size_t)in.b;
+            return true;
+        }
+        break;
+    }
+    case OP_FORINC: {
+        SValue &v = vm->locals[in.a];
+        const SValue &step = vm->locals[in.a + 2];
+        if (v.type == SV_INT && step.type == SV_INT) {
+            if ((step.i > 0 && v.i > INT64_MAX - step.i) || (step.i < 0 && v.i < INT64_MIN - step.i)) {
+                vm->pc = (size_t)vm->s->code[vm->pc + 1].a;     // past the limit, checked by FORCHK
+                v.type = SV_DBL;
+                v.d = (double)v.i + (double)step.i;
+                return true;
+            }
+            v.i += step.i;
+        } else if (!vm_arith(vm, OP_ADD, v, step)) {
+            return false;
+        }
+        break;
+    }
+    case OP_CALL:
+        if (!vm_call(vm, in.a, in.b)) {
+            return false;
+        }
+        break;
+    case OP_POP:
+        st.pop_back();
+        break;
+    }
+
+    vm->pc++;
+    return true;
+}
+
+void script_run(Script *script, ScriptEnv *env, SValue &out) {
+    VM vm;
+    vm.s = script;
+    vm.env = env;
+    vm.out = &out;
+    vm.locals.resize(script->nlocals);
+
+    uint64_t steps = 0;
+    while (true) {
+        const Instr &in = script->code[vm.pc];
+        if (in.op == OP_RET) {
+            out = std::move(vm.stack.back());
+            return;
+        }
+        if (env->max_steps && ++steps > env->max_steps) {
+            vm_error(&vm, "script exceeded %llu steps", (unsigned long long)env->max_steps);
+            return;
+        }
+        if (!vm_step(&vm, in)) {
+            return;
+        }
+    }
+}
\ No newline at end of file
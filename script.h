@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// A small Lua-like language compiled to bytecode for a stack VM, for EVAL. It has locals,
+// if/while/numeric for, arrays ({a, b}, 1-based, copied on assignment), the usual arithmetic,
+// comparison and logic operators, and the builtins call, pcall, tonumber, tostring, type and
+// error. KEYS and ARGV hold the arguments of EVAL.
+enum {
+    SV_NIL  = 0,
+    SV_BOOL = 1,
+    SV_INT  = 2,
+    SV_DBL  = 3,
+    SV_STR  = 4,
+    SV_ARR  = 5,
+    SV_ERR  = 6,                    // message in `s`, error code in `i`, 0 for errors raised by the script
+};
+
+struct SValue {
+    uint32_t type = SV_NIL;
+    int64_t i = 0;                  // SV_INT, SV_BOOL, SV_ERR
+    double d = 0;
+    std::string s;                  // SV_STR, SV_ERR
+    std::vector<SValue> arr;
+};
+
+struct Script;
+
+// runs a server command on behalf of the script and stores its reply in `out`
+typedef void (*script_call_fn)(void *ctx, std::vector<std::string> &cmd, SValue &out);
+
+struct ScriptEnv {
+    std::vector<std::string> keys;
+    std::vector<std::string> argv;
+    script_call_fn call = NULL;
+    void *ctx = NULL;
+    uint64_t max_steps = 0;         // instructions before the script is aborted, 0 for no limit
+};
+
+// NULL with a message in `err` if the source does not compile
+Script *script_compile(const char *src, size_t len, std::string &err);
+void script_free(Script *script);
+// the value returned by the script, SV_ERR if it failed
+void script_run(Script *script, ScriptEnv *env, SValue &out);
\ No newline at end of file
@@ -3,32 +3,112 @@
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 
 #include <cassert>
 #include <cerrno>
 #include <cstring>
+#include <cstdarg>
 #include <poll.h>
 #include <fcntl.h>
 #include <math.h>
 #include <time.h>
+#include <malloc.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <sys/wait.h>
+#include <sys/random.h>
+#include <sys/eventfd.h>
 
 #include <vector>
 #include <string>
 #include <map>
+#include <deque>
+#include <algorithm>
+#include <new>
 
 #include "hashtable.h"
 #include "zset.h"
+#include "hash.h"
+#include "qlist.h"
+#include "hll.h"
+#include "bloom.h"
+#include "bitops.h"
+#include "lz4.h"
 #include "common.h"
 #include "dlist.h"
 #include "heap.h"
+#include "timerwheel.h"
+#include "topk.h"
 #include "threadpool.h"
+#include "histogram.h"
+#include "uring.h"
+#include "script.h"
+#include "sha1.h"
 
-const size_t k_max_msg = 4096;
+const size_t k_max_msg = 32 << 20;
 
 typedef std::vector<uint8_t> Buffer;
 
+// role of a connection in replication
+enum {
+    REPL_NONE        = 0,       // regular client
+    REPL_WAIT_BGSAVE = 1,       // replica waiting for a snapshot child
+    REPL_SNAPSHOT    = 2,       // replica receiving a snapshot from the child, our output is held
+    REPL_CONTINUE    = 3,       // replica resuming from the backlog
+    REPL_ONLINE      = 4,       // replica receiving the command stream
+    REPL_LEADER      = 5,       // our link to the leader
+};
+
+static const char *k_repl_role_names[] = {"none", "wait_bgsave", "snapshot", "continue", "online", "leader"};
+
+// wire protocol of a connection, see proto_detect()
+enum {
+    PROTO_UNKNOWN = 0,          // nothing received yet
+    PROTO_NATIVE  = 1,          // length-prefixed requests, tagged responses
+    PROTO_RESP2   = 2,
+    PROTO_RESP3   = 3,
+};
+
+static const char *k_proto_names[] = {"unknown", "native", "resp2", "resp3"};
+
+// connection timers in g_data.timers, see conn_timer_fired()
+enum {
+    TMR_IDLE   = 0,             // Conn::idle_timer, pushed back by activity when it fires
+    TMR_BLOCK  = 1,             // Conn::block.timer, BLPOP/BRPOP timeout
+    TMR_OUTPUT = 2,             // Conn::output_timer, end of the grace period over the soft output limit
+};
+
+// immutable output shared by many connections, e.g. a published message, freed with the last reference
+struct SharedBuf {
+    uint32_t refs = 1;
+    Buffer data;
+    SharedBuf *resp[2] = {NULL, NULL};  // RESP2 and RESP3 encodings, made on first use
+};
+
+// queued output that is written before Conn::outgoing
+struct OutChunk {
+    SharedBuf *buf = NULL;
+    size_t off = 0;                     // bytes already written
+};
+
+// progress through a RESP multibulk request that has not fully arrived, so the next read resumes
+// it instead of parsing it again from the start
+struct RespParse {
+    int64_t nargs = -1;                 // -1 until the "*<n>" line is read
+    size_t nparsed = 0;                 // complete arguments
+    size_t pos = 0;                     // bytes of the request they take
+};
+
+struct Channel;
+struct BlockWait;
+
 struct Conn {
     int fd = -1;
+    uint64_t id = 0;
 
     bool want_read = false;
     bool want_write = false;
@@ -36,23 +116,366 @@ struct Conn {
 
     Buffer incoming;
     Buffer outgoing;
-
+    size_t resp_start = (size_t)-1;     // header of the response being built in `outgoing`
+    uint32_t proto = PROTO_UNKNOWN;
+    uint32_t resp_hint = 0;             // how the reply being built maps to RESP, see resp_hint()
+    std::vector<std::string> argv;      // the parsed request, reused so arguments keep their buffers
+    RespParse resp_parse;
+    std::deque<OutChunk> outq;          // output that precedes `outgoing`
+    size_t outq_bytes = 0;
+
+    uint64_t created_ms = 0;
     uint64_t last_active_ms = 0;
-    DList idle_node;
+    const char *last_cmd = NULL;
+    bool read_paused = false;           // too much output pending, see conn_pause_read()
+    uint64_t soft_limit_ms = 0;         // since when the output is over the soft limit, 0 if under
+    TimerNode output_timer;
+    TimerNode idle_timer;
+    int64_t idle_timeout_ms = -1;       // CLIENT TIMEOUT, -1 follows client-idle-timeout-ms, 0 for none
+    bool idle_exempt = false;           // never times out, see conn_set_idle_exempt()
+
+    uint32_t repl_role = REPL_NONE;
+    uint64_t repl_psync_off = 0;        // where a partial resync continues from
+
+    // io_uring backend
+    Buffer sending;                     // owned by the in-flight send, new output goes to `outgoing`
+    uint32_t uring_inflight = 0;        // submitted requests that still reference this Conn
+    bool recv_armed = false;
+    bool send_queued = false;
+    bool dead = false;                  // closed, freed once uring_inflight drops to 0
+    bool iov_inflight = false;          // a sendmsg() of `outq` chunks is in flight
+    std::vector<struct iovec> send_iov;
+    struct msghdr send_msg = {};
+
+    // pub/sub
+    std::vector<Channel *> channels;
+    std::vector<Channel *> patterns;
+
+    // BLPOP/BRPOP, one wait per key
+    struct {
+        std::vector<BlockWait *> waits;
+        bool front = true;
+        TimerNode timer;                    // timeout, if any
+    } block;
+    bool bg_wait = false;                   // parked until a background job finishes, see bg_submit()
+
+    // client-side caching, see CLIENT TRACKING
+    struct {
+        bool on = false;
+        bool bcast = false;                 // notify on key prefixes instead of keys read
+        bool noloop = false;                // skip keys modified by this connection
+        uint64_t redirect = 0;              // id of the connection receiving invalidations, 0 for itself
+        std::vector<std::string> prefixes;
+    } tracking;
+
+    // MULTI/EXEC
+    struct {
+        bool multi = false;
+        bool aborted = false;               // a command failed to queue, EXEC refuses to run
+        bool in_exec = false;
+        uint64_t repl_offset = 0;           // before MULTI, rolled back if the leader link drops
+        std::vector<std::vector<std::string>> queue;
+        std::vector<std::pair<std::string, uint64_t>> watches;     // key and its version, see key_version()
+    } tx;
+
+    // cluster mode
+    struct {
+        bool asking = false;                // the next command may use a slot being imported
+        int32_t import_slot = -1;           // the slot a migration link from another node imports
+        bool link = false;                  // our outgoing migration link, see cluster_link_input()
+    } cluster;
+};
+
+enum {
+    T_INIT = 0,
+    T_STR  = 1,
+    T_ZSET = 2,
+    T_HASH = 3,
+    T_LIST = 4,
+    T_HLL  = 5,
+    T_BLOOM = 6,
+    T_MAX  = 7,
+};
+
+static const char *k_type_names[T_MAX] = {"init", "str", "zset", "hash", "list", "hll", "bloom"};
+
+// phases of an event loop iteration, for the stall detector
+enum {
+    PH_POLL   = 0,      // building the poll() arguments
+    PH_READ   = 1,
+    PH_PARSE  = 2,
+    PH_EXEC   = 3,
+    PH_WRITE  = 4,
+    PH_TIMERS = 5,
+    PH_MAX    = 6,
+};
+
+static const char *k_phase_names[PH_MAX] = {"poll", "read", "parse", "exec", "write", "timers"};
+
+struct SlowlogEntry {
+    uint64_t id = 0;
+    int64_t unix_ms = 0;
+    uint64_t duration_us = 0;
+    std::vector<std::string> args;      // truncated copy of the command
+};
+
+struct StallEntry {
+    uint64_t id = 0;
+    int64_t unix_ms = 0;
+    uint64_t total_us = 0;
+    uint64_t phase_us[PH_MAX] = {};
+};
+
+// runtime tunables, see CONFIG GET/SET
+static struct {
+    int64_t slowlog_slower_than_us = 10 * 1000;     // -1 disables
+    int64_t slowlog_max_len = 128;
+    int64_t stall_threshold_us = 50 * 1000;         // -1 disables
+    int64_t stalllog_max_len = 128;
+    int64_t clock_coarse = 0;                       // use CLOCK_MONOTONIC_COARSE for the cached clock
+    int64_t pubsub_output_limit = 32 << 20;         // bytes pending to a subscriber, 0 disables
+    int64_t notify_keyspace_events = 0;             // NOTIFY_* flags
+    int64_t tracking_table_max_keys = 1000 * 1000;
+    int64_t script_max_steps = 100 * 1000 * 1000;   // VM instructions per script, 0 disables
+    int64_t rehash_budget_us = 1000;                // hash table resizing per loop iteration, 0 disables
+    int64_t str_compress_min_size = 1024;           // bytes, 0 disables compression
+    int64_t str_compress_bg_size = 64 << 10;        // compressed on the thread pool from this size
+    int64_t client_output_hard_limit = 256 << 20;   // bytes pending to a client, 0 disables
+    int64_t client_output_soft_limit = 64 << 20;    // tolerated for client-output-soft-seconds, 0 disables
+    int64_t client_output_soft_seconds = 60;
+    int64_t client_read_pause_bytes = 4 << 20;      // pending output that stops request processing, 0 disables
+    int64_t client_idle_timeout_ms = 5 * 1000;      // 0 disables
+    int64_t hotkeys_sample_rate = 0;                // profile the keys of one in N commands, 0 disables
+    int64_t activedefrag = 0;                       // 1 runs defragmentation passes, see defrag_cron()
+    int64_t active_defrag_threshold_pct = 10;       // RSS above the allocated bytes that starts a pass
+    int64_t active_defrag_ignore_bytes = 100 << 20; // nor does less waste than this
+    int64_t active_defrag_budget_us = 1000;         // moving objects per loop iteration
+    int64_t active_defrag_cycle_pct = 10;           // of each k_defrag_window_ms spent on it at most
+} g_config;
+
+enum {
+    NOTIFY_KEYSPACE = 1 << 0,                       // __keyspace__:<key> with the event as message
+    NOTIFY_KEYEVENT = 1 << 1,                       // __keyevent__:<event> with the key as message
+};
+
+// a key some connection WATCHes, keeps a version for it while the key doesn't exist
+struct WatchedKey {
+    uint32_t nwatches = 0;
+    uint64_t version = 0;
 };
 
 static struct {
+    uint64_t now_ms = 0;                        // cached clock, see clock_refresh()
     HMap db;
     std::vector<Conn*> fd2conn; 
-    DList idle_list; 
+    std::map<uint64_t, Conn *> id2conn;
+    uint64_t next_conn_id = 0;
+    TimerWheel timers;                          // connection timers, see TMR_*
     std::vector<HeapItem> heap;
     ThreadPool thread_pool;
+    uint64_t next_version = 0;                  // see Entry::version
+    size_t nwatching = 0;                       // connections with WATCHed keys
+    std::map<std::string, WatchedKey> watched;
+
+    // statistics for INFO
+    size_t nconns = 0;
+    size_t nkeys[T_MAX] = {};
+    struct {
+        size_t nkeys = 0;
+        size_t raw_bytes = 0;                   // of the values before compression
+        size_t bytes = 0;
+    } lz4;                                      // strings held compressed
+    struct {
+        uint64_t start_ms = 0;
+        uint64_t total_cmds = 0;
+        uint64_t total_conns = 0;
+        uint64_t ops_per_sec = 0;
+        uint64_t sample_ms = 0;                 // start of the current ops/sec window
+        uint64_t sample_cmds = 0;
+        uint64_t loop_iters = 0;
+        uint64_t loop_last_us = 0;
+        Histogram loop_us;                      // busy time of each event loop iteration
+        uint64_t phase_us[PH_MAX] = {};         // time spent in each phase of the current iteration
+    } stats;
+
+    std::deque<SlowlogEntry> slowlog;           // newest first
+    uint64_t slowlog_next_id = 0;
+    std::deque<StallEntry> stalllog;            // newest first
+    uint64_t stalllog_next_id = 0;
+
+    uint64_t output_limit_closes = 0;
+    uint64_t idle_closes = 0;
+    uint64_t read_pauses = 0;
 } g_data;
 
+// io_uring network backend, selected with --io-uring
+static struct {
+    bool enabled = false;
+    URing ring;
+    URingBufRing bufring;
+    std::vector<Conn *> send_queue;             // connections with output to submit this iteration
+    uint64_t wake_val = 0;                      // target of the eventfd read
+} g_uring;
+
+// a listening socket, see listener_open()
+struct Listener {
+    int fd = -1;
+    bool tcp = true;                            // false for a Unix domain socket
+    uint16_t port = 0;
+    std::string name;                           // as given to --listen
+};
+
+// listeners and the socket options applied to them, set on the command line
+static struct {
+    std::vector<Listener> list;
+    int64_t backlog = 511;
+    int64_t nodelay = 1;                        // TCP_NODELAY on accepted connections
+    int64_t defer_accept_s = 0;                 // TCP_DEFER_ACCEPT, wake up once data arrives
+    int64_t rcvbuf = 0;                         // SO_RCVBUF/SO_SNDBUF, 0 for the kernel default
+    int64_t sndbuf = 0;
+    int64_t unix_perm = 0;                      // mode of Unix sockets, 0 for the umask default
+    uint64_t accept_wakeups = 0;
+} g_listen;
+
+// state of the replica's link to its leader
 enum {
-    T_INIT = 0,
-    T_STR  = 1,
-    T_ZSET = 2,
+    LINK_DOWN      = 0,
+    LINK_HANDSHAKE = 1,         // PSYNC sent, waiting for the reply
+    LINK_SYNC      = 2,         // loading a snapshot
+    LINK_UP        = 3,         // applying the command stream
+};
+
+static const char *k_link_state_names[] = {"down", "handshake", "sync", "up"};
+
+// replication, see the replication section below
+static struct {
+    char replid[41] = {};                       // identifies the history of the command stream
+    uint64_t offset = 0;                        // stream bytes produced (leader) or applied (replica)
+
+    // leader side
+    Buffer backlog;                             // ring of recent stream bytes, allocated by the first PSYNC
+    size_t backlog_idx = 0;                     // next write position
+    size_t backlog_histlen = 0;
+    std::vector<Conn *> replicas;
+    pid_t snapshot_pid = -1;
+    uint64_t snapshot_start_ms = 0;
+
+    // replica side
+    bool is_replica = false;
+    std::string leader_host;
+    uint16_t leader_port = 0;
+    struct sockaddr_in leader_addr = {};
+    Conn *link = NULL;
+    uint32_t link_state = LINK_DOWN;
+    uint64_t link_retry_ms = 0;
+} g_repl;
+
+// a pub/sub channel or pattern and its subscribers
+struct Channel {
+    HNode node;
+    std::string name;
+    std::vector<Conn *> subs;
+};
+
+static struct {
+    HMap channels;
+    HMap patterns;
+    uint64_t messages = 0;                      // deliveries to subscribers
+} g_pubsub;
+
+// keys read by tracking clients, forgotten once invalidated
+struct TrackedKey {
+    HNode node;
+    std::string key;
+    std::vector<uint64_t> ids;
+};
+
+struct TrackedPrefix {
+    std::string prefix;
+    std::vector<uint64_t> ids;
+};
+
+static struct {
+    HMap keys;
+    std::vector<TrackedPrefix> prefixes;        // bcast mode
+    size_t nclients = 0;
+    uint64_t invalidations = 0;
+} g_tracking;
+
+// connections blocked on a list key, served in the order they blocked
+struct BlockedKey {
+    HNode node;
+    std::string key;
+    DList waiters;                              // BlockWait::node
+    bool ready = false;                         // in g_blocking.ready
+};
+
+struct BlockWait {
+    DList node;
+    Conn *conn = NULL;
+    BlockedKey *bk = NULL;
+};
+
+static struct {
+    HMap keys;
+    std::vector<std::string> ready;             // blocked keys pushed to by the current command
+    std::vector<uint64_t> resume;               // unblocked connections with pipelined requests
+    size_t nblocked = 0;
+} g_blocking;
+
+// Work queued to the thread pool whose result is applied on the event loop thread. Workers
+// queue a completion and signal the eventfd, which wakes poll() or io_uring. Keys a job reads
+// or writes are pinned: writes to them, and their expiry, wait until the job is done.
+static struct {
+    int fd = -1;                                // eventfd
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<Work> done;                     // completions, guarded by `mu`
+    size_t inflight = 0;
+    std::map<std::string, uint32_t> pinned;     // key -> number of jobs using it
+    std::vector<uint64_t> waiting;              // connections parked on a pinned key
+} g_bg;
+
+// compiled EVAL scripts by the SHA1 of their source
+static struct {
+    std::map<std::string, Script *> cache;
+} g_scripts;
+
+const uint32_t k_cluster_slots = 16384;
+
+struct ClusterNode {
+    std::string host;
+    uint16_t port = 0;
+};
+
+// Cluster mode, see "Cluster" below. The vectors are indexed by slot and sized only in cluster
+// mode, node indexes refer to `nodes`, whose first one is this node.
+static struct {
+    bool enabled = false;
+    std::vector<ClusterNode> nodes;
+    std::vector<int32_t> owner;                 // -1 if unassigned
+    std::vector<int32_t> migrating;             // node the slot is moving to, or -1
+    std::vector<int32_t> importing;             // node the slot is coming from, or -1
+    std::vector<DList> keys;                    // Entry::slot_node
+    std::vector<uint32_t> nkeys;
+    // the migration this node is running, one slot at a time
+    struct {
+        int32_t slot = -1;
+        int32_t node = -1;
+        Conn *link = NULL;
+        DList sent;                             // Entry::slot_node of keys sent but not acknowledged
+        std::deque<std::pair<std::string, uint64_t>> inflight;     // key and the reply that completes it
+        uint64_t requests = 0;                  // sent on the link
+        uint64_t replies = 0;
+        uint64_t finish_at = 0;                 // reply to the final SETSLOT NODE, 0 until it is sent
+        uint64_t keys_moved = 0;
+    } mig;
+} g_cluster;
+
+// encodings of a T_STR value
+enum {
+    STR_RAW = 0,
+    STR_INT = 1,                                // held in `ival`, `str` is empty
+    STR_LZ4 = 2,                                // `str` is an LZ4 block of `ival` bytes
 };
 
 // KV pair for hashtable
@@ -61,23 +484,89 @@ struct Entry {
     std::string key;
 
     size_t heap_idx = -1;
+    uint64_t version = 0;                       // bumped on modification while keys are watched
+    DList slot_node = {NULL, NULL};             // in g_cluster.keys, cluster mode only
 
     uint32_t type = 0;
     std::string str;
-    ZSet zset;
+    uint8_t enc = STR_RAW;
+    int64_t ival = 0;
+    // the state of the other types lives in an object of its own, see entry_new(), so that
+    // strings and counters don't pay for it
+    union {
+        void *obj = NULL;
+        ZSet *zset;
+        Hash *hash;
+        QList *list;
+        HLL *hll;
+        Bloom *bloom;
+    };
 };
 
-static uint64_t get_monotonic_msec() {
+static bool bg_key_pinned(const std::string &key) {
+    return !g_bg.pinned.empty() && g_bg.pinned.count(key) > 0;
+}
+
+// only the part inside the first {...}, if any, is hashed so related keys can share a slot
+static uint32_t key_slot(const std::string &key) {
+    const char *s = key.data();
+    size_t len = key.size();
+    const char *open = (const char *)memchr(s, '{', len);
+    if (open) {
+        const char *close = (const char *)memchr(open + 1, '}', (size_t)(s + len - open - 1));
+        if (close && close > open + 1) {
+            s = open + 1;
+            len = (size_t)(close - s);
+        }
+    }
+    return str_hash((const uint8_t *)s, len) & (k_cluster_slots - 1);
+}
+
+// The millisecond clock used for timers and TTLs is read once per poll() wakeup and cached in
+// g_data.now_ms, so the hot path does not call clock_gettime() per connection or per command.
+// Latency instrumentation uses get_monotonic_usec() which always reads the precise clock.
+static void clock_refresh() {
+    struct timespec tv = {0, 0};
+    clock_gettime(g_config.clock_coarse ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC, &tv);
+    g_data.now_ms = (uint64_t)tv.tv_sec * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
+// The coarse clock lags the precise one by up to a tick, so timers taken from it fire a tick,
+// rounded up to ms, after their deadline to never fire early in real time. TTLs keep the real
+// deadline, which TTL replies and replication read, and only their expiry waits for the slack.
+static uint64_t clock_slack_ms() {
+    static uint64_t coarse_tick_ms = 0;
+    if (!g_config.clock_coarse) {
+        return 0;
+    }
+    if (coarse_tick_ms == 0) {
+        struct timespec res = {0, 0};
+        clock_getres(CLOCK_MONOTONIC_COARSE, &res);
+        coarse_tick_ms = ((uint64_t)res.tv_sec * 1000 * 1000 * 1000 + (uint64_t)res.tv_nsec + 999999) / 1000000;
+        if (coarse_tick_ms == 0) {
+            coarse_tick_ms = 1;
+        }
+    }
+    return coarse_tick_ms;
+}
+
+static uint64_t get_monotonic_usec() {
     struct timespec tv = {0, 0};
     clock_gettime(CLOCK_MONOTONIC, &tv);
-    return (uint64_t)tv.tv_sec * 1000 + tv.tv_nsec / 1000 / 1000;
+    return (uint64_t)tv.tv_sec * 1000 * 1000 + tv.tv_nsec / 1000;
+}
+
+static int64_t get_realtime_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_nsec / 1000 / 1000;
 }
 
 static void heap_delete(std::vector<HeapItem> &heap, size_t pos) {
     heap[pos] = heap.back();
     heap.pop_back();
 
-    if (pos > heap.size()) {
+    if (pos < heap.size()) {
         heap_update(heap.data(), pos, heap.size());
     }
 }
@@ -95,6 +584,20 @@ static void heap_upsert(std::vector<HeapItem> &heap, size_t pos, HeapItem item)
 static Entry *entry_new(uint32_t type) {
     Entry *ent = new Entry();
     ent->type = type;
+    if (type == T_ZSET) {
+        ent->zset = new ZSet();
+    } else if (type == T_HASH) {
+        ent->hash = new Hash();
+    } else if (type == T_LIST) {
+        ent->list = new QList();
+        qlist_init(ent->list);
+    } else if (type == T_HLL) {
+        ent->hll = new HLL();
+    } else if (type == T_BLOOM) {
+        ent->bloom = new Bloom();
+    }
+    ent->version = ++g_data.next_version;
+    g_data.nkeys[type]++;
     return ent;
 }
 
@@ -103,7 +606,7 @@ static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
         heap_delete(g_data.heap, ent->heap_idx);
         ent->heap_idx = -1;
     } else if (ttl_ms >= 0) {
-        uint64_t expire_time = get_monotonic_msec() + (uint64_t)ttl_ms;
+        uint64_t expire_time = g_data.now_ms + (uint64_t)ttl_ms;
         HeapItem item = {expire_time, &ent->heap_idx};
         heap_upsert(g_data.heap, ent->heap_idx, item);
     }
@@ -111,7 +614,20 @@ static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
 
 static void entry_del_sync(Entry *ent) {
     if (ent->type == T_ZSET) {
-        zset_clear(&ent->zset);
+        zset_clear(ent->zset);
+        delete ent->zset;
+    } else if (ent->type == T_HASH) {
+        hash_clear(ent->hash);
+        delete ent->hash;
+    } else if (ent->type == T_LIST) {
+        qlist_clear(ent->list);
+        delete ent->list;
+    } else if (ent->type == T_HLL) {
+        hll_clear(ent->hll);
+        delete ent->hll;
+    } else if (ent->type == T_BLOOM) {
+        bloom_clear(ent->bloom);
+        delete ent->bloom;
     }
 
     delete ent; 
@@ -123,10 +639,25 @@ static void entry_del_func(void *arg) {
     entry_del_sync((Entry *)arg);
 }
 
+static void str_drop_lz4(Entry *ent);
+
 static void entry_del(Entry *ent) {
     entry_set_ttl(ent, -1);
-    
-    size_t set_size = (ent->type == T_ZSET) ? hm_size(&ent->zset.hmap) : 0;
+    g_data.nkeys[ent->type]--;
+    str_drop_lz4(ent);
+    if (ent->slot_node.next) {
+        dlist_detach(&ent->slot_node);
+        g_cluster.nkeys[key_slot(ent->key)]--;
+    }
+
+    size_t set_size = 0;
+    if (ent->type == T_ZSET) {
+        set_size = hm_size(&ent->zset->hmap);
+    } else if (ent->type == T_HASH) {
+        set_size = hash_size(ent->hash);
+    } else if (ent->type == T_LIST) {
+        set_size = ent->list->size;
+    }
     if (set_size > k_large_container_size) {
         thread_pool_queue(&g_data.thread_pool, &entry_del_func, ent);
     } else {
@@ -134,19 +665,156 @@ static void entry_del(Entry *ent) {
     }
 }
 
+// the key and hcode must be set
+static void db_insert(Entry *ent) {
+    hm_insert(&g_data.db, &ent->node);
+    if (g_cluster.enabled) {
+        uint32_t slot = key_slot(ent->key);
+        dlist_insert_before(&g_cluster.keys[slot], &ent->slot_node);
+        g_cluster.nkeys[slot]++;
+    }
+}
+
+// key for looking up entries in the keyspace
+struct LookupKey {
+    struct HNode node;
+    std::string key;
+};
+
+static bool entry_eq(HNode *node, HNode *key) {
+    struct Entry *ent = container_of(node, struct Entry, node);
+    struct LookupKey *keydata = container_of(key, struct LookupKey, node);
+
+    return ent->key == keydata->key;
+}
+
+static bool hnode_same(HNode *node, HNode *key) {
+    return node == key;
+}
+
+static void sharedbuf_unref(SharedBuf *sb) {
+    if (--sb->refs == 0) {
+        for (SharedBuf *enc : sb->resp) {
+            if (enc) {
+                sharedbuf_unref(enc);
+            }
+        }
+        delete sb;
+    }
+}
+
+static size_t conn_pending_bytes(Conn *conn) {
+    return conn->outq_bytes + conn->outgoing.size() + conn->sending.size();
+}
+
+static Conn *conn_by_id(uint64_t id) {
+    std::map<uint64_t, Conn *>::iterator it = g_data.id2conn.find(id);
+    return it == g_data.id2conn.end() ? NULL : it->second;
+}
+
+// buffers held by the connection, shared output counted for each connection it is queued to
+static size_t conn_memory(Conn *conn) {
+    size_t n = sizeof(Conn) + conn->incoming.capacity() + conn->outgoing.capacity() + conn->sending.capacity()
+        + conn->outq_bytes + conn->send_iov.capacity() * sizeof(struct iovec)
+        + conn->argv.capacity() * sizeof(std::string);
+    for (const std::string &arg : conn->argv) {
+        n += arg.capacity() + 1;
+    }
+    return n;
+}
+
+// Client output limits
+//
+// A regular client whose pending output passes client-output-hard-limit, or stays over
+// client-output-soft-limit for client-output-soft-seconds, is disconnected. Replicas and slot
+// migration links have limits of their own. Before that, a client with client-read-pause-bytes
+// of output pending is paused: its buffered requests wait and no more are read until the output
+// drains to half of that.
+
+static bool conn_output_limited(Conn *conn) {
+    return conn->repl_role == REPL_NONE && !conn->cluster.link && conn->cluster.import_slot < 0;
+}
+
+// false if the connection is over its output limits and must be closed
+static bool conn_output_ok(Conn *conn) {
+    if (!conn_output_limited(conn)) {
+        return true;
+    }
+
+    size_t pending = conn_pending_bytes(conn);
+    if (g_config.client_output_hard_limit > 0 && pending > (size_t)g_config.client_output_hard_limit) {
+        return false;
+    }
+    if (g_config.client_output_soft_limit == 0 || pending <= (size_t)g_config.client_output_soft_limit) {
+        conn->soft_limit_ms = 0;
+        tw_del(&g_data.timers, &conn->output_timer);
+        return true;
+    }
+    uint64_t grace_ms = (uint64_t)g_config.client_output_soft_seconds * 1000;
+    if (conn->soft_limit_ms == 0) {
+        conn->soft_limit_ms = g_data.now_ms;
+        tw_add(&g_data.timers, &conn->output_timer, g_data.now_ms + grace_ms + clock_slack_ms());
+    }
+    return g_data.now_ms - conn->soft_limit_ms < grace_ms;
+}
+
+static void uring_cancel_recv(Conn *conn);
+static void uring_arm_recv(Conn *conn);
+
+static void conn_pause_read(Conn *conn) {
+    conn->read_paused = true;
+    g_data.read_pauses++;
+    if (g_uring.enabled && conn->recv_armed) {
+        uring_cancel_recv(conn);
+    }
+}
+
+static void conn_resume_read(Conn *conn);
 
-static bool entry_eq(HNode *lhs, HNode *rhs) {
-    struct Entry *le = container_of(lhs, struct Entry, node);
-    struct Entry *re = container_of(rhs, struct Entry, node);
+// after output was written
+static void conn_output_drained(Conn *conn) {
+    if (conn->read_paused && conn_pending_bytes(conn) <= (size_t)g_config.client_read_pause_bytes / 2) {
+        conn_resume_read(conn);
+    }
+}
 
-    return le->key == re->key;
+static void conn_free(Conn *conn) {
+    for (OutChunk &chunk : conn->outq) {
+        sharedbuf_unref(chunk.buf);
+    }
+    delete conn;
 }
 
+static void repl_conn_closed(Conn *conn);
+static void pubsub_conn_closed(Conn *conn);
+static void tracking_disable(Conn *conn);
+static void block_conn_closed(Conn *conn);
+static void tx_unwatch(Conn *conn);
+static void cluster_conn_closed(Conn *conn);
+
 static void conn_destroy(Conn *conn) {
+    repl_conn_closed(conn);
+    cluster_conn_closed(conn);
+    pubsub_conn_closed(conn);
+    tracking_disable(conn);
+    block_conn_closed(conn);
+    tx_unwatch(conn);
+    g_data.id2conn.erase(conn->id);
+    if (g_uring.enabled) {
+        shutdown(conn->fd, SHUT_RDWR);          // completes the pending multishot recv
+    }
+
     close(conn->fd);
     g_data.fd2conn[conn->fd] = NULL;
-    dlist_detach(&conn->idle_node);
-    delete conn;
+    g_data.nconns--;
+    tw_del(&g_data.timers, &conn->idle_timer);
+    tw_del(&g_data.timers, &conn->output_timer);
+
+    // in-flight io_uring requests still point to the Conn and its send buffer
+    conn->dead = true;
+    if (conn->uring_inflight == 0 && !conn->send_queued) {
+        conn_free(conn);
+    }
 }
 
 static void fd_set_nb(int fd) {
@@ -161,11 +829,77 @@ static void buf_consume(std::vector<uint8_t> &buf, size_t n) {
     buf.erase(buf.begin(), buf.begin() + n);
 }
 
+// queue a shared buffer behind the output produced so far
+static void conn_push_shared(Conn *conn, SharedBuf *sb) {
+    // move pending private output into its own chunk to keep the order, except for a
+    // response that is still being built, which stays in `outgoing` and goes out after
+    size_t keep = conn->resp_start == (size_t)-1 ? conn->outgoing.size() : conn->resp_start;
+    if (keep > 0) {
+        SharedBuf *own = new SharedBuf();
+        if (keep == conn->outgoing.size()) {
+            own->data.swap(conn->outgoing);
+        } else {
+            own->data.assign(conn->outgoing.begin(), conn->outgoing.begin() + keep);
+            buf_consume(conn->outgoing, keep);
+            conn->resp_start = 0;
+        }
+        conn->outq.push_back(OutChunk{own, 0});
+        conn->outq_bytes += own->data.size();
+    }
+
+    sb->refs++;
+    conn->outq.push_back(OutChunk{sb, 0});
+    conn->outq_bytes += sb->data.size();
+}
+
+// iovecs for the queued output, followed by `outgoing` if it fits
+static size_t conn_output_iov(Conn *conn, struct iovec *iov, size_t max, bool with_outgoing) {
+    size_t n = 0;
+    for (size_t i = 0; i < conn->outq.size() && n < max; i++) {
+        const OutChunk &chunk = conn->outq[i];
+        iov[n].iov_base = chunk.buf->data.data() + chunk.off;
+        iov[n].iov_len = chunk.buf->data.size() - chunk.off;
+        n++;
+    }
+    if (with_outgoing && n < max && n == conn->outq.size() && !conn->outgoing.empty()) {
+        iov[n].iov_base = conn->outgoing.data();
+        iov[n].iov_len = conn->outgoing.size();
+        n++;
+    }
+    return n;
+}
+
+// drop written bytes from the front of the queued output, then from `outgoing`
+static void conn_consume_output(Conn *conn, size_t n) {
+    while (n > 0 && !conn->outq.empty()) {
+        OutChunk &chunk = conn->outq.front();
+        size_t left = chunk.buf->data.size() - chunk.off;
+        if (n < left) {
+            chunk.off += n;
+            conn->outq_bytes -= n;
+            return;
+        }
+
+        n -= left;
+        conn->outq_bytes -= left;
+        sharedbuf_unref(chunk.buf);
+        conn->outq.pop_front();
+    }
+    buf_consume(conn->outgoing, n);
+}
+
 enum {
     ERR_UNKNOWN  = 1,
     ERR_TOO_BIG  = 2,
     ERR_BAD_TYPE = 3,
     ERR_BAD_ARG  = 4,
+    ERR_READONLY = 5,
+    ERR_SCRIPT   = 6,                           // a script failed to compile or raised an error
+    ERR_NOSCRIPT = 7,                           // EVALSHA of a script that is not cached
+    ERR_MOVED    = 8,                           // "MOVED <slot> <host>:<port>", the slot is served elsewhere
+    ERR_ASK      = 9,                           // "ASK <slot> <host>:<port>", retry there once after ASKING
+    ERR_TRYAGAIN = 10,                          // some of the keys are being migrated
+    ERR_CLUSTER  = 11,                          // keys in different slots, or the slot is not served
 };
 
 enum {
@@ -194,33 +928,182 @@ static void buf_append_dbl(Buffer &buf, double data) {
     buf_append(buf, (const uint8_t *)&data, 8);
 }
 
+enum {
+    RESP_PLAIN = 0,
+    RESP_SPLIT = 1,             // the array holds replies sent one by one, e.g. SUBSCRIBE a b
+    RESP_MAP   = 2,             // the array holds key/value pairs, a map in RESP3
+};
+
+// RESP replies
+//
+// Replies are written with the out_*() helpers. For a RESP connection they are encoded as they
+// are written: between conn_response_begin() and conn_response_end() g_resp.conn is set and the
+// helpers write RESP to its `outgoing`. Arrays of unknown length get their header inserted in
+// front of their elements by out_end_arr(). Errors get a Redis style prefix, doubles are bulk
+// strings in RESP2, and nil is a null bulk string in RESP2 and "_" in RESP3. Other buffers, e.g.
+// the replies to scripts, stay native, and shared messages are re-encoded by resp_encode_push().
+
+struct RespOut {
+    Conn *conn = NULL;                  // whose `outgoing` gets RESP
+    bool push = false;                  // arrays are pushes, the replies of a split array in RESP3
+    uint32_t open = 0;                  // arrays begun by out_begin_arr() and not ended
+    size_t top_ctx = (size_t)-1;        // out_begin_arr() of the top-level reply, if it has a hint
+    uint32_t top_hint = RESP_PLAIN;
+};
+
+static RespOut g_resp;
+static std::vector<RespOut> g_resp_outer;       // replies to other connections started meanwhile
+
+static const char *k_resp_err_prefix[] = {
+    "ERR", "ERR", "ERR", "WRONGTYPE", "ERR", "READONLY", "ERR", "NOSCRIPT", "", "", "TRYAGAIN", "ERR",
+};
+
+static bool out_resp(const Buffer &out) {
+    return g_resp.conn && &out == &g_resp.conn->outgoing;
+}
+
+static void resp_insert_line(Buffer &out, size_t pos, char type, int64_t val) {
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    uint64_t v = val < 0 ? 0 - (uint64_t)val : (uint64_t)val;
+    *--p = '\n';
+    *--p = '\r';
+    do {
+        *--p = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    if (val < 0) {
+        *--p = '-';
+    }
+    *--p = type;
+    out.insert(out.begin() + pos, (const uint8_t *)p, (const uint8_t *)tmp + sizeof(tmp));
+}
+
+static void resp_append_line(Buffer &out, char type, int64_t val) {
+    resp_insert_line(out, out.size(), type, val);
+}
+
+static void resp_append_bulk(Buffer &out, const uint8_t *s, size_t len) {
+    resp_append_line(out, '$', (int64_t)len);
+    buf_append(out, s, len);
+    buf_append(out, (const uint8_t *)"\r\n", 2);
+}
+
+static void resp_append_nil(Buffer &out, bool resp3) {
+    buf_append(out, (const uint8_t *)(resp3 ? "_\r\n" : "$-1\r\n"), resp3 ? 3 : 5);
+}
+
+static void resp_append_dbl(Buffer &out, bool resp3, double val) {
+    char tmp[40];
+    int len = snprintf(tmp, sizeof(tmp), "%.17g", val);
+    if (resp3) {
+        out.push_back(',');
+        buf_append(out, (const uint8_t *)tmp, (size_t)len);
+        buf_append(out, (const uint8_t *)"\r\n", 2);
+    } else {
+        resp_append_bulk(out, (const uint8_t *)tmp, (size_t)len);
+    }
+}
+
+static void resp_append_err(Buffer &out, uint32_t code, const uint8_t *msg, size_t len) {
+    const char *prefix = code < sizeof(k_resp_err_prefix) / sizeof(k_resp_err_prefix[0]) ? k_resp_err_prefix[code] : "ERR";
+    out.push_back('-');
+    buf_append(out, (const uint8_t *)prefix, strlen(prefix));
+    if (prefix[0]) {
+        out.push_back(' ');
+    }
+    size_t start = out.size();
+    buf_append(out, msg, len);
+    for (size_t i = start; i < out.size(); i++) {
+        if (out[i] == '\r' || out[i] == '\n') {
+            out[i] = ' ';                       // an error is a single line
+        }
+    }
+    buf_append(out, (const uint8_t *)"\r\n", 2);
+}
+
+// the hint set for the reply if the array starting at the end of `out` is its top level
+static uint32_t resp_take_hint(const Buffer &out) {
+    Conn *conn = g_resp.conn;
+    if (out.size() != conn->resp_start || conn->resp_hint == RESP_PLAIN) {
+        return RESP_PLAIN;
+    }
+    uint32_t hint = conn->resp_hint;
+    conn->resp_hint = RESP_PLAIN;
+    g_resp.push = hint == RESP_SPLIT && conn->proto == PROTO_RESP3;
+    return hint;
+}
+
+static void resp_arr(Buffer &out, size_t pos, uint32_t n, uint32_t hint) {
+    if (hint == RESP_SPLIT) {
+        return;                                 // the elements go out as replies of their own
+    }
+    bool resp3 = g_resp.conn->proto == PROTO_RESP3;
+    if (hint == RESP_MAP && resp3 && n % 2 == 0) {
+        return resp_insert_line(out, pos, '%', (int64_t)n / 2);
+    }
+    resp_insert_line(out, pos, g_resp.push ? '>' : '*', (int64_t)n);
+}
+
 // append serialized data to back
 static void out_nil(Buffer &out) {
+    if (out_resp(out)) {
+        return resp_append_nil(out, g_resp.conn->proto == PROTO_RESP3);
+    }
     buf_append_u8(out, TAG_NIL);
 }
 
 static void out_str(Buffer &out, const char *s, size_t size) {
+    if (out_resp(out)) {
+        return resp_append_bulk(out, (const uint8_t *)s, size);
+    }
     buf_append_u8(out, TAG_STR);
     buf_append_u32(out, (uint32_t)size);
     buf_append(out, (const uint8_t *)s, size);
 }
 
+// a string reply of `size` bytes for the caller to fill in
+static uint8_t *out_str_begin(Buffer &out, size_t size) {
+    if (out_resp(out)) {
+        resp_append_line(out, '$', (int64_t)size);
+        out.resize(out.size() + size + 2);
+        memcpy(&out[out.size() - 2], "\r\n", 2);
+        return &out[out.size() - size - 2];
+    }
+    buf_append_u8(out, TAG_STR);
+    buf_append_u32(out, (uint32_t)size);
+    out.resize(out.size() + size);
+    return &out[out.size() - size];
+}
+
 static void out_int(Buffer &out, int64_t val) {
+    if (out_resp(out)) {
+        return resp_append_line(out, ':', val);
+    }
     buf_append_u8(out, TAG_INT);
     buf_append_i64(out, val);
 }
 
 static void out_dbl(Buffer &out, double val) {
+    if (out_resp(out)) {
+        return resp_append_dbl(out, g_resp.conn->proto == PROTO_RESP3, val);
+    }
     buf_append_u8(out, TAG_DBL);
     buf_append_dbl(out, val);
 }
 
 static void out_arr(Buffer &out, uint32_t n) {
+    if (out_resp(out)) {
+        return resp_arr(out, out.size(), n, resp_take_hint(out));
+    }
     buf_append_u8(out, TAG_ARR);
     buf_append_u32(out, n);
 }
 
 static void out_err(Buffer &out, uint32_t code, const std::string &msg) {
+    if (out_resp(out)) {
+        return resp_append_err(out, code, (const uint8_t *)msg.data(), msg.size());
+    }
     buf_append_u8(out, TAG_ERR);
     buf_append_u32(out, code);
     buf_append_u32(out, (uint32_t)msg.size());
@@ -228,15 +1111,38 @@ static void out_err(Buffer &out, uint32_t code, const std::string &msg) {
 }
 
 static size_t out_begin_arr(Buffer &out) {
+    if (out_resp(out)) {
+        size_t ctx = out.size();
+        uint32_t hint = resp_take_hint(out);
+        if (hint != RESP_PLAIN) {
+            g_resp.top_ctx = ctx;
+            g_resp.top_hint = hint;
+        }
+        g_resp.open++;
+        return ctx;
+    }
     out.push_back(TAG_ARR);
     buf_append_u32(out, 0);
     return out.size() - 4;
 }
 
 static void out_end_arr(Buffer &out, size_t ctx, uint32_t n) {
+    if (out_resp(out)) {
+        g_resp.open--;
+        bool top = ctx == g_resp.top_ctx && g_resp.open == 0;
+        return resp_arr(out, ctx, n, top ? g_resp.top_hint : (uint32_t)RESP_PLAIN);
+    }
     memcpy(&out[ctx], &n, 4);
 }
 
+// set while a handler writes its reply to tell how it maps to RESP, only a top-level reply
+// counts, not one nested in EXEC or made for a script
+static void resp_hint(Conn *conn, Buffer &out, uint32_t hint) {
+    if (g_resp.conn == conn && out_resp(out) && out.size() == conn->resp_start) {
+        conn->resp_hint = hint;
+    }
+}
+
 // read (int) 4 bytes from byte stream
 static bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out) { 
     if (cur + 4 > end) {
@@ -272,15 +1178,21 @@ static int32_t parse_req(const uint8_t *data, size_t size, std::vector<std::stri
         return -1;
     }
 
-    while (out.size() < nstr) {
+    if (nstr > size / 4) {
+        printf("nstr too large\n");
+        return -1;
+    }
+
+    // assigned in place, `out` may be reused and its strings keep their buffers
+    out.resize(nstr);
+    for (uint32_t i = 0; i < nstr; i++) {
         uint32_t len = 0;
         if (!read_u32(data, end, len)) {
             printf("error reading request len\n");
             return -1;
         }
 
-        out.push_back(std::string());
-        if (!read_str(data, end, len, out.back())) {
+        if (!read_str(data, end, len, out[i])) {
             printf("error reading request str\n");
             return -1;
         }
@@ -293,54 +1205,562 @@ static int32_t parse_req(const uint8_t *data, size_t size, std::vector<std::stri
     return 0;
 }
 
-static void do_get(std::vector<std::string> &cmd, Buffer &out) {
-    struct Entry key;       // dummy entry
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+// RESP requests
+//
+// Redis clients send either a multibulk request, "*<n>\r\n" followed by n "$<len>\r\n<bytes>\r\n",
+// or an inline command, a line of words separated by spaces. Both are parsed straight from the
+// receive buffer into the reused argument vector of the connection.
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node) {
-        return out_nil(out);
-    }
+const size_t k_resp_max_inline = 64 << 10;
+const int64_t k_resp_max_args = 1 << 20;
 
-    const std::string &val = container_of(node, struct Entry, node)->str;
-    return out_str(out, val.data(), val.size());
+static void str_lower(std::string &s) {
+    for (char &c : s) {
+        c = (char)tolower((unsigned char)c);
+    }
 }
 
-static void do_set(std::vector<std::string> &cmd, Buffer &out) {
-    struct Entry key;       // dummy entry
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+// the integer on the line at `cur` after its type byte, false if the line is incomplete
+static bool resp_read_line_int(const uint8_t *&cur, const uint8_t *end, int64_t &out, bool &bad) {
+    const uint8_t *eol = (const uint8_t *)memchr(cur, '\r', (size_t)(end - cur));
+    if (!eol || eol + 1 >= end) {
+        bad = end - cur > 32;
+        return false;
+    }
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (node) {
-        struct Entry *target = container_of(node, Entry, node);
-        target->str.swap(cmd[2]);
-    } else {
-        struct Entry *ent = new Entry();
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->str.swap(cmd[2]);
+    const uint8_t *p = cur + 1;
+    bool neg = p < eol && *p == '-';
+    p += neg ? 1 : 0;
+    int64_t v = 0;
+    bad = p == eol || eol - p > 18 || eol[1] != '\n';
+    for (; p < eol && !bad; p++) {
+        bad = *p < '0' || *p > '9';
+        v = v * 10 + (*p - '0');
+    }
+    out = neg ? -v : v;
+    cur = eol + 2;
+    return !bad;
+}
 
-        hm_insert(&g_data.db, &ent->node);
+static int64_t resp_parse_inline(const uint8_t *data, size_t size, std::vector<std::string> &out) {
+    const uint8_t *eol = (const uint8_t *)memchr(data, '\n', size);
+    if (!eol) {
+        return 0;
     }
 
-    return out_nil(out);
+    size_t n = 0;
+    const uint8_t *cur = data;
+    const uint8_t *line_end = eol > data && eol[-1] == '\r' ? eol - 1 : eol;
+    while (cur < line_end) {
+        while (cur < line_end && (*cur == ' ' || *cur == '\t')) {
+            cur++;
+        }
+        const uint8_t *word = cur;
+        while (cur < line_end && *cur != ' ' && *cur != '\t') {
+            cur++;
+        }
+        if (cur > word) {
+            if (n == out.size()) {
+                out.emplace_back();
+            }
+            out[n++].assign(word, cur);
+        }
+    }
+    out.resize(n);
+    return eol + 1 - data;
 }
 
-static void do_del(std::vector<std::string> &cmd, Buffer &out) {
-    struct Entry key;       // dummy entry
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+// `st` keeps the arguments parsed so far when the request is incomplete, `out` grows as they come
+static int64_t resp_parse_multibulk(const uint8_t *data, size_t size, std::vector<std::string> &out,
+    RespParse &st, const char **err)
+{
+    const uint8_t *cur = data + st.pos, *end = data + size;
+    bool bad = false;
+    if (st.nargs < 0) {
+        int64_t nargs = 0;
+        if (!resp_read_line_int(cur, end, nargs, bad) || nargs > k_resp_max_args) {
+            *err = "invalid multibulk length";
+            return bad || nargs > k_resp_max_args ? -1 : 0;
+        }
+        st.nargs = nargs > 0 ? nargs : 0;
+        st.pos = (size_t)(cur - data);
+    }
+
+    while (st.nparsed < (size_t)st.nargs) {
+        int64_t len = 0;
+        if (cur < end && *cur != '$') {
+            *err = "expected '$'";
+            st = RespParse();
+            return -1;
+        }
+        if (!resp_read_line_int(cur, end, len, bad) || len < 0 || (size_t)len > k_max_msg) {
+            *err = "invalid bulk length";
+            if (bad || len < 0 || (size_t)len > k_max_msg) {
+                st = RespParse();
+                return -1;
+            }
+            return 0;
+        }
+        if ((size_t)(end - cur) < (size_t)len + 2) {
+            return 0;
+        }
+        if (st.nparsed == out.size()) {
+            out.emplace_back();
+        }
+        out[st.nparsed++].assign(cur, cur + len);
+        cur += len + 2;
+        st.pos = (size_t)(cur - data);
+    }
+
+    out.resize(st.nparsed);
+    int64_t n = (int64_t)st.pos;
+    st = RespParse();
+    return n;
+}
+
+// returns the size of the request at the front of data, 0 if it is incomplete, or -1 with `err`
+// set on a protocol error. An empty request (a blank line or "*0") leaves `out` empty. `st` must
+// be passed again with the same request after more of it arrived.
+static int64_t resp_parse(const uint8_t *data, size_t size, std::vector<std::string> &out, RespParse &st,
+    const char **err)
+{
+    if (size == 0) {
+        return 0;
+    }
+
+    int64_t n = 0;
+    if (data[0] == '*') {
+        n = resp_parse_multibulk(data, size, out, st, err);
+        if (n == 0 && size > k_max_msg + k_resp_max_inline) {
+            *err = "request is too big";
+            st = RespParse();
+            n = -1;
+        }
+    } else {
+        n = resp_parse_inline(data, size, out);
+        if (n == 0 && size > k_resp_max_inline) {
+            *err = "too big inline request";
+            n = -1;
+        }
+    }
+
+    // commands are looked up in lowercase
+    if (n > 0 && !out.empty()) {
+        str_lower(out[0]);
+    }
+    return n;
+}
+
+// String values that are canonical integers are kept in Entry::ival instead of as decimal text,
+// so counters are updated in place and replies for small ones use the shared decimal forms.
+const int64_t k_shared_ints = 10000;
+static std::string g_shared_ints[k_shared_ints];
+
+static void shared_ints_init() {
+    for (int64_t i = 0; i < k_shared_ints; i++) {
+        g_shared_ints[i] = std::to_string(i);
+    }
+}
+
+// only text that prints back the same, e.g. not "007", "+1", "-0" or " 1"
+static bool str2int_exact(const char *s, size_t len, int64_t &out) {
+    if (len == 0 || len > 20) {
+        return false;
+    }
+
+    size_t i = s[0] == '-' ? 1 : 0;
+    if (i == len || (s[i] == '0' && (len > i + 1 || i == 1))) {
+        return false;
+    }
+
+    uint64_t v = 0;
+    for (; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') {
+            return false;
+        }
+        uint64_t d = (uint64_t)(s[i] - '0');
+        if (v > (UINT64_MAX - d) / 10) {
+            return false;
+        }
+        v = v * 10 + d;
+    }
+
+    if (s[0] == '-') {
+        if (v > (uint64_t)INT64_MAX + 1) {
+            return false;
+        }
+        out = (int64_t)(0 - v);
+    } else {
+        if (v > (uint64_t)INT64_MAX) {
+            return false;
+        }
+        out = (int64_t)v;
+    }
+    return true;
+}
+
+// decimal text of `val`, either shared or written to `buf` which holds at least 21 bytes
+static const char *int2str(int64_t val, char *buf, size_t &len) {
+    if (val >= 0 && val < k_shared_ints) {
+        len = g_shared_ints[val].size();
+        return g_shared_ints[val].data();
+    }
+
+    char *end = buf + 21;
+    char *p = end;
+    uint64_t v = val < 0 ? 0 - (uint64_t)val : (uint64_t)val;
+    do {
+        *--p = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    if (val < 0) {
+        *--p = '-';
+    }
+    len = (size_t)(end - p);
+    return p;
+}
+
+// String values of at least str-compress-min-size bytes written by SET are kept compressed if that
+// saves at least 1/8 of their size. GET decompresses them straight into the reply and the other
+// reads into a copy, see str_view(), while writes decompress them for good, see str_bytes(). From str-compress-bg-size the
+// compression runs on the thread pool: the key is pinned like the keys of a BITOP job meanwhile,
+// so it can be read, but writes to it wait.
+
+// leaving STR_LZ4
+static void str_drop_lz4(Entry *ent) {
+    if (ent->type == T_STR && ent->enc == STR_LZ4) {
+        g_data.lz4.nkeys--;
+        g_data.lz4.raw_bytes -= (size_t)ent->ival;
+        g_data.lz4.bytes -= ent->str.size();
+        ent->enc = STR_RAW;
+    }
+}
+
+// false if it does not pay off, runs on worker threads too
+static bool str_compress(const std::string &raw, std::string &packed) {
+    packed.resize(lz4_bound(raw.size()));
+    size_t n = lz4_compress((const uint8_t *)raw.data(), raw.size(), (uint8_t *)&packed[0]);
+    if (n > raw.size() - raw.size() / 8) {
+        return false;
+    }
+    packed.resize(n);
+    packed.shrink_to_fit();
+    return true;
+}
+
+// takes the contents of `packed`, the compressed form of the current value
+static void str_set_lz4(Entry *ent, std::string &packed) {
+    ent->enc = STR_LZ4;
+    ent->ival = (int64_t)ent->str.size();
+    ent->str.swap(packed);
+    g_data.lz4.nkeys++;
+    g_data.lz4.raw_bytes += (size_t)ent->ival;
+    g_data.lz4.bytes += ent->str.size();
+}
+
+static void str_decompress(const Entry *ent, uint8_t *dst) {
+    bool ok = lz4_decompress((const uint8_t *)ent->str.data(), ent->str.size(), dst, (size_t)ent->ival);
+    assert(ok);
+    (void)ok;
+}
+
+static void str_set_int(Entry *ent, int64_t val) {
+    str_drop_lz4(ent);
+    ent->enc = STR_INT;
+    ent->ival = val;
+    if (ent->str.capacity() > 0) {
+        std::string().swap(ent->str);
+    }
+}
+
+// takes the contents of `val`
+static void str_set(Entry *ent, std::string &val) {
+    int64_t ival = 0;
+    if (str2int_exact(val.data(), val.size(), ival)) {
+        str_set_int(ent, ival);
+    } else {
+        str_drop_lz4(ent);
+        ent->enc = STR_RAW;
+        ent->str.swap(val);
+    }
+}
+
+// the bytes of a string value, an integer or a compressed value is converted for good
+static std::string &str_bytes(Entry *ent) {
+    if (ent->enc == STR_INT) {
+        char buf[24];
+        size_t len = 0;
+        const char *s = int2str(ent->ival, buf, len);
+        ent->str.assign(s, len);
+        ent->enc = STR_RAW;
+    } else if (ent->enc == STR_LZ4) {
+        std::string raw((size_t)ent->ival, '\0');
+        str_decompress(ent, (uint8_t *)&raw[0]);
+        str_drop_lz4(ent);
+        ent->str.swap(raw);
+    }
+    return ent->str;
+}
+
+// the bytes of a string value without converting it, an integer or a compressed value is written
+// to `buf` and the result is valid as long as it is
+static const char *str_view(const Entry *ent, std::string &buf, size_t &len) {
+    if (ent->enc == STR_INT) {
+        char tmp[24];
+        const char *s = int2str(ent->ival, tmp, len);
+        buf.assign(s, len);
+        return buf.data();
+    }
+    if (ent->enc == STR_LZ4) {
+        buf.resize((size_t)ent->ival);
+        str_decompress(ent, (uint8_t *)&buf[0]);
+        len = buf.size();
+        return buf.data();
+    }
+    len = ent->str.size();
+    return ent->str.data();
+}
+
+// NULL if the key does not exist, `ok` is false if it exists with another type
+static Entry *expect_entry(const std::string &s, uint32_t type, bool &ok) {
+    LookupKey key;
+    key.key = s;
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    Entry *ent = hnode ? container_of(hnode, Entry, node) : NULL;
+    ok = !ent || ent->type == type;
+    return ok ? ent : NULL;
+}
+
+static Entry *entry_insert(std::string &key, uint32_t type) {
+    Entry *ent = entry_new(type);
+    ent->key.swap(key);
+    ent->node.hcode = str_hash((uint8_t *)ent->key.data(), ent->key.size());
+    db_insert(ent);
+    return ent;
+}
+
+static void signal_key_modified(Conn *by, const std::string &key, const char *event);
+static void repl_feed(const std::vector<std::string> &cmd);
+
+static void do_get(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (!node) {
+        return out_nil(out);
+    }
+
+    Entry *ent = container_of(node, struct Entry, node);
+    if (ent->type != T_STR) {
+        return out_err(out, ERR_BAD_TYPE, "expected string");
+    }
+    if (ent->enc == STR_INT) {
+        char buf[24];
+        size_t len = 0;
+        const char *s = int2str(ent->ival, buf, len);
+        return out_str(out, s, len);
+    }
+    if (ent->enc == STR_LZ4) {
+        return str_decompress(ent, out_str_begin(out, (size_t)ent->ival));
+    }
+
+    const std::string &val = ent->str;
+    return out_str(out, val.data(), val.size());
+}
+
+static void compress_submit(Entry *ent);
+
+static void str_maybe_compress(Conn *conn, Entry *ent) {
+    size_t size = ent->str.size();
+    if (ent->enc != STR_RAW || g_config.str_compress_min_size == 0 || size < (size_t)g_config.str_compress_min_size) {
+        return;
+    }
+
+    // replicas, the replication stream and transactions apply it in order, without the thread pool
+    if (size >= (size_t)g_config.str_compress_bg_size && !g_repl.is_replica
+        && conn && conn->repl_role == REPL_NONE && !conn->tx.in_exec)
+    {
+        return compress_submit(ent);
+    }
+
+    std::string packed;
+    if (str_compress(ent->str, packed)) {
+        str_set_lz4(ent, packed);
+    }
+}
+
+static void do_set(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (node) {
+        struct Entry *target = container_of(node, Entry, node);
+        if (target->type != T_STR) {
+            return out_err(out, ERR_BAD_TYPE, "expected string");
+        }
+        str_set(target, cmd[2]);
+        str_maybe_compress(conn, target);
+        signal_key_modified(conn, target->key, "set");
+    } else {
+        struct Entry *ent = entry_new(T_STR);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        str_set(ent, cmd[2]);
+
+        db_insert(ent);
+        str_maybe_compress(conn, ent);
+        signal_key_modified(conn, ent->key, "set");
+    }
+
+    return out_nil(out);
+}
+
+static void do_del(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
 
     HNode *node = hm_delete(&g_data.db, &key.node, &entry_eq);
     if (node) {
         entry_del(container_of(node, Entry, node));
+        signal_key_modified(conn, key.key, "del");
     }
 
     return out_int(out, node ? 1 : 0);
 }
 
+// INCR/DECR/INCRBY/DECRBY, a missing key counts as 0
+static void incr_by(Conn *conn, std::vector<std::string> &cmd, Buffer &out, int64_t delta) {
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_STR, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected string");
+    }
+
+    int64_t val = 0;
+    std::string buf;
+    size_t len = 0;
+    if (ent && ent->enc == STR_INT) {
+        val = ent->ival;
+    } else if (ent) {
+        const char *cur = str_view(ent, buf, len);
+        if (!str2int_exact(cur, len, val)) {
+            return out_err(out, ERR_BAD_ARG, "value is not an integer or out of range");
+        }
+    }
+    if ((delta > 0 && val > INT64_MAX - delta) || (delta < 0 && val < INT64_MIN - delta)) {
+        return out_err(out, ERR_BAD_ARG, "increment or decrement would overflow");
+    }
+    val += delta;
+
+    if (!ent) {
+        ent = entry_insert(cmd[1], T_STR);
+    }
+    str_set_int(ent, val);
+    signal_key_modified(conn, ent->key, "incrby");
+    return out_int(out, val);
+}
+
+static void do_incr(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    return incr_by(conn, cmd, out, 1);
+}
+
+static void do_decr(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    return incr_by(conn, cmd, out, -1);
+}
+
+static void do_incrby(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    int64_t delta = 0;
+    if (!str2int_exact(cmd[2].data(), cmd[2].size(), delta)) {
+        return out_err(out, ERR_BAD_ARG, "expected int");
+    }
+    return incr_by(conn, cmd, out, delta);
+}
+
+static void do_decrby(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    int64_t delta = 0;
+    if (!str2int_exact(cmd[2].data(), cmd[2].size(), delta)) {
+        return out_err(out, ERR_BAD_ARG, "expected int");
+    }
+    if (delta == INT64_MIN) {
+        return out_err(out, ERR_BAD_ARG, "increment or decrement would overflow");
+    }
+    return incr_by(conn, cmd, out, -delta);
+}
+
+static bool str2ldbl(const std::string &s, long double &out) {
+    if (s.empty() || isspace((unsigned char)s[0])) {
+        return false;
+    }
+
+    char *endp = NULL;
+    out = strtold(s.c_str(), &endp);
+    return endp == s.c_str() + s.size() && !isnan(out) && !isinf(out);
+}
+
+// INCRBYFLOAT key delta, the new value as text. Replicated as SET so replicas don't redo the
+// floating point math.
+static void do_incrbyfloat(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    long double delta = 0;
+    if (!str2ldbl(cmd[2], delta)) {
+        return out_err(out, ERR_BAD_ARG, "expected fp value");
+    }
+
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_STR, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected string");
+    }
+
+    long double val = 0;
+    if (ent && ent->enc == STR_INT) {
+        val = (long double)ent->ival;
+    } else if (ent && ent->enc == STR_LZ4) {
+        std::string buf;
+        size_t len = 0;
+        str_view(ent, buf, len);
+        if (!str2ldbl(buf, val)) {
+            return out_err(out, ERR_BAD_ARG, "value is not a valid float");
+        }
+    } else if (ent && !str2ldbl(ent->str, val)) {
+        return out_err(out, ERR_BAD_ARG, "value is not a valid float");
+    }
+    val += delta;
+    if (isnan(val) || isinf(val)) {
+        return out_err(out, ERR_BAD_ARG, "increment would produce NaN or Infinity");
+    }
+
+    // fixed point without trailing zeros, so 0.1 + 0.2 reads back as 0.3
+    char buf[5120];
+    int n = snprintf(buf, sizeof(buf), "%.17Lf", val);
+    if (n < 0 || n >= (int)sizeof(buf)) {
+        return out_err(out, ERR_BAD_ARG, "value is out of range");
+    }
+    if (strchr(buf, '.')) {
+        while (buf[n - 1] == '0') {
+            n--;
+        }
+        if (buf[n - 1] == '.') {
+            n--;
+        }
+    }
+    std::string text(buf, (size_t)n);
+
+    if (!ent) {
+        ent = entry_insert(cmd[1], T_STR);
+    }
+    repl_feed({"set", ent->key, text});
+    out_str(out, text.data(), text.size());
+    str_set(ent, text);
+    signal_key_modified(conn, ent->key, "incrbyfloat");
+}
+
 static bool cb_keys(HNode *node, void *args) {
     Buffer &out = *(Buffer *)args;
     const std::string &key = container_of(node, Entry, node)->key;
@@ -349,7 +1769,7 @@ static bool cb_keys(HNode *node, void *args) {
     return true;
 }
 
-static void do_keys(std::vector<std::string> &, Buffer &out) {
+static void do_keys(Conn *, std::vector<std::string> &, Buffer &out) {
     out_arr(out, (uint32_t)hm_size(&g_data.db));
     hm_foreach(&g_data.db, cb_keys, (void *)&out);
 }
@@ -366,26 +1786,24 @@ static bool str2int(const std::string &s, int64_t &out) {
     return endp == s.c_str() + s.size();
 }
 
-static void do_zadd(std::vector<std::string> &cmd, Buffer &out) {
+static void do_zadd(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
     double score = 0;
     if (!str2dbl(cmd[2], score)) {
         return out_err(out, ERR_BAD_ARG, "expected fp value");
     }
 
-    HNode node;
-    std::string key;
-
-    key.swap(cmd[1]);
-    node.hcode = str_hash((uint8_t *)key.data(), key.size());
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
     
-    HNode *hnode = hm_lookup(&g_data.db, &node, &entry_eq);
+    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
 
     Entry *ent = NULL;
     if (!hnode) {
         ent = entry_new(T_ZSET);
-        ent->key.swap(key);
-        ent->node.hcode = node.hcode;
-        hm_insert(&g_data.db, &ent->node);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        db_insert(ent);
     } else {
         ent = container_of(hnode, Entry, node);
         if (ent->type != T_ZSET) {
@@ -394,27 +1812,27 @@ static void do_zadd(std::vector<std::string> &cmd, Buffer &out) {
     }
 
     const std::string &name = cmd[3];
-    bool added = zset_insert(&ent->zset, name.data(), name.size(), score);
+    bool added = zset_insert(ent->zset, name.data(), name.size(), score);
+    signal_key_modified(conn, ent->key, "zadd");
     return out_int(out, (uint64_t)added);
 }
 
 static ZSet *expect_zset(std::string &s) {
-    struct HNode node;
-    std::string key;
-
-    key.swap(s);
-    node.hcode = str_hash((uint8_t *)key.data(), key.size());
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
 
-    HNode *hnode = hm_lookup(&g_data.db, &node, &entry_eq);
+    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
     if (!hnode) {
         return NULL;
     }
 
     Entry *ent = container_of(hnode, Entry, node);
-    return ent->type == T_ZSET ? &ent->zset : NULL;
+    return ent->type == T_ZSET ? ent->zset : NULL;
 }
 
-static void do_zrem(std::vector<std::string> &cmd, Buffer &out) {
+static void do_zrem(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    std::string key = cmd[1];
     ZSet *zset = expect_zset(cmd[1]);
     if (!zset) {
         return out_err(out, ERR_BAD_TYPE, "expected zset");
@@ -424,12 +1842,13 @@ static void do_zrem(std::vector<std::string> &cmd, Buffer &out) {
     ZNode *znode = zset_lookup(zset, name.data(), name.size());
     if (znode) {
         zset_delete(zset, znode);
+        signal_key_modified(conn, key, "zrem");
     }
 
     return out_int(out, znode ? 1 : 0);
 }
 
-static void do_zscore(std::vector<std::string> &cmd, Buffer &out) {
+static void do_zscore(Conn *, std::vector<std::string> &cmd, Buffer &out) {
     ZSet *zset = expect_zset(cmd[1]);
     if (!zset) {
         return out_err(out, ERR_BAD_TYPE, "expected zset");
@@ -445,7 +1864,7 @@ static void do_zscore(std::vector<std::string> &cmd, Buffer &out) {
     }
 }
 
-static void do_zquery(std::vector<std::string> &cmd, Buffer &out) {
+static void do_zquery(Conn *, std::vector<std::string> &cmd, Buffer &out) {
     // parse arguments
     double score = 0;
     if (!str2dbl(cmd[2], score)) {
@@ -483,308 +1902,5845 @@ static void do_zquery(std::vector<std::string> &cmd, Buffer &out) {
     out_end_arr(out, ctx, (uint32_t)n);
 }
 
-static void do_expire(std::vector<std::string> &cmd, Buffer &out) {
-    int64_t ttl_ms = 0;
-    if (!str2int(cmd[2], ttl_ms)) {
-        return out_err(out, ERR_BAD_ARG, "expected int");
+// HSET key field value [field value ...]
+static void do_hset(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() % 2 != 0) {
+        return out_err(out, ERR_BAD_ARG, "expected field value pairs");
     }
 
-    struct HNode key_node;
-    std::string key;
-
-    key.swap(cmd[1]);
-    key_node.hcode = str_hash((uint8_t *)key.data(), key.size());
-
-    HNode *node = hm_lookup(&g_data.db, &key_node, &entry_eq);
-    if (node) {
-        Entry *ent = container_of(node, Entry, node);
-        entry_set_ttl(ent, ttl_ms);
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_HASH, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected hash");
+    }
+    if (!ent) {
+        ent = entry_new(T_HASH);
+        ent->key.swap(cmd[1]);
+        ent->node.hcode = str_hash((uint8_t *)ent->key.data(), ent->key.size());
+        db_insert(ent);
     }
 
-    return out_int(out, node ? 1 : 0);
+    int64_t added = 0;
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        const std::string &field = cmd[i], &val = cmd[i + 1];
+        added += hash_set(ent->hash, field.data(), field.size(), val.data(), val.size()) ? 1 : 0;
+    }
+    signal_key_modified(conn, ent->key, "hset");
+    return out_int(out, added);
 }
 
-static void do_ttl(std::vector<std::string> &cmd, Buffer &out) {
-    HNode key_node;
-    std::string key;
-
-    key.swap(cmd[1]);
-    key_node.hcode = str_hash((uint8_t *)key.data(), key.size());
-
-    HNode *node = hm_lookup(&g_data.db, &key_node, &entry_eq);
-    if (!node) {
-        return out_int(out, -2);    // not found
+static void do_hget(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_HASH, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected hash");
     }
 
-    Entry *ent = container_of(node, Entry, node);
-    if (ent->heap_idx == (size_t)-1) {
-        return out_int(out, -1);    // no TTL
+    const char *val = NULL;
+    size_t vlen = 0;
+    if (!ent || !hash_get(ent->hash, cmd[2].data(), cmd[2].size(), &val, &vlen)) {
+        return out_nil(out);
     }
-
-    uint64_t expire_time = g_data.heap[ent->heap_idx].val;
-    uint64_t now_ms = get_monotonic_msec();
-    return out_int(out, expire_time > now_ms ? (expire_time - now_ms) : 0);
+    return out_str(out, val, vlen);
 }
 
-static void do_request(std::vector<std::string> &cmd, Buffer &out) {
-    if (cmd.size() == 2 && cmd[0] == "get") {
-        return do_get(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "set") {
-        return do_set(cmd, out);
-    } else if (cmd.size() == 2 && cmd[0] == "del") {
-        return do_del(cmd, out);
-    } else if(cmd.size() == 3 && cmd[0] == "pexpire") {
-        return do_expire(cmd, out);
-    } else if (cmd.size() == 2 && cmd[0] == "pttl") {
-        return do_ttl(cmd, out);
-    } else if (cmd.size() == 1 && cmd[0] == "keys") {
-        return do_keys(cmd, out);
-    } else if (cmd.size() == 4 && cmd[0] == "zadd") {
-        return do_zadd(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "zrem") {
-        return do_zrem(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "zscore") {
-        return do_zscore(cmd, out);
-    } else if (cmd.size() == 6 && cmd[0] == "zquery") {
-        return do_zquery(cmd, out);
-    } else {
-        return out_err(out, ERR_UNKNOWN, "unknown commands");
+// HMGET key field [field ...]
+static void do_hmget(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_HASH, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected hash");
     }
-}
 
-static void response_begin(Buffer &out, size_t *header) {
-    *header = out.size();
-    buf_append_u32(out, 0);                                     // reserve 4 bytes for response header
+    out_arr(out, (uint32_t)(cmd.size() - 2));
+    for (size_t i = 2; i < cmd.size(); i++) {
+        const char *val = NULL;
+        size_t vlen = 0;
+        if (ent && hash_get(ent->hash, cmd[i].data(), cmd[i].size(), &val, &vlen)) {
+            out_str(out, val, vlen);
+        } else {
+            out_nil(out);
+        }
+    }
 }
 
-static size_t response_size(Buffer &out, size_t header) {
-    return out.size() - header - 4;
-}
+// HDEL key field [field ...], the key is removed with its last field
+static void do_hdel(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_HASH, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected hash");
+    }
+    if (!ent) {
+        return out_int(out, 0);
+    }
 
-static void response_end(Buffer &out, size_t header) {
-    size_t msg_size = response_size(out, header);
-    if (msg_size > k_max_msg) {
-        out.resize(header + 4);
-        out_err(out, ERR_TOO_BIG, "response is too big");
-        msg_size = response_size(out, header);
+    int64_t removed = 0;
+    for (size_t i = 2; i < cmd.size(); i++) {
+        removed += hash_del(ent->hash, cmd[i].data(), cmd[i].size()) ? 1 : 0;
+    }
+    if (removed) {
+        signal_key_modified(conn, ent->key, "hdel");
     }
 
-    // message header
-    uint32_t len = (uint32_t)msg_size;
-    memcpy(&out[header], &len, 4);
+    if (hash_size(ent->hash) == 0) {
+        hm_delete(&g_data.db, &ent->node, &hnode_same);
+        signal_key_modified(conn, ent->key, "del");
+        entry_del(ent);
+    }
+    return out_int(out, removed);
 }
 
-static bool try_one_request(Conn* conn) {
-    if (conn->incoming.size() < 4) {
-        return false;
+static void do_hlen(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_HASH, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected hash");
     }
+    return out_int(out, ent ? (int64_t)hash_size(ent->hash) : 0);
+}
 
-    uint32_t len = 0; 
-    memcpy(&len, conn->incoming.data(), 4);
-    if (len > k_max_msg) {    
-        conn->want_close = true;
-        return false;
+// HINCRBY key field delta
+static void do_hincrby(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    int64_t delta = 0;
+    if (!str2int_exact(cmd[3].data(), cmd[3].size(), delta)) {
+        return out_err(out, ERR_BAD_ARG, "expected int");
     }
 
-    if (4 + len > conn->incoming.size()) {
-        return false;
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_HASH, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected hash");
     }
 
-    const uint8_t* request = &conn->incoming[4];
+    const std::string &field = cmd[2];
+    int64_t val = 0;
+    const char *cur = NULL;
+    size_t curlen = 0;
+    if (ent && hash_get(ent->hash, field.data(), field.size(), &cur, &curlen)) {
+        if (!str2int_exact(cur, curlen, val)) {
+            return out_err(out, ERR_BAD_ARG, "hash value is not an integer");
+        }
+    }
+    if ((delta > 0 && val > INT64_MAX - delta) || (delta < 0 && val < INT64_MIN - delta)) {
+        return out_err(out, ERR_BAD_ARG, "increment would overflow");
+    }
+    val += delta;
 
-    // parse the requests 
-    std::vector<std::string> cmd;
-    if (parse_req(request, len, cmd) < 0) {
-        conn->want_close = true;
-        printf("error parsing request\n");
-        return false;
+    if (!ent) {
+        ent = entry_new(T_HASH);
+        ent->key.swap(cmd[1]);
+        ent->node.hcode = str_hash((uint8_t *)ent->key.data(), ent->key.size());
+        db_insert(ent);
     }
 
-    // generate response
-    size_t header_pos = 0;
-    response_begin(conn->outgoing, &header_pos);
-    do_request(cmd, conn->outgoing);
-    response_end(conn->outgoing, header_pos);
+    std::string s = std::to_string(val);
+    hash_set(ent->hash, field.data(), field.size(), s.data(), s.size());
+    signal_key_modified(conn, ent->key, "hincrby");
+    return out_int(out, val);
+}
 
-    // clear incoming buffer
-    buf_consume(conn->incoming, len + 4);
+static bool cb_hgetall(const char *field, size_t flen, const char *val, size_t vlen, void *arg) {
+    Buffer &out = *(Buffer *)arg;
+    out_str(out, field, flen);
+    out_str(out, val, vlen);
     return true;
 }
 
-static uint32_t handle_accept(int fd) {
-    // accept
-    struct sockaddr_in client_addr = {};
-    socklen_t addrlen = sizeof(client_addr);
-
-    int conn_fd = accept(fd, (struct sockaddr*)&client_addr, &addrlen);
-    if (conn_fd < 0) {
-        return -1;
+// flat [field, value, ...] array
+static void do_hgetall(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_HASH, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected hash");
+    }
+    if (!ent) {
+        return out_arr(out, 0);
     }
 
-    // set the new fd connection to non blocking mode
-    fd_set_nb(conn_fd);
+    resp_hint(conn, out, RESP_MAP);
+    out_arr(out, (uint32_t)(hash_size(ent->hash) * 2));
+    hash_foreach(ent->hash, &cb_hgetall, &out);
+}
 
-    Conn* conn = new Conn();
-    conn->fd = conn_fd;
-    conn->want_read = true;
-    conn->last_active_ms = get_monotonic_msec();
-    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+static void block_key_ready(const std::string &key);
 
-    if (g_data.fd2conn.size() <= (size_t)conn->fd) {
-        g_data.fd2conn.resize(conn->fd + 1);
+// LPUSH/RPUSH key value [value ...]
+static void list_push(Conn *conn, std::vector<std::string> &cmd, Buffer &out, bool front) {
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_LIST, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected list");
+    }
+    if (!ent) {
+        ent = entry_new(T_LIST);
+        ent->key.swap(cmd[1]);
+        ent->node.hcode = str_hash((uint8_t *)ent->key.data(), ent->key.size());
+        db_insert(ent);
     }
-    g_data.fd2conn[conn->fd] = conn;
 
-    return 0;
+    for (size_t i = 2; i < cmd.size(); i++) {
+        qlist_push(ent->list, front, cmd[i].data(), cmd[i].size());
+    }
+    signal_key_modified(conn, ent->key, front ? "lpush" : "rpush");
+    block_key_ready(ent->key);
+    return out_int(out, (int64_t)ent->list->size);
 }
 
+static void do_lpush(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    return list_push(conn, cmd, out, true);
+}
+
+static void do_rpush(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    return list_push(conn, cmd, out, false);
+}
+
+// after removing an element, the key is removed with its last element
+static void list_popped(Conn *conn, Entry *ent, bool front) {
+    signal_key_modified(conn, ent->key, front ? "lpop" : "rpop");
+    if (ent->list->size == 0) {
+        hm_delete(&g_data.db, &ent->node, &hnode_same);
+        signal_key_modified(conn, ent->key, "del");
+        entry_del(ent);
+    }
+}
+
+static void list_pop(Conn *conn, Entry *ent, bool front, std::string &val) {
+    const char *s = NULL;
+    size_t len = 0;
+    qlist_peek(ent->list, front, &s, &len);
+    val.assign(s, len);
+    qlist_pop(ent->list, front);
+    list_popped(conn, ent, front);
+}
+
+static void list_pop_cmd(Conn *conn, std::vector<std::string> &cmd, Buffer &out, bool front) {
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_LIST, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected list");
+    }
+    if (!ent) {
+        return out_nil(out);
+    }
+
+    std::string val;
+    list_pop(conn, ent, front, val);
+    return out_str(out, val.data(), val.size());
+}
+
+static void do_lpop(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    return list_pop_cmd(conn, cmd, out, true);
+}
+
+static void do_rpop(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    return list_pop_cmd(conn, cmd, out, false);
+}
+
+static void do_llen(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_LIST, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected list");
+    }
+    return out_int(out, ent ? (int64_t)ent->list->size : 0);
+}
+
+static bool cb_lrange(const char *s, size_t len, void *arg) {
+    out_str(*(Buffer *)arg, s, len);
+    return true;
+}
+
+// LRANGE key start stop, negative indexes count from the end
+static void do_lrange(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, ERR_BAD_ARG, "expected int");
+    }
+
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_LIST, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected list");
+    }
+
+    int64_t size = ent ? (int64_t)ent->list->size : 0;
+    if (start < 0) {
+        start = start + size < 0 ? 0 : start + size;
+    }
+    if (stop < 0) {
+        stop += size;
+    }
+    if (stop >= size) {
+        stop = size - 1;
+    }
+    if (start > stop) {
+        return out_arr(out, 0);
+    }
+
+    out_arr(out, (uint32_t)(stop - start + 1));
+    qlist_range(ent->list, (size_t)start, (size_t)stop, &cb_lrange, &out);
+}
+
+// PFADD key [element ...], 1 if the estimate may have changed
+static void do_pfadd(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_HLL, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected hll");
+    }
+
+    bool changed = false;
+    if (!ent) {
+        ent = entry_insert(cmd[1], T_HLL);
+        changed = true;
+    }
+    for (size_t i = 2; i < cmd.size(); i++) {
+        changed = hll_add(ent->hll, cmd[i].data(), cmd[i].size()) || changed;
+    }
+
+    if (changed) {
+        signal_key_modified(conn, ent->key, "pfadd");
+    }
+    return out_int(out, changed ? 1 : 0);
+}
+
+// PFCOUNT key [key ...], the cardinality of the union
+static void do_pfcount(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() == 2) {
+        bool ok = false;
+        Entry *ent = expect_entry(cmd[1], T_HLL, ok);
+        if (!ok) {
+            return out_err(out, ERR_BAD_TYPE, "expected hll");
+        }
+        return out_int(out, ent ? (int64_t)hll_count(ent->hll) : 0);
+    }
+
+    HLL merged;
+    for (size_t i = 1; i < cmd.size(); i++) {
+        bool ok = false;
+        Entry *ent = expect_entry(cmd[i], T_HLL, ok);
+        if (!ok) {
+            hll_clear(&merged);
+            return out_err(out, ERR_BAD_TYPE, "expected hll");
+        }
+        if (ent) {
+            hll_merge(&merged, ent->hll);
+        }
+    }
+
+    uint64_t card = hll_count(&merged);
+    hll_clear(&merged);
+    return out_int(out, (int64_t)card);
+}
+
+// PFMERGE dest [src ...], dest becomes the union of itself and the sources
+static void do_pfmerge(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    std::vector<Entry *> srcs;
+    for (size_t i = 1; i < cmd.size(); i++) {
+        bool ok = false;
+        Entry *ent = expect_entry(cmd[i], T_HLL, ok);
+        if (!ok) {
+            return out_err(out, ERR_BAD_TYPE, "expected hll");
+        }
+        if (ent && i > 1) {
+            srcs.push_back(ent);
+        }
+    }
+
+    bool ok = false;
+    Entry *dst = expect_entry(cmd[1], T_HLL, ok);
+    if (!dst) {
+        dst = entry_insert(cmd[1], T_HLL);
+    }
+    for (Entry *src : srcs) {
+        if (src != dst) {
+            hll_merge(dst->hll, src->hll);
+        }
+    }
+
+    signal_key_modified(conn, dst->key, "pfmerge");
+    return out_nil(out);
+}
+
+// PFSETREGS and BF.LOADCHUNK write raw sketch state, only the snapshot of the leader or of the
+// node migrating the slot of the key may send them
+static bool conn_sends_snapshot(Conn *conn, const std::string &key) {
+    if (conn->repl_role == REPL_LEADER) {
+        return true;
+    }
+    return conn->cluster.import_slot >= 0 && (int32_t)key_slot(key) == conn->cluster.import_slot;
+}
+
+// PFSETREGS key (u16 index, u8 value)..., raises registers, used to transfer sketches in snapshots
+static void do_pfsetregs(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    if (!conn_sends_snapshot(conn, cmd[1])) {
+        return out_err(out, ERR_BAD_ARG, "only accepted from the leader or a migration link");
+    }
+    const std::string &regs = cmd[2];
+    if (regs.size() % 3 != 0) {
+        return out_err(out, ERR_BAD_ARG, "expected (index, value) triples");
+    }
+
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_HLL, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected hll");
+    }
+    if (!ent) {
+        ent = entry_insert(cmd[1], T_HLL);
+    }
+
+    for (size_t i = 0; i < regs.size(); i += 3) {
+        uint16_t idx = 0;
+        memcpy(&idx, &regs[i], 2);
+        uint8_t val = (uint8_t)regs[i + 2];
+        if (idx < k_hll_registers && val <= 64 - k_hll_p + 1) {
+            hll_set_register(ent->hll, idx, val);
+        }
+    }
+    return out_nil(out);
+}
+
+// BF.RESERVE key error_rate capacity
+static void do_bf_reserve(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    double error = 0;
+    int64_t capacity = 0;
+    if (!str2dbl(cmd[2], error) || error < k_bloom_min_error || error >= 1) {
+        return out_err(out, ERR_BAD_ARG, "expected error rate between 1e-9 and 1");
+    }
+    if (!str2int(cmd[3], capacity) || capacity <= 0 || (uint64_t)capacity > k_bloom_max_capacity) {
+        return out_err(out, ERR_BAD_ARG, "expected capacity between 1 and 2^32");
+    }
+
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_BLOOM, ok);
+    if (!ok || ent) {
+        return out_err(out, ERR_BAD_ARG, "key exists");
+    }
+    Bloom bf;
+    if (!bloom_init(&bf, error, (uint64_t)capacity)) {
+        return out_err(out, ERR_TOO_BIG, "filter too large");
+    }
+
+    ent = entry_insert(cmd[1], T_BLOOM);
+    *ent->bloom = bf;
+    signal_key_modified(conn, ent->key, "bf.reserve");
+    return out_nil(out);
+}
+
+// NULL on a type error, creates the filter with the default parameters
+static Entry *bloom_for_add(std::string &key) {
+    bool ok = false;
+    Entry *ent = expect_entry(key, T_BLOOM, ok);
+    if (ok && !ent) {
+        ent = entry_insert(key, T_BLOOM);
+        bloom_init(ent->bloom, k_bloom_default_error, k_bloom_default_capacity);
+    }
+    return ent;
+}
+
+// BF.ADD key item, 1 if the item was not present
+static void do_bf_add(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = bloom_for_add(cmd[1]);
+    if (!ent) {
+        return out_err(out, ERR_BAD_TYPE, "expected bloom");
+    }
+
+    bool added = bloom_add(ent->bloom, cmd[2].data(), cmd[2].size());
+    if (added) {
+        signal_key_modified(conn, ent->key, "bf.add");
+    }
+    return out_int(out, added ? 1 : 0);
+}
+
+// BF.MADD key item [item ...]
+static void do_bf_madd(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = bloom_for_add(cmd[1]);
+    if (!ent) {
+        return out_err(out, ERR_BAD_TYPE, "expected bloom");
+    }
+
+    size_t n = cmd.size() - 2;
+    std::vector<const char *> items(n);
+    std::vector<size_t> lens(n);
+    for (size_t i = 0; i < n; i++) {
+        items[i] = cmd[i + 2].data();
+        lens[i] = cmd[i + 2].size();
+    }
+    bool *added = new bool[n];
+    bloom_add_many(ent->bloom, items.data(), lens.data(), n, added);
+
+    bool any = false;
+    out_arr(out, (uint32_t)n);
+    for (size_t i = 0; i < n; i++) {
+        out_int(out, added[i] ? 1 : 0);
+        any = any || added[i];
+    }
+    delete[] added;
+    if (any) {
+        signal_key_modified(conn, ent->key, "bf.madd");
+    }
+}
+
+static void do_bf_exists(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_BLOOM, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected bloom");
+    }
+    return out_int(out, ent && bloom_exists(ent->bloom, cmd[2].data(), cmd[2].size()) ? 1 : 0);
+}
+
+// BF.LOADCHUNK key layer count offset bytes, used to transfer filters in snapshots
+static void do_bf_loadchunk(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    if (!conn_sends_snapshot(conn, cmd[1])) {
+        return out_err(out, ERR_BAD_ARG, "only accepted from the leader or a migration link");
+    }
+    int64_t layer = 0, count = 0, offset = 0;
+    if (!str2int(cmd[2], layer) || !str2int(cmd[3], count) || !str2int(cmd[4], offset)
+        || layer < 0 || layer > 63 || count < 0 || offset < 0)
+    {
+        return out_err(out, ERR_BAD_ARG, "expected int");
+    }
+
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_BLOOM, ok);
+    if (!ent) {
+        return out_err(out, ERR_BAD_ARG, "expected a reserved bloom filter");
+    }
+
+    Bloom *bf = ent->bloom;
+    if ((uint64_t)layer > bf->nlayers) {
+        return out_err(out, ERR_BAD_ARG, "layers must be loaded in order");
+    }
+    if ((uint64_t)layer == bf->nlayers && !bloom_add_layer(bf)) {
+        return out_err(out, ERR_TOO_BIG, "filter too large");
+    }
+
+    BloomLayer *l = &bf->layers[layer];
+    const std::string &data = cmd[5];
+    if ((uint64_t)offset + data.size() > l->nbits / 8) {
+        return out_err(out, ERR_BAD_ARG, "chunk out of range");
+    }
+    memcpy((uint8_t *)l->bits + offset, data.data(), data.size());
+    l->count = (uint64_t)count;
+    return out_nil(out);
+}
+
+// Bitmaps
+//
+// Bit commands work on string values, bit 0 being the most significant bit of the first byte.
+// BITCOUNT and BITOP use AVX2 when the CPU has it, see bitops.cpp. A BITOP over at least
+// k_bitop_bg_bytes of input runs on the thread pool, see bitop_submit().
+
+const uint64_t k_max_bit_offset = ((uint64_t)1 << 32) - 1;     // 512 MB strings
+const size_t k_bitop_bg_bytes = 1 << 20;
+
+static bool parse_bit_offset(const std::string &s, uint64_t &off) {
+    int64_t val = 0;
+    if (!str2int(s, val) || val < 0 || (uint64_t)val > k_max_bit_offset) {
+        return false;
+    }
+    off = (uint64_t)val;
+    return true;
+}
+
+// SETBIT key offset 0|1, the old bit, the string grows with zero bytes
+static void do_setbit(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    uint64_t off = 0;
+    if (!parse_bit_offset(cmd[2], off)) {
+        return out_err(out, ERR_BAD_ARG, "bit offset is not an integer or out of range");
+    }
+    if (cmd[3] != "0" && cmd[3] != "1") {
+        return out_err(out, ERR_BAD_ARG, "bit is not 0 or 1");
+    }
+
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_STR, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected string");
+    }
+    if (!ent) {
+        ent = entry_insert(cmd[1], T_STR);
+    }
+
+    std::string &s = str_bytes(ent);
+    size_t byte = (size_t)(off >> 3);
+    if (s.size() <= byte) {
+        s.resize(byte + 1, '\0');
+    }
+
+    uint8_t mask = (uint8_t)(0x80 >> (off & 7));
+    uint8_t b = (uint8_t)s[byte];
+    bool old = (b & mask) != 0;
+    s[byte] = (char)(cmd[3] == "1" ? (b | mask) : (b & ~mask));
+    signal_key_modified(conn, ent->key, "setbit");
+    return out_int(out, old ? 1 : 0);
+}
+
+// GETBIT key offset
+static void do_getbit(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    uint64_t off = 0;
+    if (!parse_bit_offset(cmd[2], off)) {
+        return out_err(out, ERR_BAD_ARG, "bit offset is not an integer or out of range");
+    }
+
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_STR, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected string");
+    }
+
+    std::string buf;
+    size_t len = 0;
+    const char *s = ent ? str_view(ent, buf, len) : NULL;
+    size_t byte = (size_t)(off >> 3);
+    if (len <= byte) {
+        return out_int(out, 0);
+    }
+    return out_int(out, ((uint8_t)s[byte] & (0x80 >> (off & 7))) ? 1 : 0);
+}
+
+// byte range [start, end] of a string of `len` bytes, negative indexes count from the end
+static bool byte_range(int64_t start, int64_t end, size_t len, size_t &from, size_t &to) {
+    int64_t n = (int64_t)len;
+    if (start < 0) {
+        start = std::max<int64_t>(start + n, 0);
+    }
+    if (end < 0) {
+        end += n;
+    }
+    end = std::min(end, n - 1);
+    if (start > end) {
+        return false;                           // empty
+    }
+
+    from = (size_t)start;
+    to = (size_t)end + 1;
+    return true;
+}
+
+// BITCOUNT key [start end], over a range of bytes
+static void do_bitcount(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    int64_t start = 0, end = -1;
+    if (cmd.size() == 3 || cmd.size() > 4) {
+        return out_err(out, ERR_BAD_ARG, "expected BITCOUNT key [start end]");
+    }
+    if (cmd.size() == 4 && (!str2int(cmd[2], start) || !str2int(cmd[3], end))) {
+        return out_err(out, ERR_BAD_ARG, "expected int");
+    }
+
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_STR, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected string");
+    }
+
+    std::string buf;
+    size_t len = 0;
+    const char *s = ent ? str_view(ent, buf, len) : NULL;
+    size_t from = 0, to = 0;
+    if (!ent || !byte_range(start, end, len, from, to)) {
+        return out_int(out, 0);
+    }
+    return out_int(out, (int64_t)bit_count((const uint8_t *)s + from, to - from));
+}
+
+// BITPOS key 0|1 [start [end]], the first bit set or clear in a range of bytes, or -1
+static void do_bitpos(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    int64_t start = 0, end = -1;
+    if (cmd.size() > 5) {
+        return out_err(out, ERR_BAD_ARG, "expected BITPOS key bit [start [end]]");
+    }
+    if (cmd[2] != "0" && cmd[2] != "1") {
+        return out_err(out, ERR_BAD_ARG, "bit is not 0 or 1");
+    }
+    if ((cmd.size() > 3 && !str2int(cmd[3], start)) || (cmd.size() > 4 && !str2int(cmd[4], end))) {
+        return out_err(out, ERR_BAD_ARG, "expected int");
+    }
+    bool bit = cmd[2] == "1";
+
+    bool ok = false;
+    Entry *ent = expect_entry(cmd[1], T_STR, ok);
+    if (!ok) {
+        return out_err(out, ERR_BAD_TYPE, "expected string");
+    }
+    if (!ent) {
+        return out_int(out, bit ? -1 : 0);      // a missing key is all zeros
+    }
+
+    std::string buf;
+    size_t len = 0;
+    const char *s = str_view(ent, buf, len);
+    size_t from = 0, to = 0;
+    if (!byte_range(start, end, len, from, to)) {
+        return out_int(out, -1);
+    }
+
+    int64_t pos = bit_pos((const uint8_t *)s + from, to - from, bit);
+    if (pos >= 0) {
+        return out_int(out, pos + (int64_t)from * 8);
+    }
+    // without an explicit end the string is taken as padded with zeros on the right
+    return out_int(out, !bit && cmd.size() < 5 ? (int64_t)to * 8 : -1);
+}
+
+static bool parse_bitop(const std::string &s, uint32_t &op) {
+    static const char *names[] = {"and", "or", "xor", "not"};
+    for (uint32_t i = 0; i < 4; i++) {
+        if (s == names[i]) {
+            op = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void bitop_run(uint32_t op, const std::vector<const uint8_t *> &srcs, const std::vector<size_t> &lens,
+    std::string &result)
+{
+    size_t len = *std::max_element(lens.begin(), lens.end());
+    result.assign(len, '\0');
+    bit_op(op, (uint8_t *)&result[0], len, srcs.data(), lens.data(), srcs.size());
+}
+
+// the result replaces `dest` whatever its type, an empty result deletes it
+static void bitop_store(Conn *by, const std::string &dest, std::string &result) {
+    LookupKey key;
+    key.key = dest;
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    Entry *ent = node ? container_of(node, Entry, node) : NULL;
+    if (ent && (ent->type != T_STR || result.empty())) {
+        hm_delete(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+        ent = NULL;
+    }
+
+    if (result.empty()) {
+        if (node) {
+            signal_key_modified(by, dest, "del");
+        }
+        return;
+    }
+    if (!ent) {
+        ent = entry_insert(key.key, T_STR);
+    }
+    str_set(ent, result);
+    signal_key_modified(by, ent->key, "set");
+}
+
+static void bitop_submit(Conn *conn, uint32_t op, std::vector<std::string> &cmd,
+    std::vector<const uint8_t *> &srcs, std::vector<size_t> &lens, std::vector<std::string> &copies);
+
+// BITOP and|or|xor|not dest key [key ...], the length of the result, missing keys are empty strings
+static void do_bitop(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    uint32_t op = 0;
+    if (!parse_bitop(cmd[1], op)) {
+        return out_err(out, ERR_BAD_ARG, "expected and, or, xor or not");
+    }
+    if (op == BITOP_NOT && cmd.size() != 4) {
+        return out_err(out, ERR_BAD_ARG, "BITOP NOT takes a single source key");
+    }
+
+    // sources that are not raw strings are read from copies, sized up front so they don't move
+    std::vector<std::string> copies(cmd.size() - 3);
+    std::vector<const uint8_t *> srcs;
+    std::vector<size_t> lens;
+    size_t total = 0;
+    for (size_t i = 3; i < cmd.size(); i++) {
+        bool ok = false;
+        Entry *ent = expect_entry(cmd[i], T_STR, ok);
+        if (!ok) {
+            return out_err(out, ERR_BAD_TYPE, "expected string");
+        }
+        size_t len = 0;
+        srcs.push_back(ent ? (const uint8_t *)str_view(ent, copies[i - 3], len) : NULL);
+        lens.push_back(len);
+        total += len;
+    }
+
+    // replicas, the replication stream and transactions apply it in order, without the thread pool
+    if (total >= k_bitop_bg_bytes && !g_repl.is_replica && conn->repl_role == REPL_NONE && !conn->tx.in_exec) {
+        return bitop_submit(conn, op, cmd, srcs, lens, copies);
+    }
+
+    std::string result;
+    bitop_run(op, srcs, lens, result);
+    int64_t len = (int64_t)result.size();
+    bitop_store(conn, cmd[2], result);
+    return out_int(out, len);
+}
+
+static void do_expire(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    int64_t ttl_ms = 0;
+    if (!str2int(cmd[2], ttl_ms)) {
+        return out_err(out, ERR_BAD_ARG, "expected int");
+    }
+
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (node) {
+        Entry *ent = container_of(node, Entry, node);
+        entry_set_ttl(ent, ttl_ms);
+        signal_key_modified(conn, ent->key, "expire");
+    }
+
+    return out_int(out, node ? 1 : 0);
+}
+
+static void do_ttl(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (!node) {
+        return out_int(out, -2);    // not found
+    }
+
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->heap_idx == (size_t)-1) {
+        return out_int(out, -1);    // no TTL
+    }
+
+    uint64_t expire_time = g_data.heap[ent->heap_idx].val;
+    uint64_t now_ms = g_data.now_ms;
+    return out_int(out, expire_time > now_ms ? (expire_time - now_ms) : 0);
+}
+
+static void do_info(Conn *, std::vector<std::string> &cmd, Buffer &out);
+static void do_config(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_slowlog(Conn *, std::vector<std::string> &cmd, Buffer &out);
+static void do_stalllog(Conn *, std::vector<std::string> &cmd, Buffer &out);
+static void do_psync(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_replicaof(Conn *, std::vector<std::string> &cmd, Buffer &out);
+static void do_subscribe(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_unsubscribe(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_psubscribe(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_punsubscribe(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_publish(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_client(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_blpop(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_brpop(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_multi(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_exec(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_discard(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_watch(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_unwatch(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_eval(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_evalsha(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_script(Conn *, std::vector<std::string> &cmd, Buffer &out);
+static void do_cluster(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_asking(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_ping(Conn *, std::vector<std::string> &cmd, Buffer &out);
+static void do_hello(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+static void do_hotkeys(Conn *, std::vector<std::string> &cmd, Buffer &out);
+static void do_bigkeys(Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+
+enum {
+    CMD_WRITE    = 1 << 0,                      // modifies the keyspace, replicated
+    CMD_READ     = 1 << 1,                      // reads the key in cmd[1], for client tracking
+    CMD_NOFEED   = 1 << 2,                      // write command that replicates its effects itself
+    CMD_TX       = 1 << 3,                      // runs right away after MULTI instead of being queued
+    CMD_NOSCRIPT = 1 << 4,                      // can't be called from a script
+    CMD_NUMKEYS  = 1 << 5,                      // cmd[2] is the number of keys, which follow it
+    CMD_SUBCMD   = 1 << 6,                      // cmd[1] is a subcommand, matched in lowercase
+};
+
+struct Command {
+    const char *name;
+    int arity;                                  // number of args including the name, -N means at least N
+    uint32_t flags;
+    int first_key;                              // keys are cmd[first_key..last_key], 0 if none
+    int last_key;                               // negative counts from the end, -1 is the last arg
+    void (*f)(Conn *, std::vector<std::string> &, Buffer &);
+};
+
+static const Command k_commands[] = {
+    {"get", 2, CMD_READ, 1, 1, &do_get},
+    {"set", 3, CMD_WRITE, 1, 1, &do_set},
+    {"del", 2, CMD_WRITE, 1, 1, &do_del},
+    {"incr", 2, CMD_WRITE, 1, 1, &do_incr},
+    {"decr", 2, CMD_WRITE, 1, 1, &do_decr},
+    {"incrby", 3, CMD_WRITE, 1, 1, &do_incrby},
+    {"decrby", 3, CMD_WRITE, 1, 1, &do_decrby},
+    {"incrbyfloat", 3, CMD_WRITE | CMD_NOFEED, 1, 1, &do_incrbyfloat},
+    {"pexpire", 3, CMD_WRITE, 1, 1, &do_expire},
+    {"pttl", 2, CMD_READ, 1, 1, &do_ttl},
+    {"keys", 1, 0, 0, 0, &do_keys},
+    {"zadd", 4, CMD_WRITE, 1, 1, &do_zadd},
+    {"zrem", 3, CMD_WRITE, 1, 1, &do_zrem},
+    {"zscore", 3, CMD_READ, 1, 1, &do_zscore},
+    {"zquery", 6, CMD_READ, 1, 1, &do_zquery},
+    {"hset", -4, CMD_WRITE, 1, 1, &do_hset},
+    {"hget", 3, CMD_READ, 1, 1, &do_hget},
+    {"hmget", -3, CMD_READ, 1, 1, &do_hmget},
+    {"hdel", -3, CMD_WRITE, 1, 1, &do_hdel},
+    {"hlen", 2, CMD_READ, 1, 1, &do_hlen},
+    {"hincrby", 4, CMD_WRITE, 1, 1, &do_hincrby},
+    {"hgetall", 2, CMD_READ, 1, 1, &do_hgetall},
+    {"lpush", -3, CMD_WRITE, 1, 1, &do_lpush},
+    {"rpush", -3, CMD_WRITE, 1, 1, &do_rpush},
+    {"lpop", 2, CMD_WRITE, 1, 1, &do_lpop},
+    {"rpop", 2, CMD_WRITE, 1, 1, &do_rpop},
+    {"llen", 2, CMD_READ, 1, 1, &do_llen},
+    {"lrange", 4, CMD_READ, 1, 1, &do_lrange},
+    {"blpop", -3, CMD_WRITE | CMD_NOFEED, 1, -2, &do_blpop},
+    {"brpop", -3, CMD_WRITE | CMD_NOFEED, 1, -2, &do_brpop},
+    {"pfadd", -2, CMD_WRITE, 1, 1, &do_pfadd},
+    {"pfcount", -2, CMD_READ, 1, -1, &do_pfcount},
+    {"pfmerge", -2, CMD_WRITE, 1, -1, &do_pfmerge},
+    {"pfsetregs", 3, CMD_WRITE, 1, 1, &do_pfsetregs},
+    {"bf.reserve", 4, CMD_WRITE, 1, 1, &do_bf_reserve},
+    {"bf.add", 3, CMD_WRITE, 1, 1, &do_bf_add},
+    {"bf.madd", -3, CMD_WRITE, 1, 1, &do_bf_madd},
+    {"bf.exists", 3, CMD_READ, 1, 1, &do_bf_exists},
+    {"bf.loadchunk", 6, CMD_WRITE, 1, 1, &do_bf_loadchunk},
+    {"setbit", 4, CMD_WRITE, 1, 1, &do_setbit},
+    {"getbit", 3, CMD_READ, 1, 1, &do_getbit},
+    {"bitcount", -2, CMD_READ, 1, 1, &do_bitcount},
+    {"bitpos", -3, CMD_READ, 1, 1, &do_bitpos},
+    {"bitop", -4, CMD_WRITE, 2, -1, &do_bitop},
+    {"info", -1, 0, 0, 0, &do_info},
+    {"config", -3, CMD_SUBCMD, 0, 0, &do_config},
+    {"slowlog", -2, CMD_SUBCMD, 0, 0, &do_slowlog},
+    {"stalllog", -2, CMD_SUBCMD, 0, 0, &do_stalllog},
+    {"psync", 3, CMD_NOSCRIPT, 0, 0, &do_psync},
+    {"replicaof", 3, CMD_NOSCRIPT, 0, 0, &do_replicaof},
+    {"subscribe", -2, CMD_NOSCRIPT, 0, 0, &do_subscribe},
+    {"unsubscribe", -1, CMD_NOSCRIPT, 0, 0, &do_unsubscribe},
+    {"psubscribe", -2, CMD_NOSCRIPT, 0, 0, &do_psubscribe},
+    {"punsubscribe", -1, CMD_NOSCRIPT, 0, 0, &do_punsubscribe},
+    {"publish", 3, 0, 0, 0, &do_publish},
+    {"client", -2, CMD_NOSCRIPT | CMD_SUBCMD, 0, 0, &do_client},
+    {"multi", 1, CMD_TX | CMD_NOSCRIPT, 0, 0, &do_multi},
+    {"exec", 1, CMD_TX | CMD_NOSCRIPT, 0, 0, &do_exec},
+    {"discard", 1, CMD_TX | CMD_NOSCRIPT, 0, 0, &do_discard},
+    {"watch", -2, CMD_TX | CMD_NOSCRIPT, 1, -1, &do_watch},
+    {"unwatch", 1, CMD_TX | CMD_NOSCRIPT, 0, 0, &do_unwatch},
+    {"eval", -3, CMD_WRITE | CMD_NOFEED | CMD_NOSCRIPT | CMD_NUMKEYS, 0, 0, &do_eval},
+    {"evalsha", -3, CMD_WRITE | CMD_NOFEED | CMD_NOSCRIPT | CMD_NUMKEYS, 0, 0, &do_evalsha},
+    {"script", -2, CMD_NOSCRIPT | CMD_SUBCMD, 0, 0, &do_script},
+    {"cluster", -2, CMD_NOSCRIPT | CMD_SUBCMD, 0, 0, &do_cluster},
+    {"asking", 1, CMD_TX | CMD_NOSCRIPT, 0, 0, &do_asking},
+    {"ping", -1, 0, 0, 0, &do_ping},
+    {"hello", -1, CMD_NOSCRIPT, 0, 0, &do_hello},
+    {"hotkeys", -1, 0, 0, 0, &do_hotkeys},
+    {"bigkeys", -1, 0, 0, 0, &do_bigkeys},
+};
+
+const size_t k_num_commands = sizeof(k_commands) / sizeof(k_commands[0]);
+
+struct CmdStats {
+    uint64_t calls = 0;
+    uint64_t usec = 0;
+    Histogram latency_us;
+};
+
+static CmdStats g_cmdstats[k_num_commands];
+
+static const Command *lookup_command(std::vector<std::string> &cmd) {
+    for (size_t i = 0; i < k_num_commands; i++) {
+        const Command *c = &k_commands[i];
+        bool arity_ok = c->arity >= 0 ? cmd.size() == (size_t)c->arity : cmd.size() >= (size_t)-c->arity;
+        if (arity_ok && cmd[0] == c->name) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+// the keys of the command are cmd[first..last], first is 0 if it has none
+static void command_keys(const Command *c, std::vector<std::string> &cmd, size_t &first, size_t &last) {
+    first = (size_t)c->first_key;
+    last = c->last_key < 0 ? cmd.size() - (size_t)-c->last_key : (size_t)c->last_key;
+    if (c->flags & CMD_NUMKEYS) {
+        int64_t numkeys = 0;
+        bool ok = str2int(cmd[2], numkeys) && numkeys >= 0 && (size_t)numkeys <= cmd.size() - 3;
+        first = ok ? 3 : 0;
+        last = ok ? 2 + (size_t)numkeys : 0;
+    }
+}
+
+static void tracking_remember(Conn *conn, const std::string &key);
+static bool keyprof_sample(const Command *c, std::vector<std::string> &cmd);
+static void keyprof_record();
+static void block_serve_ready(Conn *self);
+static void tx_queue(Conn *conn, const Command *c, std::vector<std::string> &cmd, Buffer &out);
+static bool cluster_check(Conn *conn, const Command *c, std::vector<std::string> &cmd, Buffer &out);
+
+// returns the execution time in microseconds
+static uint64_t do_request(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    const Command *c = lookup_command(cmd);
+    if (c && (c->flags & CMD_SUBCMD)) {
+        str_lower(cmd[1]);
+    }
+    if (c && g_cluster.enabled && !conn->tx.in_exec && !cluster_check(conn, c, cmd, out)) {
+        if (conn->tx.multi) {
+            conn->tx.aborted = true;            // queued commands are not checked again by EXEC
+        }
+        return 0;
+    }
+    if (conn->tx.multi && !(c && (c->flags & CMD_TX))) {
+        tx_queue(conn, c, cmd, out);
+        return 0;
+    }
+    if (!c) {
+        out_err(out, ERR_UNKNOWN, "unknown commands");
+        return 0;
+    }
+
+    if (c->flags & CMD_WRITE) {
+        if (g_repl.is_replica && conn->repl_role != REPL_LEADER) {
+            out_err(out, ERR_READONLY, "read-only replica");
+            return 0;
+        }
+        if (!(c->flags & CMD_NOFEED)) {
+            repl_feed(cmd);                     // before the handler consumes the arguments
+        }
+    }
+    if ((c->flags & CMD_READ) && conn->tracking.on && !conn->tracking.bcast) {
+        tracking_remember(conn, cmd[1]);
+    }
+    bool sampled = g_config.hotkeys_sample_rate > 0 && keyprof_sample(c, cmd);
+
+    uint64_t start_us = get_monotonic_usec();
+    conn->last_cmd = c->name;
+    c->f(conn, cmd, out);
+    if (!g_blocking.ready.empty() && !conn->tx.in_exec) {
+        block_serve_ready(conn);
+    }
+    uint64_t elapsed_us = get_monotonic_usec() - start_us;
+
+    CmdStats *st = &g_cmdstats[c - k_commands];
+    st->calls++;
+    st->usec += elapsed_us;
+    hist_record(&st->latency_us, elapsed_us);
+    g_data.stats.total_cmds++;
+    if (sampled) {
+        keyprof_record();                       // after the command, for the sizes it left
+    }
+    return elapsed_us;
+}
+
+// Hot and big keys. The keys of one in hotkeys-sample-rate commands are counted in a top-K
+// sketch, and the size of each sampled key is kept in a top-K of the largest keys of its type.
+// With sampling off a command costs one branch.
+const uint32_t k_keyprof_top = 64;
+const size_t k_keyprof_max_keys = 16;           // sampled from one command
+const uint64_t k_keyprof_decay_samples = 1 << 16;
+
+static struct {
+    uint64_t countdown = 0;                     // commands until the next sample
+    uint64_t rng = 0;
+    uint64_t samples = 0;
+    std::vector<std::string> keys;              // of the command being sampled
+    TopK hot;                                   // sampled accesses, halved every k_keyprof_decay_samples
+    TopK big[T_MAX];                            // sizes by type
+} g_keyprof;
+
+static Entry *key_entry(const std::string &key);
+
+// elements of containers, bytes of strings and sketches
+static uint64_t entry_size(Entry *ent) {
+    switch (ent->type) {
+    case T_STR:
+        if (ent->enc == STR_INT) {
+            return std::to_string(ent->ival).size();
+        }
+        return ent->enc == STR_LZ4 ? (uint64_t)ent->ival : ent->str.size();
+    case T_ZSET:
+        return hm_size(&ent->zset->hmap);
+    case T_HASH:
+        return hash_size(ent->hash);
+    case T_LIST:
+        return ent->list->size;
+    case T_HLL:
+        return hll_bytes(ent->hll);
+    case T_BLOOM:
+        return bloom_bytes(ent->bloom);
+    }
+    return 0;
+}
+
+// true if the keys of this command are sampled, they are copied as the handler may consume them
+static bool keyprof_sample(const Command *c, std::vector<std::string> &cmd) {
+    if (g_keyprof.countdown > 1) {
+        g_keyprof.countdown--;
+        return false;
+    }
+
+    size_t first = 0, last = 0;
+    command_keys(c, cmd, first, last);
+    if (first == 0) {
+        return false;                           // the next command with keys is sampled
+    }
+
+    // a random gap with the configured mean, so periodic traffic isn't sampled in step
+    uint64_t rate = (uint64_t)g_config.hotkeys_sample_rate;
+    uint64_t z = (g_keyprof.rng += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    g_keyprof.countdown = 1 + (z ^ (z >> 31)) % (2 * rate - 1);
+
+    last = std::min(last, first + k_keyprof_max_keys - 1);
+    g_keyprof.keys.assign(cmd.begin() + first, cmd.begin() + last + 1);
+    return true;
+}
+
+// a key that was deleted or changed type leaves the size lists
+static void keyprof_size(const std::string &key) {
+    Entry *ent = key_entry(key);
+    for (uint32_t t = T_STR; t < T_MAX; t++) {
+        if (ent && ent->type == t) {
+            topk_set(&g_keyprof.big[t], key.data(), key.size(), entry_size(ent));
+        } else {
+            topk_del(&g_keyprof.big[t], key.data(), key.size());
+        }
+    }
+}
+
+static void keyprof_record() {
+    for (const std::string &key : g_keyprof.keys) {
+        if (g_keyprof.hot.k == 0) {
+            topk_init(&g_keyprof.hot, k_keyprof_top);
+            for (TopK &tk : g_keyprof.big) {
+                topk_init(&tk, k_keyprof_top);
+            }
+        }
+        topk_incr(&g_keyprof.hot, key.data(), key.size(), 1);
+        keyprof_size(key);
+    }
+    if (++g_keyprof.samples % k_keyprof_decay_samples == 0) {
+        topk_decay(&g_keyprof.hot);
+    }
+}
+
+static bool parse_count(std::vector<std::string> &cmd, size_t i, size_t &count) {
+    int64_t val = k_keyprof_top;
+    if (i < cmd.size() && (!str2int(cmd[i], val) || val <= 0)) {
+        return false;
+    }
+    count = (size_t)val;
+    return true;
+}
+
+// HOTKEYS [count] | HOTKEYS RESET, the most sampled keys as [key, samples]
+static void do_hotkeys(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() == 2) {
+        str_lower(cmd[1]);
+    }
+    if (cmd.size() == 2 && cmd[1] == "reset") {
+        topk_clear(&g_keyprof.hot);
+        for (TopK &tk : g_keyprof.big) {
+            topk_clear(&tk);
+        }
+        g_keyprof.samples = 0;
+        return out_nil(out);
+    }
+
+    size_t count = 0;
+    if (cmd.size() > 2 || !parse_count(cmd, 1, count)) {
+        return out_err(out, ERR_BAD_ARG, "expected HOTKEYS [count] or HOTKEYS RESET");
+    }
+
+    std::vector<std::pair<std::string, uint64_t>> list;
+    topk_list(&g_keyprof.hot, list);
+    count = std::min(count, list.size());
+    out_arr(out, (uint32_t)count);
+    for (size_t i = 0; i < count; i++) {
+        out_arr(out, 2);
+        out_str(out, list[i].first.data(), list[i].first.size());
+        out_int(out, (int64_t)list[i].second);
+    }
+}
+
+// BIGKEYS [count], for each type the largest sampled keys as [key, size], sizes are refreshed
+static void do_bigkeys(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    size_t count = 0;
+    if (cmd.size() > 2 || !parse_count(cmd, 1, count)) {
+        return out_err(out, ERR_BAD_ARG, "expected BIGKEYS [count]");
+    }
+
+    std::vector<std::pair<std::string, uint64_t>> lists[T_MAX];
+    for (uint32_t t = T_STR; t < T_MAX; t++) {
+        topk_list(&g_keyprof.big[t], lists[t]);
+        for (const std::pair<std::string, uint64_t> &it : lists[t]) {
+            keyprof_size(it.first);
+        }
+    }
+
+    resp_hint(conn, out, RESP_MAP);
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    for (uint32_t t = T_STR; t < T_MAX; t++) {
+        topk_list(&g_keyprof.big[t], lists[t]);
+        if (lists[t].empty()) {
+            continue;
+        }
+
+        size_t limit = std::min(count, lists[t].size());
+        out_str(out, k_type_names[t], strlen(k_type_names[t]));
+        out_arr(out, (uint32_t)limit);
+        for (size_t i = 0; i < limit; i++) {
+            out_arr(out, 2);
+            out_str(out, lists[t][i].first.data(), lists[t][i].first.size());
+            out_int(out, (int64_t)lists[t][i].second);
+        }
+        n += 2;
+    }
+    out_end_arr(out, ctx, n);
+}
+
+// Active defragmentation. After long churn the heap is full of holes that malloc() cannot give
+// back to the OS. When activedefrag is on and RSS exceeds the allocated bytes by both
+// active-defrag-threshold-pct and active-defrag-ignore-bytes, a pass walks the keyspace for up to
+// active-defrag-budget-us per loop iteration, and no more than active-defrag-cycle-pct of each
+// 100 ms window, so an idle server does not spin on it. It moves entries, their strings, sorted set nodes
+// and hash table bucket arrays into fresh blocks, fixing the pointers to them: hash chains, AVL
+// links, TTL heap refs and cluster slot lists.
+//
+// glibc tells nothing about how full a page is, so the pass walks the keyspace twice: the first
+// walk counts the live bytes of each page, the second moves an object off a page less than half
+// full if malloc() gives it a block on a fuller page. Pages emptied that way are handed back to
+// the OS by malloc_trim() at the end of the pass.
+//
+// Keys pinned by background jobs are skipped, as they are used outside the event loop, and no
+// pass runs while a snapshot child shares the pages. A resize of the keyspace during a pass can
+// make it skip or revisit some keys, which is harmless.
+const size_t k_defrag_zset_batch = 64;          // nodes between clock checks
+const size_t k_defrag_max_size = 64 << 10;      // larger blocks are mmap()ed and do not fragment
+const size_t k_defrag_max_buckets = k_defrag_max_size / sizeof(HNode *);
+const size_t k_defrag_page = 4096;
+const size_t k_defrag_max_spare = 16 << 10;     // blocks
+const uint64_t k_defrag_window_ms = 100;
+
+struct DefragPage {
+    HNode node;
+    uintptr_t page = 0;
+    size_t bytes = 0;                           // of live keyspace objects
+};
+
+static struct {
+    bool running = false;
+    bool moving = false;                        // the second walk of the pass
+    uint64_t check_ms = 0;                      // last check whether a pass is due
+    uint64_t start_us = 0;
+    uint64_t window_ms = 0;                     // start of the current duty cycle window
+    uint64_t window_us = 0;                     // spent in it
+    size_t cursor = 0;                          // bucket of g_data.db
+    std::vector<std::string> zsets;             // keys of the current bucket, nodes still to walk
+    bool zset_started = false;
+    double zset_score = 0;                      // next node of zsets.back()
+    std::string zset_name;
+    HMap pages;                                 // DefragPage
+    std::vector<void *> spare;                  // rejected malloc() blocks, see defrag_better()
+    std::vector<void *> spare_ents;             // rejected operator new blocks
+    std::vector<std::string> spare_strs;
+    // stats
+    uint64_t passes = 0;
+    uint64_t hits = 0;                          // objects moved
+    uint64_t misses = 0;                        // not moved, no block on a fuller page
+    double ratio_before = 0;                    // of the last pass
+    double ratio_after = 0;
+    uint64_t last_pass_ms = 0;
+} g_defrag;
+
+static size_t mem_used() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+static size_t mem_rss() {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) {
+        return 0;
+    }
+    unsigned long long size = 0, resident = 0;
+    if (fscanf(f, "%llu %llu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(f);
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static double mem_frag_ratio(size_t used, size_t rss) {
+    return used ? (double)rss / (double)used : 0;
+}
+
+static void info_line(std::string &s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void info_line(std::string &s, const char *fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    s.append(buf, n < (int)sizeof(buf) ? n : sizeof(buf) - 1);
+    s.append("\r\n");
+}
+
+// INFO [section]: server, clients, memory, stats, replication, keyspace, commandstats
+static void do_info(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() > 2) {
+        return out_err(out, ERR_BAD_ARG, "too many arguments");
+    }
+
+    const std::string section = cmd.size() > 1 ? cmd[1] : "all";
+    bool all = section == "all";
+    uint64_t now_ms = g_data.now_ms;
+    std::string s;
+
+    if (all || section == "server") {
+        s.append("# Server\r\n");
+        info_line(s, "uptime_in_seconds:%llu", (unsigned long long)(now_ms - g_data.stats.start_ms) / 1000);
+        info_line(s, "event_loop_iterations:%llu", (unsigned long long)g_data.stats.loop_iters);
+        info_line(s, "event_loop_last_us:%llu", (unsigned long long)g_data.stats.loop_last_us);
+        info_line(s, "event_loop_p50_us:%llu", (unsigned long long)hist_percentile(&g_data.stats.loop_us, 0.5));
+        info_line(s, "event_loop_p99_us:%llu", (unsigned long long)hist_percentile(&g_data.stats.loop_us, 0.99));
+        info_line(s, "event_loop_max_us:%llu", (unsigned long long)g_data.stats.loop_us.max);
+        info_line(s, "thread_pool_queue_depth:%zu", thread_pool_pending(&g_data.thread_pool));
+        info_line(s, "background_jobs:%zu", g_bg.inflight);
+        info_line(s, "bitops_impl:%s", bitops_impl());
+        info_line(s, "scripts_cached:%zu", g_scripts.cache.size());
+        std::string names;
+        for (const Listener &l : g_listen.list) {
+            names += (names.empty() ? "" : ",") + l.name;
+        }
+        info_line(s, "listeners:%s", names.c_str());
+    }
+
+    if (all || section == "clients") {
+        s.append("# Clients\r\n");
+        info_line(s, "connected_clients:%zu", g_data.nconns);
+        info_line(s, "total_connections_received:%llu", (unsigned long long)g_data.stats.total_conns);
+        info_line(s, "pubsub_channels:%zu", hm_size(&g_pubsub.channels));
+        info_line(s, "pubsub_patterns:%zu", hm_size(&g_pubsub.patterns));
+        info_line(s, "tracking_clients:%zu", g_tracking.nclients);
+        info_line(s, "blocked_clients:%zu", g_blocking.nblocked);
+        info_line(s, "connection_timers:%zu", g_data.timers.size);
+    }
+
+    if (all || section == "memory") {
+        size_t conn_bytes = 0, client_mem = 0;
+        for (Conn *conn : g_data.fd2conn) {
+            if (conn) {
+                conn_bytes += conn->incoming.capacity() + conn->outgoing.capacity() + conn->sending.capacity()
+                    + conn->outq_bytes;
+                client_mem += conn_memory(conn);
+            }
+        }
+
+        size_t used = mem_used(), rss = mem_rss();
+        s.append("# Memory\r\n");
+        info_line(s, "used_memory:%zu", used);
+        info_line(s, "used_memory_rss:%zu", rss);
+        info_line(s, "mem_fragmentation_ratio:%.2f", mem_frag_ratio(used, rss));
+        info_line(s, "active_defrag_running:%d", g_defrag.running ? 1 : 0);
+        info_line(s, "client_buffer_bytes:%zu", conn_bytes);
+        info_line(s, "client_memory:%zu", client_mem);
+    }
+
+    if (all || section == "stats") {
+        s.append("# Stats\r\n");
+        info_line(s, "total_commands_processed:%llu", (unsigned long long)g_data.stats.total_cmds);
+        info_line(s, "instantaneous_ops_per_sec:%llu", (unsigned long long)g_data.stats.ops_per_sec);
+        info_line(s, "accept_wakeups:%llu", (unsigned long long)g_listen.accept_wakeups);
+        info_line(s, "client_output_limit_disconnections:%llu", (unsigned long long)g_data.output_limit_closes);
+        info_line(s, "client_read_pauses:%llu", (unsigned long long)g_data.read_pauses);
+        info_line(s, "idle_timeout_disconnections:%llu", (unsigned long long)g_data.idle_closes);
+        info_line(s, "hotkeys_samples:%llu", (unsigned long long)g_keyprof.samples);
+        info_line(s, "active_defrag_passes:%llu", (unsigned long long)g_defrag.passes);
+        info_line(s, "active_defrag_hits:%llu", (unsigned long long)g_defrag.hits);
+        info_line(s, "active_defrag_misses:%llu", (unsigned long long)g_defrag.misses);
+        info_line(s, "active_defrag_last_ratio_before:%.2f", g_defrag.ratio_before);
+        info_line(s, "active_defrag_last_ratio_after:%.2f", g_defrag.ratio_after);
+        info_line(s, "active_defrag_last_pass_ms:%llu", (unsigned long long)g_defrag.last_pass_ms);
+        info_line(s, "pubsub_messages_delivered:%llu", (unsigned long long)g_pubsub.messages);
+        info_line(s, "tracking_keys:%zu", hm_size(&g_tracking.keys));
+        info_line(s, "tracking_prefixes:%zu", g_tracking.prefixes.size());
+        info_line(s, "tracking_invalidations:%llu", (unsigned long long)g_tracking.invalidations);
+    }
+
+    if (all || section == "replication") {
+        s.append("# Replication\r\n");
+        info_line(s, "role:%s", g_repl.is_replica ? "replica" : "leader");
+        info_line(s, "replid:%s", g_repl.replid);
+        info_line(s, "repl_offset:%llu", (unsigned long long)g_repl.offset);
+        if (g_repl.is_replica) {
+            info_line(s, "leader_host:%s", g_repl.leader_host.c_str());
+            info_line(s, "leader_port:%u", (unsigned)g_repl.leader_port);
+            info_line(s, "leader_link_status:%s", k_link_state_names[g_repl.link_state]);
+        }
+
+        info_line(s, "connected_replicas:%zu", g_repl.replicas.size());
+        for (size_t i = 0; i < g_repl.replicas.size(); i++) {
+            const Conn *r = g_repl.replicas[i];
+            info_line(s, "replica%zu:fd=%d,state=%s,pending_bytes=%zu", i, r->fd,
+                k_repl_role_names[r->repl_role], r->outgoing.size() + r->sending.size());
+        }
+        info_line(s, "repl_backlog_size:%zu", g_repl.backlog.size());
+        info_line(s, "repl_backlog_histlen:%zu", g_repl.backlog_histlen);
+        info_line(s, "snapshot_in_progress:%d", g_repl.snapshot_pid > 0 ? 1 : 0);
+    }
+
+    if (g_cluster.enabled && (all || section == "cluster")) {
+        size_t assigned = 0, owned = 0;
+        for (uint32_t slot = 0; slot < k_cluster_slots; slot++) {
+            assigned += g_cluster.owner[slot] >= 0;
+            owned += g_cluster.owner[slot] == 0;
+        }
+        s.append("# Cluster\r\n");
+        info_line(s, "cluster_slots_assigned:%zu", assigned);
+        info_line(s, "cluster_slots_owned:%zu", owned);
+        info_line(s, "cluster_known_nodes:%zu", g_cluster.nodes.size());
+        info_line(s, "migrating_slot:%d", g_cluster.mig.slot);
+        info_line(s, "migrate_keys_inflight:%zu", g_cluster.mig.inflight.size());
+        info_line(s, "migrate_keys_moved:%llu", (unsigned long long)g_cluster.mig.keys_moved);
+    }
+
+    if (all || section == "keyspace") {
+        s.append("# Keyspace\r\n");
+        info_line(s, "keys:%zu", hm_size(&g_data.db));
+        for (uint32_t t = T_STR; t < T_MAX; t++) {
+            info_line(s, "keys_%s:%zu", k_type_names[t], g_data.nkeys[t]);
+        }
+        info_line(s, "expires:%zu", g_data.heap.size());
+        info_line(s, "compressed_strings:%zu", g_data.lz4.nkeys);
+        info_line(s, "compressed_raw_bytes:%zu", g_data.lz4.raw_bytes);
+        info_line(s, "compressed_bytes:%zu", g_data.lz4.bytes);
+        info_line(s, "buckets:%zu", hm_buckets(&g_data.db));
+        info_line(s, "rehashing:%d", g_data.db.old_table.table ? 1 : 0);
+    }
+
+    if (all || section == "commandstats") {
+        s.append("# Commandstats\r\n");
+        for (size_t i = 0; i < k_num_commands; i++) {
+            const CmdStats *st = &g_cmdstats[i];
+            if (st->calls == 0) {
+                continue;       // keep the reply small
+            }
+
+            info_line(s, "cmdstat_%s:calls=%llu,usec=%llu,usec_per_call=%.2f,p50=%llu,p99=%llu,p999=%llu,max=%llu",
+                k_commands[i].name,
+                (unsigned long long)st->calls, (unsigned long long)st->usec, (double)st->usec / (double)st->calls,
+                (unsigned long long)hist_percentile(&st->latency_us, 0.5),
+                (unsigned long long)hist_percentile(&st->latency_us, 0.99),
+                (unsigned long long)hist_percentile(&st->latency_us, 0.999),
+                (unsigned long long)st->latency_us.max);
+        }
+    }
+
+    return out_str(out, s.data(), s.size());
+}
+
+struct ConfigVar {
+    const char *name;
+    int64_t *val;
+    int64_t min;
+    int64_t max;
+};
+
+static const ConfigVar k_config_vars[] = {
+    {"slowlog-log-slower-than", &g_config.slowlog_slower_than_us, -1, INT64_MAX},
+    {"slowlog-max-len", &g_config.slowlog_max_len, 0, 1 << 20},
+    {"stall-threshold-us", &g_config.stall_threshold_us, -1, INT64_MAX},
+    {"stalllog-max-len", &g_config.stalllog_max_len, 0, 1 << 20},
+    {"clock-coarse", &g_config.clock_coarse, 0, 1},
+    {"pubsub-output-limit", &g_config.pubsub_output_limit, 0, INT64_MAX},
+    {"notify-keyspace-events", &g_config.notify_keyspace_events, 0, NOTIFY_KEYSPACE | NOTIFY_KEYEVENT},
+    {"tracking-table-max-keys", &g_config.tracking_table_max_keys, 0, INT64_MAX},
+    {"script-max-steps", &g_config.script_max_steps, 0, INT64_MAX},
+    {"rehash-budget-us", &g_config.rehash_budget_us, 0, 1000 * 1000},
+    {"str-compress-min-size", &g_config.str_compress_min_size, 0, INT64_MAX},
+    {"str-compress-bg-size", &g_config.str_compress_bg_size, 0, INT64_MAX},
+    {"client-output-hard-limit", &g_config.client_output_hard_limit, 0, INT64_MAX},
+    {"client-output-soft-limit", &g_config.client_output_soft_limit, 0, INT64_MAX},
+    {"client-output-soft-seconds", &g_config.client_output_soft_seconds, 0, INT64_MAX / 1000},
+    {"client-read-pause-bytes", &g_config.client_read_pause_bytes, 0, INT64_MAX},
+    {"client-idle-timeout-ms", &g_config.client_idle_timeout_ms, 0, INT64_MAX / 2},
+    {"hotkeys-sample-rate", &g_config.hotkeys_sample_rate, 0, 1 << 30},
+    {"activedefrag", &g_config.activedefrag, 0, 1},
+    {"active-defrag-threshold-pct", &g_config.active_defrag_threshold_pct, 0, 1000},
+    {"active-defrag-ignore-bytes", &g_config.active_defrag_ignore_bytes, 0, INT64_MAX},
+    {"active-defrag-budget-us", &g_config.active_defrag_budget_us, 1, 1000 * 1000},
+    {"active-defrag-cycle-pct", &g_config.active_defrag_cycle_pct, 1, 100},
+};
+
+static const ConfigVar *lookup_config(const std::string &name) {
+    for (const ConfigVar &var : k_config_vars) {
+        if (name == var.name) {
+            return &var;
+        }
+    }
+    return NULL;
+}
+
+static void conn_arm_idle(Conn *conn);
+
+// CONFIG GET <name> | CONFIG SET <name> <value>
+static void do_config(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    const ConfigVar *var = lookup_config(cmd[2]);
+    if (!var) {
+        return out_err(out, ERR_BAD_ARG, "unknown config parameter");
+    }
+
+    if (cmd.size() == 3 && cmd[1] == "get") {
+        resp_hint(conn, out, RESP_MAP);
+        out_arr(out, 2);
+        out_str(out, var->name, strlen(var->name));
+        return out_int(out, *var->val);
+    }
+
+    if (cmd.size() == 4 && cmd[1] == "set") {
+        int64_t val = 0;
+        if (!str2int(cmd[3], val) || val < var->min || val > var->max) {
+            return out_err(out, ERR_BAD_ARG, "value out of range");
+        }
+
+        *var->val = val;
+        if (var->val == &g_config.client_idle_timeout_ms) {
+            for (const std::pair<const uint64_t, Conn *> &it : g_data.id2conn) {
+                conn_arm_idle(it.second);       // applies to connections idle already
+            }
+        }
+        return out_nil(out);
+    }
+
+    return out_err(out, ERR_BAD_ARG, "expected CONFIG GET <name> or CONFIG SET <name> <value>");
+}
+
+const size_t k_slowlog_max_args = 32;
+const size_t k_slowlog_max_arglen = 128;
+
+// the handler may have consumed the arguments, so the entry is rebuilt from the raw request
+static void slowlog_push(uint32_t proto, const uint8_t *request, size_t len, uint64_t duration_us) {
+    std::vector<std::string> cmd;
+    RespParse st;
+    const char *err = NULL;
+    if (proto == PROTO_NATIVE ? parse_req(request, len, cmd) < 0 : resp_parse(request, len, cmd, st, &err) <= 0) {
+        return;
+    }
+
+    SlowlogEntry ent;
+    ent.id = g_data.slowlog_next_id++;
+    ent.unix_ms = get_realtime_msec();
+    ent.duration_us = duration_us;
+
+    for (size_t i = 0; i < cmd.size() && i < k_slowlog_max_args; i++) {
+        std::string &arg = cmd[i];
+        if (i == k_slowlog_max_args - 1 && cmd.size() > k_slowlog_max_args) {
+            ent.args.push_back("... (" + std::to_string(cmd.size() - i) + " more arguments)");
+        } else if (arg.size() > k_slowlog_max_arglen) {
+            size_t more = arg.size() - k_slowlog_max_arglen;
+            arg.resize(k_slowlog_max_arglen);
+            ent.args.push_back(arg + "... (" + std::to_string(more) + " more bytes)");
+        } else {
+            ent.args.push_back(std::move(arg));
+        }
+    }
+
+    g_data.slowlog.push_front(std::move(ent));
+    while (g_data.slowlog.size() > (size_t)g_config.slowlog_max_len) {
+        g_data.slowlog.pop_back();
+    }
+}
+
+// number of entries requested by GET [count]
+static bool log_get_count(std::vector<std::string> &cmd, size_t total, size_t &n) {
+    n = total < 10 ? total : 10;
+    if (cmd.size() < 3) {
+        return true;
+    }
+
+    int64_t count = 0;
+    if (!str2int(cmd[2], count) || count < 0) {
+        return false;
+    }
+
+    n = (size_t)count < total ? (size_t)count : total;
+    return true;
+}
+
+// SLOWLOG GET [count] | LEN | RESET
+static void do_slowlog(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd[1] == "len" && cmd.size() == 2) {
+        return out_int(out, (int64_t)g_data.slowlog.size());
+    }
+
+    if (cmd[1] == "reset" && cmd.size() == 2) {
+        g_data.slowlog.clear();
+        return out_nil(out);
+    }
+
+    size_t n = 0;
+    if (cmd[1] != "get" || cmd.size() > 3 || !log_get_count(cmd, g_data.slowlog.size(), n)) {
+        return out_err(out, ERR_BAD_ARG, "expected SLOWLOG GET [count], LEN or RESET");
+    }
+
+    // each entry: [id, unix time ms, duration us, [args...]]
+    out_arr(out, (uint32_t)n);
+    for (size_t i = 0; i < n; i++) {
+        const SlowlogEntry &ent = g_data.slowlog[i];
+        out_arr(out, 4);
+        out_int(out, (int64_t)ent.id);
+        out_int(out, ent.unix_ms);
+        out_int(out, (int64_t)ent.duration_us);
+        out_arr(out, (uint32_t)ent.args.size());
+        for (const std::string &arg : ent.args) {
+            out_str(out, arg.data(), arg.size());
+        }
+    }
+}
+
+// record the iteration if it ran longer than the stall threshold
+static void stall_check(uint64_t total_us) {
+    if (g_config.stall_threshold_us < 0 || total_us < (uint64_t)g_config.stall_threshold_us) {
+        return;
+    }
+
+    StallEntry ent;
+    ent.id = g_data.stalllog_next_id++;
+    ent.unix_ms = get_realtime_msec();
+    ent.total_us = total_us;
+    memcpy(ent.phase_us, g_data.stats.phase_us, sizeof(ent.phase_us));
+
+    g_data.stalllog.push_front(ent);
+    while (g_data.stalllog.size() > (size_t)g_config.stalllog_max_len) {
+        g_data.stalllog.pop_back();
+    }
+}
+
+// STALLLOG GET [count] | LEN | RESET
+static void do_stalllog(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd[1] == "len" && cmd.size() == 2) {
+        return out_int(out, (int64_t)g_data.stalllog.size());
+    }
+
+    if (cmd[1] == "reset" && cmd.size() == 2) {
+        g_data.stalllog.clear();
+        return out_nil(out);
+    }
+
+    size_t n = 0;
+    if (cmd[1] != "get" || cmd.size() > 3 || !log_get_count(cmd, g_data.stalllog.size(), n)) {
+        return out_err(out, ERR_BAD_ARG, "expected STALLLOG GET [count], LEN or RESET");
+    }
+
+    // each entry: [id, unix time ms, total us, slowest phase, [phase, us, ...]]
+    out_arr(out, (uint32_t)n);
+    for (size_t i = 0; i < n; i++) {
+        const StallEntry &ent = g_data.stalllog[i];
+        size_t worst = 0;
+        for (size_t ph = 1; ph < PH_MAX; ph++) {
+            if (ent.phase_us[ph] > ent.phase_us[worst]) {
+                worst = ph;
+            }
+        }
+
+        out_arr(out, 5);
+        out_int(out, (int64_t)ent.id);
+        out_int(out, ent.unix_ms);
+        out_int(out, (int64_t)ent.total_us);
+        out_str(out, k_phase_names[worst], strlen(k_phase_names[worst]));
+        out_arr(out, PH_MAX * 2);
+        for (size_t ph = 0; ph < PH_MAX; ph++) {
+            out_str(out, k_phase_names[ph], strlen(k_phase_names[ph]));
+            out_int(out, (int64_t)ent.phase_us[ph]);
+        }
+    }
+}
+
+static void response_begin(Buffer &out, size_t *header) {
+    *header = out.size();
+    buf_append_u32(out, 0);                                     // reserve 4 bytes for response header
+}
+
+static size_t response_size(Buffer &out, size_t header) {
+    return out.size() - header - 4;
+}
+
+static void response_end(Buffer &out, size_t header) {
+    size_t msg_size = response_size(out, header);
+    if (msg_size > k_max_msg) {
+        out.resize(header + 4);
+        out_err(out, ERR_TOO_BIG, "response is too big");
+        msg_size = response_size(out, header);
+    }
+
+    // message header
+    uint32_t len = (uint32_t)msg_size;
+    memcpy(&out[header], &len, 4);
+}
+
+// re-encode one native value, `arr_type` is the RESP type of an array at this level
+static void resp_value(const uint8_t *&cur, uint32_t proto, char arr_type, Buffer &out) {
+    uint8_t tag = *cur++;
+    uint32_t n = 0;
+    switch (tag) {
+    case TAG_NIL:
+        resp_append_nil(out, proto == PROTO_RESP3);
+        break;
+    case TAG_ERR: {
+        uint32_t code = 0;
+        memcpy(&code, cur, 4);
+        memcpy(&n, cur + 4, 4);
+        resp_append_err(out, code, cur + 8, n);
+        cur += 8 + n;
+        break;
+    }
+    case TAG_STR:
+        memcpy(&n, cur, 4);
+        resp_append_bulk(out, cur + 4, n);
+        cur += 4 + n;
+        break;
+    case TAG_INT: {
+        int64_t val = 0;
+        memcpy(&val, cur, 8);
+        resp_append_line(out, ':', val);
+        cur += 8;
+        break;
+    }
+    case TAG_DBL: {
+        double val = 0;
+        memcpy(&val, cur, 8);
+        resp_append_dbl(out, proto == PROTO_RESP3, val);
+        cur += 8;
+        break;
+    }
+    case TAG_ARR:
+        memcpy(&n, cur, 4);
+        cur += 4;
+        resp_append_line(out, arr_type, (int64_t)n);
+        for (uint32_t i = 0; i < n; i++) {
+            resp_value(cur, proto, '*', out);
+        }
+        break;
+    }
+}
+
+// append the RESP form of the native message in data[0..len), a push in RESP3
+static void resp_encode_push(const uint8_t *data, size_t len, uint32_t proto, Buffer &out) {
+    const uint8_t *cur = data;
+    if (len > 0) {
+        resp_value(cur, proto, proto == PROTO_RESP3 ? '>' : '*', out);
+    }
+}
+
+// a reply to `conn`, also one made while another connection's reply is being written
+static void conn_response_begin(Conn *conn, size_t *header) {
+    g_resp_outer.push_back(g_resp);
+    g_resp = RespOut();
+    if (conn->proto == PROTO_NATIVE) {
+        return response_begin(conn->outgoing, header);
+    }
+    g_resp.conn = conn;
+    *header = conn->outgoing.size();
+}
+
+static void conn_response_done(Conn *conn) {
+    conn->resp_hint = RESP_PLAIN;
+    g_resp = g_resp_outer.back();
+    g_resp_outer.pop_back();
+}
+
+static void conn_response_end(Conn *conn, size_t header) {
+    if (conn->proto == PROTO_NATIVE) {
+        response_end(conn->outgoing, header);
+    } else if (conn->outgoing.size() - header > k_max_msg) {
+        conn->outgoing.resize(header);
+        out_err(conn->outgoing, ERR_TOO_BIG, "response is too big");
+    }
+    conn_response_done(conn);
+}
+
+// drop the reply, e.g. of a command that blocked
+static void conn_response_discard(Conn *conn, size_t header) {
+    conn->outgoing.resize(header);
+    conn_response_done(conn);
+}
+
+// the encoding of a shared message for the protocol of `conn`
+static SharedBuf *sharedbuf_for(Conn *conn, SharedBuf *sb) {
+    if (conn->proto == PROTO_NATIVE) {
+        return sb;
+    }
+
+    SharedBuf *&enc = sb->resp[conn->proto == PROTO_RESP3];
+    if (!enc) {
+        enc = new SharedBuf();
+        resp_encode_push(sb->data.data() + 4, sb->data.size() - 4, conn->proto, enc->data);
+    }
+    return enc;
+}
+
+// Requests start with a little-endian length below k_max_msg, so the 4th byte is 0, 1 or 2,
+// while a RESP request starts with "*" or a command name and has a printable or CRLF byte there.
+static uint32_t proto_detect(const uint8_t *data, size_t size) {
+    if (size < 4) {
+        return PROTO_UNKNOWN;
+    }
+    bool resp_start = data[0] == '*' || isalpha(data[0]);
+    return resp_start && data[3] > (k_max_msg >> 24) ? PROTO_RESP2 : PROTO_NATIVE;
+}
+
+static void repl_link_input(Conn *conn, const uint8_t *data, size_t len);
+static void cluster_link_input(Conn *conn, const uint8_t *data, size_t len);
+static bool bg_must_wait(Conn *conn, std::vector<std::string> &cmd);
+
+// a RESP request at the front of data, returns its size, 0 if incomplete or on a protocol error
+static size_t resp_read_request(Conn *conn, const uint8_t *data, size_t size) {
+    const char *err = NULL;
+    int64_t n = resp_parse(data, size, conn->argv, conn->resp_parse, &err);
+    if (n < 0) {
+        std::string msg = std::string("-ERR Protocol error: ") + err + "\r\n";
+        buf_append(conn->outgoing, (const uint8_t *)msg.data(), msg.size());
+        conn->want_close = true;
+        return 0;
+    }
+    return (size_t)n;
+}
+
+// handle the request at the front of data, returns the number of bytes consumed or 0 if incomplete
+static size_t try_one_request(Conn* conn, const uint8_t *data, size_t size) {
+    if (!conn->block.waits.empty() || conn->bg_wait || conn->read_paused || conn->want_close) {
+        return 0;                               // a blocked connection resumes after it is served
+    }
+    if (conn->proto == PROTO_UNKNOWN && (conn->proto = proto_detect(data, size)) == PROTO_UNKNOWN) {
+        return 0;
+    }
+
+    std::vector<std::string> &cmd = conn->argv;
+    const uint8_t *request = data;
+    size_t len = 0;
+    size_t consumed = 0;
+    if (conn->proto != PROTO_NATIVE) {
+        consumed = len = resp_read_request(conn, data, size);
+        if (consumed == 0) {
+            return 0;
+        }
+        if (cmd.empty()) {
+            return consumed;                    // blank line
+        }
+    } else {
+        if (size < 4) {
+            return 0;
+        }
+
+        uint32_t msg_len = 0;
+        memcpy(&msg_len, data, 4);
+        if (msg_len > k_max_msg) {
+            conn->want_close = true;
+            return 0;
+        }
+
+        if (4 + msg_len > size) {
+            return 0;
+        }
+
+        request = &data[4];
+        len = msg_len;
+        consumed = len + 4;
+
+        if (conn->repl_role == REPL_LEADER) {
+            repl_link_input(conn, request, len);   // PSYNC reply and command stream from our leader
+            return conn->want_close ? 0 : consumed;
+        }
+        if (conn->cluster.link) {
+            cluster_link_input(conn, request, len); // replies to a slot migration
+            return conn->want_close ? 0 : consumed;
+        }
+        if (conn->repl_role != REPL_NONE) {
+            return consumed;                        // replicas only receive, ignore anything they send
+        }
+
+        // parse the requests
+        if (parse_req(request, len, cmd) < 0) {
+            conn->want_close = true;
+            printf("error parsing request\n");
+            return 0;
+        }
+    }
+    if (bg_must_wait(conn, cmd)) {
+        conn->bg_wait = true;                   // retried once the keys are released
+        g_bg.waiting.push_back(conn->id);
+        return 0;
+    }
+
+    // generate response, its header may move if the command pushes shared output to this conn
+    conn_response_begin(conn, &conn->resp_start);
+    uint64_t exec_us = do_request(conn, cmd, conn->outgoing);
+    if (conn->block.waits.empty() && !conn->bg_wait) {
+        conn_response_end(conn, conn->resp_start);
+    } else {
+        conn_response_discard(conn, conn->resp_start);     // blocked, replied to when served or timed out
+    }
+    conn->resp_start = (size_t)-1;
+
+    if (!conn_output_ok(conn)) {
+        printf("closing connection %d over the output limit (%zu bytes)\n", conn->fd, conn_pending_bytes(conn));
+        g_data.output_limit_closes++;
+        conn->want_close = true;
+    } else if (g_config.client_read_pause_bytes > 0 && conn_output_limited(conn)
+        && conn_pending_bytes(conn) > (size_t)g_config.client_read_pause_bytes)
+    {
+        conn_pause_read(conn);
+    }
+
+    g_data.stats.phase_us[PH_EXEC] += exec_us;
+    if (g_config.slowlog_slower_than_us >= 0 && exec_us >= (uint64_t)g_config.slowlog_slower_than_us) {
+        slowlog_push(conn->proto, request, len, exec_us);
+    }
+
+    return consumed;
+}
+
+// Feed newly received bytes to the connection. Complete requests are parsed straight from
+// `data` when nothing is buffered, only a trailing partial request is copied into `incoming`.
+static void handle_input(Conn *conn, const uint8_t *data, size_t size) {
+    uint64_t parse_start_us = get_monotonic_usec();
+
+    // execution time is accounted by try_one_request(), the rest is parsing
+    uint64_t exec_before_us = g_data.stats.phase_us[PH_EXEC];
+    if (conn->incoming.empty()) {
+        size_t off = 0;
+        while (size_t n = try_one_request(conn, data + off, size - off)) {
+            off += n;
+        }
+        if (!conn->want_close) {
+            buf_append(conn->incoming, data + off, size - off);
+        }
+    } else {
+        buf_append(conn->incoming, data, size);
+
+        size_t off = 0;
+        while (size_t n = try_one_request(conn, conn->incoming.data() + off, conn->incoming.size() - off)) {
+            off += n;
+        }
+        buf_consume(conn->incoming, off);
+    }
+
+    uint64_t exec_us = g_data.stats.phase_us[PH_EXEC] - exec_before_us;
+    g_data.stats.phase_us[PH_PARSE] += get_monotonic_usec() - parse_start_us - exec_us;
+}
+
+static Conn *conn_new(int fd) {
+    Conn* conn = new Conn();
+    conn->fd = fd;
+    conn->id = ++g_data.next_conn_id;
+    g_data.id2conn[conn->id] = conn;
+    conn->want_read = true;
+    conn->created_ms = conn->last_active_ms = g_data.now_ms;
+    conn->idle_timer.kind = TMR_IDLE;
+    conn->block.timer.kind = TMR_BLOCK;
+    conn->output_timer.kind = TMR_OUTPUT;
+    conn_arm_idle(conn);
+
+    if (g_data.fd2conn.size() <= (size_t)conn->fd) {
+        g_data.fd2conn.resize(conn->fd + 1);
+    }
+    g_data.fd2conn[conn->fd] = conn;
+    g_data.nconns++;
+    g_data.stats.total_conns++;
+
+    return conn;
+}
+
+// Activity only records the time, the idle timer is pushed back when it fires, so a busy
+// connection doesn't move in the timer wheel on every event.
+static void conn_touch(Conn *conn) {
+    conn->last_active_ms = g_data.now_ms;
+}
+
+static uint64_t conn_idle_timeout_ms(Conn *conn) {
+    if (conn->idle_exempt) {
+        return 0;
+    }
+    return conn->idle_timeout_ms >= 0 ? conn->idle_timeout_ms : g_config.client_idle_timeout_ms;
+}
+
+// idle timeout counted from the last activity
+static void conn_arm_idle(Conn *conn) {
+    uint64_t timeout_ms = conn_idle_timeout_ms(conn);
+    if (timeout_ms == 0) {
+        tw_del(&g_data.timers, &conn->idle_timer);
+    } else {
+        tw_add(&g_data.timers, &conn->idle_timer, conn->last_active_ms + timeout_ms + clock_slack_ms());
+    }
+}
+
+// long-lived connections that may stay quiet, e.g. replication links and subscribers
+static void conn_set_idle_exempt(Conn *conn, bool exempt) {
+    if (conn->idle_exempt == exempt) {
+        return;
+    }
+
+    conn->idle_exempt = exempt;
+    if (!exempt) {
+        conn_touch(conn);
+    }
+    conn_arm_idle(conn);
+}
+
+// replicas waiting for a snapshot must not receive anything before it
+static bool conn_output_held(Conn *conn) {
+    return conn->repl_role == REPL_WAIT_BGSAVE || conn->repl_role == REPL_SNAPSHOT;
+}
+
+const int k_max_accepts_per_call = 1000;
+
+static Conn *conn_accepted(Listener *l, int fd) {
+    if (l->tcp && g_listen.nodelay) {
+        int val = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    }
+    return conn_new(fd);
+}
+
+// accept what is pending on a non-blocking listener, so a burst of connections takes one wakeup
+static void handle_accept(Listener *l) {
+    g_listen.accept_wakeups++;
+    for (int i = 0; i < k_max_accepts_per_call; i++) {
+        int conn_fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                perror("accept4");
+            }
+            return;
+        }
+        conn_accepted(l, conn_fd);
+    }
+}
+
+const size_t k_max_iov = 64;
+
 static void handle_write(Conn* conn) {
-    assert(conn->outgoing.size() > 0);
+    if (conn_output_held(conn)) {
+        return;
+    }
+    assert(conn_pending_bytes(conn) > 0);
+
+    uint64_t start_us = get_monotonic_usec();
+    ssize_t rv = 0;
+    if (conn->outq.empty()) {
+        rv = write(conn->fd, conn->outgoing.data(), conn->outgoing.size());
+    } else {
+        struct iovec iov[k_max_iov];
+        size_t n = conn_output_iov(conn, iov, k_max_iov, true);
+        rv = writev(conn->fd, iov, (int)n);
+    }
+    g_data.stats.phase_us[PH_WRITE] += get_monotonic_usec() - start_us;
+    if (rv < 0) {
+        if (errno == EAGAIN)                                            // if client is not reading, send buffer (kernel buffer) fills up
+            return;
+
+        conn->want_close = true;
+        return;
+    }
+
+    // remove written data from buffer
+    conn_consume_output(conn, (size_t)rv);
+    conn_output_drained(conn);
+
+    if (conn_pending_bytes(conn) == 0) {
+        conn->want_read = true;
+        conn->want_write = false;
+    }
+}
+
+static void handle_read(Conn* conn) {
+    uint8_t buf[64 * 1024];
+
+    uint64_t read_start_us = get_monotonic_usec();
+    ssize_t rv = read(conn->fd, buf, sizeof(buf));
+    if (rv <= 0) {                                                      // handle IO Error (rv < 0) and EOF (rv == 0)                  
+        conn->want_close = true;
+        return;
+    }
+
+    g_data.stats.phase_us[PH_READ] += get_monotonic_usec() - read_start_us;
+    handle_input(conn, buf, (size_t)rv);
+
+    // update readiness intention
+    if (conn_pending_bytes(conn) > 0) {
+        conn->want_read = false;
+        conn->want_write = true;
+
+        return handle_write(conn);                                      // optimization for request-response protocol
+    }                                                                   // assume client is ready to be written to because it has sent a request
+}                                                                       // thus server can write a response without waiting for event loop
+
+static uint64_t repl_next_timer_ms();
+static bool rehash_pending();
+static bool defrag_pending();
+static uint64_t defrag_next_ms();
+
+static int32_t next_timer_ms() {
+    uint64_t now_ms = g_data.now_ms;
+
+    // idle, blocking and output limit timers of connections
+    uint64_t next_ms = tw_next_ms(&g_data.timers);
+
+    // ttl timers entries
+    if (!g_repl.is_replica && !g_data.heap.empty() && g_data.heap[0].val + clock_slack_ms() < next_ms
+        && !bg_key_pinned(container_of(g_data.heap[0].ref, Entry, heap_idx)->key))
+    {
+        next_ms = g_data.heap[0].val + clock_slack_ms();
+    }
+
+    // replication housekeeping
+    uint64_t repl_ms = repl_next_timer_ms();
+    if (repl_ms < next_ms) {
+        next_ms = repl_ms;
+    }
+
+    // idle time goes to resizing hash tables and defragmentation
+    if (rehash_pending()) {
+        next_ms = now_ms;
+    }
+    uint64_t defrag_ms = defrag_next_ms();
+    if (defrag_ms < next_ms) {
+        next_ms = defrag_ms;
+    }
+
+    if (next_ms == (size_t)-1) {
+        return -1;  // no timeouts
+    }
+
+    if (next_ms <= now_ms) {
+        return 0;   
+    }
+
+    return (uint32_t)(next_ms - now_ms);
+}
+
+const size_t k_max_work = 2000;
+
+static void block_unblock(Conn *conn);
+static void block_reply_nil(Conn *conn);
+
+static void conn_timer_fired(TimerNode *timer) {
+    switch (timer->kind) {
+    case TMR_IDLE: {
+        Conn *conn = container_of(timer, Conn, idle_timer);
+        uint64_t timeout_ms = conn_idle_timeout_ms(conn);
+        if (timeout_ms == 0 || conn->last_active_ms + timeout_ms > g_data.now_ms) {
+            return conn_arm_idle(conn);         // active since the timer was set
+        }
+        printf("removing idle connection %d\n", conn->fd);
+        g_data.idle_closes++;
+        return conn_destroy(conn);
+    }
+    case TMR_BLOCK: {
+        Conn *conn = container_of(timer, Conn, block.timer);
+        block_unblock(conn);
+        return block_reply_nil(conn);
+    }
+    case TMR_OUTPUT: {
+        Conn *conn = container_of(timer, Conn, output_timer);
+        if (!conn_output_ok(conn)) {
+            printf("closing connection %d over the soft output limit (%zu bytes)\n", conn->fd, conn_pending_bytes(conn));
+            g_data.output_limit_closes++;
+            return conn_destroy(conn);
+        }
+        if (conn->soft_limit_ms) {              // the grace period was made longer
+            tw_add(&g_data.timers, timer, conn->soft_limit_ms + (uint64_t)g_config.client_output_soft_seconds * 1000);
+        }
+        return;
+    }
+    }
+}
+
+// delete expired timers
+static void process_timers() {
+    uint64_t now_ms = g_data.now_ms;
+
+    // connection timers, a burst of expiries is spread over several loop iterations
+    for (size_t n = 0; n < k_max_work; n++) {
+        TimerNode *timer = tw_pop(&g_data.timers, now_ms);
+        if (!timer) {
+            break;
+        }
+        conn_timer_fired(timer);
+    }
+
+    // ttl timers for entries, replicas leave expiry to the leader which replicates it as DEL
+    const std::vector<HeapItem> &heap = g_data.heap;
+    size_t nworks = 0;
+
+    while (!g_repl.is_replica && !heap.empty() && heap[0].val + clock_slack_ms() < now_ms) {
+        Entry *ent = container_of(heap[0].ref, Entry, heap_idx);
+        if (bg_key_pinned(ent->key)) {
+            break;                              // expires once the job using it is done
+        }
+        hm_delete(&g_data.db, &ent->node, &hnode_same);
+        printf("removing key %s\n", ent->key.c_str());
+        repl_feed({"del", ent->key});
+        signal_key_modified(NULL, ent->key, "expired");
+        entry_del(ent);
+
+        if (nworks++ >= k_max_work) {
+            break;  // don't stall server if too many keys expires at once
+        }
+    }
+}
+
+// A resize of the tables below is moved along between events too, for up to rehash-budget-us
+// per loop iteration, so it finishes while the server is idle instead of leaving lookups to probe
+// two tables until enough commands touch the table.
+static HMap *const k_rehash_maps[] = {
+    &g_data.db, &g_pubsub.channels, &g_pubsub.patterns, &g_tracking.keys, &g_blocking.keys,
+};
+
+static bool rehash_pending() {
+    if (g_config.rehash_budget_us == 0) {
+        return false;
+    }
+    for (HMap *hmap : k_rehash_maps) {
+        if (hmap->old_table.table) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void rehash_cron() {
+    if (!rehash_pending()) {
+        return;
+    }
+
+    uint64_t deadline_us = get_monotonic_usec() + (uint64_t)g_config.rehash_budget_us;
+    for (HMap *hmap : k_rehash_maps) {
+        while (hm_rehash_step(hmap)) {
+            if (get_monotonic_usec() >= deadline_us) {
+                return;
+            }
+        }
+    }
+}
+
+static bool defrag_page_eq(HNode *node, HNode *key) {
+    return container_of(node, DefragPage, node)->page == container_of(key, DefragPage, node)->page;
+}
+
+static DefragPage *defrag_page(const void *ptr, bool add) {
+    DefragPage key;
+    key.page = (uintptr_t)ptr / k_defrag_page;
+    key.node.hcode = str_hash((const uint8_t *)&key.page, sizeof(key.page));
+    HNode *node = hm_lookup(&g_defrag.pages, &key.node, &defrag_page_eq);
+    if (node || !add) {
+        return node ? container_of(node, DefragPage, node) : NULL;
+    }
+
+    DefragPage *pg = new DefragPage();
+    pg->page = key.page;
+    pg->node.hcode = key.node.hcode;
+    hm_insert(&g_defrag.pages, &pg->node);
+    return pg;
+}
+
+static bool str_inline(const std::string &str) {
+    const char *data = str.data();
+    return (const char *)&str <= data && data < (const char *)(&str + 1);
+}
+
+// the first walk
+static void defrag_count(const void *ptr, size_t size) {
+    defrag_page(ptr, true)->bytes += size;
+}
+
+static void defrag_count_string(const std::string &str) {
+    if (!str_inline(str)) {
+        defrag_count(str.data(), str.capacity() + 1);
+    }
+}
+
+// the page of an object that is worth leaving, NULL if none
+static DefragPage *defrag_sparse(const void *old) {
+    DefragPage *pg = defrag_page(old, false);
+    return pg && pg->bytes < k_defrag_page / 2 ? pg : NULL;
+}
+
+// A rejected block is kept until the pass ends or too many pile up: freed at once, malloc()
+// would hand the same block out again for the next object of the size.
+static bool defrag_better(DefragPage *from, const void *mem, size_t size) {
+    DefragPage *to = defrag_page(mem, false);
+    if (!to || to == from || to->bytes < from->bytes) {
+        g_defrag.misses++;
+        return false;
+    }
+    from->bytes -= std::min(from->bytes, size);
+    to->bytes += size;
+    g_defrag.hits++;
+    return true;
+}
+
+static void defrag_release() {
+    for (void *mem : g_defrag.spare) {
+        free(mem);
+    }
+    for (void *mem : g_defrag.spare_ents) {
+        ::operator delete(mem);
+    }
+    g_defrag.spare.clear();
+    g_defrag.spare_ents.clear();
+    g_defrag.spare_strs.clear();
+}
+
+static void defrag_string(std::string &str) {
+    if (str_inline(str) || str.size() > k_defrag_max_size) {
+        return;
+    }
+    DefragPage *from = defrag_sparse(str.data());
+    if (!from) {
+        return;
+    }
+
+    std::string copy(str);
+    if (defrag_better(from, copy.data(), copy.capacity() + 1)) {
+        str.swap(copy);                         // the old buffer goes with the copy
+    } else {
+        g_defrag.spare_strs.push_back(std::move(copy));
+    }
+}
+
+static void defrag_table(HMap *hmap) {
+    if (!hmap->old_table.table && hm_buckets(hmap) <= k_defrag_max_buckets) {
+        hm_defrag(hmap);
+    }
+}
+
+// the TTL heap and the slot list point into the entry, the per-type object is moved on its own
+static Entry *defrag_entry(Entry *ent) {
+    DefragPage *from = defrag_sparse(ent);
+    if (!from) {
+        return ent;
+    }
+    void *mem = ::operator new(sizeof(Entry));
+    if (!defrag_better(from, mem, sizeof(Entry))) {
+        g_defrag.spare_ents.push_back(mem);
+        return ent;
+    }
+
+    Entry *fresh = new (mem) Entry();
+    fresh->node.hcode = ent->node.hcode;
+    fresh->key.swap(ent->key);
+    fresh->heap_idx = ent->heap_idx;
+    fresh->version = ent->version;
+    fresh->type = ent->type;
+    fresh->str.swap(ent->str);
+    fresh->enc = ent->enc;
+    fresh->ival = ent->ival;
+    fresh->obj = ent->obj;
+
+    if (fresh->heap_idx != (size_t)-1) {
+        g_data.heap[fresh->heap_idx].ref = &fresh->heap_idx;
+    }
+    if (ent->slot_node.next) {
+        dlist_insert_before(&ent->slot_node, &fresh->slot_node);
+        dlist_detach(&ent->slot_node);
+    }
+    hm_replace(&g_data.db, &ent->node, &fresh->node);
+
+    delete ent;
+    return fresh;
+}
+
+static size_t entry_obj_size(uint32_t type) {
+    switch (type) {
+    case T_ZSET:
+        return sizeof(ZSet);
+    case T_HASH:
+        return sizeof(Hash);
+    case T_LIST:
+        return sizeof(QList);
+    case T_HLL:
+        return sizeof(HLL);
+    case T_BLOOM:
+        return sizeof(Bloom);
+    default:
+        return 0;
+    }
+}
+
+// the object of the type of the entry, nothing points to it but the entry, except for the chunks
+// of a list pointing to its head
+static void defrag_entry_obj(Entry *ent) {
+    size_t size = entry_obj_size(ent->type);
+    DefragPage *from = size ? defrag_sparse(ent->obj) : NULL;
+    if (!from) {
+        return;
+    }
+    void *mem = ::operator new(size);
+    if (!defrag_better(from, mem, size)) {
+        g_defrag.spare_ents.push_back(mem);
+        return;
+    }
+
+    if (ent->type == T_ZSET) {
+        ZSet *old = ent->zset;
+        ent->zset = new (mem) ZSet(*old);
+        delete old;
+    } else if (ent->type == T_HASH) {
+        Hash *old = ent->hash;
+        ent->hash = new (mem) Hash(*old);
+        delete old;
+    } else if (ent->type == T_LIST) {
+        QList *old = ent->list;
+        QList *ql = new (mem) QList(*old);
+        if (dlist_empty(&old->chunks)) {
+            dlist_init(&ql->chunks);
+        } else {
+            ql->chunks.next->prev = &ql->chunks;
+            ql->chunks.prev->next = &ql->chunks;
+        }
+        ent->list = ql;
+        delete old;
+    } else if (ent->type == T_HLL) {
+        HLL *old = ent->hll;
+        ent->hll = new (mem) HLL(*old);
+        delete old;
+    } else if (ent->type == T_BLOOM) {
+        Bloom *old = ent->bloom;
+        ent->bloom = new (mem) Bloom(*old);
+        delete old;
+    }
+}
+
+static void defrag_visit(HNode *node, void *) {
+    Entry *ent = container_of(node, Entry, node);
+    if (bg_key_pinned(ent->key)) {
+        return;
+    }
+
+    if (!g_defrag.moving) {
+        defrag_count(ent, sizeof(Entry));
+        defrag_count_string(ent->key);
+        if (ent->type == T_STR) {
+            defrag_count_string(ent->str);
+        } else if (ent->obj) {
+            defrag_count(ent->obj, entry_obj_size(ent->type));
+        }
+    } else {
+        ent = defrag_entry(ent);
+        defrag_entry_obj(ent);
+        defrag_string(ent->key);
+        if (ent->type == T_STR) {
+            defrag_string(ent->str);
+        } else if (ent->type == T_ZSET) {
+            defrag_table(&ent->zset->hmap);
+        } else if (ent->type == T_HASH && ent->hash->is_map) {
+            defrag_table(&ent->hash->hmap);
+        }
+    }
+    if (ent->type == T_ZSET) {
+        g_defrag.zsets.push_back(ent->key);
+    }
+}
+
+static void defrag_znode(ZSet *zset, ZNode *node) {
+    size_t size = sizeof(ZNode) + node->len;
+    if (!g_defrag.moving) {
+        defrag_count(node, size);
+        return;
+    }
+
+    DefragPage *from = size <= k_defrag_max_size ? defrag_sparse(node) : NULL;
+    if (!from) {
+        return;
+    }
+    void *mem = malloc(size);
+    if (defrag_better(from, mem, size)) {
+        zset_move(zset, node, mem);
+    } else {
+        g_defrag.spare.push_back(mem);
+    }
+}
+
+// a batch of the nodes of the sorted set on top of g_defrag.zsets, in order, resuming at the
+// next node by its score and name since the set may change in between
+static void defrag_zset_step() {
+    Entry *ent = key_entry(g_defrag.zsets.back());
+    ZNode *node = NULL;
+    if (ent && ent->type == T_ZSET && !bg_key_pinned(ent->key)) {
+        node = g_defrag.zset_started
+            ? zset_seekge(ent->zset, g_defrag.zset_score, g_defrag.zset_name.data(), g_defrag.zset_name.size())
+            : zset_seekge(ent->zset, -INFINITY, "", 0);
+    }
+
+    for (size_t i = 0; node && i < k_defrag_zset_batch; i++) {
+        ZNode *next = znode_offset(node, +1);
+        defrag_znode(ent->zset, node);
+        node = next;
+    }
+
+    if (node) {
+        g_defrag.zset_started = true;
+        g_defrag.zset_score = node->score;
+        g_defrag.zset_name.assign(node->name, node->len);
+    } else {
+        g_defrag.zsets.pop_back();
+        g_defrag.zset_started = false;
+    }
+}
+
+static void defrag_start(size_t used, size_t rss) {
+    g_defrag.running = true;
+    g_defrag.moving = false;
+    g_defrag.start_us = get_monotonic_usec();
+    g_defrag.cursor = 0;
+    g_defrag.ratio_before = mem_frag_ratio(used, rss);
+}
+
+static bool cb_collect_page(HNode *node, void *arg) {
+    ((std::vector<DefragPage *> *)arg)->push_back(container_of(node, DefragPage, node));
+    return true;
+}
+
+static void defrag_stop() {
+    g_defrag.running = false;
+    g_defrag.zsets.clear();
+    g_defrag.zset_started = false;
+    defrag_release();
+
+    std::vector<DefragPage *> pages;
+    hm_foreach(&g_defrag.pages, &cb_collect_page, &pages);
+    hm_clear(&g_defrag.pages);
+    for (DefragPage *pg : pages) {
+        delete pg;
+    }
+}
+
+static void defrag_finish() {
+    defrag_stop();
+    malloc_trim(0);
+
+    g_defrag.passes++;
+    g_defrag.ratio_after = mem_frag_ratio(mem_used(), mem_rss());
+    g_defrag.last_pass_ms = (get_monotonic_usec() - g_defrag.start_us) / 1000;
+    g_defrag.check_ms = g_data.now_ms;
+    printf("active defrag pass done in %llu ms, fragmentation %.2f -> %.2f\n",
+        (unsigned long long)g_defrag.last_pass_ms, g_defrag.ratio_before, g_defrag.ratio_after);
+}
+
+// the cursor needs the keyspace to stay in one table, see rehash_cron()
+static bool defrag_pending() {
+    return g_defrag.running && g_repl.snapshot_pid < 0 && !g_data.db.old_table.table;
+}
+
+static uint64_t defrag_window_budget_us() {
+    return k_defrag_window_ms * 1000 * (uint64_t)g_config.active_defrag_cycle_pct / 100;
+}
+
+// when the next slice of the pass may run, -1 if none is pending
+static uint64_t defrag_next_ms() {
+    if (!defrag_pending()) {
+        return (uint64_t)-1;
+    }
+    if (g_defrag.window_us < defrag_window_budget_us()) {
+        return g_data.now_ms;
+    }
+    return g_defrag.window_ms + k_defrag_window_ms;
+}
+
+static void defrag_cron() {
+    if (!g_config.activedefrag) {
+        if (g_defrag.running) {
+            defrag_stop();
+        }
+        return;
+    }
+
+    if (!g_defrag.running) {
+        if (g_repl.snapshot_pid > 0 || g_data.now_ms - g_defrag.check_ms < 1000) {
+            return;
+        }
+        g_defrag.check_ms = g_data.now_ms;
+
+        size_t used = mem_used(), rss = mem_rss();
+        if (rss < used + (size_t)g_config.active_defrag_ignore_bytes
+            || rss * 100 < used * (100 + (size_t)g_config.active_defrag_threshold_pct))
+        {
+            return;
+        }
+        defrag_start(used, rss);
+    }
+    if (!defrag_pending()) {
+        return;
+    }
+    if (g_data.now_ms >= g_defrag.window_ms + k_defrag_window_ms) {
+        g_defrag.window_ms = g_data.now_ms;
+        g_defrag.window_us = 0;
+    }
+    uint64_t window_budget_us = defrag_window_budget_us();
+    if (g_defrag.window_us >= window_budget_us) {
+        return;
+    }
+
+    uint64_t slice_us = std::min((uint64_t)g_config.active_defrag_budget_us, window_budget_us - g_defrag.window_us);
+    uint64_t start_us = get_monotonic_usec();
+    uint64_t deadline_us = start_us + slice_us;
+    while (get_monotonic_usec() < deadline_us) {
+        if (!g_defrag.zsets.empty()) {
+            defrag_zset_step();
+        } else if (!hm_scan(&g_data.db, &g_defrag.cursor, &defrag_visit, NULL)) {
+            if (g_defrag.moving) {
+                defrag_finish();
+                break;
+            }
+            g_defrag.moving = true;             // the pages are counted, now the second walk
+            g_defrag.cursor = 0;
+            for (HMap *hmap : k_rehash_maps) {
+                defrag_table(hmap);
+            }
+        }
+
+        if (g_defrag.spare.size() + g_defrag.spare_ents.size() + g_defrag.spare_strs.size() >= k_defrag_max_spare) {
+            defrag_release();
+        }
+    }
+    g_defrag.window_us += get_monotonic_usec() - start_us;
+}
+
+// refresh the ops/sec figure about once a second
+static void stats_tick(uint64_t now_ms) {
+    uint64_t elapsed = now_ms - g_data.stats.sample_ms;
+    if (elapsed < 1000) {
+        return;
+    }
+
+    g_data.stats.ops_per_sec = (g_data.stats.total_cmds - g_data.stats.sample_cmds) * 1000 / elapsed;
+    g_data.stats.sample_ms = now_ms;
+    g_data.stats.sample_cmds = g_data.stats.total_cmds;
+}
+
+// statistics and the stall check at the end of an event loop iteration
+static void repl_cron();
+static void block_resume();
+
+static void loop_finish(uint64_t loop_start_us) {
+    uint64_t timers_start_us = get_monotonic_usec();
+    process_timers();
+    block_resume();
+    repl_cron();
+    rehash_cron();
+    defrag_cron();
+
+    // busy time of this iteration, excluding the wait for events
+    uint64_t loop_end_us = get_monotonic_usec();
+    g_data.stats.phase_us[PH_TIMERS] = loop_end_us - timers_start_us;
+    g_data.stats.loop_iters++;
+    g_data.stats.loop_last_us = g_data.stats.phase_us[PH_POLL] + (loop_end_us - loop_start_us);
+    hist_record(&g_data.stats.loop_us, g_data.stats.loop_last_us);
+    stall_check(g_data.stats.loop_last_us);
+    stats_tick(loop_end_us / 1000);
+}
+
+enum {
+    UOP_NONE   = 0,
+    UOP_ACCEPT = 1,
+    UOP_RECV   = 2,
+    UOP_SEND   = 3,
+    UOP_WAKE   = 4,         // read of the background job eventfd
+};
+
+const uint32_t k_uring_entries = 4096;
+const uint32_t k_uring_nbufs = 1024;                   // provided receive buffers, power of 2
+const uint32_t k_uring_buf_size = 16 * 1024;
+const uint16_t k_uring_bgid = 1;
+
+// user_data: operation in the top byte, Conn (or Listener for accepts) pointer below
+static uint64_t uring_udata(uint8_t op, void *ptr) {
+    return ((uint64_t)op << 56) | (uint64_t)(uintptr_t)ptr;
+}
+
+static struct io_uring_sqe *uring_sqe() {
+    struct io_uring_sqe *sqe = uring_get_sqe(&g_uring.ring);
+    if (!sqe) {
+        uring_submit(&g_uring.ring);            // SQ full, flush early
+        sqe = uring_get_sqe(&g_uring.ring);
+    }
+    assert(sqe);
+    return sqe;
+}
+
+static void uring_arm_accept(Listener *l) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = l->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = uring_udata(UOP_ACCEPT, l);
+}
+
+static void uring_arm_wake() {
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = g_bg.fd;
+    sqe->addr = (uint64_t)(uintptr_t)&g_uring.wake_val;
+    sqe->len = sizeof(g_uring.wake_val);
+    sqe->user_data = uring_udata(UOP_WAKE, NULL);
+}
+
+// multishot recv into the provided buffer ring
+static void uring_arm_recv(Conn *conn) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = k_uring_bgid;
+    sqe->user_data = uring_udata(UOP_RECV, conn);
+
+    conn->recv_armed = true;
+    conn->uring_inflight++;
+}
+
+// stop the multishot recv, completed with -ECANCELED
+static void uring_cancel_recv(Conn *conn) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_udata(UOP_RECV, conn);
+    sqe->user_data = uring_udata(UOP_NONE, NULL);
+}
+
+static void uring_send(Conn *conn) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)conn->sending.data();
+    sqe->len = (uint32_t)conn->sending.size();
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uring_udata(UOP_SEND, conn);
+
+    conn->uring_inflight++;
+}
+
+static void uring_queue_send(Conn *conn) {
+    if (!conn->send_queued) {
+        conn->send_queued = true;
+        g_uring.send_queue.push_back(conn);
+    }
+}
+
+// queued chunks go out with one sendmsg(), the iovecs and chunks stay put until it completes
+static void uring_sendmsg(Conn *conn) {
+    conn->send_iov.resize(k_max_iov);
+    size_t n = conn_output_iov(conn, conn->send_iov.data(), k_max_iov, false);
+
+    conn->send_msg = {};
+    conn->send_msg.msg_iov = conn->send_iov.data();
+    conn->send_msg.msg_iovlen = n;
+
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&conn->send_msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uring_udata(UOP_SEND, conn);
+
+    conn->iov_inflight = true;
+    conn->uring_inflight++;
+}
+
+static void uring_release(Conn *conn) {
+    if (conn->dead && conn->uring_inflight == 0 && !conn->send_queued) {
+        conn_free(conn);
+    }
+}
+
+// one send per connection, all submitted together with the wait for events
+static void uring_flush_sends() {
+    for (Conn *conn : g_uring.send_queue) {
+        conn->send_queued = false;
+        if (conn->dead) {
+            uring_release(conn);
+            continue;
+        }
+
+        if (conn_output_held(conn)) {
+            continue;                           // queued again once the snapshot is done
+        }
+
+        if (!conn->sending.empty() || conn->iov_inflight) {
+            continue;                           // resumed by the send completion
+        }
+
+        if (!conn->outq.empty()) {
+            if (!conn->outgoing.empty()) {
+                SharedBuf *own = new SharedBuf();
+                own->data.swap(conn->outgoing);
+                conn->outq.push_back(OutChunk{own, 0});
+                conn->outq_bytes += own->data.size();
+            }
+            uring_sendmsg(conn);
+        } else if (!conn->outgoing.empty()) {
+            conn->sending.swap(conn->outgoing);
+            uring_send(conn);
+        }
+    }
+    g_uring.send_queue.clear();
+}
+
+static void uring_handle_accept(Listener *l, int32_t res, uint32_t flags) {
+    if (res >= 0) {
+        Conn *conn = conn_accepted(l, res);
+        uring_arm_recv(conn);
+    } else {
+        fprintf(stderr, "accept: %s\n", strerror(-res));
+    }
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        uring_arm_accept(l);
+    }
+}
+
+static void uring_handle_recv(Conn *conn, int32_t res, uint32_t flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = false;
+        conn->uring_inflight--;
+    }
+
+    bool has_buf = flags & IORING_CQE_F_BUFFER;
+    uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+
+    if (!conn->dead) {
+        conn_touch(conn);
+        if (res > 0) {
+            handle_input(conn, uring_bufring_get(&g_uring.bufring, bid), (size_t)res);
+        } else if (res != -ENOBUFS && res != -ECANCELED) {    // out of buffers or paused, see conn_pause_read()
+            conn->want_close = true;
+        }
+    }
+
+    if (has_buf) {
+        uring_bufring_recycle(&g_uring.bufring, bid);
+    }
+
+    if (conn->dead) {
+        return uring_release(conn);
+    }
+    if (conn->want_close) {
+        return conn_destroy(conn);
+    }
+
+    if (!conn->recv_armed && !conn->read_paused) {
+        uring_arm_recv(conn);
+    }
+    if (conn_pending_bytes(conn) > 0) {
+        uring_queue_send(conn);
+    }
+}
+
+static void uring_handle_send(Conn *conn, int32_t res) {
+    conn->uring_inflight--;
+    if (conn->dead) {
+        return uring_release(conn);
+    }
+
+    if (res < 0) {
+        return conn_destroy(conn);
+    }
+
+    if (conn->iov_inflight) {
+        conn->iov_inflight = false;
+        conn_consume_output(conn, (size_t)res);             // only covers the front of `outq`
+        conn_output_drained(conn);
+        if (conn_pending_bytes(conn) > 0) {
+            uring_queue_send(conn);
+        }
+        return;
+    }
+
+    buf_consume(conn->sending, (size_t)res);
+    conn_output_drained(conn);
+    if (!conn->sending.empty()) {
+        uring_send(conn);                       // short send, continue with the rest
+    } else if (conn_pending_bytes(conn) > 0) {
+        uring_queue_send(conn);
+    }
+}
+
+// output appended outside of a request/response cycle
+static void conn_want_write(Conn *conn) {
+    conn->want_write = true;
+    if (g_uring.enabled) {
+        uring_queue_send(conn);
+    }
+}
+
+// Replication
+//
+// A replica connects to its leader and sends PSYNC <replid> <offset>. If the offset is still in the
+// leader's backlog the reply is "continue" and the missing part of the command stream follows.
+// Otherwise the reply is "full": a forked child writes a copy-on-write snapshot of the keyspace to
+// the socket, encoded as commands between SNAPSHOT-BEGIN <nkeys>, so the replica can presize its
+// keyspace, and SNAPSHOT-END <replid> <offset>, while the leader keeps serving clients and holds
+// the stream produced meanwhile until the child exits.
+// The stream uses the request framing so replicas apply it with do_request().
+
+const size_t k_repl_backlog_size = 1 << 20;
+const size_t k_repl_output_limit = 64 << 20;            // replicas further behind are dropped
+const uint64_t k_repl_retry_ms = 1000;
+const uint64_t k_repl_snapshot_poll_ms = 100;
+const size_t k_snapshot_chunk = 64 * 1024;
+const int k_snapshot_write_timeout_ms = 60 * 1000;
+static const char k_snapshot_begin[] = "snapshot-begin";
+static const char k_snapshot_end[] = "snapshot-end";
+
+// encode a command with the request framing
+static size_t req_begin(Buffer &out, uint32_t nstr) {
+    size_t pos = out.size();
+    buf_append_u32(out, 0);                     // message length, set by req_end()
+    buf_append_u32(out, nstr);
+    return pos;
+}
+
+static void req_arg(Buffer &out, const char *s, size_t len) {
+    buf_append_u32(out, (uint32_t)len);
+    buf_append(out, (const uint8_t *)s, len);
+}
+
+static void req_end(Buffer &out, size_t pos) {
+    uint32_t len = (uint32_t)(out.size() - pos - 4);
+    memcpy(&out[pos], &len, 4);
+}
+
+static void repl_new_replid() {
+    uint8_t raw[20];
+    if (getrandom(raw, sizeof(raw), 0) != (ssize_t)sizeof(raw)) {
+        srand((unsigned)(get_realtime_msec() ^ getpid()));
+        for (uint8_t &b : raw) {
+            b = (uint8_t)rand();
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(raw); i++) {
+        snprintf(&g_repl.replid[i * 2], 3, "%02x", raw[i]);
+    }
+}
+
+static void backlog_append(const uint8_t *data, size_t len) {
+    Buffer &bl = g_repl.backlog;
+    while (len > 0) {
+        size_t n = bl.size() - g_repl.backlog_idx;
+        n = n < len ? n : len;
+        memcpy(&bl[g_repl.backlog_idx], data, n);
+        g_repl.backlog_idx = (g_repl.backlog_idx + n) % bl.size();
+        g_repl.backlog_histlen = g_repl.backlog_histlen + n < bl.size() ? g_repl.backlog_histlen + n : bl.size();
+        data += n;
+        len -= n;
+    }
+}
+
+static bool backlog_has(uint64_t offset) {
+    return offset <= g_repl.offset && offset >= g_repl.offset - g_repl.backlog_histlen;
+}
+
+// append the stream from `offset` to the current position
+static void backlog_copy(Buffer &out, uint64_t offset) {
+    const Buffer &bl = g_repl.backlog;
+    size_t n = (size_t)(g_repl.offset - offset);
+    size_t pos = (g_repl.backlog_idx + bl.size() - n) % bl.size();
+    while (n > 0) {
+        size_t chunk = bl.size() - pos < n ? bl.size() - pos : n;
+        buf_append(out, &bl[pos], chunk);
+        pos = (pos + chunk) % bl.size();
+        n -= chunk;
+    }
+}
+
+// propagate a write command to the backlog and the replicas
+static void repl_feed(const std::vector<std::string> &cmd) {
+    if (g_repl.backlog.empty()) {
+        return;                                 // no replica has attached yet
+    }
+
+    static Buffer frame;
+    frame.clear();
+    size_t pos = req_begin(frame, (uint32_t)cmd.size());
+    for (const std::string &arg : cmd) {
+        req_arg(frame, arg.data(), arg.size());
+    }
+    req_end(frame, pos);
+
+    backlog_append(frame.data(), frame.size());
+    g_repl.offset += frame.size();
+
+    for (Conn *r : g_repl.replicas) {
+        if (r->repl_role == REPL_SNAPSHOT || r->repl_role == REPL_ONLINE) {
+            buf_append(r->outgoing, frame.data(), frame.size());
+        }
+        if (r->repl_role == REPL_ONLINE) {
+            conn_want_write(r);
+        }
+    }
+}
+
+static void repl_conn_closed(Conn *conn) {
+    if (conn->repl_role == REPL_LEADER) {
+        printf("lost connection to leader\n");
+        g_repl.link = NULL;
+        g_repl.link_state = LINK_DOWN;
+        if (conn->tx.multi) {
+            g_repl.offset = conn->tx.repl_offset;   // the partial transaction is sent again
+        }
+        g_repl.link_retry_ms = g_data.now_ms + k_repl_retry_ms;
+    } else if (conn->repl_role != REPL_NONE) {
+        std::vector<Conn *> &v = g_repl.replicas;
+        for (size_t i = 0; i < v.size(); i++) {
+            if (v[i] == conn) {
+                v[i] = v.back();
+                v.pop_back();
+                break;
+            }
+        }
+        printf("replica %d disconnected\n", conn->fd);
+    }
+}
+
+// PSYNC <replid> <offset>, sent by a replica to start or resume replication
+static void do_psync(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    if (conn->proto != PROTO_NATIVE) {
+        return out_err(out, ERR_BAD_ARG, "replication needs the native protocol");
+    }
+    if (g_repl.is_replica) {
+        return out_err(out, ERR_BAD_ARG, "replicas cannot have replicas");
+    }
+
+    int64_t offset = 0;
+    if (!str2int(cmd[2], offset)) {
+        return out_err(out, ERR_BAD_ARG, "expected int");
+    }
+
+    if (g_repl.backlog.empty()) {
+        g_repl.backlog.resize(k_repl_backlog_size);
+    }
+
+    conn_set_idle_exempt(conn, true);
+    g_repl.replicas.push_back(conn);
+
+    if (cmd[1] == g_repl.replid && offset >= 0 && backlog_has((uint64_t)offset)) {
+        printf("replica %d: partial resync from offset %lld\n", conn->fd, (long long)offset);
+        conn->repl_role = REPL_CONTINUE;        // repl_cron() sends the backlog after this reply
+        conn->repl_psync_off = (uint64_t)offset;
+        return out_str(out, "continue", 8);
+    }
+
+    printf("replica %d: full resync\n", conn->fd);
+    conn->repl_role = REPL_WAIT_BGSAVE;
+    return out_str(out, "full", 4);
+}
+
+struct SnapshotWriter {
+    std::vector<int> fds;                       // -1 once writing to the replica failed
+    bool collect = false;                       // keep everything in `buf`, the caller sends it
+    Buffer buf;
+    const Entry *ent = NULL;                    // entry whose members are being written
+};
+
+// write all of it to a non-blocking socket, false if the replica is gone or stopped reading
+static bool write_full(int fd, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t rv = write(fd, data, len);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            if (poll(&pfd, 1, k_snapshot_write_timeout_ms) <= 0) {
+                return false;
+            }
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+
+        data += rv;
+        len -= (size_t)rv;
+    }
+    return true;
+}
+
+static void snapshot_flush(SnapshotWriter *w) {
+    if (w->collect) {
+        return;
+    }
+    for (int &fd : w->fds) {
+        if (fd >= 0 && !write_full(fd, w->buf.data(), w->buf.size())) {
+            fd = -1;
+        }
+    }
+    w->buf.clear();
+}
+
+static bool cb_snapshot_member(HNode *node, void *arg) {
+    SnapshotWriter *w = (SnapshotWriter *)arg;
+    ZNode *znode = container_of(node, ZNode, hmap);
+
+    char score[32];
+    int n = snprintf(score, sizeof(score), "%.17g", znode->score);      // round-trips exactly
+
+    size_t pos = req_begin(w->buf, 4);
+    req_arg(w->buf, "zadd", 4);
+    req_arg(w->buf, w->ent->key.data(), w->ent->key.size());
+    req_arg(w->buf, score, (size_t)n);
+    req_arg(w->buf, znode->name, znode->len);
+    req_end(w->buf, pos);
+
+    if (w->buf.size() >= k_snapshot_chunk) {
+        snapshot_flush(w);
+    }
+    return true;
+}
+
+static bool cb_snapshot_field(const char *field, size_t flen, const char *val, size_t vlen, void *arg) {
+    SnapshotWriter *w = (SnapshotWriter *)arg;
+
+    size_t pos = req_begin(w->buf, 4);
+    req_arg(w->buf, "hset", 4);
+    req_arg(w->buf, w->ent->key.data(), w->ent->key.size());
+    req_arg(w->buf, field, flen);
+    req_arg(w->buf, val, vlen);
+    req_end(w->buf, pos);
+
+    if (w->buf.size() >= k_snapshot_chunk) {
+        snapshot_flush(w);
+    }
+    return true;
+}
+
+static bool cb_snapshot_element(const char *s, size_t len, void *arg) {
+    SnapshotWriter *w = (SnapshotWriter *)arg;
+
+    size_t pos = req_begin(w->buf, 3);
+    req_arg(w->buf, "rpush", 5);
+    req_arg(w->buf, w->ent->key.data(), w->ent->key.size());
+    req_arg(w->buf, s, len);
+    req_end(w->buf, pos);
+
+    if (w->buf.size() >= k_snapshot_chunk) {
+        snapshot_flush(w);
+    }
+    return true;
+}
+
+const size_t k_snapshot_blob = 2048;           // bytes of sketch data per command
+
+static void snapshot_hll_flush(SnapshotWriter *w, std::string &regs) {
+    size_t pos = req_begin(w->buf, 3);
+    req_arg(w->buf, "pfsetregs", 9);
+    req_arg(w->buf, w->ent->key.data(), w->ent->key.size());
+    req_arg(w->buf, regs.data(), regs.size());
+    req_end(w->buf, pos);
+    regs.clear();
+}
+
+struct SnapshotRegs {
+    SnapshotWriter *w;
+    std::string regs;
+};
+
+static bool cb_snapshot_register(uint32_t idx, uint8_t val, void *arg) {
+    SnapshotRegs *sr = (SnapshotRegs *)arg;
+    uint16_t idx16 = (uint16_t)idx;
+    sr->regs.append((const char *)&idx16, 2);
+    sr->regs.push_back((char)val);
+
+    if (sr->regs.size() + 3 > k_snapshot_blob) {
+        snapshot_hll_flush(sr->w, sr->regs);
+    }
+    if (sr->w->buf.size() >= k_snapshot_chunk) {
+        snapshot_flush(sr->w);
+    }
+    return true;
+}
+
+// PFADD creates the key, then the non-zero registers
+static void snapshot_hll(SnapshotWriter *w, Entry *ent) {
+    size_t pos = req_begin(w->buf, 2);
+    req_arg(w->buf, "pfadd", 5);
+    req_arg(w->buf, ent->key.data(), ent->key.size());
+    req_end(w->buf, pos);
+
+    w->ent = ent;
+    SnapshotRegs sr = {w, std::string()};
+    hll_foreach(ent->hll, &cb_snapshot_register, &sr);
+    if (!sr.regs.empty()) {
+        snapshot_hll_flush(w, sr.regs);
+    }
+}
+
+// BF.RESERVE with the original parameters, then the bits of each layer
+static void snapshot_bloom(SnapshotWriter *w, Entry *ent) {
+    const Bloom *bf = ent->bloom;
+    char error[32];
+    int n = snprintf(error, sizeof(error), "%.17g", bf->error);
+    std::string capacity = std::to_string(bf->capacity);
+
+    size_t pos = req_begin(w->buf, 4);
+    req_arg(w->buf, "bf.reserve", 10);
+    req_arg(w->buf, ent->key.data(), ent->key.size());
+    req_arg(w->buf, error, (size_t)n);
+    req_arg(w->buf, capacity.data(), capacity.size());
+    req_end(w->buf, pos);
+
+    for (uint32_t i = 0; i < bf->nlayers; i++) {
+        const BloomLayer *l = &bf->layers[i];
+        std::string layer = std::to_string(i), count = std::to_string(l->count);
+        for (size_t off = 0; off < l->nbits / 8; off += k_snapshot_blob) {
+            size_t len = l->nbits / 8 - off < k_snapshot_blob ? l->nbits / 8 - off : k_snapshot_blob;
+            std::string offset = std::to_string(off);
+
+            pos = req_begin(w->buf, 6);
+            req_arg(w->buf, "bf.loadchunk", 12);
+            req_arg(w->buf, ent->key.data(), ent->key.size());
+            req_arg(w->buf, layer.data(), layer.size());
+            req_arg(w->buf, count.data(), count.size());
+            req_arg(w->buf, offset.data(), offset.size());
+            req_arg(w->buf, (const char *)l->bits + off, len);
+            req_end(w->buf, pos);
+
+            if (w->buf.size() >= k_snapshot_chunk) {
+                snapshot_flush(w);
+            }
+        }
+    }
+}
+
+static bool cb_snapshot_entry(HNode *node, void *arg) {
+    SnapshotWriter *w = (SnapshotWriter *)arg;
+    Entry *ent = container_of(node, Entry, node);
+
+    if (ent->type == T_STR) {
+        size_t pos = req_begin(w->buf, 3);
+        req_arg(w->buf, "set", 3);
+        req_arg(w->buf, ent->key.data(), ent->key.size());
+        if (ent->enc == STR_INT) {
+            char buf[24];
+            size_t len = 0;
+            const char *s = int2str(ent->ival, buf, len);
+            req_arg(w->buf, s, len);
+        } else if (ent->enc == STR_LZ4) {
+            std::string raw((size_t)ent->ival, '\0');
+            str_decompress(ent, (uint8_t *)&raw[0]);
+            req_arg(w->buf, raw.data(), raw.size());
+        } else {
+            req_arg(w->buf, ent->str.data(), ent->str.size());
+        }
+        req_end(w->buf, pos);
+    } else if (ent->type == T_ZSET) {
+        w->ent = ent;
+        hm_foreach(&ent->zset->hmap, &cb_snapshot_member, w);
+    } else if (ent->type == T_HASH) {
+        w->ent = ent;
+        hash_foreach(ent->hash, &cb_snapshot_field, w);
+    } else if (ent->type == T_LIST) {
+        w->ent = ent;
+        qlist_range(ent->list, 0, ent->list->size - 1, &cb_snapshot_element, w);
+    } else if (ent->type == T_HLL) {
+        snapshot_hll(w, ent);
+    } else if (ent->type == T_BLOOM) {
+        snapshot_bloom(w, ent);
+    }
+
+    if (ent->heap_idx != (size_t)-1) {
+        uint64_t expire_ms = g_data.heap[ent->heap_idx].val;
+        std::string ttl = std::to_string(expire_ms > g_data.now_ms ? expire_ms - g_data.now_ms : 0);
+
+        size_t pos = req_begin(w->buf, 3);
+        req_arg(w->buf, "pexpire", 7);
+        req_arg(w->buf, ent->key.data(), ent->key.size());
+        req_arg(w->buf, ttl.data(), ttl.size());
+        req_end(w->buf, pos);
+    }
+
+    if (w->buf.size() >= k_snapshot_chunk) {
+        snapshot_flush(w);
+    }
+    return true;
+}
+
+// runs in the forked child, which sees the keyspace as it was at fork time
+static void repl_snapshot_child(const std::vector<Conn *> &targets) {
+    SnapshotWriter w;
+    for (Conn *r : targets) {
+        // output not sent yet, including the PSYNC reply
+        bool ok = write_full(r->fd, r->outgoing.data(), r->outgoing.size());
+        w.fds.push_back(ok ? r->fd : -1);
+    }
+
+    std::string nkeys = std::to_string(hm_size(&g_data.db));
+    size_t pos = req_begin(w.buf, 2);
+    req_arg(w.buf, k_snapshot_begin, strlen(k_snapshot_begin));
+    req_arg(w.buf, nkeys.data(), nkeys.size());
+    req_end(w.buf, pos);
+    hm_foreach(&g_data.db, &cb_snapshot_entry, &w);
+
+    std::string offset = std::to_string(g_repl.offset);
+    pos = req_begin(w.buf, 3);
+    req_arg(w.buf, k_snapshot_end, strlen(k_snapshot_end));
+    req_arg(w.buf, g_repl.replid, strlen(g_repl.replid));
+    req_arg(w.buf, offset.data(), offset.size());
+    req_end(w.buf, pos);
+    snapshot_flush(&w);
+
+    for (int fd : w.fds) {
+        if (fd < 0) {
+            _exit(1);                           // the parent drops all targets, they retry
+        }
+    }
+    _exit(0);
+}
+
+static void repl_start_snapshot() {
+    std::vector<Conn *> targets;
+    for (Conn *r : g_repl.replicas) {
+        if (r->repl_role == REPL_WAIT_BGSAVE && r->sending.empty()) {
+            targets.push_back(r);
+        }
+    }
+    if (targets.empty()) {
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        for (Conn *r : targets) {
+            conn_destroy(r);
+        }
+        return;
+    }
+    if (pid == 0) {
+        repl_snapshot_child(targets);
+    }
+
+    printf("snapshot child %d started for %zu replica(s)\n", (int)pid, targets.size());
+    g_repl.snapshot_pid = pid;
+    g_repl.snapshot_start_ms = g_data.now_ms;
+    for (Conn *r : targets) {
+        r->repl_role = REPL_SNAPSHOT;
+        r->outgoing.clear();                    // written by the child
+        r->want_read = true;
+        r->want_write = false;
+    }
+}
+
+static void repl_snapshot_done(bool ok) {
+    printf("snapshot child %d %s after %llu ms\n", (int)g_repl.snapshot_pid, ok ? "finished" : "failed",
+        (unsigned long long)(g_data.now_ms - g_repl.snapshot_start_ms));
+    g_repl.snapshot_pid = -1;
+
+    std::vector<Conn *> replicas = g_repl.replicas;
+    for (Conn *r : replicas) {
+        if (r->repl_role != REPL_SNAPSHOT) {
+            continue;
+        }
+
+        if (!ok) {
+            conn_destroy(r);
+            continue;
+        }
+
+        r->repl_role = REPL_ONLINE;
+        if (!r->outgoing.empty()) {
+            conn_want_write(r);
+        }
+    }
+}
+
+static void db_clear();
+
+// apply the reply to our PSYNC
+static void repl_handshake_reply(Conn *conn, const uint8_t *data, size_t len) {
+    const uint8_t *end = data + len;
+    uint32_t n = 0;
+    std::string reply;
+    if (len > 0 && data[0] == TAG_STR) {
+        data++;
+        if (!read_u32(data, end, n) || !read_str(data, end, n, reply)) {
+            reply.clear();
+        }
+    }
+
+    if (reply == "continue") {
+        printf("partial resync from offset %llu\n", (unsigned long long)g_repl.offset);
+        g_repl.link_state = LINK_UP;
+    } else if (reply == "full") {
+        printf("full resync, loading snapshot\n");
+        db_clear();
+        g_repl.replid[0] = '\0';               // a partially loaded snapshot cannot be resumed
+        g_repl.link_state = LINK_SYNC;
+    } else {
+        printf("leader refused PSYNC\n");
+        conn->want_close = true;
+    }
+}
+
+// a message from our leader
+static void repl_link_input(Conn *conn, const uint8_t *data, size_t len) {
+    if (g_repl.link_state == LINK_HANDSHAKE) {
+        return repl_handshake_reply(conn, data, len);
+    }
+
+    std::vector<std::string> cmd;
+    if (parse_req(data, len, cmd) < 0 || cmd.empty()) {
+        printf("bad replication stream\n");
+        conn->want_close = true;
+        return;
+    }
+
+    if (g_repl.link_state == LINK_SYNC && cmd[0] == k_snapshot_begin) {
+        int64_t nkeys = 0;
+        if (cmd.size() == 2 && str2int(cmd[1], nkeys) && nkeys > 0) {
+            hm_reserve(&g_data.db, (size_t)nkeys);  // no resizing while the keys are loaded
+        }
+        return;
+    }
+    if (g_repl.link_state == LINK_SYNC && cmd[0] == k_snapshot_end) {
+        int64_t offset = 0;
+        if (cmd.size() != 3 || cmd[1].size() != sizeof(g_repl.replid) - 1 || !str2int(cmd[2], offset)) {
+            printf("bad snapshot trailer\n");
+            conn->want_close = true;
+            return;
+        }
+
+        memcpy(g_repl.replid, cmd[1].data(), cmd[1].size());
+        g_repl.offset = (uint64_t)offset;
+        g_repl.link_state = LINK_UP;
+        printf("snapshot loaded, %zu keys\n", hm_size(&g_data.db));
+        return;
+    }
+
+    static Buffer discard;
+    discard.clear();
+    do_request(conn, cmd, discard);
+    if (g_repl.link_state == LINK_UP) {
+        g_repl.offset += 4 + len;               // snapshot contents are not part of the stream
+    }
+}
+
+// an outgoing link to another node, connected in the background
+static Conn *conn_connect(const struct sockaddr_in &addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return NULL;
+    }
+
+    fd_set_nb(fd);
+    int val = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val));      // links are exempt from the idle timeout
+
+    int rv = connect(fd, (const struct sockaddr *)&addr, sizeof(addr));
+    if (rv < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        close(fd);
+        return NULL;
+    }
+
+    Conn *conn = conn_new(fd);
+    conn->proto = PROTO_NATIVE;
+    conn_set_idle_exempt(conn, true);
+    return conn;
+}
+
+static void repl_connect() {
+    Conn *conn = conn_connect(g_repl.leader_addr);
+    if (!conn) {
+        g_repl.link_retry_ms = g_data.now_ms + k_repl_retry_ms;
+        return;
+    }
+    conn->repl_role = REPL_LEADER;
+    g_repl.link = conn;
+    g_repl.link_state = LINK_HANDSHAKE;
+
+    // PSYNC <replid> <offset>, "?" asks for a full resync
+    const char *replid = g_repl.replid[0] ? g_repl.replid : "?";
+    std::string offset = std::to_string(g_repl.offset);
+    size_t pos = req_begin(conn->outgoing, 3);
+    req_arg(conn->outgoing, "psync", 5);
+    req_arg(conn->outgoing, replid, strlen(replid));
+    req_arg(conn->outgoing, offset.data(), offset.size());
+    req_end(conn->outgoing, pos);
+
+    if (g_uring.enabled) {
+        uring_arm_recv(conn);
+    }
+    conn_want_write(conn);
+}
+
+static bool repl_resolve(const std::string &host, uint16_t port, struct sockaddr_in &addr) {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(host.c_str(), NULL, &hints, &res) != 0 || !res) {
+        return false;
+    }
+
+    memcpy(&addr, res->ai_addr, sizeof(addr));
+    addr.sin_port = htons(port);
+    freeaddrinfo(res);
+    return true;
+}
+
+// become a replica of host:port, our own replicas are dropped as replication is not chained
+static bool repl_set_leader(const std::string &host, uint16_t port) {
+    struct sockaddr_in addr = {};
+    if (!repl_resolve(host, port, addr)) {
+        return false;
+    }
+
+    std::vector<Conn *> replicas = g_repl.replicas;
+    for (Conn *r : replicas) {
+        conn_destroy(r);
+    }
+    if (g_repl.link) {
+        conn_destroy(g_repl.link);
+    }
+
+    Buffer().swap(g_repl.backlog);
+    g_repl.backlog_idx = g_repl.backlog_histlen = 0;
+
+    g_repl.is_replica = true;
+    g_repl.leader_host = host;
+    g_repl.leader_port = port;
+    g_repl.leader_addr = addr;
+    g_repl.link_state = LINK_DOWN;
+    g_repl.link_retry_ms = 0;                   // connect right away
+    printf("replicating from %s:%u\n", host.c_str(), (unsigned)port);
+    return true;
+}
+
+static void repl_promote() {
+    if (!g_repl.is_replica) {
+        return;
+    }
+
+    if (g_repl.link) {
+        conn_destroy(g_repl.link);
+    }
+    g_repl.is_replica = false;
+    g_repl.link_state = LINK_DOWN;
+    g_repl.leader_host.clear();
+    g_repl.leader_port = 0;
+    repl_new_replid();                          // our history diverges from the old leader's
+    printf("promoted to leader\n");
+}
+
+// REPLICAOF <host> <port> | REPLICAOF NO ONE
+static void block_unblock_all(uint32_t code, const char *msg);
+
+static void do_replicaof(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    str_lower(cmd[1]);
+    str_lower(cmd[2]);
+    if (cmd[1] == "no" && cmd[2] == "one") {
+        repl_promote();
+        return out_nil(out);
+    }
+
+    int64_t port = 0;
+    if (!str2int(cmd[2], port) || port <= 0 || port > 65535) {
+        return out_err(out, ERR_BAD_ARG, "expected port");
+    }
+    if (!repl_set_leader(cmd[1], (uint16_t)port)) {
+        return out_err(out, ERR_BAD_ARG, "cannot resolve host");
+    }
+    block_unblock_all(ERR_READONLY, "became a read-only replica");
+    return out_nil(out);
+}
+
+static uint64_t repl_next_timer_ms() {
+    if (g_repl.snapshot_pid > 0) {
+        return g_data.now_ms + k_repl_snapshot_poll_ms;
+    }
+    if (g_repl.is_replica && !g_repl.link) {
+        return g_repl.link_retry_ms;
+    }
+    return -1;
+}
+
+// reap the snapshot child, start a new one, resume replicas, (re)connect to the leader
+static void repl_cron() {
+    if (g_repl.snapshot_pid > 0) {
+        int status = 0;
+        pid_t pid = waitpid(g_repl.snapshot_pid, &status, WNOHANG);
+        if (pid == g_repl.snapshot_pid || pid < 0) {
+            repl_snapshot_done(pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }
+    }
+
+    std::vector<Conn *> dropped;
+    for (Conn *r : g_repl.replicas) {
+        if (r->repl_role == REPL_CONTINUE && backlog_has(r->repl_psync_off)) {
+            backlog_copy(r->outgoing, r->repl_psync_off);
+            r->repl_role = REPL_ONLINE;
+            conn_want_write(r);
+        } else if (r->repl_role == REPL_CONTINUE) {
+            dropped.push_back(r);               // overwritten since PSYNC, it will retry
+        } else if (r->outgoing.size() + r->sending.size() > k_repl_output_limit) {
+            printf("replica %d exceeded the output limit\n", r->fd);
+            dropped.push_back(r);
+        }
+    }
+    for (Conn *r : dropped) {
+        conn_destroy(r);
+    }
+
+    if (g_repl.snapshot_pid < 0) {
+        repl_start_snapshot();
+    }
+
+    if (g_repl.is_replica && !g_repl.link && g_data.now_ms >= g_repl.link_retry_ms) {
+        repl_connect();
+    }
+}
+
+static bool cb_collect_entry(HNode *node, void *arg) {
+    ((std::vector<Entry *> *)arg)->push_back(container_of(node, Entry, node));
+    return true;
+}
+
+static void tracking_invalidate_all();
+static void bg_wait_all();
+
+static void db_clear() {
+    bg_wait_all();
+    std::vector<Entry *> ents;
+    hm_foreach(&g_data.db, &cb_collect_entry, &ents);
+    hm_clear(&g_data.db);
+    for (Entry *ent : ents) {
+        entry_del(ent);
+    }
+    tracking_invalidate_all();
+}
+
+// Pub/Sub
+//
+// A published message is encoded once into a SharedBuf and queued by reference to each
+// subscriber, see conn_push_shared(). Subscribers are exempt from the idle timeout but are
+// disconnected when their pending output exceeds pubsub-output-limit.
+
+static bool channel_eq(HNode *node, HNode *key) {
+    Channel *ch = container_of(node, Channel, node);
+    LookupKey *keydata = container_of(key, LookupKey, node);
+    return ch->name == keydata->key;
+}
+
+static Channel *channel_lookup(HMap *map, const std::string &name) {
+    LookupKey key;
+    key.key = name;
+    key.node.hcode = str_hash((const uint8_t *)name.data(), name.size());
+
+    HNode *node = hm_lookup(map, &key.node, &channel_eq);
+    return node ? container_of(node, Channel, node) : NULL;
+}
+
+static void vec_remove(std::vector<Channel *> &v, Channel *ch) {
+    for (size_t i = 0; i < v.size(); i++) {
+        if (v[i] == ch) {
+            v[i] = v.back();
+            v.pop_back();
+            return;
+        }
+    }
+}
+
+static void vec_remove(std::vector<Conn *> &v, Conn *conn) {
+    for (size_t i = 0; i < v.size(); i++) {
+        if (v[i] == conn) {
+            v[i] = v.back();
+            v.pop_back();
+            return;
+        }
+    }
+}
+
+// returns false if already subscribed
+static bool pubsub_add(HMap *map, std::vector<Channel *> &subs, Conn *conn, const std::string &name) {
+    Channel *ch = channel_lookup(map, name);
+    if (!ch) {
+        ch = new Channel();
+        ch->name = name;
+        ch->node.hcode = str_hash((const uint8_t *)name.data(), name.size());
+        hm_insert(map, &ch->node);
+    }
+
+    for (Channel *c : subs) {
+        if (c == ch) {
+            return false;
+        }
+    }
+
+    ch->subs.push_back(conn);
+    subs.push_back(ch);
+    conn_set_idle_exempt(conn, true);
+    return true;
+}
+
+static void pubsub_remove(HMap *map, std::vector<Channel *> &subs, Conn *conn, Channel *ch) {
+    vec_remove(ch->subs, conn);
+    vec_remove(subs, ch);
+    if (ch->subs.empty()) {
+        hm_delete(map, &ch->node, &hnode_same);
+        delete ch;
+    }
+    if (conn->channels.empty() && conn->patterns.empty()) {
+        conn_set_idle_exempt(conn, false);
+    }
+}
+
+static void pubsub_conn_closed(Conn *conn) {
+    while (!conn->channels.empty()) {
+        pubsub_remove(&g_pubsub.channels, conn->channels, conn, conn->channels.back());
+    }
+    while (!conn->patterns.empty()) {
+        pubsub_remove(&g_pubsub.patterns, conn->patterns, conn, conn->patterns.back());
+    }
+}
+
+// one [kind, name, count] triple per name
+static void pubsub_reply(Buffer &out, const char *kind, const std::string *name, Conn *conn) {
+    out_arr(out, 3);
+    out_str(out, kind, strlen(kind));
+    if (name) {
+        out_str(out, name->data(), name->size());
+    } else {
+        out_nil(out);
+    }
+    out_int(out, (int64_t)(conn->channels.size() + conn->patterns.size()));
+}
+
+// SUBSCRIBE channel [channel ...] / PSUBSCRIBE pattern [pattern ...]
+static void subscribe(Conn *conn, std::vector<std::string> &cmd, Buffer &out, bool pattern) {
+    HMap *map = pattern ? &g_pubsub.patterns : &g_pubsub.channels;
+    std::vector<Channel *> &subs = pattern ? conn->patterns : conn->channels;
+
+    resp_hint(conn, out, RESP_SPLIT);
+    out_arr(out, (uint32_t)(cmd.size() - 1));
+    for (size_t i = 1; i < cmd.size(); i++) {
+        pubsub_add(map, subs, conn, cmd[i]);
+        pubsub_reply(out, pattern ? "psubscribe" : "subscribe", &cmd[i], conn);
+    }
+}
+
+// UNSUBSCRIBE [channel ...] / PUNSUBSCRIBE [pattern ...], all of them without arguments
+static void unsubscribe(Conn *conn, std::vector<std::string> &cmd, Buffer &out, bool pattern) {
+    HMap *map = pattern ? &g_pubsub.patterns : &g_pubsub.channels;
+    std::vector<Channel *> &subs = pattern ? conn->patterns : conn->channels;
+    const char *kind = pattern ? "punsubscribe" : "unsubscribe";
+
+    resp_hint(conn, out, RESP_SPLIT);
+    if (cmd.size() == 1 && subs.empty()) {
+        out_arr(out, 1);
+        return pubsub_reply(out, kind, NULL, conn);
+    }
+
+    std::vector<std::string> names(cmd.begin() + 1, cmd.end());
+    if (names.empty()) {
+        for (Channel *ch : subs) {
+            names.push_back(ch->name);
+        }
+    }
+
+    out_arr(out, (uint32_t)names.size());
+    for (const std::string &name : names) {
+        Channel *ch = channel_lookup(map, name);
+        for (Channel *c : subs) {
+            if (c == ch) {
+                pubsub_remove(map, subs, conn, ch);
+                break;
+            }
+        }
+        pubsub_reply(out, kind, &name, conn);
+    }
+}
+
+static void do_subscribe(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    subscribe(conn, cmd, out, false);
+}
+
+static void do_psubscribe(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    subscribe(conn, cmd, out, true);
+}
+
+static void do_unsubscribe(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    unsubscribe(conn, cmd, out, false);
+}
+
+static void do_punsubscribe(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    unsubscribe(conn, cmd, out, true);
+}
+
+// match one pattern element at p[pi] against c, sets the position of the next element
+static bool glob_one(const char *p, size_t plen, size_t pi, uint8_t c, size_t *next) {
+    if (p[pi] == '?') {
+        *next = pi + 1;
+        return true;
+    }
+    if (p[pi] == '\\' && pi + 1 < plen) {
+        *next = pi + 2;
+        return (uint8_t)p[pi + 1] == c;
+    }
+    if (p[pi] != '[') {
+        *next = pi + 1;
+        return (uint8_t)p[pi] == c;
+    }
+
+    // [abc], [^abc], [a-z]
+    size_t i = pi + 1;
+    bool negate = i < plen && p[i] == '^';
+    if (negate) {
+        i++;
+    }
+
+    bool hit = false;
+    for (; i < plen && p[i] != ']'; i++) {
+        if (p[i] == '\\' && i + 1 < plen) {
+            i++;
+            hit = hit || (uint8_t)p[i] == c;
+        } else if (i + 2 < plen && p[i + 1] == '-' && p[i + 2] != ']') {
+            uint8_t lo = (uint8_t)p[i], hi = (uint8_t)p[i + 2];
+            if (lo > hi) {
+                std::swap(lo, hi);
+            }
+            hit = hit || (c >= lo && c <= hi);
+            i += 2;
+        } else {
+            hit = hit || (uint8_t)p[i] == c;
+        }
+    }
+
+    if (i >= plen) {
+        *next = pi + 1;                         // unterminated, a literal '['
+        return c == '[';
+    }
+    *next = i + 1;
+    return hit != negate;
+}
+
+// glob-style matching with *, ?, [...] and \ escapes
+static bool glob_match(const std::string &pattern, const std::string &s) {
+    const char *p = pattern.data();
+    size_t plen = pattern.size();
+    size_t pi = 0, si = 0;
+    size_t star_pi = (size_t)-1, star_si = 0;   // backtrack to the last '*'
+
+    while (si < s.size()) {
+        size_t next = 0;
+        if (pi < plen && p[pi] == '*') {
+            star_pi = ++pi;
+            star_si = si;
+        } else if (pi < plen && glob_one(p, plen, pi, (uint8_t)s[si], &next)) {
+            pi = next;
+            si++;
+        } else if (star_pi != (size_t)-1) {
+            pi = star_pi;
+            si = ++star_si;
+        } else {
+            return false;
+        }
+    }
+
+    while (pi < plen && p[pi] == '*') {
+        pi++;
+    }
+    return pi == plen;
+}
+
+// encode ["message", channel, payload] or ["pmessage", pattern, channel, payload] once
+static SharedBuf *pubsub_message(const std::string *pattern, const std::string &channel, const std::string &msg) {
+    SharedBuf *sb = new SharedBuf();
+    size_t header = 0;
+    response_begin(sb->data, &header);
+    if (pattern) {
+        out_arr(sb->data, 4);
+        out_str(sb->data, "pmessage", 8);
+        out_str(sb->data, pattern->data(), pattern->size());
+    } else {
+        out_arr(sb->data, 3);
+        out_str(sb->data, "message", 7);
+    }
+    out_str(sb->data, channel.data(), channel.size());
+    out_str(sb->data, msg.data(), msg.size());
+    response_end(sb->data, header);
+    return sb;
+}
+
+// queue an out-of-band message, connections over pubsub-output-limit are added to `slow`
+static bool conn_push_message(Conn *conn, SharedBuf *sb, std::vector<Conn *> &slow) {
+    if (conn->want_close) {
+        return false;                           // over the limit, about to be closed
+    }
+
+    conn_push_shared(conn, sharedbuf_for(conn, sb));
+    conn_want_write(conn);
+    bool over = g_config.pubsub_output_limit > 0 && conn_pending_bytes(conn) > (size_t)g_config.pubsub_output_limit;
+    if (over || !conn_output_ok(conn)) {
+        conn->want_close = true;
+        slow.push_back(conn);
+    }
+    return true;
+}
+
+static void close_slow_conns(Conn *self, const std::vector<Conn *> &slow) {
+    for (Conn *conn : slow) {
+        printf("closing connection %d over the output limit (%zu bytes)\n", conn->fd, conn_pending_bytes(conn));
+        g_data.output_limit_closes++;
+        if (conn != self) {
+            conn_destroy(conn);                 // the current connection is closed after its request
+        }
+    }
+}
+
+static void pubsub_deliver(Channel *ch, SharedBuf *sb, size_t &receivers, std::vector<Conn *> &slow) {
+    for (Conn *sub : ch->subs) {
+        if (conn_push_message(sub, sb, slow)) {
+            receivers++;
+        }
+    }
+}
+
+struct PatternMatch {
+    const std::string *channel;
+    const std::string *msg;
+    size_t receivers = 0;
+    std::vector<Conn *> slow;
+};
+
+static bool cb_publish_pattern(HNode *node, void *arg) {
+    PatternMatch *m = (PatternMatch *)arg;
+    Channel *pat = container_of(node, Channel, node);
+    if (glob_match(pat->name, *m->channel)) {
+        SharedBuf *sb = pubsub_message(&pat->name, *m->channel, *m->msg);
+        pubsub_deliver(pat, sb, m->receivers, m->slow);
+        sharedbuf_unref(sb);
+    }
+    return true;
+}
+
+// returns the number of receivers
+static size_t pubsub_publish(Conn *publisher, const std::string &channel, const std::string &msg) {
+    PatternMatch m;
+    m.channel = &channel;
+    m.msg = &msg;
+
+    Channel *ch = channel_lookup(&g_pubsub.channels, channel);
+    if (ch) {
+        SharedBuf *sb = pubsub_message(NULL, channel, msg);
+        pubsub_deliver(ch, sb, m.receivers, m.slow);
+        sharedbuf_unref(sb);
+    }
+    hm_foreach(&g_pubsub.patterns, &cb_publish_pattern, &m);
+
+    close_slow_conns(publisher, m.slow);
+    g_pubsub.messages += m.receivers;
+    return m.receivers;
+}
+
+// PUBLISH channel message
+static void do_publish(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    return out_int(out, (int64_t)pubsub_publish(conn, cmd[1], cmd[2]));
+}
+
+// Keyspace notifications and client tracking
+//
+// Every modification of a key goes through signal_key_modified(). With notify-keyspace-events
+// set it is published to __keyspace__:<key> and/or __keyevent__:<event>. Connections with
+// CLIENT TRACKING ON get ["invalidate", key] pushed when a key they read (or, in bcast mode, a
+// key under one of their prefixes) changes, so they can cache reads locally. The server forgets
+// a key once it has been invalidated, the client has to read it again to keep tracking it.
+
+static void notify_keyspace_event(Conn *by, const std::string &key, const char *event) {
+    if (g_config.notify_keyspace_events & NOTIFY_KEYSPACE) {
+        pubsub_publish(by, "__keyspace__:" + key, event);
+    }
+    if (g_config.notify_keyspace_events & NOTIFY_KEYEVENT) {
+        pubsub_publish(by, std::string("__keyevent__:") + event, key);
+    }
+}
+
+static bool tracked_key_eq(HNode *node, HNode *key) {
+    TrackedKey *tk = container_of(node, TrackedKey, node);
+    LookupKey *keydata = container_of(key, LookupKey, node);
+    return tk->key == keydata->key;
+}
+
+// ["invalidate", key], a nil key means everything
+static SharedBuf *tracking_message(const std::string *key) {
+    SharedBuf *sb = new SharedBuf();
+    size_t header = 0;
+    response_begin(sb->data, &header);
+    out_arr(sb->data, 2);
+    out_str(sb->data, "invalidate", 10);
+    if (key) {
+        out_str(sb->data, key->data(), key->size());
+    } else {
+        out_nil(sb->data);
+    }
+    response_end(sb->data, header);
+    return sb;
+}
+
+static void tracking_send(Conn *by, const std::vector<uint64_t> &ids, SharedBuf *sb, std::vector<Conn *> &slow) {
+    for (uint64_t id : ids) {
+        Conn *conn = conn_by_id(id);
+        if (!conn || !conn->tracking.on || (conn->tracking.noloop && conn == by)) {
+            continue;                           // gone or no longer tracking, ids are dropped lazily
+        }
+
+        Conn *target = conn->tracking.redirect ? conn_by_id(conn->tracking.redirect) : conn;
+        if (target && conn_push_message(target, sb, slow)) {
+            g_tracking.invalidations++;
+        }
+    }
+}
+
+// `self` is the connection whose request is running, it is closed by the caller if too slow
+static void tracking_invalidate(Conn *by, Conn *self, const std::string &key) {
+    if (g_tracking.nclients == 0) {
+        return;
+    }
+
+    SharedBuf *sb = NULL;
+    std::vector<Conn *> slow;
+
+    LookupKey lk;
+    lk.key = key;
+    lk.node.hcode = str_hash((const uint8_t *)key.data(), key.size());
+    HNode *node = hm_delete(&g_tracking.keys, &lk.node, &tracked_key_eq);
+    if (node) {
+        TrackedKey *tk = container_of(node, TrackedKey, node);
+        sb = tracking_message(&key);
+        tracking_send(by, tk->ids, sb, slow);
+        delete tk;
+    }
+
+    for (const TrackedPrefix &tp : g_tracking.prefixes) {
+        if (key.compare(0, tp.prefix.size(), tp.prefix) == 0) {
+            if (!sb) {
+                sb = tracking_message(&key);
+            }
+            tracking_send(by, tp.ids, sb, slow);
+        }
+    }
+
+    if (sb) {
+        sharedbuf_unref(sb);
+    }
+    close_slow_conns(self, slow);
+}
+
+static bool cb_evict_tracked(HNode *node, void *arg) {
+    *(TrackedKey **)arg = container_of(node, TrackedKey, node);
+    return false;                               // stop at the first one
+}
+
+static void tracking_remember(Conn *conn, const std::string &key) {
+    LookupKey lk;
+    lk.key = key;
+    lk.node.hcode = str_hash((const uint8_t *)key.data(), key.size());
+
+    HNode *node = hm_lookup(&g_tracking.keys, &lk.node, &tracked_key_eq);
+    TrackedKey *tk = node ? container_of(node, TrackedKey, node) : NULL;
+    if (!tk) {
+        // make room by invalidating an arbitrary key, its readers fetch it again
+        while (hm_size(&g_tracking.keys) >= (size_t)g_config.tracking_table_max_keys
+            && g_config.tracking_table_max_keys > 0)
+        {
+            TrackedKey *victim = NULL;
+            hm_foreach(&g_tracking.keys, &cb_evict_tracked, &victim);
+            tracking_invalidate(NULL, conn, std::string(victim->key));
+        }
+
+        tk = new TrackedKey();
+        tk->key = key;
+        tk->node.hcode = lk.node.hcode;
+        hm_insert(&g_tracking.keys, &tk->node);
+    }
+
+    if (tk->ids.empty() || tk->ids.back() != conn->id) {
+        tk->ids.push_back(conn->id);
+    }
+}
+
+// after a wholesale change of the keyspace, e.g. loading a snapshot
+static bool cb_collect_tracked(HNode *node, void *arg) {
+    ((std::vector<TrackedKey *> *)arg)->push_back(container_of(node, TrackedKey, node));
+    return true;
+}
+
+static void tracking_invalidate_all() {
+    std::vector<TrackedKey *> tks;
+    hm_foreach(&g_tracking.keys, &cb_collect_tracked, &tks);
+    hm_clear(&g_tracking.keys);
+    for (TrackedKey *tk : tks) {
+        delete tk;
+    }
+
+    if (g_tracking.nclients == 0) {
+        return;
+    }
+
+    SharedBuf *sb = tracking_message(NULL);
+    std::vector<Conn *> slow;
+    for (const std::pair<const uint64_t, Conn *> &it : g_data.id2conn) {
+        Conn *conn = it.second;
+        Conn *target = conn->tracking.redirect ? conn_by_id(conn->tracking.redirect) : conn;
+        if (conn->tracking.on && target) {
+            conn_push_message(target, sb, slow);
+        }
+    }
+    sharedbuf_unref(sb);
+    close_slow_conns(g_repl.link, slow);        // only called while loading a snapshot from the leader
+}
+
+static void key_touch(const std::string &key);
+
+static void signal_key_modified(Conn *by, const std::string &key, const char *event) {
+    if (g_data.nwatching > 0) {
+        key_touch(key);
+    }
+    tracking_invalidate(by, by, key);
+    notify_keyspace_event(by, key, event);
+}
+
+static void tracking_disable(Conn *conn) {
+    if (!conn->tracking.on) {
+        return;
+    }
+
+    for (const std::string &prefix : conn->tracking.prefixes) {
+        for (size_t i = 0; i < g_tracking.prefixes.size(); i++) {
+            TrackedPrefix &tp = g_tracking.prefixes[i];
+            if (tp.prefix != prefix) {
+                continue;
+            }
+
+            tp.ids.erase(std::remove(tp.ids.begin(), tp.ids.end(), conn->id), tp.ids.end());
+            if (tp.ids.empty()) {
+                g_tracking.prefixes[i] = g_tracking.prefixes.back();
+                g_tracking.prefixes.pop_back();
+            }
+            break;
+        }
+    }
+
+    conn->tracking = {};
+    g_tracking.nclients--;
+}
+
+// CLIENT TRACKING ON [REDIRECT <id>] [BCAST] [PREFIX <prefix> ...] [NOLOOP] | CLIENT TRACKING OFF
+static void client_tracking(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    str_lower(cmd[2]);
+    if (cmd[2] == "off" && cmd.size() == 3) {
+        tracking_disable(conn);
+        return out_nil(out);
+    }
+    if (cmd[2] != "on") {
+        return out_err(out, ERR_BAD_ARG, "expected CLIENT TRACKING ON|OFF");
+    }
+
+    bool bcast = false, noloop = false;
+    int64_t redirect = 0;
+    std::vector<std::string> prefixes;
+    for (size_t i = 3; i < cmd.size(); i++) {
+        str_lower(cmd[i]);                      // an option, prefixes are skipped below
+        if (cmd[i] == "bcast") {
+            bcast = true;
+        } else if (cmd[i] == "noloop") {
+            noloop = true;
+        } else if (cmd[i] == "redirect" && i + 1 < cmd.size() && str2int(cmd[i + 1], redirect)) {
+            i++;
+        } else if (cmd[i] == "prefix" && i + 1 < cmd.size()) {
+            prefixes.push_back(cmd[++i]);
+        } else {
+            return out_err(out, ERR_BAD_ARG, "bad CLIENT TRACKING option");
+        }
+    }
+
+    if (!prefixes.empty() && !bcast) {
+        return out_err(out, ERR_BAD_ARG, "PREFIX requires BCAST");
+    }
+    if (bcast && prefixes.empty()) {
+        prefixes.push_back("");                 // every key
+    }
+    if (redirect && ((uint64_t)redirect == conn->id || !conn_by_id((uint64_t)redirect))) {
+        return out_err(out, ERR_BAD_ARG, "no connection to redirect to");
+    }
+
+    tracking_disable(conn);
+    conn->tracking.on = true;
+    conn->tracking.bcast = bcast;
+    conn->tracking.noloop = noloop;
+    conn->tracking.redirect = (uint64_t)redirect;
+    g_tracking.nclients++;
+
+    for (const std::string &prefix : prefixes) {
+        bool dup = false;
+        for (const std::string &p : conn->tracking.prefixes) {
+            dup = dup || p == prefix;
+        }
+        if (dup) {
+            continue;
+        }
+        conn->tracking.prefixes.push_back(prefix);
+
+        TrackedPrefix *tp = NULL;
+        for (TrackedPrefix &it : g_tracking.prefixes) {
+            if (it.prefix == prefix) {
+                tp = &it;
+            }
+        }
+        if (!tp) {
+            g_tracking.prefixes.push_back(TrackedPrefix{prefix, {}});
+            tp = &g_tracking.prefixes.back();
+        }
+        tp->ids.push_back(conn->id);
+    }
+    return out_nil(out);
+}
+
+static std::string conn_peer_addr(Conn *conn) {
+    struct sockaddr_storage ss = {};
+    socklen_t len = sizeof(ss);
+    char host[INET6_ADDRSTRLEN] = "?";
+    if (getpeername(conn->fd, (struct sockaddr *)&ss, &len) < 0) {
+        return "?";
+    }
+    if (ss.ss_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+        inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+        return std::string(host) + ":" + std::to_string(ntohs(sin->sin_port));
+    }
+    if (ss.ss_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+        inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host));
+        return "[" + std::string(host) + "]:" + std::to_string(ntohs(sin6->sin6_port));
+    }
+    return "unix";
+}
+
+// one line per connection, with its buffers in bytes
+static void client_list(Buffer &out) {
+    std::string s;
+    for (const std::pair<const uint64_t, Conn *> &it : g_data.id2conn) {
+        Conn *conn = it.second;
+        std::string flags;
+        flags += conn->repl_role == REPL_LEADER ? "M" : conn->repl_role != REPL_NONE ? "S" : "";
+        flags += conn->channels.empty() && conn->patterns.empty() ? "" : "P";
+        flags += conn->tx.multi ? "x" : "";
+        flags += !conn->block.waits.empty() || conn->bg_wait ? "b" : "";
+        flags += conn->tracking.on ? "t" : "";
+        flags += conn->read_paused ? "r" : "";
+        flags += conn->cluster.link || conn->cluster.import_slot >= 0 ? "c" : "";
+
+        size_t argv_mem = 0;
+        for (const std::string &arg : conn->argv) {
+            argv_mem += arg.capacity() + 1;
+        }
+        char line[512];
+        snprintf(line, sizeof(line), "id=%llu addr=%s fd=%d proto=%s age=%llu idle=%llu flags=%s sub=%zu psub=%zu "
+            "multi=%d qbuf=%zu qbuf-cap=%zu argv-mem=%zu obl=%zu oll=%zu omem=%zu tot-mem=%zu cmd=%s\n",
+            (unsigned long long)conn->id, conn_peer_addr(conn).c_str(), conn->fd, k_proto_names[conn->proto],
+            (unsigned long long)(g_data.now_ms - conn->created_ms) / 1000,
+            (unsigned long long)(g_data.now_ms - conn->last_active_ms) / 1000,
+            flags.empty() ? "N" : flags.c_str(), conn->channels.size(), conn->patterns.size(),
+            conn->tx.multi ? (int)conn->tx.queue.size() : -1, conn->incoming.size(), conn->incoming.capacity(),
+            argv_mem, conn->outgoing.size() + conn->sending.size(), conn->outq.size(), conn_pending_bytes(conn),
+            conn_memory(conn), conn->last_cmd ? conn->last_cmd : "NULL");
+        s += line;
+    }
+    return out_str(out, s.data(), s.size());
+}
+
+// CLIENT TIMEOUT <ms>|default, 0 for none, e.g. for pooled connections
+static void client_timeout(Conn *conn, std::string &arg, Buffer &out) {
+    int64_t timeout_ms = -1;
+    str_lower(arg);
+    if (arg != "default" && (!str2int(arg, timeout_ms) || timeout_ms < 0)) {
+        return out_err(out, ERR_BAD_ARG, "expected CLIENT TIMEOUT <ms>|default");
+    }
+
+    conn->idle_timeout_ms = timeout_ms;
+    conn_arm_idle(conn);
+    return out_nil(out);
+}
+
+// CLIENT ID | CLIENT LIST | CLIENT TIMEOUT | CLIENT TRACKING ...
+static void do_client(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd[1] == "id" && cmd.size() == 2) {
+        return out_int(out, (int64_t)conn->id);
+    }
+    if (cmd[1] == "list" && cmd.size() == 2) {
+        return client_list(out);
+    }
+    if (cmd[1] == "timeout" && cmd.size() == 3) {
+        return client_timeout(conn, cmd[2], out);
+    }
+    if (cmd[1] == "tracking" && cmd.size() >= 3) {
+        return client_tracking(conn, cmd, out);
+    }
+    return out_err(out, ERR_BAD_ARG, "expected CLIENT ID, CLIENT LIST, CLIENT TIMEOUT or CLIENT TRACKING");
+}
+
+// PING [message]
+static void do_ping(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() > 2) {
+        return out_err(out, ERR_BAD_ARG, "expected PING [message]");
+    }
+    return cmd.size() == 2 ? out_str(out, cmd[1].data(), cmd[1].size()) : out_str(out, "PONG", 4);
+}
+
+// HELLO [2|3], switches a RESP connection to the protocol version
+static void do_hello(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    int64_t ver = conn->proto == PROTO_RESP3 ? 3 : 2;
+    if (cmd.size() > 2 || (cmd.size() == 2 && (!str2int(cmd[1], ver) || ver < 2 || ver > 3))) {
+        return out_err(out, ERR_BAD_ARG, "expected HELLO [2|3]");
+    }
+    if (conn->proto == PROTO_NATIVE) {
+        return out_err(out, ERR_BAD_ARG, "HELLO is for RESP connections");
+    }
+
+    conn->proto = ver == 3 ? PROTO_RESP3 : PROTO_RESP2;
+    const char *mode = g_cluster.enabled ? "cluster" : "standalone";
+    const char *role = g_repl.is_replica ? "replica" : "master";
+    resp_hint(conn, out, RESP_MAP);
+    out_arr(out, 10);
+    out_str(out, "server", 6);
+    out_str(out, "redis-database", 14);
+    out_str(out, "proto", 5);
+    out_int(out, ver);
+    out_str(out, "id", 2);
+    out_int(out, (int64_t)conn->id);
+    out_str(out, "mode", 4);
+    out_str(out, mode, strlen(mode));
+    out_str(out, "role", 4);
+    out_str(out, role, strlen(role));
+}
+
+// Transactions
+//
+// After MULTI the connection's commands are queued on Conn::tx instead of being run, and EXEC
+// runs the queue through do_request() in one go, so no other connection's command interleaves.
+// Waiters of blocking pops are served after EXEC, and blocking pops inside EXEC don't block.
+// The writes are replicated wrapped in MULTI/EXEC so replicas apply them atomically too.
+//
+// WATCH remembers the version of each key, see Entry::version, and EXEC replies nil without
+// running anything if one of them changed. Versions are only bumped while some connection
+// watches keys, a recreated key gets a fresh one from entry_new(). A watched key also keeps its
+// version in g_data.watched, so one created and deleted again before EXEC is noticed too.
+
+static Entry *key_entry(const std::string &key) {
+    LookupKey lk;
+    lk.key = key;
+    lk.node.hcode = str_hash((const uint8_t *)key.data(), key.size());
+
+    HNode *node = hm_lookup(&g_data.db, &lk.node, &entry_eq);
+    return node ? container_of(node, Entry, node) : NULL;
+}
+
+// the version of the entry, or of the watched key if it doesn't exist
+static uint64_t key_version(const std::string &key) {
+    if (Entry *ent = key_entry(key)) {
+        return ent->version;
+    }
+    std::map<std::string, WatchedKey>::iterator it = g_data.watched.find(key);
+    return it != g_data.watched.end() ? it->second.version : 0;
+}
+
+static void key_touch(const std::string &key) {
+    uint64_t version = ++g_data.next_version;
+    if (Entry *ent = key_entry(key)) {
+        ent->version = version;
+    }
+    std::map<std::string, WatchedKey>::iterator it = g_data.watched.find(key);
+    if (it != g_data.watched.end()) {
+        it->second.version = version;
+    }
+}
+
+static void tx_unwatch(Conn *conn) {
+    if (conn->tx.watches.empty()) {
+        return;
+    }
+    for (const std::pair<std::string, uint64_t> &w : conn->tx.watches) {
+        std::map<std::string, WatchedKey>::iterator it = g_data.watched.find(w.first);
+        if (--it->second.nwatches == 0) {
+            g_data.watched.erase(it);
+        }
+    }
+    conn->tx.watches.clear();
+    g_data.nwatching--;
+}
+
+static void tx_reset(Conn *conn) {
+    conn->tx.multi = false;
+    conn->tx.aborted = false;
+    conn->tx.queue.clear();
+    tx_unwatch(conn);
+}
+
+// a command sent after MULTI, errors are reported now and make EXEC fail
+static void tx_queue(Conn *conn, const Command *c, std::vector<std::string> &cmd, Buffer &out) {
+    if (!c) {
+        conn->tx.aborted = true;
+        return out_err(out, ERR_UNKNOWN, "unknown commands");
+    }
+    if ((c->flags & CMD_WRITE) && g_repl.is_replica && conn->repl_role != REPL_LEADER) {
+        conn->tx.aborted = true;
+        return out_err(out, ERR_READONLY, "read-only replica");
+    }
+
+    conn->tx.queue.push_back(std::move(cmd));
+    return out_str(out, "queued", 6);
+}
+
+static void do_multi(Conn *conn, std::vector<std::string> &, Buffer &out) {
+    if (conn->tx.multi) {
+        return out_err(out, ERR_BAD_ARG, "MULTI calls can not be nested");
+    }
+    conn->tx.multi = true;
+    conn->tx.repl_offset = g_repl.offset;
+    return out_nil(out);
+}
+
+static void do_discard(Conn *conn, std::vector<std::string> &, Buffer &out) {
+    if (!conn->tx.multi) {
+        return out_err(out, ERR_BAD_ARG, "DISCARD without MULTI");
+    }
+    tx_reset(conn);
+    return out_nil(out);
+}
+
+// WATCH key [key ...]
+static void do_watch(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    if (conn->tx.multi) {
+        return out_err(out, ERR_BAD_ARG, "WATCH inside MULTI is not allowed");
+    }
+
+    if (conn->tx.watches.empty()) {
+        g_data.nwatching++;
+    }
+    for (size_t i = 1; i < cmd.size(); i++) {
+        g_data.watched[cmd[i]].nwatches++;
+        conn->tx.watches.emplace_back(cmd[i], key_version(cmd[i]));
+    }
+    return out_nil(out);
+}
+
+static void do_unwatch(Conn *conn, std::vector<std::string> &, Buffer &out) {
+    tx_unwatch(conn);
+    return out_nil(out);
+}
+
+// an array with the reply of each queued command, or nil if a watched key changed
+static void do_exec(Conn *conn, std::vector<std::string> &, Buffer &out) {
+    if (!conn->tx.multi) {
+        return out_err(out, ERR_BAD_ARG, "EXEC without MULTI");
+    }
+    if (conn->tx.aborted) {
+        tx_reset(conn);
+        return out_err(out, ERR_BAD_ARG, "transaction discarded because of previous errors");
+    }
+
+    bool changed = false;
+    for (const std::pair<std::string, uint64_t> &w : conn->tx.watches) {
+        changed = changed || key_version(w.first) != w.second;
+    }
+    std::vector<std::vector<std::string>> queue;
+    queue.swap(conn->tx.queue);
+    tx_reset(conn);
+    if (changed) {
+        return out_nil(out);
+    }
+
+    bool writes = false;
+    for (std::vector<std::string> &cmd : queue) {
+        const Command *c = lookup_command(cmd);
+        writes = writes || (c->flags & CMD_WRITE);
+    }
+
+    if (writes) {
+        repl_feed({"multi"});
+    }
+    conn->tx.in_exec = true;
+    out_arr(out, (uint32_t)queue.size());
+    for (std::vector<std::string> &cmd : queue) {
+        do_request(conn, cmd, out);
+    }
+    conn->tx.in_exec = false;
+    if (writes) {
+        repl_feed({"exec"});
+    }
+}
+
+// Scripting
+//
+// EVAL compiles a script, see script.h, caches it under the SHA1 of its source and runs it on
+// the event loop thread, so like EXEC nothing interleaves with it. Its commands go through
+// do_request() with Conn::tx.in_exec set, which keeps blocking pops from blocking and defers
+// serving their waiters to the end of the script. Only the effects are replicated: the writes
+// of a script are fed wrapped in MULTI/EXEC, so replicas never run scripts.
+
+struct ScriptCall {
+    Conn *conn = NULL;
+    bool in_exec = false;                   // the script itself runs inside EXEC
+    bool wrapped = false;                   // MULTI was fed before the first write
+    Buffer reply;
+};
+
+// a reply made by the out_*() functions
+static bool script_decode(const uint8_t *&cur, const uint8_t *end, SValue &v) {
+    if (cur >= end) {
+        return false;
+    }
+
+    uint8_t tag = *cur++;
+    uint32_t n = 0;
+    switch (tag) {
+    case TAG_NIL:
+        v.type = SV_NIL;
+        return true;
+    case TAG_ERR:
+        v.type = SV_ERR;
+        if (!read_u32(cur, end, n)) {
+            return false;
+        }
+        v.i = n;
+        return read_u32(cur, end, n) && read_str(cur, end, n, v.s);
+    case TAG_STR:
+        v.type = SV_STR;
+        return read_u32(cur, end, n) && read_str(cur, end, n, v.s);
+    case TAG_INT:
+    case TAG_DBL:
+        if (cur + 8 > end) {
+            return false;
+        }
+        v.type = tag == TAG_INT ? SV_INT : SV_DBL;
+        memcpy(tag == TAG_INT ? (void *)&v.i : (void *)&v.d, cur, 8);
+        cur += 8;
+        return true;
+    case TAG_ARR:
+        v.type = SV_ARR;
+        if (!read_u32(cur, end, n)) {
+            return false;
+        }
+        v.arr.resize(n);
+        for (SValue &elem : v.arr) {
+            if (!script_decode(cur, end, elem)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+static void script_call(void *arg, std::vector<std::string> &cmd, SValue &out) {
+    ScriptCall *sc = (ScriptCall *)arg;
+    const Command *c = lookup_command(cmd);
+    if (c && (c->flags & CMD_NOSCRIPT)) {
+        out.type = SV_ERR;
+        out.i = ERR_BAD_ARG;
+        out.s = "this command is not allowed from scripts";
+        return;
+    }
+    if (c && (c->flags & CMD_WRITE) && !sc->wrapped && !sc->in_exec) {
+        repl_feed({"multi"});
+        sc->wrapped = true;
+    }
+
+    sc->reply.clear();
+    if (!c || !g_cluster.enabled || cluster_check(sc->conn, c, cmd, sc->reply)) {
+        do_request(sc->conn, cmd, sc->reply);
+    }
+    const uint8_t *cur = sc->reply.data();
+    bool ok = script_decode(cur, cur + sc->reply.size(), out);
+    assert(ok);
+    (void)ok;
+}
+
+// booleans are returned as 1 or nil, errors without a code as ERR_SCRIPT
+static void script_reply(Buffer &out, const SValue &v) {
+    switch (v.type) {
+    case SV_BOOL:
+        return v.i ? out_int(out, 1) : out_nil(out);
+    case SV_INT:
+        return out_int(out, v.i);
+    case SV_DBL:
+        return out_dbl(out, v.d);
+    case SV_STR:
+        return out_str(out, v.s.data(), v.s.size());
+    case SV_ARR:
+        out_arr(out, (uint32_t)v.arr.size());
+        for (const SValue &elem : v.arr) {
+            script_reply(out, elem);
+        }
+        return;
+    case SV_ERR:
+        return out_err(out, v.i ? (uint32_t)v.i : (uint32_t)ERR_SCRIPT, v.s);
+    default:
+        return out_nil(out);
+    }
+}
+
+static Script *script_load(const std::string &src, std::string &sha, std::string &err) {
+    char hex[41];
+    sha1_hex((const uint8_t *)src.data(), src.size(), hex);
+    sha = hex;
+
+    std::map<std::string, Script *>::iterator it = g_scripts.cache.find(sha);
+    if (it != g_scripts.cache.end()) {
+        return it->second;
+    }
+    Script *script = script_compile(src.data(), src.size(), err);
+    if (script) {
+        g_scripts.cache[sha] = script;
+    }
+    return script;
+}
+
+// cmd is EVAL or EVALSHA: <script> numkeys [key ...] [arg ...]
+static void script_exec(Conn *conn, Script *script, std::vector<std::string> &cmd, Buffer &out) {
+    int64_t numkeys = 0;
+    if (!str2int(cmd[2], numkeys) || numkeys < 0 || (size_t)numkeys > cmd.size() - 3) {
+        return out_err(out, ERR_BAD_ARG, "number of keys out of range");
+    }
+
+    ScriptEnv env;
+    env.keys.assign(cmd.begin() + 3, cmd.begin() + 3 + numkeys);
+    env.argv.assign(cmd.begin() + 3 + numkeys, cmd.end());
+    ScriptCall sc;
+    sc.conn = conn;
+    sc.in_exec = conn->tx.in_exec;
+    env.call = &script_call;
+    env.ctx = &sc;
+    env.max_steps = (uint64_t)g_config.script_max_steps;
+
+    SValue res;
+    conn->tx.in_exec = true;
+    script_run(script, &env, res);
+    conn->tx.in_exec = sc.in_exec;
+    if (sc.wrapped) {
+        repl_feed({"exec"});
+    }
+    return script_reply(out, res);
+}
+
+// EVAL script numkeys [key ...] [arg ...]
+static void do_eval(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    std::string sha, err;
+    Script *script = script_load(cmd[1], sha, err);
+    if (!script) {
+        return out_err(out, ERR_SCRIPT, err);
+    }
+    return script_exec(conn, script, cmd, out);
+}
+
+// EVALSHA sha1 numkeys [key ...] [arg ...]
+static void do_evalsha(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    std::string &sha = cmd[1];
+    std::transform(sha.begin(), sha.end(), sha.begin(), ::tolower);
+    std::map<std::string, Script *>::iterator it = g_scripts.cache.find(sha);
+    if (it == g_scripts.cache.end()) {
+        return out_err(out, ERR_NOSCRIPT, "no matching script, use EVAL");
+    }
+    return script_exec(conn, it->second, cmd, out);
+}
+
+// SCRIPT LOAD <script> | SCRIPT EXISTS <sha1> [sha1 ...] | SCRIPT FLUSH
+static void do_script(Conn *, std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd[1] == "load" && cmd.size() == 3) {
+        std::string sha, err;
+        if (!script_load(cmd[2], sha, err)) {
+            return out_err(out, ERR_SCRIPT, err);
+        }
+        return out_str(out, sha.data(), sha.size());
+    }
+    if (cmd[1] == "exists" && cmd.size() >= 3) {
+        out_arr(out, (uint32_t)cmd.size() - 2);
+        for (size_t i = 2; i < cmd.size(); i++) {
+            std::transform(cmd[i].begin(), cmd[i].end(), cmd[i].begin(), ::tolower);
+            out_int(out, g_scripts.cache.count(cmd[i]));
+        }
+        return;
+    }
+    if (cmd[1] == "flush" && cmd.size() == 2) {
+        for (std::pair<const std::string, Script *> &it : g_scripts.cache) {
+            script_free(it.second);
+        }
+        g_scripts.cache.clear();
+        return out_nil(out);
+    }
+    return out_err(out, ERR_BAD_ARG, "expected SCRIPT LOAD, SCRIPT EXISTS or SCRIPT FLUSH");
+}
+
+// Blocking list pops
+//
+// BLPOP/BRPOP on empty lists park the connection: it gets one BlockWait per key, linked into
+// that key's waiters list, and stops processing its pipelined requests. Commands that push to a
+// key with waiters mark it ready, and once the command has executed the waiters are served in
+// the order they blocked. Served or timed out connections are resumed at the end of the loop
+// iteration so they never run requests from inside another connection's command.
+
+static bool blocked_key_eq(HNode *node, HNode *key) {
+    BlockedKey *bk = container_of(node, BlockedKey, node);
+    LookupKey *keydata = container_of(key, LookupKey, node);
+    return bk->key == keydata->key;
+}
+
+static BlockedKey *blocked_key_lookup(const std::string &key) {
+    LookupKey lk;
+    lk.key = key;
+    lk.node.hcode = str_hash((const uint8_t *)key.data(), key.size());
+
+    HNode *node = hm_lookup(&g_blocking.keys, &lk.node, &blocked_key_eq);
+    return node ? container_of(node, BlockedKey, node) : NULL;
+}
+
+static void block_key_ready(const std::string &key) {
+    if (g_blocking.nblocked == 0) {
+        return;
+    }
+
+    BlockedKey *bk = blocked_key_lookup(key);
+    if (bk && !bk->ready) {
+        bk->ready = true;
+        g_blocking.ready.push_back(key);
+    }
+}
+
+static void block_conn(Conn *conn, const std::vector<std::string> &keys, uint64_t timeout_ms, bool front) {
+    for (const std::string &key : keys) {
+        BlockedKey *bk = blocked_key_lookup(key);
+        if (!bk) {
+            bk = new BlockedKey();
+            bk->key = key;
+            bk->node.hcode = str_hash((const uint8_t *)key.data(), key.size());
+            dlist_init(&bk->waiters);
+            hm_insert(&g_blocking.keys, &bk->node);
+        }
+
+        bool dup = false;
+        for (BlockWait *w : conn->block.waits) {
+            dup = dup || w->bk == bk;
+        }
+        if (dup) {
+            continue;
+        }
+
+        BlockWait *w = new BlockWait();
+        w->conn = conn;
+        w->bk = bk;
+        dlist_insert_before(&bk->waiters, &w->node);
+        conn->block.waits.push_back(w);
+    }
+
+    conn->block.front = front;
+    if (timeout_ms > 0) {
+        tw_add(&g_data.timers, &conn->block.timer, g_data.now_ms + timeout_ms + clock_slack_ms());
+    }
+    conn_set_idle_exempt(conn, true);
+    g_blocking.nblocked++;
+}
+
+// the connection then resumes its pipelined requests
+static void block_unblock(Conn *conn) {
+    for (BlockWait *w : conn->block.waits) {
+        BlockedKey *bk = w->bk;
+        dlist_detach(&w->node);
+        delete w;
+
+        if (dlist_empty(&bk->waiters)) {
+            hm_delete(&g_blocking.keys, &bk->node, &hnode_same);
+            delete bk;                          // a pending ready entry is looked up again by name
+        }
+    }
+    conn->block.waits.clear();
+
+    tw_del(&g_data.timers, &conn->block.timer);
+    conn_set_idle_exempt(conn, !conn->channels.empty() || !conn->patterns.empty());
+    g_blocking.nblocked--;
+    g_blocking.resume.push_back(conn->id);
+}
+
+static void block_conn_closed(Conn *conn) {
+    if (!conn->block.waits.empty()) {
+        block_unblock(conn);
+    }
+}
+
+// a reply outside of the request/response cycle
+static void block_reply_nil(Conn *conn) {
+    size_t header = 0;
+    conn_response_begin(conn, &header);
+    out_nil(conn->outgoing);
+    conn_response_end(conn, header);
+    conn_want_write(conn);
+}
+
+// serve the connections blocked on keys that were pushed to
+static void block_serve_ready(Conn *self) {
+    std::vector<std::string> ready;
+    ready.swap(g_blocking.ready);
+
+    for (const std::string &key : ready) {
+        // looked up again after each pop, which may close connections and remove the key
+        while (BlockedKey *bk = blocked_key_lookup(key)) {
+            bk->ready = false;
+
+            bool ok = false;
+            Entry *ent = expect_entry(key, T_LIST, ok);
+            if (!ent) {
+                break;
+            }
+
+            Conn *conn = container_of(bk->waiters.next, BlockWait, node)->conn;
+            bool front = conn->block.front;
+            const char *s = NULL;
+            size_t len = 0;
+            qlist_peek(ent->list, front, &s, &len);
+
+            size_t header = 0;
+            conn_response_begin(conn, &header);
+            out_arr(conn->outgoing, 2);
+            out_str(conn->outgoing, key.data(), key.size());
+            out_str(conn->outgoing, s, len);
+            conn_response_end(conn, header);
+            conn_want_write(conn);
+
+            block_unblock(conn);
+            qlist_pop(ent->list, front);
+            repl_feed({front ? "lpop" : "rpop", key});
+            list_popped(self, ent, front);
+        }
+    }
+}
+
+static void block_unblock_all(uint32_t code, const char *msg) {
+    std::vector<Conn *> blocked;
+    for (const std::pair<const uint64_t, Conn *> &it : g_data.id2conn) {
+        if (!it.second->block.waits.empty()) {
+            blocked.push_back(it.second);
+        }
+    }
+
+    for (Conn *conn : blocked) {
+        block_unblock(conn);
+
+        size_t header = 0;
+        conn_response_begin(conn, &header);
+        out_err(conn->outgoing, code, msg);
+        conn_response_end(conn, header);
+        conn_want_write(conn);
+    }
+}
+
+// run the requests that arrived while the connections were blocked or paused
+static void block_resume() {
+    while (!g_blocking.resume.empty()) {
+        std::vector<uint64_t> ids;
+        ids.swap(g_blocking.resume);
+
+        for (uint64_t id : ids) {
+            Conn *conn = conn_by_id(id);
+            if (!conn || conn->incoming.empty()) {
+                continue;
+            }
+
+            handle_input(conn, NULL, 0);
+            if (conn->want_close) {
+                conn_destroy(conn);
+            } else if (conn_pending_bytes(conn) > 0) {
+                conn_want_write(conn);
+            }
+        }
+    }
+}
+
+// the output of a paused connection has drained, run its buffered requests and read again
+static void conn_resume_read(Conn *conn) {
+    conn->read_paused = false;
+    g_blocking.resume.push_back(conn->id);
+    if (g_uring.enabled && !conn->recv_armed && !conn->dead) {
+        uring_arm_recv(conn);
+    }
+}
+
+// BLPOP/BRPOP key [key ...] timeout, in seconds with 0 waiting forever
+static void block_pop(Conn *conn, std::vector<std::string> &cmd, Buffer &out, bool front) {
+    double timeout = 0;
+    if (!str2dbl(cmd.back(), timeout) || timeout < 0) {
+        return out_err(out, ERR_BAD_ARG, "expected timeout");
+    }
+
+    std::vector<std::string> keys(cmd.begin() + 1, cmd.end() - 1);
+    for (const std::string &key : keys) {
+        bool ok = false;
+        Entry *ent = expect_entry(key, T_LIST, ok);
+        if (!ok) {
+            return out_err(out, ERR_BAD_TYPE, "expected list");
+        }
+        if (!ent) {
+            continue;
+        }
+
+        std::string val;
+        list_pop(conn, ent, front, val);
+        repl_feed({front ? "lpop" : "rpop", key});
+        out_arr(out, 2);
+        out_str(out, key.data(), key.size());
+        return out_str(out, val.data(), val.size());
+    }
+
+    if (conn->tx.in_exec) {
+        return out_nil(out);                    // never blocks inside a transaction
+    }
+    block_conn(conn, keys, (uint64_t)(timeout * 1000), front);
+}
+
+static void do_blpop(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    return block_pop(conn, cmd, out, true);
+}
+
+static void do_brpop(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    return block_pop(conn, cmd, out, false);
+}
+
+// Background jobs
+//
+// A job runs on the thread pool and hands its result back through bg_finish(). The event loop
+// drains the completions when the eventfd fires, see bg_drain(). While a job runs, the keys it
+// uses are pinned: a write naming a pinned key parks its connection in try_one_request() without
+// consuming the request, and parked connections retry once a job is done.
+
+static void bg_pin(const std::string &key) {
+    g_bg.pinned[key]++;
+}
+
+static void bg_submit(void (*work)(void *), void *arg, const std::vector<std::string> &keys) {
+    for (const std::string &key : keys) {
+        bg_pin(key);
+    }
+    g_bg.inflight++;
+    thread_pool_queue(&g_data.thread_pool, work, arg);
+}
+
+// called by the worker, `done` then runs on the event loop thread
+static void bg_finish(void (*done)(void *), void *arg) {
+    pthread_mutex_lock(&g_bg.mu);
+    g_bg.done.push_back(Work{done, arg});
+    pthread_mutex_unlock(&g_bg.mu);
+
+    uint64_t one = 1;
+    ssize_t rv = write(g_bg.fd, &one, sizeof(one));
+    (void)rv;                                   // fails only if the counter is saturated, still readable
+}
+
+static void bg_release(const std::vector<std::string> &keys) {
+    for (const std::string &key : keys) {
+        std::map<std::string, uint32_t>::iterator it = g_bg.pinned.find(key);
+        if (--it->second == 0) {
+            g_bg.pinned.erase(it);
+        }
+    }
+
+    for (uint64_t id : g_bg.waiting) {
+        if (Conn *conn = conn_by_id(id)) {
+            conn->bg_wait = false;
+            g_blocking.resume.push_back(id);    // runs the parked request again, see block_resume()
+        }
+    }
+    g_bg.waiting.clear();
+}
+
+static bool bg_write_pinned(std::vector<std::string> &cmd) {
+    const Command *c = lookup_command(cmd);
+    if (!c || !(c->flags & CMD_WRITE)) {
+        return false;
+    }
+    for (size_t i = 1; i < cmd.size(); i++) {
+        if (bg_key_pinned(cmd[i])) {
+            return true;                        // may be a value rather than a key, it only waits
+        }
+    }
+    return false;
+}
+
+// a write that has to wait for a job using one of its keys, for EXEC any of the queued ones
+static bool bg_must_wait(Conn *conn, std::vector<std::string> &cmd) {
+    if (g_bg.pinned.empty()) {
+        return false;
+    }
+    if (!conn->tx.multi) {
+        return bg_write_pinned(cmd);
+    }
 
-    ssize_t rv = write(conn->fd, conn->outgoing.data(), conn->outgoing.size());
-    if (rv < 0) {
-        if (errno == EAGAIN)                                            // if client is not reading, send buffer (kernel buffer) fills up
-            return;
+    if (cmd.size() != 1 || cmd[0] != "exec") {
+        return false;                           // only queued
+    }
+    for (std::vector<std::string> &queued : conn->tx.queue) {
+        if (bg_write_pinned(queued)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-        conn->want_close = true;
+static void migrate_step();
+
+static void bg_drain() {
+    uint64_t n = 0;
+    ssize_t rv = read(g_bg.fd, &n, sizeof(n));  // io_uring has read it already
+    (void)rv;
+
+    std::vector<Work> done;
+    pthread_mutex_lock(&g_bg.mu);
+    done.swap(g_bg.done);
+    pthread_mutex_unlock(&g_bg.mu);
+
+    for (const Work &w : done) {
+        g_bg.inflight--;
+        w.f(w.arg);
+    }
+    if (g_cluster.mig.link && !done.empty()) {
+        migrate_step();                         // keys the jobs used may be moved now
+    }
+}
+
+// before the keyspace is replaced
+static void bg_wait_all() {
+    while (g_bg.inflight > 0) {
+        struct pollfd pfd = {g_bg.fd, POLLIN, 0};
+        poll(&pfd, 1, -1);
+        bg_drain();
+    }
+}
+
+struct BitopJob {
+    uint64_t conn_id = 0;
+    uint32_t op = 0;
+    std::vector<std::string> keys;              // destination then sources, pinned
+    std::vector<const uint8_t *> srcs;          // point into the pinned entries or into `copies`
+    std::vector<size_t> lens;
+    std::vector<std::string> copies;
+    std::string result;
+};
+
+static void bitop_done(void *arg) {
+    BitopJob *job = (BitopJob *)arg;
+    int64_t len = (int64_t)job->result.size();
+    bitop_store(NULL, job->keys[0], job->result);
+    bg_release(job->keys);
+
+    if (Conn *conn = conn_by_id(job->conn_id)) {
+        size_t header = 0;
+        conn_response_begin(conn, &header);
+        out_int(conn->outgoing, len);
+        conn_response_end(conn, header);
+        conn_want_write(conn);
+
+        conn->bg_wait = false;
+        g_blocking.resume.push_back(conn->id);
+    }
+    delete job;
+}
+
+static void bitop_work(void *arg) {
+    BitopJob *job = (BitopJob *)arg;
+    bitop_run(job->op, job->srcs, job->lens, job->result);
+    bg_finish(&bitop_done, job);
+}
+
+// the connection is parked like a blocked one and replied to by bitop_done()
+static void bitop_submit(Conn *conn, uint32_t op, std::vector<std::string> &cmd,
+    std::vector<const uint8_t *> &srcs, std::vector<size_t> &lens, std::vector<std::string> &copies)
+{
+    BitopJob *job = new BitopJob();
+    job->conn_id = conn->id;
+    job->op = op;
+    job->keys.assign(cmd.begin() + 2, cmd.end());
+    job->srcs.swap(srcs);
+    job->lens.swap(lens);
+    job->copies.swap(copies);
+
+    conn->bg_wait = true;
+    bg_submit(&bitop_work, job, job->keys);
+}
+
+struct CompressJob {
+    Entry *ent = NULL;                          // pinned
+    std::vector<std::string> keys;
+    std::string packed;
+    bool ok = false;
+};
+
+static void compress_done(void *arg) {
+    CompressJob *job = (CompressJob *)arg;
+    if (job->ok) {
+        str_set_lz4(job->ent, job->packed);
+    }
+    bg_release(job->keys);
+    delete job;
+}
+
+static void compress_work(void *arg) {
+    CompressJob *job = (CompressJob *)arg;
+    job->ok = str_compress(job->ent->str, job->packed);
+    bg_finish(&compress_done, job);
+}
+
+// the SET is answered right away, the value stays uncompressed until compress_done()
+static void compress_submit(Entry *ent) {
+    CompressJob *job = new CompressJob();
+    job->ent = ent;
+    job->keys.push_back(ent->key);
+    bg_submit(&compress_work, job, job->keys);
+}
+
+// Cluster
+//
+// With --cluster the keyspace is split into k_cluster_slots hash slots, see key_slot(), each
+// served by one node. There is no gossip: every node keeps its own slot map, set up with
+// CLUSTER ADDSLOTS and CLUSTER SETSLOT, and commands on keys of a slot served elsewhere are
+// answered with MOVED, so clients can cache the map and send each command to the right node.
+//
+// CLUSTER MIGRATE moves a slot to another node while both keep serving. The source connects to
+// the target, marks the slot importing there, then streams a batch of keys at a time, each as a
+// DEL followed by the commands that rebuild it, the encoding of replication snapshots. Keys in
+// flight are pinned like those of background jobs, so writes to them wait, and each is deleted
+// here once the target has replied to all of its commands. Commands on keys that have left get
+// ASK, which clients follow once, prefixed with ASKING. Once the slot is empty the target takes
+// it over with SETSLOT NODE and the source follows. Other nodes still send clients to the
+// source, which redirects them with MOVED.
+
+const size_t k_migrate_batch_bytes = 64 << 10;     // encoded per step
+const size_t k_migrate_max_inflight = 256;         // keys sent but not acknowledged
+const size_t k_migrate_max_pending = 1 << 20;      // bytes queued to the link
+
+static int32_t cluster_node(const std::string &host, uint16_t port) {
+    for (size_t i = 0; i < g_cluster.nodes.size(); i++) {
+        if (g_cluster.nodes[i].host == host && g_cluster.nodes[i].port == port) {
+            return (int32_t)i;
+        }
+    }
+
+    ClusterNode node;
+    node.host = host;
+    node.port = port;
+    g_cluster.nodes.push_back(node);
+    return (int32_t)g_cluster.nodes.size() - 1;
+}
+
+static void cluster_init(const std::string &host, uint16_t port) {
+    g_cluster.enabled = true;
+    cluster_node(host, port);
+    g_cluster.owner.assign(k_cluster_slots, -1);
+    g_cluster.migrating.assign(k_cluster_slots, -1);
+    g_cluster.importing.assign(k_cluster_slots, -1);
+    g_cluster.keys.resize(k_cluster_slots);
+    for (DList &head : g_cluster.keys) {
+        dlist_init(&head);
+    }
+    g_cluster.nkeys.assign(k_cluster_slots, 0);
+    dlist_init(&g_cluster.mig.sent);
+}
+
+static void out_redirect(Buffer &out, uint32_t code, const char *kind, uint32_t slot, int32_t node) {
+    const ClusterNode &n = g_cluster.nodes[node];
+    char msg[300];
+    snprintf(msg, sizeof(msg), "%s %u %s:%u", kind, slot, n.host.c_str(), (unsigned)n.port);
+    out_err(out, code, msg);
+}
+
+// false with an error or a redirection in `out` if the keys of the command are not served here
+static bool cluster_check(Conn *conn, const Command *c, std::vector<std::string> &cmd, Buffer &out) {
+    bool asking = conn->cluster.asking;
+    conn->cluster.asking = false;
+    if (conn->repl_role == REPL_LEADER) {
+        return true;
+    }
+
+    size_t first = 0, last = 0;
+    command_keys(c, cmd, first, last);
+
+    int64_t slot = -1;
+    size_t nkeys = 0, present = 0;
+    for (size_t i = first; first > 0 && i <= last; i++) {
+        int64_t s = key_slot(cmd[i]);
+        if (slot >= 0 && s != slot) {
+            out_err(out, ERR_CLUSTER, "keys in different slots");
+            return false;
+        }
+        slot = s;
+        nkeys++;
+        present += key_entry(cmd[i]) != NULL;
+    }
+    if (slot < 0 || slot == conn->cluster.import_slot) {
+        return true;                            // the migration link is not redirected
+    }
+
+    int32_t owner = g_cluster.owner[slot];
+    if (owner == 0) {
+        int32_t target = g_cluster.migrating[slot];
+        if (target < 0 || present == nkeys) {
+            return true;
+        }
+        if (present == 0) {
+            out_redirect(out, ERR_ASK, "ASK", (uint32_t)slot, target);     // moved already, or new
+        } else {
+            out_err(out, ERR_TRYAGAIN, "some of the keys are being migrated");
+        }
+        return false;
+    }
+    if (asking && g_cluster.importing[slot] >= 0) {
+        return true;
+    }
+    if (owner < 0) {
+        out_err(out, ERR_CLUSTER, "slot is not served");
+        return false;
+    }
+    out_redirect(out, ERR_MOVED, "MOVED", (uint32_t)slot, owner);
+    return false;
+}
+
+static void migrate_send(const std::vector<std::string> &cmd) {
+    Conn *link = g_cluster.mig.link;
+    size_t pos = req_begin(link->outgoing, (uint32_t)cmd.size());
+    for (const std::string &arg : cmd) {
+        req_arg(link->outgoing, arg.data(), arg.size());
+    }
+    req_end(link->outgoing, pos);
+    g_cluster.mig.requests++;
+}
+
+static size_t count_requests(const Buffer &buf, size_t pos) {
+    size_t n = 0;
+    while (pos < buf.size()) {
+        uint32_t len = 0;
+        memcpy(&len, &buf[pos], 4);
+        pos += 4 + len;
+        n++;
+    }
+    return n;
+}
+
+// sends the next batch of keys, or hands the slot over once all of them are gone
+static void migrate_step() {
+    Conn *link = g_cluster.mig.link;
+    if (!link || g_cluster.mig.finish_at) {
         return;
     }
 
-    // remove written data from buffer
-    buf_consume(conn->outgoing, (size_t)rv);
+    int32_t slot = g_cluster.mig.slot;
+    DList *head = &g_cluster.keys[slot];
+    SnapshotWriter w;
+    w.collect = true;
+    size_t skipped = 0;
+    while (!dlist_empty(head) && w.buf.size() < k_migrate_batch_bytes
+        && g_cluster.mig.inflight.size() < k_migrate_max_inflight
+        && conn_pending_bytes(link) + w.buf.size() < k_migrate_max_pending)
+    {
+        Entry *ent = container_of(head->next, Entry, slot_node);
+        dlist_detach(&ent->slot_node);
+        if (bg_key_pinned(ent->key)) {
+            dlist_insert_before(head, &ent->slot_node);        // used by a job, retried when it is done
+            if (++skipped >= g_cluster.nkeys[slot]) {
+                break;
+            }
+            continue;
+        }
+        dlist_insert_before(&g_cluster.mig.sent, &ent->slot_node);
+
+        size_t start = w.buf.size();
+        size_t pos = req_begin(w.buf, 2);
+        req_arg(w.buf, "del", 3);
+        req_arg(w.buf, ent->key.data(), ent->key.size());
+        req_end(w.buf, pos);
+        cb_snapshot_entry(&ent->node, &w);
+
+        g_cluster.mig.requests += count_requests(w.buf, start);
+        g_cluster.mig.inflight.emplace_back(ent->key, g_cluster.mig.requests);
+        bg_pin(ent->key);
+    }
+    buf_append(link->outgoing, w.buf.data(), w.buf.size());
 
-    if (conn->incoming.size() == 0) {
-        conn->want_read = true;
-        conn->want_write = false;
+    if (dlist_empty(head) && g_cluster.mig.inflight.empty()) {
+        const ClusterNode &target = g_cluster.nodes[g_cluster.mig.node];
+        migrate_send({"cluster", "setslot", std::to_string(slot), "node", target.host, std::to_string(target.port)});
+        g_cluster.mig.finish_at = g_cluster.mig.requests;
     }
+    conn_want_write(link);
 }
 
-static void handle_read(Conn* conn) {
-    uint8_t buf[64 * 1024];
+// keys in flight stay here, and the slot stays migrating so the keys moved already are found
+static void migrate_stop(const char *why) {
+    std::vector<std::string> keys;
+    for (std::pair<std::string, uint64_t> &k : g_cluster.mig.inflight) {
+        keys.push_back(std::move(k.first));
+    }
+    bg_release(keys);
 
-    ssize_t rv = read(conn->fd, buf, sizeof(buf));
-    if (rv <= 0) {                                                      // handle IO Error (rv < 0) and EOF (rv == 0)                  
+    DList *head = &g_cluster.keys[g_cluster.mig.slot];
+    while (!dlist_empty(&g_cluster.mig.sent)) {
+        DList *node = g_cluster.mig.sent.next;
+        dlist_detach(node);
+        dlist_insert_before(head, node);
+    }
+    printf("migration of slot %d stopped: %s\n", g_cluster.mig.slot, why);
+
+    g_cluster.mig.inflight.clear();
+    g_cluster.mig.link = NULL;
+    g_cluster.mig.slot = g_cluster.mig.node = -1;
+    g_cluster.mig.requests = g_cluster.mig.replies = g_cluster.mig.finish_at = 0;
+}
+
+static void cluster_conn_closed(Conn *conn) {
+    if (conn == g_cluster.mig.link) {
+        migrate_stop("link closed");
+    }
+}
+
+// a reply from the target of our migration
+static void cluster_link_input(Conn *conn, const uint8_t *data, size_t len) {
+    if (conn != g_cluster.mig.link) {
+        conn->want_close = true;                // a finished migration
+        return;
+    }
+    if (len > 0 && data[0] == TAG_ERR) {
+        const uint8_t *cur = data + 1, *end = data + len;
+        uint32_t code = 0, n = 0;
+        std::string msg;
+        if (read_u32(cur, end, code) && read_u32(cur, end, n)) {
+            read_str(cur, end, n, msg);
+        }
+        printf("migration target replied: %s\n", msg.c_str());
         conn->want_close = true;
         return;
     }
 
-    buf_append(conn->incoming, buf, rv);
+    // the keys whose commands have all been applied by the target
+    g_cluster.mig.replies++;
+    std::vector<std::string> done;
+    while (!g_cluster.mig.inflight.empty() && g_cluster.mig.inflight.front().second <= g_cluster.mig.replies) {
+        done.push_back(std::move(g_cluster.mig.inflight.front().first));
+        g_cluster.mig.inflight.pop_front();
+
+        const std::string &key = done.back();
+        if (Entry *ent = key_entry(key)) {
+            hm_delete(&g_data.db, &ent->node, &hnode_same);
+            repl_feed({"del", key});
+            signal_key_modified(NULL, key, "del");
+            entry_del(ent);
+        }
+        g_cluster.mig.keys_moved++;
+    }
+    if (!done.empty()) {
+        bg_release(done);
+    }
 
-    while (try_one_request(conn)) {}
+    if (g_cluster.mig.finish_at && g_cluster.mig.replies >= g_cluster.mig.finish_at) {
+        int32_t slot = g_cluster.mig.slot;
+        g_cluster.owner[slot] = g_cluster.mig.node;
+        g_cluster.migrating[slot] = -1;
+        printf("slot %d migrated, %llu keys\n", slot, (unsigned long long)g_cluster.mig.keys_moved);
+        g_cluster.mig.link = NULL;
+        g_cluster.mig.slot = g_cluster.mig.node = -1;
+        g_cluster.mig.requests = g_cluster.mig.replies = g_cluster.mig.finish_at = 0;
+        conn->want_close = true;
+        return;
+    }
+    if (g_cluster.mig.inflight.size() <= k_migrate_max_inflight / 2) {
+        migrate_step();
+    }
+}
 
-    // update readiness intention
-    if (conn->outgoing.size() > 0) {
-        conn->want_read = false;
-        conn->want_write = true;
+static bool parse_slot(const std::string &s, uint32_t &slot) {
+    int64_t val = 0;
+    if (!str2int(s, val) || val < 0 || val >= (int64_t)k_cluster_slots) {
+        return false;
+    }
+    slot = (uint32_t)val;
+    return true;
+}
 
-        return handle_write(conn);                                      // optimization for request-response protocol
-    }                                                                   // assume client is ready to be written to because it has sent a request
-}                                                                       // thus server can write a response without waiting for event loop
+static bool parse_node(const std::string &host, const std::string &port, int32_t &node) {
+    int64_t val = 0;
+    if (!str2int(port, val) || val <= 0 || val > 65535) {
+        return false;
+    }
+    node = cluster_node(host, (uint16_t)val);
+    return true;
+}
 
-const uint64_t k_idle_timeout_ms = 5 * 1000;
+// CLUSTER MIGRATE <slot> <host> <port>
+static void cluster_migrate(uint32_t slot, int32_t node, Buffer &out) {
+    if (g_cluster.mig.link) {
+        return out_err(out, ERR_BAD_ARG, "a migration is already running");
+    }
+    if (g_cluster.owner[slot] != 0) {
+        return out_err(out, ERR_BAD_ARG, "slot is not served by this node");
+    }
+    if (node == 0) {
+        return out_err(out, ERR_BAD_ARG, "can't migrate to this node");
+    }
 
-static int32_t next_timer_ms() {
-    uint64_t now_ms = get_monotonic_msec();
-    uint64_t next_ms = -1;
+    const ClusterNode &target = g_cluster.nodes[node];
+    struct sockaddr_in addr = {};
+    if (!repl_resolve(target.host, target.port, addr)) {
+        return out_err(out, ERR_BAD_ARG, "cannot resolve host");
+    }
+    Conn *link = conn_connect(addr);
+    if (!link) {
+        return out_err(out, ERR_BAD_ARG, "cannot connect");
+    }
+    link->cluster.link = true;
+
+    g_cluster.migrating[slot] = node;
+    g_cluster.mig.slot = (int32_t)slot;
+    g_cluster.mig.node = node;
+    g_cluster.mig.link = link;
+    g_cluster.mig.keys_moved = 0;
+    const ClusterNode &self = g_cluster.nodes[0];
+    migrate_send({"cluster", "setslot", std::to_string(slot), "importing", self.host, std::to_string(self.port)});
+    if (g_uring.enabled) {
+        uring_arm_recv(link);
+    }
+    migrate_step();
+    return out_nil(out);
+}
 
-    // idle timers for connections
-    if (!dlist_empty(&g_data.idle_list)) {
-        Conn *conn = container_of(g_data.idle_list.next, Conn, idle_node);
-        next_ms = conn->last_active_ms + k_idle_timeout_ms;
+// [[first, last, host, port], ...] for the assigned slots
+static void cluster_slots(Buffer &out) {
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    for (uint32_t first = 0; first < k_cluster_slots;) {
+        int32_t owner = g_cluster.owner[first];
+        uint32_t last = first;
+        while (last + 1 < k_cluster_slots && g_cluster.owner[last + 1] == owner) {
+            last++;
+        }
+        if (owner >= 0) {
+            const ClusterNode &node = g_cluster.nodes[owner];
+            out_arr(out, 4);
+            out_int(out, first);
+            out_int(out, last);
+            out_str(out, node.host.data(), node.host.size());
+            out_int(out, node.port);
+            n++;
+        }
+        first = last + 1;
     }
+    out_end_arr(out, ctx, n);
+}
 
-    // ttl timers entries
-    if (!g_data.heap.empty() && g_data.heap[0].val < next_ms) {
-        next_ms = g_data.heap[0].val;
+static void cluster_getkeys(uint32_t slot, int64_t count, Buffer &out) {
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    DList *lists[2] = {&g_cluster.keys[slot], g_cluster.mig.slot == (int32_t)slot ? &g_cluster.mig.sent : NULL};
+    for (DList *head : lists) {
+        for (DList *node = head ? head->next : NULL; node && node != head && n < count; node = node->next) {
+            const std::string &key = container_of(node, Entry, slot_node)->key;
+            out_str(out, key.data(), key.size());
+            n++;
+        }
     }
+    out_end_arr(out, ctx, n);
+}
 
-    if (next_ms == (size_t)-1) {
-        return -1;  // no timeouts
+// CLUSTER KEYSLOT <key> | SLOTS | ADDSLOTS <first> [last] | SETSLOT <slot> NODE|IMPORTING|MIGRATING
+// <host> <port> | SETSLOT <slot> STABLE | COUNTKEYSINSLOT <slot> | GETKEYSINSLOT <slot> <count>
+// | MIGRATE <slot> <host> <port>
+static void do_cluster(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    const std::string &sub = cmd[1];
+    if (sub == "keyslot" && cmd.size() == 3) {
+        return out_int(out, key_slot(cmd[2]));
+    }
+    if (!g_cluster.enabled) {
+        return out_err(out, ERR_BAD_ARG, "cluster mode is disabled");
+    }
+    if (sub == "slots" && cmd.size() == 2) {
+        return cluster_slots(out);
     }
 
-    if (next_ms <= now_ms) {
-        return 0;   
+    uint32_t slot = 0, last = 0;
+    if (cmd.size() < 3 || !parse_slot(cmd[2], slot)) {
+        return out_err(out, ERR_BAD_ARG, "expected a slot number");
+    }
+    int32_t node = -1;
+    bool has_node = cmd.size() == 6 && parse_node(cmd[4], cmd[5], node);
+    if (cmd.size() > 3) {
+        str_lower(cmd[3]);                      // SETSLOT state
     }
 
-    return (uint32_t)(next_ms - now_ms);
+    if (sub == "addslots" && (cmd.size() == 3 || (cmd.size() == 4 && parse_slot(cmd[3], last) && last >= slot))) {
+        last = cmd.size() == 3 ? slot : last;
+        for (uint32_t i = slot; i <= last; i++) {
+            g_cluster.owner[i] = 0;
+        }
+        return out_nil(out);
+    }
+    if (sub == "setslot" && has_node && cmd[3] == "node") {
+        g_cluster.owner[slot] = node;
+        if (node == 0) {
+            g_cluster.importing[slot] = -1;     // the end of a migration to this node
+        }
+        if (conn->cluster.import_slot == (int32_t)slot) {
+            conn->cluster.import_slot = -1;
+        }
+        return out_nil(out);
+    }
+    if (sub == "setslot" && has_node && cmd[3] == "importing") {
+        g_cluster.importing[slot] = node;
+        conn->cluster.import_slot = (int32_t)slot;     // the migration link of the source node
+        return out_nil(out);
+    }
+    if (sub == "setslot" && has_node && cmd[3] == "migrating") {
+        g_cluster.migrating[slot] = node;
+        return out_nil(out);
+    }
+    if (sub == "setslot" && cmd.size() == 4 && cmd[3] == "stable") {
+        if (g_cluster.mig.slot == (int32_t)slot) {
+            return out_err(out, ERR_BAD_ARG, "the slot is being migrated");
+        }
+        g_cluster.importing[slot] = g_cluster.migrating[slot] = -1;
+        return out_nil(out);
+    }
+    if (sub == "countkeysinslot" && cmd.size() == 3) {
+        return out_int(out, g_cluster.nkeys[slot]);
+    }
+    int64_t count = 0;
+    if (sub == "getkeysinslot" && cmd.size() == 4 && str2int(cmd[3], count) && count >= 0) {
+        return cluster_getkeys(slot, count, out);
+    }
+    if (sub == "migrate" && cmd.size() == 5 && parse_node(cmd[3], cmd[4], node)) {
+        return cluster_migrate(slot, node, out);
+    }
+    return out_err(out, ERR_BAD_ARG, "unknown CLUSTER subcommand or wrong arguments");
 }
 
-const size_t k_max_work = 2000;
+// the next command may use a slot this node is importing
+static void do_asking(Conn *conn, std::vector<std::string> &, Buffer &out) {
+    if (!g_cluster.enabled) {
+        return out_err(out, ERR_BAD_ARG, "cluster mode is disabled");
+    }
+    conn->cluster.asking = true;
+    return out_nil(out);
+}
 
-static bool hnode_same(HNode *node, HNode *key) {
-    return node == key;
+static bool uring_setup_buffers(bool legacy) {
+    URingBufRing *br = &g_uring.bufring;
+    if (!uring_bufring_init(&g_uring.ring, br, k_uring_bgid, k_uring_nbufs, k_uring_buf_size, legacy)) {
+        return false;
+    }
+    if (!uring_probe_multishot(&g_uring.ring, br)) {
+        uring_bufring_free(br);
+        return false;
+    }
+    return true;
 }
 
-// delete expired timers
-static void process_timers() {
-    uint64_t now_ms = get_monotonic_msec();
+static bool uring_setup() {
+    if (!uring_init(&g_uring.ring, k_uring_entries)) {
+        fprintf(stderr, "io_uring unavailable: %s\n", strerror(errno));
+        return false;
+    }
 
-    // idle timers for connections
-    while (!dlist_empty(&g_data.idle_list)) {
-        Conn *conn = container_of(g_data.idle_list.next, Conn, idle_node);
-        uint64_t next_ms = conn->last_active_ms + k_idle_timeout_ms;
+    // prefer a buffer ring, older kernels only have IORING_OP_PROVIDE_BUFFERS
+    if (!(g_uring.ring.features & IORING_FEAT_EXT_ARG)
+        || !(uring_setup_buffers(false) || uring_setup_buffers(true)))
+    {
+        fprintf(stderr, "io_uring lacks multishot recv or provided buffers\n");
+        uring_exit(&g_uring.ring);
+        return false;
+    }
 
-        if (next_ms >= now_ms) {
-            break;      // not expired
-        }
+    g_uring.enabled = true;
+    return true;
+}
 
-        printf("removing idle connection %d\n", conn->fd);
-        conn_destroy(conn);
+static int uring_run() {
+    for (Listener &l : g_listen.list) {
+        uring_arm_accept(&l);
     }
+    uring_arm_wake();
 
-    // ttl timers for entries
-    const std::vector<HeapItem> &heap = g_data.heap;
-    size_t nworks = 0;
+    while (true) {
+        memset(g_data.stats.phase_us, 0, sizeof(g_data.stats.phase_us));
+        uint64_t prepare_start_us = get_monotonic_usec();
 
-    while (!heap.empty() && heap[0].val < now_ms) {
-        Entry *ent = container_of(heap[0].ref, Entry, heap_idx);
-        hm_delete(&g_data.db, &ent->node, &hnode_same);
-        printf("removing key %s\n", ent->key.c_str());
-        entry_del(ent);
+        clock_refresh();
+        int32_t timeout_ms = next_timer_ms();
+        uring_flush_sends();
+        g_data.stats.phase_us[PH_POLL] = get_monotonic_usec() - prepare_start_us;
 
-        if (nworks++ >= k_max_work) {
-            break;  // don't stall server if too many keys expires at once
+        int rv = uring_submit_and_wait(&g_uring.ring, timeout_ms);
+        if (rv < 0 && rv != -EINTR) {
+            fprintf(stderr, "io_uring_enter() error: %s\n", strerror(-rv));
+            return 1;
+        }
+
+        clock_refresh();
+        uint64_t loop_start_us = get_monotonic_usec();
+
+        while (struct io_uring_cqe *cqe = uring_peek_cqe(&g_uring.ring)) {
+            uint64_t udata = cqe->user_data;
+            int32_t res = cqe->res;
+            uint32_t flags = cqe->flags;
+            uring_cqe_seen(&g_uring.ring);
+
+            uint8_t op = (uint8_t)(udata >> 56);
+            void *ptr = (void *)(uintptr_t)(udata & ((1ull << 56) - 1));
+            Conn *conn = (Conn *)ptr;
+            if (op == UOP_ACCEPT) {
+                uring_handle_accept((Listener *)ptr, res, flags);
+            } else if (op == UOP_RECV) {
+                uring_handle_recv(conn, res, flags);
+            } else if (op == UOP_SEND) {
+                uring_handle_send(conn, res);
+            } else if (op == UOP_WAKE) {
+                bg_drain();
+                uring_arm_wake();
+            }
         }
+
+        loop_finish(loop_start_us);
+    }
+
+    return 0;
+}
+
+// Listeners
+//
+// --listen takes "<port>", "<host>:<port>", "[<ipv6>]:<port>" or "unix:<path>" and may be repeated,
+// the default being 0.0.0.0 on --port. Listeners are non-blocking so the poll() loop drains the
+// accept queue with accept4() in one go, while io_uring keeps a multishot accept on each.
+
+static void listener_tune(int fd) {
+    if (g_listen.rcvbuf > 0) {
+        int val = (int)g_listen.rcvbuf;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+    }
+    if (g_listen.sndbuf > 0) {
+        int val = (int)g_listen.sndbuf;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val));
     }
 }
 
-int main(void) {
-    dlist_init(&g_data.idle_list);
-    thread_pool_init(&g_data.thread_pool, 4);
+static int listener_tcp(const std::string &host, uint16_t port) {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
 
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct addrinfo *res = NULL;
+    int err = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res);
+    if (err != 0 || !res) {
+        fprintf(stderr, "cannot resolve %s: %s\n", host.c_str(), gai_strerror(err));
+        return -1;
+    }
 
+    int fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        freeaddrinfo(res);
+        return -1;
+    }
     int val = 1;
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    if (res->ai_family == AF_INET6) {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &val, sizeof(val));  // "::" and "0.0.0.0" can both be bound
+    }
+    listener_tune(fd);
 
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;                                          // IPv4
-    addr.sin_port = htons(1234);                                        // host to network short port 1234
-    addr.sin_addr.s_addr = htonl(0);                                    // wildcard IP 0.0.0.0
-    
-    int rv = bind(fd, (const struct sockaddr*)&addr, sizeof(addr));
-    if (rv) {
-        perror("bind failed");
-        return 1;
+    int rv = bind(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rv < 0 || listen(fd, (int)g_listen.backlog) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (g_listen.defer_accept_s > 0) {
+        int secs = (int)g_listen.defer_accept_s;
+        setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs));
+    }
+    return fd;
+}
+
+static int listener_unix(const std::string &path) {
+    struct sockaddr_un addr = {};
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    listener_tune(fd);
+
+    unlink(path.c_str());                       // left over by an earlier run
+    if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0
+        || (g_listen.unix_perm && chmod(path.c_str(), (mode_t)g_listen.unix_perm) < 0)
+        || listen(fd, (int)g_listen.backlog) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// open the listener for a --listen address
+static bool listener_open(const std::string &spec) {
+    Listener l;
+    l.name = spec;
+    if (spec.compare(0, 5, "unix:") == 0) {
+        l.tcp = false;
+        l.fd = listener_unix(spec.substr(5));
+    } else {
+        // "[v6]:port", "host:port" or "port"
+        size_t colon = spec.rfind(':');
+        std::string host = colon == std::string::npos ? "0.0.0.0" : spec.substr(0, colon);
+        if (host.size() >= 2 && host[0] == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+        int64_t port = 0;
+        if (!str2int(colon == std::string::npos ? spec : spec.substr(colon + 1), port) || port <= 0 || port > 65535) {
+            fprintf(stderr, "bad listen address %s\n", spec.c_str());
+            return false;
+        }
+        l.port = (uint16_t)port;
+        l.fd = listener_tcp(host, l.port);
     }
 
-    rv = listen(fd, SOMAXCONN);
-    if (rv) {
-        printf("listen()");
+    if (l.fd < 0) {
+        fprintf(stderr, "cannot listen on %s: %s\n", spec.c_str(), strerror(errno));
+        return false;
+    }
+    g_listen.list.push_back(l);
+    return true;
+}
+
+// --name <value> with the value in [min, max]
+static bool opt_int(int argc, char **argv, int &i, const char *name, int64_t min, int64_t max, int64_t &out) {
+    if (strcmp(argv[i], name) != 0 || i + 1 >= argc || !str2int(argv[i + 1], out) || out < min || out > max) {
+        return false;
+    }
+    i++;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    bool use_uring = false;
+    int64_t port = 1234;
+    bool port_set = false;
+    const char *leader_host = NULL;
+    int64_t leader_port = 0;
+    bool cluster = false;
+    const char *announce_host = "127.0.0.1";
+    std::vector<std::string> listen_specs;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--io-uring") == 0) {
+            use_uring = true;
+        } else if (strcmp(argv[i], "--cluster") == 0) {
+            cluster = true;
+        } else if (strcmp(argv[i], "--cluster-announce") == 0 && i + 1 < argc) {
+            announce_host = argv[++i];
+        } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            listen_specs.push_back(argv[++i]);
+        } else if (opt_int(argc, argv, i, "--port", 1, 65535, port)) {
+            port_set = true;
+        } else if (strcmp(argv[i], "--unix-perm") == 0 && i + 1 < argc) {
+            g_listen.unix_perm = strtol(argv[++i], NULL, 8);
+        } else if (opt_int(argc, argv, i, "--tcp-backlog", 1, INT32_MAX, g_listen.backlog)
+            || opt_int(argc, argv, i, "--tcp-nodelay", 0, 1, g_listen.nodelay)
+            || opt_int(argc, argv, i, "--tcp-defer-accept", 0, INT32_MAX, g_listen.defer_accept_s)
+            || opt_int(argc, argv, i, "--tcp-rcvbuf", 0, INT32_MAX, g_listen.rcvbuf)
+            || opt_int(argc, argv, i, "--tcp-sndbuf", 0, INT32_MAX, g_listen.sndbuf))
+        {
+            continue;
+        } else if (strcmp(argv[i], "--replicaof") == 0 && i + 2 < argc && str2int(argv[i + 2], leader_port)
+            && leader_port > 0 && leader_port <= 65535)
+        {
+            leader_host = argv[i + 1];
+            i += 2;
+        } else {
+            fprintf(stderr, "usage: %s [--io-uring] [--port <port>] [--listen <addr> ...] [--replicaof <host> <port>] "
+                "[--cluster [--cluster-announce <host>]]\n"
+                "  --listen <port>|<host>:<port>|[<ipv6>]:<port>|unix:<path>  [--unix-perm <octal mode>]\n"
+                "  [--tcp-backlog <n>] [--tcp-nodelay 0|1] [--tcp-defer-accept <seconds>] "
+                "[--tcp-rcvbuf <bytes>] [--tcp-sndbuf <bytes>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (listen_specs.empty()) {
+        listen_specs.push_back(std::to_string(port));
+    }
+    for (const std::string &spec : listen_specs) {
+        if (!listener_open(spec)) {
+            return 1;
+        }
+    }
+    for (const Listener &l : g_listen.list) {
+        if (!port_set && l.tcp) {
+            port = l.port;                      // announced in cluster mode
+            break;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    clock_refresh();
+    tw_init(&g_data.timers, g_data.now_ms);
+    g_data.stats.start_ms = g_data.stats.sample_ms = g_data.now_ms;
+    thread_pool_init(&g_data.thread_pool, 4);
+    bitops_init();
+    shared_ints_init();
+    g_bg.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_bg.fd < 0) {
+        perror("eventfd");
+        return 1;
+    }
+    repl_new_replid();
+    if (cluster) {
+        cluster_init(announce_host, (uint16_t)port);
+    }
+    if (leader_host && !repl_set_leader(leader_host, (uint16_t)leader_port)) {
+        fprintf(stderr, "cannot resolve %s\n", leader_host);
         return 1;
     }
 
+    if (use_uring && uring_setup()) {
+        printf("using io_uring backend with %s\n", g_uring.bufring.legacy ? "provided buffers" : "a buffer ring");
+        return uring_run();
+    } else if (use_uring) {
+        fprintf(stderr, "falling back to poll()\n");
+    }
+
     std::vector<struct pollfd> poll_args;
 
     while (true) { 
+        memset(g_data.stats.phase_us, 0, sizeof(g_data.stats.phase_us));
+        uint64_t prepare_start_us = get_monotonic_usec();
         poll_args.clear();
 
-        struct pollfd pfd = {
-            fd,
-            POLLIN,                                                     // can read
-            0
-        };
-        poll_args.push_back(pfd);
+        for (const Listener &l : g_listen.list) {
+            poll_args.push_back({l.fd, POLLIN, 0});
+        }
+        poll_args.push_back({g_bg.fd, POLLIN, 0});
         
         // update poll() args for existing connections
         for (Conn *conn : g_data.fd2conn) {
@@ -801,13 +7757,16 @@ int main(void) {
             if (conn->want_read) {
                 pfd.events |= POLLIN;
             }
-            if (conn->want_write) {
+            if (conn->want_write && !conn_output_held(conn)) {
                 pfd.events |= POLLOUT;
             }
             poll_args.push_back(pfd);
         }
 
+        clock_refresh();
         int32_t timeout_ms = next_timer_ms();
+        g_data.stats.phase_us[PH_POLL] = get_monotonic_usec() - prepare_start_us;
+
         int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
         if (rv < 0 && errno == EINTR) {
             continue;                                                   // if received interrupt while waiting for a ready fds
@@ -817,28 +7776,38 @@ int main(void) {
             return 1;
         }
 
-        // handle listening socket (server)
-        if (poll_args[0].revents) {
-            handle_accept(fd);
+        clock_refresh();
+        uint64_t loop_start_us = get_monotonic_usec();
+
+        // handle listening sockets (server)
+        size_t nlisteners = g_listen.list.size();
+        for (size_t i = 0; i < nlisteners; i++) {
+            if (poll_args[i].revents) {
+                handle_accept(&g_listen.list[i]);
+            }
+        }
+        if (poll_args[nlisteners].revents) {
+            bg_drain();
         }
 
         // handle client connections
-        for (size_t i = 1; i < poll_args.size(); i++) {
+        for (size_t i = nlisteners + 1; i < poll_args.size(); i++) {
             uint32_t ready = poll_args[i].revents;                      // retrieve poll() return
             if (ready == 0) {
                 continue;
             }
 
             Conn *conn = g_data.fd2conn[poll_args[i].fd];
-            conn->last_active_ms = get_monotonic_msec();
-            dlist_detach(&conn->idle_node);
-            dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+            if (!conn) {
+                continue;                                               // closed by an earlier command
+            }
+            conn_touch(conn);
 
             if (ready & POLLIN) {
                 handle_read(conn);
             }
-            if (ready & POLLOUT) {
-                handle_write(conn);
+            if ((ready & POLLOUT) && conn_pending_bytes(conn) > 0) {
+                handle_write(conn);                                     // handle_read() may have sent it all
             }
 
             if ((ready & POLLERR) || conn->want_close) {
@@ -846,7 +7815,7 @@ int main(void) {
             }
         }
 
-        process_timers();
+        loop_finish(loop_start_us);
     }
 
     return 0;
@@ -0,0 +1,79 @@
+#include <string.h>
+
+#include "sha1.h"
+
+static uint32_t rol(uint32_t x, uint32_t n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static void sha1_block(uint32_t h[5], const uint8_t *p) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f = 0, k = 0;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+
+        uint32_t t = rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol(b, 30);
+        b = a;
+        a = t;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+void sha1_hex(const uint8_t *data, size_t len, char out[41]) {
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+
+    size_t off = 0;
+    for (; off + 64 <= len; off += 64) {
+        sha1_block(h, data + off);
+    }
+
+    // the rest, then 0x80, zeros and the length in bits, in one or two blocks
+    uint8_t tail[128] = {};
+    size_t rest = len - off;
+    memcpy(tail, data + off, rest);
+    tail[rest] = 0x80;
+    size_t tlen = rest + 1 + 8 <= 64 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tlen - 1 - i] = (uint8_t)(bits >> (i * 8));
+    }
+    for (size_t i = 0; i < tlen; i += 64) {
+        sha1_block(h, tail + i);
+    }
+
+    static const char hex[] = "0123456789abcdef";
+    for (int i = 0; i < 20; i++) {
+        uint8_t byte = (uint8_t)(h[i / 4] >> (24 - (i % 4) * 8));
+        out[i * 2] = hex[byte >> 4];
+        out[i * 2 + 1] = hex[byte & 15];
+    }
+    out[40] = 0;
+}
\ No newline at end of file
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-1 digest of `data` as 40 lowercase hex characters plus a terminating 0, for naming scripts
+void sha1_hex(const uint8_t *data, size_t len, char out[41]);
\ No newline at end of file
@@ -48,4 +48,11 @@ void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg) {
     tp->queue.push_back(Work {f, arg});
     pthread_cond_signal(&tp->not_empty);
     pthread_mutex_unlock(&tp->mu);
+}
+
+size_t thread_pool_pending(ThreadPool *tp) {
+    pthread_mutex_lock(&tp->mu);
+    size_t n = tp->queue.size();
+    pthread_mutex_unlock(&tp->mu);
+    return n;
 }
\ No newline at end of file
@@ -16,4 +16,5 @@ struct ThreadPool {
 };
 
 void thread_pool_init(ThreadPool *tp, size_t num_threads);
-void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg);
\ No newline at end of file
+void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg);
+size_t thread_pool_pending(ThreadPool *tp);
\ No newline at end of file
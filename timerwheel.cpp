@@ -0,0 +1,142 @@
+#include "timerwheel.h"
+#include "common.h"
+
+const uint64_t k_tw_span = 1ull << (k_tw_bits * k_tw_levels);    // ms ahead covered by the wheel
+const uint32_t k_tw_mask = k_tw_slots - 1;
+
+static uint32_t tw_shift(uint32_t level) {
+    return level * k_tw_bits;
+}
+
+void tw_init(TimerWheel *tw, uint64_t now_ms) {
+    tw->now_ms = now_ms;
+    tw->size = 0;
+    for (uint64_t &bits : tw->occupied) {
+        bits = 0;
+    }
+    for (DList &slot : tw->slots) {
+        dlist_init(&slot);
+    }
+}
+
+// the lowest level whose span covers the expiry, relative to the current time
+static void tw_place(TimerWheel *tw, TimerNode *timer) {
+    uint64_t expire = timer->expire_ms < tw->now_ms ? tw->now_ms : timer->expire_ms;
+    if (expire - tw->now_ms >= k_tw_span) {
+        expire = tw->now_ms + k_tw_span - 1;    // placed again when the last level gets there
+    }
+
+    uint32_t level = 0;
+    while (expire - tw->now_ms >= 1ull << tw_shift(level + 1)) {
+        level++;
+    }
+    uint32_t idx = (expire >> tw_shift(level)) & k_tw_mask;
+    timer->slot = level * k_tw_slots + idx;
+    dlist_insert_before(&tw->slots[timer->slot], &timer->node);
+    tw->occupied[level] |= 1ull << idx;
+}
+
+static void tw_unlink(TimerWheel *tw, TimerNode *timer) {
+    dlist_detach(&timer->node);
+    if (dlist_empty(&tw->slots[timer->slot])) {
+        tw->occupied[timer->slot / k_tw_slots] &= ~(1ull << (timer->slot % k_tw_slots));
+    }
+    timer->slot = -1;
+}
+
+void tw_add(TimerWheel *tw, TimerNode *timer, uint64_t expire_ms) {
+    if (tw_armed(timer)) {
+        tw_unlink(tw, timer);
+    } else {
+        tw->size++;
+    }
+    timer->expire_ms = expire_ms;
+    tw_place(tw, timer);
+}
+
+void tw_del(TimerWheel *tw, TimerNode *timer) {
+    if (tw_armed(timer)) {
+        tw_unlink(tw, timer);
+        tw->size--;
+    }
+}
+
+uint64_t tw_next_ms(TimerWheel *tw) {
+    uint64_t now = tw->now_ms;
+    uint64_t next = -1;
+
+    // level 0 holds the next 64 ms, the slots before the current one are in the next turn
+    uint64_t bits = tw->occupied[0];
+    uint32_t pos = now & k_tw_mask;
+    if (bits >> pos) {
+        next = now + __builtin_ctzll(bits >> pos);
+    } else if (bits) {
+        next = now - pos + k_tw_slots + __builtin_ctzll(bits);
+    }
+
+    // higher levels: when the first non-empty slot from now on starts, the current slot is
+    // only due if it starts right now and has not been moved down yet
+    for (uint32_t level = 1; level < k_tw_levels; level++) {
+        bits = tw->occupied[level];
+        if (!bits) {
+            continue;
+        }
+        uint64_t first = (now >> tw_shift(level)) + ((now & ((1ull << tw_shift(level)) - 1)) != 0);
+        uint32_t from = first & k_tw_mask;
+        uint64_t rotated = (bits >> from) | (bits << ((k_tw_slots - from) & k_tw_mask));
+        uint64_t start = (first + __builtin_ctzll(rotated)) << tw_shift(level);
+        if (start < next) {
+            next = start;
+        }
+    }
+    return next;
+}
+
+// move the higher level slots that start now down, highest first so they can go down twice
+static void tw_cascade(TimerWheel *tw) {
+    for (uint32_t level = k_tw_levels - 1; level > 0; level--) {
+        if (tw->now_ms & ((1ull << tw_shift(level)) - 1)) {
+            continue;
+        }
+        uint32_t idx = (tw->now_ms >> tw_shift(level)) & k_tw_mask;
+        DList *head = &tw->slots[level * k_tw_slots + idx];
+        if (dlist_empty(head)) {
+            continue;
+        }
+
+        DList moving;
+        dlist_init(&moving);
+        dlist_insert_before(head, &moving);     // take the whole chain, then unhook the head
+        dlist_detach(head);
+        dlist_init(head);
+        tw->occupied[level] &= ~(1ull << idx);
+
+        while (!dlist_empty(&moving)) {
+            TimerNode *timer = container_of(moving.next, TimerNode, node);
+            dlist_detach(&timer->node);
+            tw_place(tw, timer);
+        }
+    }
+}
+
+TimerNode *tw_pop(TimerWheel *tw, uint64_t now_ms) {
+    while (true) {
+        uint64_t next = tw_next_ms(tw);
+        if (next > now_ms) {
+            if (tw->now_ms <= now_ms) {
+                tw->now_ms = now_ms + 1;        // nothing is due in between
+            }
+            return NULL;
+        }
+
+        tw->now_ms = next;
+        tw_cascade(tw);
+        DList *head = &tw->slots[next & k_tw_mask];
+        if (!dlist_empty(head)) {
+            TimerNode *timer = container_of(head->next, TimerNode, node);
+            tw_unlink(tw, timer);
+            tw->size--;
+            return timer;
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dlist.h"
+
+// Hierarchical timing wheel with 1 ms ticks. Level L has 64 slots of 64^L ms each, so 4 levels
+// reach about 4.6 hours ahead; later timers wait in the last level and are placed again when it
+// turns. Adding and deleting a timer is O(1). A slot of a higher level is moved down a level when
+// the wheel reaches it, and a bitmap of non-empty slots per level lets the wheel skip empty time.
+struct TimerNode {
+    DList node;
+    uint64_t expire_ms = 0;
+    uint32_t kind = 0;              // set by the owner, to tell its timers apart when they fire
+    uint32_t slot = -1;             // level * 64 + index in the level, -1 if not armed
+};
+
+const uint32_t k_tw_bits = 6;
+const uint32_t k_tw_slots = 1 << k_tw_bits;
+const uint32_t k_tw_levels = 4;
+
+struct TimerWheel {
+    uint64_t now_ms = 0;            // timers before this have fired
+    uint64_t occupied[k_tw_levels] = {};
+    DList slots[k_tw_levels * k_tw_slots];
+    size_t size = 0;
+};
+
+void tw_init(TimerWheel *tw, uint64_t now_ms);
+// arms the timer, or moves it if it is armed already
+void tw_add(TimerWheel *tw, TimerNode *timer, uint64_t expire_ms);
+void tw_del(TimerWheel *tw, TimerNode *timer);
+// a lower bound of the next expiry (it may only be a slot to move down), -1 if there is no timer
+uint64_t tw_next_ms(TimerWheel *tw);
+// disarms and returns a timer that expired by `now_ms`, NULL if there is none
+TimerNode *tw_pop(TimerWheel *tw, uint64_t now_ms);
+
+inline bool tw_armed(const TimerNode *timer) {
+    return timer->slot != (uint32_t)-1;
+}
\ No newline at end of file
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "topk.h"
+#include "common.h"
+
+const uint64_t k_topk_seed = 0x9ae16a3b2f90404full;
+
+struct TopKLookup {
+    HNode node;
+    const char *key = NULL;
+    size_t len = 0;
+};
+
+static bool topk_item_eq(HNode *node, HNode *key) {
+    TopKItem *item = container_of(node, TopKItem, node);
+    TopKLookup *lk = container_of(key, TopKLookup, node);
+    return item->key.size() == lk->len && memcmp(item->key.data(), lk->key, lk->len) == 0;
+}
+
+static bool topk_node_same(HNode *lhs, HNode *rhs) {
+    return lhs == rhs;
+}
+
+static TopKItem *topk_lookup(TopK *tk, const char *key, size_t len) {
+    TopKLookup lk;
+    lk.key = key;
+    lk.len = len;
+    lk.node.hcode = str_hash((const uint8_t *)key, len);
+    HNode *node = hm_lookup(&tk->items, &lk.node, &topk_item_eq);
+    return node ? container_of(node, TopKItem, node) : NULL;
+}
+
+static void topk_remove(TopK *tk, TopKItem *item) {
+    size_t pos = item->heap_idx;
+    tk->heap[pos] = tk->heap.back();
+    tk->heap.pop_back();
+    if (pos < tk->heap.size()) {
+        heap_update(tk->heap.data(), pos, tk->heap.size());
+    }
+    hm_delete(&tk->items, &item->node, &topk_node_same);
+    delete item;
+}
+
+// the smallest members go if k shrinks
+void topk_init(TopK *tk, uint32_t k) {
+    tk->k = k;
+    while (tk->heap.size() > k) {
+        topk_remove(tk, container_of(tk->heap[0].ref, TopKItem, heap_idx));
+    }
+}
+
+void topk_set(TopK *tk, const char *key, size_t len, uint64_t val) {
+    TopKItem *item = topk_lookup(tk, key, len);
+    if (item) {
+        tk->heap[item->heap_idx].val = val;
+        heap_update(tk->heap.data(), item->heap_idx, tk->heap.size());
+        return;
+    }
+
+    if (tk->heap.size() >= tk->k) {
+        if (tk->heap.empty() || val <= tk->heap[0].val) {
+            return;
+        }
+        topk_remove(tk, container_of(tk->heap[0].ref, TopKItem, heap_idx));
+    }
+
+    item = new TopKItem();
+    item->key.assign(key, len);
+    item->node.hcode = str_hash((const uint8_t *)key, len);
+    hm_insert(&tk->items, &item->node);
+    tk->heap.push_back(HeapItem{val, &item->heap_idx});
+    heap_update(tk->heap.data(), tk->heap.size() - 1, tk->heap.size());
+}
+
+uint64_t topk_incr(TopK *tk, const char *key, size_t len, uint32_t n) {
+    if (!tk->sketch) {
+        tk->sketch = (uint32_t *)calloc(k_topk_depth * k_topk_width, sizeof(uint32_t));
+    }
+
+    // one counter per row, the estimate is the smallest: the one with the fewest collisions
+    uint64_t h = str_hash64((const uint8_t *)key, len, k_topk_seed);
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    uint32_t *cells[k_topk_depth];
+    uint64_t est = UINT32_MAX;
+    for (uint32_t i = 0; i < k_topk_depth; i++) {
+        cells[i] = &tk->sketch[i * k_topk_width + ((h1 + i * h2) & (k_topk_width - 1))];
+        est = std::min<uint64_t>(est, *cells[i]);
+    }
+
+    // conservative update: counters already above the new estimate were inflated by others
+    est = std::min<uint64_t>(est + n, UINT32_MAX);
+    for (uint32_t i = 0; i < k_topk_depth; i++) {
+        if (*cells[i] < est) {
+            *cells[i] = (uint32_t)est;
+        }
+    }
+
+    topk_set(tk, key, len, est);
+    return est;
+}
+
+void topk_del(TopK *tk, const char *key, size_t len) {
+    TopKItem *item = topk_lookup(tk, key, len);
+    if (item) {
+        topk_remove(tk, item);
+    }
+}
+
+void topk_decay(TopK *tk) {
+    if (tk->sketch) {
+        for (size_t i = 0; i < k_topk_depth * k_topk_width; i++) {
+            tk->sketch[i] >>= 1;
+        }
+    }
+    for (HeapItem &it : tk->heap) {
+        it.val >>= 1;                           // keeps the heap order
+    }
+}
+
+void topk_clear(TopK *tk) {
+    for (HeapItem &it : tk->heap) {
+        delete container_of(it.ref, TopKItem, heap_idx);
+    }
+    tk->heap.clear();
+    hm_clear(&tk->items);
+    free(tk->sketch);
+    tk->sketch = NULL;
+}
+
+static bool topk_count_greater(const std::pair<std::string, uint64_t> &lhs, const std::pair<std::string, uint64_t> &rhs) {
+    return lhs.second > rhs.second;
+}
+
+void topk_list(TopK *tk, std::vector<std::pair<std::string, uint64_t>> &out) {
+    out.clear();
+    for (const HeapItem &it : tk->heap) {
+        out.emplace_back(container_of(it.ref, TopKItem, heap_idx)->key, it.val);
+    }
+    std::sort(out.begin(), out.end(), &topk_count_greater);
+}
\ No newline at end of file
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "hashtable.h"
+#include "heap.h"
+
+// The k items with the largest counts. With topk_incr() the counts are estimates from a
+// Count-Min sketch (4 rows of 2048 counters, conservative update) so items outside the top
+// cost no memory; with topk_set() they are exact values, e.g. sizes. A min-heap of the
+// members decides which one is evicted when a larger item shows up.
+struct TopKItem {
+    HNode node;                     // in TopK::items
+    std::string key;
+    size_t heap_idx = -1;           // in TopK::heap
+};
+
+struct TopK {
+    uint32_t k = 0;
+    uint32_t *sketch = NULL;        // allocated by the first topk_incr()
+    std::vector<HeapItem> heap;     // counts, refs TopKItem::heap_idx
+    HMap items;
+};
+
+const uint32_t k_topk_depth = 4;
+const uint32_t k_topk_width = 2048;
+
+void topk_init(TopK *tk, uint32_t k);
+// the estimated count of the key after adding `n`
+uint64_t topk_incr(TopK *tk, const char *key, size_t len, uint32_t n);
+void topk_set(TopK *tk, const char *key, size_t len, uint64_t val);
+void topk_del(TopK *tk, const char *key, size_t len);
+// halves every count, so old activity fades
+void topk_decay(TopK *tk);
+void topk_clear(TopK *tk);
+// members by decreasing count
+void topk_list(TopK *tk, std::vector<std::pair<std::string, uint64_t>> &out);
\ No newline at end of file
@@ -0,0 +1,352 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool uring_init(URing *ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;     // only the event loop submits
+
+    int fd = sys_setup(entries, &p);
+    if (fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));                                       // older kernel, retry without hints
+        fd = sys_setup(entries, &p);
+    }
+    if (fd < 0) {
+        return false;
+    }
+
+    ring->fd = fd;
+    ring->features = p.features;
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len) {
+            ring->sq_len = ring->cq_len;
+        }
+        ring->cq_len = ring->sq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        uring_exit(ring);
+        return false;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            uring_exit(ring);
+            return false;
+        }
+    }
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        uring_exit(ring);
+        return false;
+    }
+    ring->sqes = (struct io_uring_sqe *)sqes;
+
+    uint8_t *sq = (uint8_t *)ring->sq_ptr;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = *(unsigned *)(sq + p.sq_off.ring_entries);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+    uint8_t *cq = (uint8_t *)ring->cq_ptr;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return true;
+}
+
+void uring_exit(URing *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    if (ring->sq_ptr) {
+        munmap(ring->sq_ptr, ring->sq_len);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    *ring = URing{};
+}
+
+struct io_uring_sqe *uring_get_sqe(URing *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->sq_pending;
+    if (tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+
+    unsigned idx = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sq_pending++;
+    return sqe;
+}
+
+// make the prepared SQEs visible to the kernel
+static unsigned uring_flush(URing *ring) {
+    unsigned n = ring->sq_pending;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + n, __ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+    return n;
+}
+
+int uring_submit(URing *ring) {
+    unsigned n = uring_flush(ring);
+    if (n == 0) {
+        return 0;
+    }
+
+    int rv = sys_enter(ring->fd, n, 0, 0, NULL, 0);
+    return rv < 0 ? -errno : rv;
+}
+
+int uring_submit_and_wait(URing *ring, int32_t timeout_ms) {
+    unsigned n = uring_flush(ring);
+    unsigned flags = IORING_ENTER_GETEVENTS;
+
+    if (timeout_ms < 0) {
+        int rv = sys_enter(ring->fd, n, 1, flags, NULL, 0);
+        return rv < 0 ? -errno : rv;
+    }
+
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000 * 1000;
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    int rv = sys_enter(ring->fd, n, 1, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (rv < 0 && errno == ETIME) {
+        return 0;                                                       // timed out, not an error
+    }
+    return rv < 0 ? -errno : rv;
+}
+
+struct io_uring_cqe *uring_peek_cqe(URing *ring) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(URing *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// SQE for internal bookkeeping, flushes the queue if it is full
+static struct io_uring_sqe *uring_get_sqe_flush(URing *ring) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) {
+        uring_submit(ring);
+        sqe = uring_get_sqe(ring);
+    }
+    return sqe;
+}
+
+// IORING_OP_PROVIDE_BUFFERS for n consecutive buffers, only failures post a completion
+static bool uring_provide(URingBufRing *br, uint16_t bid, uint32_t n) {
+    struct io_uring_sqe *sqe = uring_get_sqe_flush(br->ring);
+    if (!sqe) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = (int32_t)n;
+    sqe->addr = (uint64_t)(uintptr_t)uring_bufring_get(br, bid);
+    sqe->len = br->buf_size;
+    sqe->off = bid;
+    sqe->buf_group = br->bgid;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    return true;
+}
+
+bool uring_bufring_init(URing *ring, URingBufRing *br, uint16_t bgid, uint32_t nbufs, uint32_t buf_size, bool legacy) {
+    br->ring = ring;
+    br->legacy = legacy;
+    br->bgid = bgid;
+    br->nbufs = nbufs;
+    br->buf_size = buf_size;
+    br->tail = 0;
+
+    if (legacy) {
+        br->bufs = new uint8_t[(size_t)nbufs * buf_size];
+        if (!uring_provide(br, 0, nbufs) || uring_submit(ring) < 0) {
+            uring_bufring_free(br);
+            return false;
+        }
+        return true;
+    }
+
+    size_t ring_len = nbufs * sizeof(struct io_uring_buf);
+    void *mem = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) {
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)mem;
+    reg.ring_entries = nbufs;
+    reg.bgid = bgid;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(mem, ring_len);
+        return false;
+    }
+
+    br->br = (struct io_uring_buf_ring *)mem;
+    br->bufs = new uint8_t[(size_t)nbufs * buf_size];
+    for (uint32_t i = 0; i < nbufs; i++) {
+        uring_bufring_recycle(br, (uint16_t)i);
+    }
+    return true;
+}
+
+// legacy buffers are released when the io_uring instance is closed
+void uring_bufring_free(URingBufRing *br) {
+    if (br->br) {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = br->bgid;
+        sys_register(br->ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(br->br, br->nbufs * sizeof(struct io_uring_buf));
+    }
+    delete[] br->bufs;
+    *br = URingBufRing{};
+}
+
+uint8_t *uring_bufring_get(URingBufRing *br, uint16_t bid) {
+    return br->bufs + (size_t)bid * br->buf_size;
+}
+
+// hand a buffer back to the kernel
+void uring_bufring_recycle(URingBufRing *br, uint16_t bid) {
+    if (br->legacy) {
+        uring_provide(br, bid, 1);
+        return;
+    }
+
+    // entries start at the ring base and overlap its header, compiled as C++ the uapi
+    // __DECLARE_FLEX_ARRAY places `bufs` after an empty struct, one entry too far
+    struct io_uring_buf *buf = (struct io_uring_buf *)br->br + (br->tail & (br->nbufs - 1));
+    buf->addr = (uint64_t)(uintptr_t)uring_bufring_get(br, bid);
+    buf->len = br->buf_size;
+    buf->bid = bid;
+
+    br->tail++;
+    __atomic_store_n(&br->br->tail, br->tail, __ATOMIC_RELEASE);
+}
+
+const uint64_t k_probe_udata = 1;
+
+// next completion of the probe request, skipping anything else (e.g. failed buffer provides)
+static struct io_uring_cqe *probe_wait(URing *ring) {
+    while (true) {
+        if (uring_submit_and_wait(ring, 1000) < 0) {
+            return NULL;
+        }
+
+        struct io_uring_cqe *cqe = uring_peek_cqe(ring);
+        if (!cqe) {
+            return NULL;                                                // timed out
+        }
+        if (cqe->user_data == k_probe_udata) {
+            return cqe;
+        }
+        uring_cqe_seen(ring);
+    }
+}
+
+bool uring_probe_multishot(URing *ring, URingBufRing *br) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        return false;
+    }
+
+    bool ok = false;
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fds[0];
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = br->bgid;
+        sqe->user_data = k_probe_udata;
+
+        if (write(fds[1], "x", 1) == 1) {
+            struct io_uring_cqe *cqe = probe_wait(ring);
+            if (cqe) {
+                ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) && (cqe->flags & IORING_CQE_F_MORE);
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                    uring_bufring_recycle(br, (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+                }
+                uring_cqe_seen(ring);
+            }
+        }
+    }
+
+    // closing the peer ends the multishot request, drain its final completion
+    close(fds[1]);
+    shutdown(fds[0], SHUT_RDWR);
+    while (ok) {
+        struct io_uring_cqe *cqe = probe_wait(ring);
+        if (!cqe) {
+            ok = false;
+            break;
+        }
+
+        bool more = cqe->flags & IORING_CQE_F_MORE;
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            uring_bufring_recycle(br, (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+        }
+        uring_cqe_seen(ring);
+        if (!more) {
+            break;
+        }
+    }
+
+    close(fds[0]);
+    return ok;
+}
\ No newline at end of file
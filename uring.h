@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// minimal io_uring wrapper over the raw syscalls
+struct URing {
+    int fd = -1;
+    unsigned features = 0;
+
+    // submission queue
+    unsigned *sq_head = NULL;
+    unsigned *sq_tail = NULL;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned *sq_array = NULL;
+    struct io_uring_sqe *sqes = NULL;
+    unsigned sq_pending = 0;                    // prepared but not yet submitted
+
+    // completion queue
+    unsigned *cq_head = NULL;
+    unsigned *cq_tail = NULL;
+    unsigned cq_mask = 0;
+    struct io_uring_cqe *cqes = NULL;
+
+    // mappings
+    void *sq_ptr = NULL;
+    size_t sq_len = 0;
+    void *cq_ptr = NULL;
+    size_t cq_len = 0;
+    size_t sqes_len = 0;
+};
+
+// Group of receive buffers the kernel picks from (IOSQE_BUFFER_SELECT). Registered as a buffer
+// ring (IORING_REGISTER_PBUF_RING) when possible, otherwise with IORING_OP_PROVIDE_BUFFERS.
+struct URingBufRing {
+    URing *ring = NULL;
+    struct io_uring_buf_ring *br = NULL;        // NULL in legacy mode
+    bool legacy = false;
+    uint8_t *bufs = NULL;
+    uint16_t bgid = 0;
+    uint32_t nbufs = 0;                         // power of 2
+    uint32_t buf_size = 0;
+    uint16_t tail = 0;
+};
+
+bool uring_init(URing *ring, unsigned entries);
+void uring_exit(URing *ring);
+
+// NULL means the submission queue is full, call uring_submit() first
+struct io_uring_sqe *uring_get_sqe(URing *ring);
+
+// submit pending SQEs and wait for at least 1 completion, timeout_ms < 0 waits forever
+int uring_submit_and_wait(URing *ring, int32_t timeout_ms);
+int uring_submit(URing *ring);
+
+// NULL if the completion queue is empty
+struct io_uring_cqe *uring_peek_cqe(URing *ring);
+void uring_cqe_seen(URing *ring);
+
+bool uring_bufring_init(URing *ring, URingBufRing *br, uint16_t bgid, uint32_t nbufs, uint32_t buf_size, bool legacy);
+void uring_bufring_free(URingBufRing *br);
+uint8_t *uring_bufring_get(URingBufRing *br, uint16_t bid);
+void uring_bufring_recycle(URingBufRing *br, uint16_t bid);
+
+// check that multishot recv with provided buffers works on this kernel
+bool uring_probe_multishot(URing *ring, URingBufRing *br);
\ No newline at end of file
@@ -167,4 +167,29 @@ ZNode *znode_offset(ZNode *node, int64_t offset) {
 
     AVLNode *tnode = avl_offset(&node->tree, offset);
     return tnode ? container_of(tnode, ZNode, tree) : NULL;
+}
+
+ZNode *zset_move(ZSet *zset, ZNode *node, void *mem) {
+    ZNode *fresh = (ZNode *)mem;
+    memcpy((void *)fresh, node, sizeof(ZNode) + node->len);
+
+    // the parent and the children point to the node, the hash chain too
+    AVLNode *parent = node->tree.parent;
+    if (!parent) {
+        zset->root = &fresh->tree;
+    } else if (parent->left == &node->tree) {
+        parent->left = &fresh->tree;
+    } else {
+        parent->right = &fresh->tree;
+    }
+    if (fresh->tree.left) {
+        fresh->tree.left->parent = &fresh->tree;
+    }
+    if (fresh->tree.right) {
+        fresh->tree.right->parent = &fresh->tree;
+    }
+    hm_replace(&zset->hmap, &node->hmap, &fresh->hmap);
+
+    znode_del(node);
+    return fresh;
 }
\ No newline at end of file
@@ -24,4 +24,6 @@ void zset_clear(ZSet *zset);
 
 // find first pair greater than or equal to (score, name)
 ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len);
-ZNode *znode_offset(ZNode *node, int64_t offset);
\ No newline at end of file
+ZNode *znode_offset(ZNode *node, int64_t offset);
+// moves the node into `mem`, a malloc() block of sizeof(ZNode) + len bytes, and frees the old one
+ZNode *zset_move(ZSet *zset, ZNode *node, void *mem);
\ No newline at end of file